@@ -23,6 +23,30 @@ static u64 BigInt_as_unsigned(const BigInt* bigint)
     }
 }
 
+u64 BigInt_as_u64(const BigInt* big_int)
+{
+    return BigInt_as_unsigned(big_int);
+}
+
+s64 BigInt_as_signed(const BigInt* big_int)
+{
+    if (big_int->digit_count == 0)
+    {
+        return 0;
+    }
+
+    redassert(big_int->digit_count == 1);
+    u64 magnitude = big_int->digit;
+    if (big_int->is_negative)
+    {
+        redassert(magnitude <= (u64)INT64_MAX + 1);
+        return (s64)(~magnitude + 1);
+    }
+
+    redassert(magnitude <= INT64_MAX);
+    return (s64)magnitude;
+}
+
 static void BigInt_normalize(BigInt *dst)
 {
     const u64* digits = bigint_ptr(dst);
@@ -77,7 +101,7 @@ static bool bit_at_index(const BigInt* bi, size_t index)
 
     usize digit_bit_index = index % 64;
     const u64* digits = bigint_ptr(bi);
-    u64 digit = digits[digit_bit_index];
+    u64 digit = digits[digit_index];
     return ((digit >> digit_bit_index) & 0x1) == 0x1;
 }
 
@@ -114,6 +138,52 @@ size_t BigInt_clz(const BigInt* big_int, size_t bit_count)
     return count;
 }
 
+// The trailing zeros of a two's complement number are the ones of its magnitude
+size_t BigInt_ctz(const BigInt* big_int, size_t bit_count)
+{
+    if (big_int->digit_count == 0)
+    {
+        return bit_count;
+    }
+
+    usize count = 0;
+    while (count < bit_count && !bit_at_index(big_int, count))
+    {
+        count++;
+    }
+
+    return count;
+}
+
+size_t BigInt_popcount_unsigned(const BigInt* big_int)
+{
+    redassert(!big_int->is_negative);
+    const u64* digits = bigint_ptr(big_int);
+    usize count = 0;
+    for (usize i = 0; i < big_int->digit_count; i++)
+    {
+        for (u64 digit = digits[i]; digit; digit &= digit - 1)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Negative numbers are counted in their bit_count-wide two's complement form
+size_t BigInt_popcount_signed(const BigInt* big_int, size_t bit_count)
+{
+    if (!big_int->is_negative)
+    {
+        return BigInt_popcount_unsigned(big_int);
+    }
+
+    BigInt bits;
+    BigInt_truncate(&bits, big_int, bit_count, false);
+    return BigInt_popcount_unsigned(&bits);
+}
+
 size_t BigInt_bits_needed(const BigInt* op)
 {
     usize full_bits = op->digit_count * 64;
@@ -134,6 +204,18 @@ void BigInt_init_unsigned(BigInt* dst, u64 x)
     dst->is_negative = false;
 }
 
+void BigInt_init_signed(BigInt* dst, s64 x)
+{
+    if (x >= 0)
+    {
+        return BigInt_init_unsigned(dst, (u64)x);
+    }
+
+    dst->digit_count = 1;
+    dst->digit = ~(u64)x + 1;
+    dst->is_negative = true;
+}
+
 static bool add_u64_overflow(const u64 op1, const u64 op2, u64 *result)
 {
 #if _MSC_VER
@@ -181,7 +263,8 @@ void BigInt_add(BigInt *dst, const BigInt *op1, const BigInt *op2)
         }
         size_t i = 1;
         u64 first_digit = dst->digit;
-        dst->digits = NEW(u64, max(op1->digit_count, op2->digit_count));
+        // One extra digit for the final carry
+        dst->digits = NEW(u64, (max(op1->digit_count, op2->digit_count) + 1));
         dst->digits[0] = first_digit;
 
         for(;;)
@@ -269,26 +352,23 @@ void BigInt_add(BigInt *dst, const BigInt *op1, const BigInt *op2)
 
     for (;;)
     {
-        bool found_digit = false;
         u64 x = bigger_op_digits[i];
         u64 prev_overflow = overflow;
         overflow = 0;
 
         if (i < smaller_op->digit_count)
         {
-            found_digit = true;
             u64 digit = smaller_op_digits[i];
             overflow += sub_u64_overflow(x, digit, &x);
         }
         if (sub_u64_overflow(x, prev_overflow, &x))
         {
-            found_digit = true;
             overflow += 1;
         }
         dst->digits[i] = x;
         i += 1;
 
-        if (!found_digit || i >= bigger_op->digit_count)
+        if (i >= bigger_op->digit_count)
         {
             break;
         }
@@ -351,7 +431,8 @@ void BigInt_shl(BigInt* dst, const BigInt* op1, const BigInt* op2)
     u64 digit_shift_count = shift_amt / 64;
     u64 leftover_shift_count = shift_amt % 64;
 
-    dst->digits = NEW(u64, op1->digit_count + digit_shift_count + 1);
+    dst->digits = NEW(u64, (op1->digit_count + digit_shift_count + 1));
+    memset(dst->digits, 0, sizeof(u64) * digit_shift_count);
     dst->digit_count = digit_shift_count;
     u64 carry = 0;
 
@@ -443,7 +524,7 @@ void BigInt_mul(BigInt *dst, const BigInt *op1, const BigInt *op2)
 
     BigInt bi_64;
 
-    BigInt_init_unsigned(&bi_64, 0);
+    BigInt_init_unsigned(&bi_64, 64);
 
     usize i = op2->digit_count - 1;
 
@@ -531,7 +612,7 @@ Cmp BigInt_cmp(const BigInt *op1, const BigInt *op2)
         {
             return op1->is_negative ? CMP_LESS : CMP_GREATER;
         }
-        if (op1_digit > op2_digit)
+        if (op1_digit < op2_digit)
         {
             return op1->is_negative ? CMP_GREATER : CMP_LESS;
         }
@@ -542,3 +623,165 @@ Cmp BigInt_cmp(const BigInt *op1, const BigInt *op2)
         }
     }
 }
+
+Cmp BigInt_cmp_zero(const BigInt* op)
+{
+    if (op->digit_count == 0 || (op->digit_count == 1 && op->digit == 0))
+    {
+        return CMP_EQ;
+    }
+
+    return op->is_negative ? CMP_LESS : CMP_GREATER;
+}
+
+void BigInt_sub(BigInt* dst, const BigInt* op1, const BigInt* op2)
+{
+    BigInt op2_negated;
+    BigInt_negate(&op2_negated, op2);
+    BigInt_add(dst, op1, &op2_negated);
+}
+
+// Binary long division of the magnitudes: the dividend is shifted into the remainder one bit at a time, and the divisor is subtracted whenever it fits
+static void div_trunc_magnitude(BigInt* dst, const BigInt* op1, const BigInt* op2)
+{
+    const u64* op1_digits = bigint_ptr(op1);
+    const u64* op2_digits = bigint_ptr(op2);
+    size_t digit_count = op1->digit_count;
+    size_t remainder_digit_count = digit_count + 1;
+
+    u64* quotient = NEW(u64, digit_count);
+    memset(quotient, 0, sizeof(u64) * digit_count);
+    u64* remainder = NEW(u64, remainder_digit_count);
+    memset(remainder, 0, sizeof(u64) * remainder_digit_count);
+
+    for (size_t bit = digit_count * 64; bit-- > 0;)
+    {
+        u64 carry = (op1_digits[bit / 64] >> (bit % 64)) & 1;
+        for (size_t i = 0; i < remainder_digit_count; i++)
+        {
+            u64 next_carry = remainder[i] >> 63;
+            remainder[i] = (remainder[i] << 1) | carry;
+            carry = next_carry;
+        }
+
+        bool fits = true;
+        for (size_t i = remainder_digit_count; i-- > 0;)
+        {
+            u64 divisor_digit = i < op2->digit_count ? op2_digits[i] : 0;
+            if (remainder[i] != divisor_digit)
+            {
+                fits = remainder[i] > divisor_digit;
+                break;
+            }
+        }
+
+        if (fits)
+        {
+            u64 borrow = 0;
+            for (size_t i = 0; i < remainder_digit_count; i++)
+            {
+                u64 divisor_digit = i < op2->digit_count ? op2_digits[i] : 0;
+                u64 difference = remainder[i] - divisor_digit - borrow;
+                borrow = (remainder[i] < divisor_digit) || (remainder[i] - divisor_digit < borrow);
+                remainder[i] = difference;
+            }
+            quotient[bit / 64] |= (u64)1 << (bit % 64);
+        }
+    }
+
+    dst->digits = quotient;
+    dst->digit_count = digit_count;
+    dst->is_negative = false;
+    BigInt_normalize(dst);
+}
+
+void BigInt_div_trunc(BigInt* dst, const BigInt* op1, const BigInt* op2)
+{
+    redassert(BigInt_cmp_zero(op2) != CMP_EQ);
+    if (BigInt_cmp_zero(op1) == CMP_EQ || op1->digit_count < op2->digit_count)
+    {
+        return BigInt_init_unsigned(dst, 0);
+    }
+
+    bool is_negative = op1->is_negative != op2->is_negative;
+    if (op1->digit_count == 1)
+    {
+        dst->digit = op1->digit / op2->digit;
+        dst->digit_count = 1;
+    }
+    else
+    {
+        div_trunc_magnitude(dst, op1, op2);
+    }
+
+    dst->is_negative = is_negative;
+    BigInt_normalize(dst);
+}
+
+// Wraps op to a bit_count-wide two's complement integer. dst can alias op
+void BigInt_truncate(BigInt* dst, const BigInt* op, size_t bit_count, bool is_signed)
+{
+    redassert(bit_count > 0);
+    if (bit_count > 64)
+    {
+        RED_NOT_IMPLEMENTED;
+        return;
+    }
+
+    // The low bits of a two's complement number only depend on the low digit of its magnitude
+    u64 bits = op->digit_count == 0 ? 0 : bigint_ptr(op)[0];
+    if (op->is_negative)
+    {
+        bits = ~bits + 1;
+    }
+
+    u64 mask = bit_count == 64 ? UINT64_MAX : (((u64)1 << bit_count) - 1);
+    bits &= mask;
+
+    bool is_negative = is_signed && ((bits >> (bit_count - 1)) & 1);
+    if (is_negative)
+    {
+        bits = (~bits + 1) & mask;
+    }
+
+    dst->digit_count = 1;
+    dst->digit = bits;
+    dst->is_negative = is_negative;
+    BigInt_normalize(dst);
+}
+
+// Bytes of the low bit_count bits of op in reverse order. bit_count is a multiple of 8
+void BigInt_bswap(BigInt* dst, const BigInt* op, size_t bit_count)
+{
+    BigInt unsigned_op;
+    BigInt_truncate(&unsigned_op, op, bit_count, false);
+    u64 bits = BigInt_as_u64(&unsigned_op);
+    u64 swapped = 0;
+    for (size_t i = 0; i < bit_count; i += 8)
+    {
+        swapped |= ((bits >> i) & 0xff) << (bit_count - 8 - i);
+    }
+    BigInt_init_unsigned(dst, swapped);
+}
+
+// The low bit_count bits of op rotated left. The amount is taken modulo the bit count, like LLVM's funnel shifts do
+void BigInt_rotl(BigInt* dst, const BigInt* op, const BigInt* amount, size_t bit_count)
+{
+    BigInt unsigned_op;
+    BigInt_truncate(&unsigned_op, op, bit_count, false);
+    u64 bits = BigInt_as_u64(&unsigned_op);
+    BigInt unsigned_amount;
+    BigInt_truncate(&unsigned_amount, amount, bit_count, false);
+    size_t shift = (size_t)(BigInt_as_u64(&unsigned_amount) % bit_count);
+    u64 mask = bit_count == 64 ? UINT64_MAX : ((u64)1 << bit_count) - 1;
+    BigInt_init_unsigned(dst, shift ? ((bits << shift) | (bits >> (bit_count - shift))) & mask : bits);
+}
+
+void BigInt_rotr(BigInt* dst, const BigInt* op, const BigInt* amount, size_t bit_count)
+{
+    BigInt unsigned_amount;
+    BigInt_truncate(&unsigned_amount, amount, bit_count, false);
+    BigInt left_amount;
+    BigInt_init_unsigned(&left_amount, (bit_count - BigInt_as_u64(&unsigned_amount) % bit_count) % bit_count);
+    BigInt_rotl(dst, op, &left_amount, bit_count);
+}
@@ -67,6 +67,10 @@ size_t BigInt_clz(const BigInt* big_int, size_t bit_count);
 size_t BigInt_popcount_signed(const BigInt* big_int, size_t bit_count);
 size_t BigInt_popcount_unsigned(const BigInt* big_int);
 
+void BigInt_bswap(BigInt* dst, const BigInt* op, size_t bit_count);
+void BigInt_rotl(BigInt* dst, const BigInt* op, const BigInt* amount, size_t bit_count);
+void BigInt_rotr(BigInt* dst, const BigInt* op, const BigInt* amount, size_t bit_count);
+
 size_t BigInt_bits_needed(const BigInt* op);
 
 Cmp BigInt_cmp_zero(const BigInt* op);
@@ -1,60 +1,1796 @@
 //
 // Created by David on 03/12/2020.
 //
-#include "bytecode.h"
 #include "types.h"
+#include "compiler_types.h"
 #include "ir.h"
+#include "bytecode.h"
+#include "lexer.h"
+#include <assert.h>
+
+GEN_BUFFER_FUNCTIONS(bc_code, cb, BCInstructionBuffer, BCInstruction)
+GEN_BUFFER_FUNCTIONS(bc_fn, fb, BCFunctionBuffer, BCFunction)
+GEN_BUFFER_FUNCTIONS(bc_extern, eb, BCExternFunctionBuffer, BCExternFunction)
+GEN_BUFFER_FUNCTIONS(s64, sb, S64Buffer, s64)
+GEN_BUFFER_FUNCTIONS(bc_jump_table, jb, BCJumpTableBuffer, BCJumpTable)
+
+static const char* bc_opcode_names[] =
+{
+    [BC_OP_MOV] = "mov",
+    [BC_OP_LOADI] = "loadi",
+    [BC_OP_LOADK] = "loadk",
+    [BC_OP_GETGLOBAL] = "getglobal",
+    [BC_OP_SETGLOBAL] = "setglobal",
+    [BC_OP_GETINDEX] = "getindex",
+    [BC_OP_SETINDEX] = "setindex",
+    [BC_OP_ADD] = "add",
+    [BC_OP_ADDI] = "addi",
+    [BC_OP_SUB] = "sub",
+    [BC_OP_MUL] = "mul",
+    [BC_OP_DIV] = "div",
+    [BC_OP_DIVU] = "divu",
+    [BC_OP_SEXT] = "sext",
+    [BC_OP_ZEXT] = "zext",
+    [BC_OP_POPCNT] = "popcnt",
+    [BC_OP_CLZ] = "clz",
+    [BC_OP_CTZ] = "ctz",
+    [BC_OP_BSWAP] = "bswap",
+    [BC_OP_ROTL] = "rotl",
+    [BC_OP_ROTR] = "rotr",
+    [BC_OP_LT] = "lt",
+    [BC_OP_GT] = "gt",
+    [BC_OP_EQ] = "eq",
+    [BC_OP_LTU] = "ltu",
+    [BC_OP_BTEST] = "btest",
+    [BC_OP_JMP] = "jmp",
+    [BC_OP_JMPF] = "jmpf",
+    [BC_OP_JMPT] = "jmpt",
+    [BC_OP_JMPTAB] = "jmptab",
+    [BC_OP_CALL] = "call",
+    [BC_OP_CALLX] = "callx",
+    [BC_OP_RET] = "ret",
+    [BC_OP_RET0] = "ret0",
+};
+static_assert(array_length(bc_opcode_names) == BC_OP_COUNT, "Every opcode must have a name");
+
+BCFunction* bc_add_function(BCModule* module, const char* name, u8 param_count)
+{
+    BCFunction* fn = bc_fn_add_one(&module->functions);
+    *fn = (const BCFunction) { .name = name, .param_count = param_count, .register_count = param_count, };
+    return fn;
+}
 
-typedef struct BCModule
+u32 bc_add_extern(BCModule* module, const char* name, u8 param_count)
 {
-    char* name;
-    char* filename;
-    BIT_FIELD_4(is_debug, pad1, pad2, pad3);
-} BCModule;
+    u32 extern_count = module->extern_functions.len;
+    for (u32 i = 0; i < extern_count; i++)
+    {
+        if (strequal(module->extern_functions.ptr[i].name, name))
+        {
+            return i;
+        }
+    }
+
+    if (param_count > BC_MAX_EXTERN_PARAM_COUNT)
+    {
+        RED_PANIC("Extern function %s has %u parameters, the bytecode trampolines support up to %u\n", name, param_count, BC_MAX_EXTERN_PARAM_COUNT);
+    }
+
+    bc_extern_append(&module->extern_functions, (const BCExternFunction) { .name = name, .param_count = param_count, });
+    return extern_count;
+}
 
-typedef enum BCInstructionID
+s32 bc_find_function(BCModule* module, const char* name)
 {
-    FN_PROTO, // No function definition
-    FN_DEF, // Full function definition
-} BCInstructionID;
+    u32 fn_count = module->functions.len;
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        if (strequal(module->functions.ptr[i].name, name))
+        {
+            return (s32)i;
+        }
+    }
+
+    return -1;
+}
 
-typedef enum BCScopeID
+void bc_bind_extern(BCModule* module, const char* name, void* address)
 {
-    MAIN,
-    MODULE,
-    BLABLABLA,
-} BCScopeID;
-typedef struct BCScope
+    u32 extern_count = module->extern_functions.len;
+    for (u32 i = 0; i < extern_count; i++)
+    {
+        BCExternFunction* it = &module->extern_functions.ptr[i];
+        if (strequal(it->name, name))
+        {
+            it->address = address;
+            return;
+        }
+    }
+}
+
+void bc_print_function(BCFunction* fn)
 {
-    int foo;
-} BCScope;
+    print("%s: %u params, %u registers\n", fn->name, fn->param_count, fn->register_count);
+    u32 instruction_count = fn->code.len;
+    for (u32 pc = 0; pc < instruction_count; pc++)
+    {
+        BCInstruction i = fn->code.ptr[pc];
+        BCOpcode op = BC_GET_OP(i);
+        redassert(op < BC_OP_COUNT);
+        print("%4u\t%-10s", pc, bc_opcode_names[op]);
+        switch (op)
+        {
+            case BC_OP_LOADI:
+                print("r%u, %d\n", BC_GET_A(i), BC_GET_SBX(i));
+                break;
+            case BC_OP_LOADK:
+            case BC_OP_GETGLOBAL:
+            case BC_OP_SETGLOBAL:
+            case BC_OP_CALL:
+            case BC_OP_CALLX:
+                print("r%u, %u\n", BC_GET_A(i), BC_GET_BX(i));
+                break;
+            case BC_OP_MOV:
+                print("r%u, r%u\n", BC_GET_A(i), BC_GET_B(i));
+                break;
+            case BC_OP_ADDI:
+                print("r%u, r%u, %lld\n", BC_GET_A(i), BC_GET_B(i), BC_GET_SC(i));
+                break;
+            case BC_OP_JMP:
+                print("-> %d\n", (s32)pc + 1 + BC_GET_SAX(i));
+                break;
+            case BC_OP_JMPF:
+            case BC_OP_JMPT:
+                print("r%u -> %d\n", BC_GET_A(i), (s32)pc + 1 + BC_GET_SBX(i));
+                break;
+            case BC_OP_JMPTAB:
+                print("r%u, table %u\n", BC_GET_A(i), BC_GET_BX(i));
+                break;
+            case BC_OP_RET:
+                print("r%u\n", BC_GET_A(i));
+                break;
+            case BC_OP_RET0:
+                print("\n");
+                break;
+            default:
+                print("r%u, r%u, r%u\n", BC_GET_A(i), BC_GET_B(i), BC_GET_C(i));
+                break;
+        }
+    }
+}
 
+/* Lowering from the IR.
+ * Parameters take the first registers, then every local gets its own registers (arrays one per element) for the whole function.
+ * Temporaries are allocated on top of the locals in stack order, so the callee window of a call starts right after its result register */
 typedef struct BCBuilder
 {
-    int foo;
+    BCModule* module;
+    IRModule* ir_module;
+    IRFunctionDefinition* ir_fn;
+    BCFunction* fn;
+    /* Indexed like ir_fn->sym_declarations */
+    u16* local_registers;
+    u32 local_count;
+    u16 local_top;
+    u16 free_register;
 } BCBuilder;
 
-typedef struct BCTarget
+static inline u32 bc_emit(BCBuilder* builder, BCInstruction instruction)
+{
+    u32 index = builder->fn->code.len;
+    bc_code_append(&builder->fn->code, instruction);
+    return index;
+}
+
+static inline u8 bc_reserve_registers(BCBuilder* builder, u16 count)
+{
+    u16 first = builder->free_register;
+    if (first + count > BC_MAX_REGISTER_COUNT)
+    {
+        RED_PANIC("Function %s needs more than %u bytecode registers\n", builder->fn->name, BC_MAX_REGISTER_COUNT);
+    }
+
+    builder->free_register += count;
+    if (builder->free_register > builder->fn->register_count)
+    {
+        builder->fn->register_count = builder->free_register;
+    }
+
+    return (u8)first;
+}
+
+static inline u8 bc_new_register(BCBuilder* builder)
+{
+    return bc_reserve_registers(builder, 1);
+}
+
+/* Registers that outlive the current statement */
+static inline u8 bc_reserve_local_registers(BCBuilder* builder, u16 count)
 {
-    char* triple;
-} BCTarget;
+    redassert(builder->free_register == builder->local_top);
+    u8 first = bc_reserve_registers(builder, count);
+    builder->local_top = builder->free_register;
+    return first;
+}
 
-void fooo(BCModule* root_module, IRFunctionPrototypeBuffer* fn_proto_bf)
+static inline u32 bc_emit_jump(BCBuilder* builder, BCOpcode op, u8 a)
 {
-    IRFunctionPrototype* fn_proto_it = fn_proto_bf->ptr;
-    u32 fn_proto_count = fn_proto_bf->len;
+    return bc_emit(builder, op == BC_OP_JMP ? BC_AX(BC_OP_JMP, 0) : BC_ABX(op, a, 0));
+}
 
-    for (u32 i = 0; i < fn_proto_count; i++)
+static inline void bc_patch_jump(BCBuilder* builder, u32 jump_index, u32 target)
+{
+    BCInstruction* jump = &builder->fn->code.ptr[jump_index];
+    s64 offset = (s64)target - (s64)(jump_index + 1);
+    if (BC_GET_OP(*jump) == BC_OP_JMP)
     {
-        struct IRFunctionPrototype* it = &fn_proto_it[i];
-        if (it->has_body)
+        if (offset < -(1 << 23) || offset >= (1 << 23))
         {
-            break;
+            RED_PANIC("Jump offset out of range in %s\n", builder->fn->name);
+        }
+        *jump = BC_AX(BC_OP_JMP, (s32)offset);
+    }
+    else
+    {
+        if (offset < INT16_MIN || offset > INT16_MAX)
+        {
+            RED_PANIC("Conditional jump offset out of range in %s\n", builder->fn->name);
+        }
+        *jump = BC_ABX(BC_GET_OP(*jump), BC_GET_A(*jump), (s16)offset);
+    }
+}
+
+static inline void bc_patch_jump_here(BCBuilder* builder, u32 jump_index)
+{
+    bc_patch_jump(builder, jump_index, builder->fn->code.len);
+}
+
+static inline u32 bc_add_constant(BCModule* module, s64 value)
+{
+    u32 constant_count = module->constants.len;
+    for (u32 i = 0; i < constant_count; i++)
+    {
+        if (module->constants.ptr[i] == value)
+        {
+            return i;
+        }
+    }
+
+    if (constant_count > UINT16_MAX)
+    {
+        RED_PANIC("Too many bytecode constants\n");
+    }
+    s64_append(&module->constants, value);
+    return constant_count;
+}
+
+static const u8 bc_primitive_bit_counts[] =
+{
+    [IR_TYPE_PRIMITIVE_U8] = 8,
+    [IR_TYPE_PRIMITIVE_U16] = 16,
+    [IR_TYPE_PRIMITIVE_U32] = 32,
+    [IR_TYPE_PRIMITIVE_U64] = 64,
+    [IR_TYPE_PRIMITIVE_S8] = 8,
+    [IR_TYPE_PRIMITIVE_S16] = 16,
+    [IR_TYPE_PRIMITIVE_S32] = 32,
+    [IR_TYPE_PRIMITIVE_S64] = 64,
+    [IR_TYPE_PRIMITIVE_F32] = 32,
+    [IR_TYPE_PRIMITIVE_F64] = 64,
+    [IR_TYPE_PRIMITIVE_F128] = 128,
+    [IR_TYPE_PRIMITIVE_BOOL] = 1,
+};
+static_assert(array_length(bc_primitive_bit_counts) == IR_TYPE_PRIMITIVE_COUNT, "Every primitive type must have a bit count");
+
+static inline bool bc_primitive_is_signed(IRTypePrimitive type)
+{
+    return type >= IR_TYPE_PRIMITIVE_S8 && type <= IR_TYPE_PRIMITIVE_S64;
+}
+
+static inline bool bc_type_is_unsigned(IRType* type)
+{
+    return type->kind == TYPE_KIND_PRIMITIVE && type->primitive_type <= IR_TYPE_PRIMITIVE_U64;
+}
+
+/* Bit count of the integers that need a SEXT or ZEXT after arithmetic, 0 for the ones that fill a register */
+static inline u8 bc_narrow_bit_count(IRType* type)
+{
+    if (type->kind != TYPE_KIND_PRIMITIVE || type->primitive_type > IR_TYPE_PRIMITIVE_S64)
+    {
+        return 0;
+    }
+    u8 bit_count = bc_primitive_bit_counts[type->primitive_type];
+    return bit_count < 64 ? bit_count : 0;
+}
+
+static inline s64 bc_sign_extend(s64 value, u32 bit_count)
+{
+    u32 shift = 64 - bit_count;
+    return (s64)((u64)value << shift) >> shift;
+}
+
+static inline s64 bc_zero_extend(s64 value, u32 bit_count)
+{
+    return (s64)((u64)value & (UINT64_MAX >> (64 - bit_count)));
+}
+
+/* The bit operations take the value already zero-extended to its bit count, and give the same results as ir_fold_bit_intrinsic */
+static inline s64 bc_popcount(u64 bits)
+{
+    s64 count = 0;
+    for (; bits; bits &= bits - 1)
+    {
+        count++;
+    }
+    return count;
+}
+
+static inline s64 bc_clz(u64 bits, u32 bit_count)
+{
+    s64 count = 0;
+    for (u32 bit = bit_count; bit > 0 && !((bits >> (bit - 1)) & 1); bit--)
+    {
+        count++;
+    }
+    return count;
+}
+
+static inline s64 bc_ctz(u64 bits, u32 bit_count)
+{
+    s64 count = 0;
+    while ((u32)count < bit_count && !((bits >> count) & 1))
+    {
+        count++;
+    }
+    return count;
+}
+
+static inline s64 bc_bswap(u64 bits, u32 bit_count)
+{
+    u64 swapped = 0;
+    for (u32 i = 0; i < bit_count; i += 8)
+    {
+        swapped |= ((bits >> i) & 0xff) << (bit_count - 8 - i);
+    }
+    return (s64)swapped;
+}
+
+/* Like LLVM's funnel shifts, the amount is taken modulo the bit count */
+static inline s64 bc_rotl(s64 value, s64 amount, u32 bit_count)
+{
+    u64 bits = (u64)bc_zero_extend(value, bit_count);
+    u32 shift = (u32)((u64)bc_zero_extend(amount, bit_count) % bit_count);
+    return shift ? bc_zero_extend((s64)((bits << shift) | (bits >> (bit_count - shift))), bit_count) : (s64)bits;
+}
+
+static inline s64 bc_int_literal_value(IRIntLiteral* int_lit)
+{
+    BigInt* bigint = &int_lit->bigint;
+    if (bigint->digit_count == 0)
+    {
+        return 0;
+    }
+    /* Registers are 64 bits wide, the same restriction as the LLVM backend */
+    if (bigint->digit_count > 1 || (bigint->is_negative && bigint->digit > (u64)INT64_MAX + 1))
+    {
+        os_exit_with_message("Integer literal doesn't fit in 64 bits, the bytecode VM can't represent it\n");
+    }
+    s64 value = (s64)bigint->digit;
+    value = bigint->is_negative ? (s64)(0 - (u64)value) : value;
+
+    /* -1 as a u8 is 255 */
+    IRType type = { .kind = TYPE_KIND_PRIMITIVE, .primitive_type = int_lit->type, };
+    u8 bit_count = bc_narrow_bit_count(&type);
+    if (bit_count)
+    {
+        value = bc_primitive_is_signed(int_lit->type) ? bc_sign_extend(value, bit_count) : bc_zero_extend(value, bit_count);
+    }
+    return value;
+}
+
+static inline void bc_emit_normalize(BCBuilder* builder, u8 value_register, IRType* type)
+{
+    u8 bit_count = bc_narrow_bit_count(type);
+    if (bit_count)
+    {
+        bc_emit(builder, BC_ABC(bc_primitive_is_signed(type->primitive_type) ? BC_OP_SEXT : BC_OP_ZEXT, value_register, value_register, bit_count));
+    }
+}
+
+static inline bool bc_constant_expression_value(IRExpression* expression, s64* value)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_INT_LIT:
+            *value = bc_int_literal_value(&expression->int_literal);
+            return true;
+        case IR_EXPRESSION_TYPE_STRING_LIT:
+            *value = (s64)(uptr)sb_ptr(expression->string_literal.str_lit);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline void bc_emit_load_constant(BCBuilder* builder, u8 target, s64 value)
+{
+    if (value >= INT16_MIN && value <= INT16_MAX)
+    {
+        bc_emit(builder, BC_ABX(BC_OP_LOADI, target, (s16)value));
+    }
+    else
+    {
+        bc_emit(builder, BC_ABX(BC_OP_LOADK, target, bc_add_constant(builder->module, value)));
+    }
+}
+
+/* Registers hold integers and pointers, and arrays of them one element per register. 0 for every other type */
+static inline u16 bc_type_register_count(IRType* type)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_PRIMITIVE:
+        case TYPE_KIND_ENUM:
+        case TYPE_KIND_POINTER:
+        case TYPE_KIND_RAW_STRING:
+            return 1;
+        case TYPE_KIND_ARRAY:
+        {
+            IRExpression* elem_count_expr = type->array_type.elem_count_expr;
+            if (!elem_count_expr || elem_count_expr->type != IR_EXPRESSION_TYPE_INT_LIT || type->array_type.is_soa)
+            {
+                return 0;
+            }
+            if (bc_type_register_count(type->array_type.base_type) != 1)
+            {
+                return 0;
+            }
+            s64 elem_count = bc_int_literal_value(&elem_count_expr->int_literal);
+            return elem_count > 0 && elem_count < BC_MAX_REGISTER_COUNT ? (u16)elem_count : 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+static inline const char* bc_type_kind_name(IRType* type)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_STRUCT:
+            return "struct";
+        case TYPE_KIND_UNION:
+            return "union";
+        case TYPE_KIND_ARRAY:
+            return "array";
+        case TYPE_KIND_FRAME:
+            return "frame";
+        case TYPE_KIND_FUNCTION:
+            return "function";
+        default:
+            return "this type of";
+    }
+}
+
+/* Values the interpreter can't hold are rejected with a diagnostic before any code is generated for them.
+ * Only locals can be arrays: globals and parameters get a single register */
+static inline u16 bc_check_type(IRType* type, bool allow_array, const char* what, SB* name)
+{
+    /* Registers are 64 bits wide and there are no lane-wise opcodes */
+    if (type->kind == TYPE_KIND_VECTOR || (type->kind == TYPE_KIND_ARRAY && type->array_type.base_type->kind == TYPE_KIND_VECTOR))
+    {
+        os_exit_with_message("%s %s: vector types are not supported in the bytecode VM\n", what, sb_ptr(name));
+    }
+    u16 register_count = bc_type_register_count(type);
+    if (register_count == 0 && type->kind == TYPE_KIND_ARRAY && allow_array)
+    {
+        os_exit_with_message("%s %s: arrays of aggregates, #soa arrays and arrays of %u or more elements are not supported in the bytecode VM\n", what, sb_ptr(name), BC_MAX_REGISTER_COUNT);
+    }
+    if (register_count == 0 || (type->kind == TYPE_KIND_ARRAY && !allow_array))
+    {
+        os_exit_with_message("%s %s: %s values are not supported in the bytecode VM\n", what, sb_ptr(name), bc_type_kind_name(type));
+    }
+    return register_count;
+}
+
+static inline void bc_check_signature(IRFunctionPrototype* proto)
+{
+    for (u8 i = 0; i < proto->param_count; i++)
+    {
+        bc_check_type(&proto->params[i].type, false, "Parameter", proto->params[i].name);
+    }
+    if (proto->ret_type.kind != TYPE_KIND_VOID)
+    {
+        bc_check_type(&proto->ret_type, false, "Return value of", proto->name);
+    }
+}
+
+static inline u16 bc_function_index(BCBuilder* builder, IRFunctionPrototype* proto)
+{
+    IRFunctionDefinitionBuffer* fn_definitions = &builder->ir_module->fn_definitions;
+    u32 fn_count = fn_definitions->len;
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        if (fn_definitions->ptr[i].proto == proto)
+        {
+            return (u16)i;
+        }
+    }
+
+    return UINT16_MAX;
+}
+
+static u8 bc_gen_expression(BCBuilder* builder, IRExpression* expression, s32 target);
+static void bc_gen_statement(BCBuilder* builder, IRStatement* st);
+
+static inline u8 bc_target_register(BCBuilder* builder, s32 target)
+{
+    return target >= 0 ? (u8)target : bc_new_register(builder);
+}
+
+static inline u8 bc_move_to_target(BCBuilder* builder, u8 value_register, s32 target)
+{
+    if (target < 0 || target == value_register)
+    {
+        return value_register;
+    }
+
+    bc_emit(builder, BC_ABC(BC_OP_MOV, target, value_register, 0));
+    return (u8)target;
+}
+
+static inline u8 bc_gen_fn_call(BCBuilder* builder, IRFunctionCallExpr* fn_call, s32 target)
+{
+    IRFunctionPrototype* proto = fn_call->fn;
+    redassert(fn_call->arg_count == proto->param_count);
+    /* Async calls need a frame that outlives the call, the interpreter only has the register window */
+    if (proto->attributes.is_async)
+    {
+        os_exit_with_message("Calling async function %s is not supported in the bytecode VM\n", sb_ptr(proto->name));
+    }
+
+    /* The callee window starts right after the result register, so both go on top of every live register */
+    u8 call_register = bc_new_register(builder);
+    for (u8 i = 0; i < fn_call->arg_count; i++)
+    {
+        u8 arg_register = bc_new_register(builder);
+        bc_gen_expression(builder, &fn_call->args[i], arg_register);
+        builder->free_register = arg_register + 1;
+    }
+
+    u16 fn_index = bc_function_index(builder, proto);
+    if (fn_index != UINT16_MAX)
+    {
+        bc_emit(builder, BC_ABX(BC_OP_CALL, call_register, fn_index));
+    }
+    else
+    {
+        /* Only the main module is lowered, so functions defined in the others are unknown to the interpreter */
+        if (proto->has_body)
+        {
+            os_exit_with_message("Calling %s from another module is not supported in the bytecode VM\n", sb_ptr(proto->name));
+        }
+        bc_check_signature(proto);
+        u32 extern_index = bc_add_extern(builder->module, sb_ptr(proto->name), proto->param_count);
+        bc_emit(builder, BC_ABX(BC_OP_CALLX, call_register, extern_index));
+        /* The C ABI leaves the upper bits of narrow results undefined */
+        bc_emit_normalize(builder, call_register, &proto->ret_type);
+    }
+    builder->free_register = call_register + 1;
+
+    return bc_move_to_target(builder, call_register, target);
+}
+
+static inline s64 bc_enum_field_value(IREnumDecl* enum_decl, SB* field_name)
+{
+    u32 field_count = enum_decl->fields.len;
+    IREnumField* field_ptr = enum_decl->fields.ptr;
+    for (u32 i = 0; i < field_count; i++)
+    {
+        IREnumField* field = &field_ptr[i];
+        if (sb_cmp(field->name, field_name))
+        {
+            return field->value.signed64;
+        }
+    }
+
+    RED_UNREACHABLE;
+    return 0;
+}
+
+static inline u8 bc_local_register(BCBuilder* builder, IRSymDeclStatement* sym)
+{
+    u32 index = (u32)(sym - builder->ir_fn->sym_declarations.ptr);
+    redassert(index < builder->local_count);
+    return (u8)builder->local_registers[index];
+}
+
+static inline u8 bc_gen_sym_load(BCBuilder* builder, IRSymExpr* sym_expr, s32 target)
+{
+    IRExpression* subscript = sym_expr->subscript;
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_PARAM:
+        {
+            redassert(!subscript);
+            u8 param_register = (u8)(sym_expr->param_decl - builder->ir_fn->proto->params);
+            return bc_move_to_target(builder, param_register, target);
+        }
+        case IR_SYM_EXPR_TYPE_SYM:
+        {
+            IRSymDeclStatement* sym = sym_expr->sym_decl;
+            u8 local_register = bc_local_register(builder, sym);
+            if (subscript)
+            {
+                /* Locals are either arrays or scalars, see bc_check_type() */
+                redassert(sym->type.kind == TYPE_KIND_ARRAY);
+
+                u16 mark = builder->free_register;
+                u8 index_register = bc_gen_expression(builder, subscript, -1);
+                builder->free_register = mark;
+                u8 result = bc_target_register(builder, target);
+                bc_emit(builder, BC_ABC(BC_OP_GETINDEX, result, local_register, index_register));
+                return result;
+            }
+
+            return bc_move_to_target(builder, local_register, target);
+        }
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+        {
+            redassert(!subscript);
+            u32 global_index = (u32)(sym_expr->global_sym_decl - builder->ir_module->global_sym_decls.ptr);
+            u8 result = bc_target_register(builder, target);
+            bc_emit(builder, BC_ABX(BC_OP_GETGLOBAL, result, global_index));
+            return result;
         }
-        else
+        case IR_SYM_EXPR_TYPE_ENUM:
         {
+            redassert(subscript && subscript->type == IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS);
+            u8 result = bc_target_register(builder, target);
+            bc_emit_load_constant(builder, result, bc_enum_field_value(sym_expr->enum_decl, subscript->subscript_access.name));
+            return result;
+        }
+        default:
+            /* Aggregates other than arrays don't fit in registers */
+            os_exit_with_message("Struct and module member accesses are not supported in the bytecode VM\n");
+            return 0;
+    }
+}
+
+/* Only the bit operations compute a value, #expect is just a hint */
+static inline u8 bc_gen_intrinsic(BCBuilder* builder, IRIntrinsicExpr* intrinsic, s32 target)
+{
+    IntrinsicID id = intrinsic->id;
+    if (id == INTRINSIC_EXPECT)
+    {
+        return bc_gen_expression(builder, &intrinsic->args[0], target);
+    }
+
+    BCOpcode bc_op;
+    switch (id)
+    {
+        case INTRINSIC_POPCOUNT:
+            bc_op = BC_OP_POPCNT;
+            break;
+        case INTRINSIC_CLZ:
+            bc_op = BC_OP_CLZ;
+            break;
+        case INTRINSIC_CTZ:
+            bc_op = BC_OP_CTZ;
+            break;
+        case INTRINSIC_BSWAP:
+            bc_op = BC_OP_BSWAP;
+            break;
+        case INTRINSIC_ROTL:
+            bc_op = BC_OP_ROTL;
+            break;
+        case INTRINSIC_ROTR:
+            bc_op = BC_OP_ROTR;
+            break;
+        default:
+            /* Registers hold no vectors, and there are no opcodes for the atomics */
+            os_exit_with_message("#%s is not supported in the bytecode VM\n", intrinsic_name(id));
+            return 0;
+    }
+
+    IRType type = ast_to_ir_find_expression_type(&intrinsic->args[0]);
+    redassert(type.kind == TYPE_KIND_PRIMITIVE);
+    u8 bit_count = bc_primitive_bit_counts[type.primitive_type];
+    u16 mark = builder->free_register;
+    u8 value = bc_gen_expression(builder, &intrinsic->args[0], -1);
 
+    if (intrinsic->arg_count == 1)
+    {
+        builder->free_register = mark;
+        u8 result = bc_target_register(builder, target);
+        bc_emit(builder, BC_ABC(bc_op, result, value, bit_count));
+        /* Counts are small and never need it */
+        if (bc_op == BC_OP_BSWAP)
+        {
+            bc_emit_normalize(builder, result, &type);
         }
+        return result;
+    }
+
+    /* Rotations work in place, so an amount living in the result register is moved above every operand first */
+    u8 amount = bc_gen_expression(builder, &intrinsic->args[1], -1);
+    u8 spare = bc_new_register(builder);
+    builder->free_register = mark;
+    u8 result = bc_target_register(builder, target);
+    if (result == amount)
+    {
+        bc_emit(builder, BC_ABC(BC_OP_MOV, spare, amount, 0));
+        amount = spare;
+    }
+    if (result != value)
+    {
+        bc_emit(builder, BC_ABC(BC_OP_MOV, result, value, 0));
     }
+    bc_emit(builder, BC_ABC(bc_op, result, amount, bit_count));
+    bc_emit_normalize(builder, result, &type);
+    return result;
 }
 
+static const char* bc_expression_type_names[] =
+{
+    [IR_EXPRESSION_TYPE_VOID] = "Void",
+    [IR_EXPRESSION_TYPE_INT_LIT] = "Integer literal",
+    [IR_EXPRESSION_TYPE_ARRAY_LIT] = "Array literal",
+    [IR_EXPRESSION_TYPE_STRING_LIT] = "String literal",
+    [IR_EXPRESSION_TYPE_SYM_EXPR] = "Symbol",
+    [IR_EXPRESSION_TYPE_BIN_EXPR] = "Binary",
+    [IR_EXPRESSION_TYPE_FN_CALL_EXPR] = "Call",
+    [IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS] = "Member access",
+    [IR_EXPRESSION_TYPE_COMPTIME_EXPR] = "Comptime",
+    [IR_EXPRESSION_TYPE_INTRINSIC_EXPR] = "Intrinsic",
+    [IR_EXPRESSION_TYPE_AWAIT_EXPR] = "Await",
+};
+static_assert(array_length(bc_expression_type_names) == IR_EXPRESSION_TYPE_AWAIT_EXPR + 1, "Every expression type must have a name");
+
+static u8 bc_gen_expression(BCBuilder* builder, IRExpression* expression, s32 target)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_INT_LIT:
+        case IR_EXPRESSION_TYPE_STRING_LIT:
+        {
+            s64 value;
+            bool is_constant = bc_constant_expression_value(expression, &value);
+            redassert(is_constant);
+            u8 result = bc_target_register(builder, target);
+            bc_emit_load_constant(builder, result, value);
+            return result;
+        }
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+            redassert(expression->sym_expr.use_type == LOAD);
+            return bc_gen_sym_load(builder, &expression->sym_expr, target);
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+        {
+            IRBinaryExpr* bin_expr = &expression->bin_expr;
+            TokenID op = bin_expr->op;
+            /* Both operands have the type of the left one, and so does the result of the arithmetic */
+            IRType type = ast_to_ir_find_expression_type(bin_expr->left);
+            if (type.kind == TYPE_KIND_VECTOR)
+            {
+                os_exit_with_message("Vector operations are not supported in the bytecode VM\n");
+            }
+            bool is_unsigned = bc_type_is_unsigned(&type);
+            u16 mark = builder->free_register;
+            u8 left = bc_gen_expression(builder, bin_expr->left, -1);
+
+            s64 immediate;
+            if ((op == TOKEN_ID_PLUS || op == TOKEN_ID_DASH) && bin_expr->right->type == IR_EXPRESSION_TYPE_INT_LIT && bc_constant_expression_value(bin_expr->right, &immediate))
+            {
+                immediate = op == TOKEN_ID_PLUS ? immediate : -immediate;
+                if (immediate >= INT8_MIN && immediate <= INT8_MAX)
+                {
+                    builder->free_register = mark;
+                    u8 result = bc_target_register(builder, target);
+                    bc_emit(builder, BC_ABC(BC_OP_ADDI, result, left, (s8)immediate));
+                    bc_emit_normalize(builder, result, &type);
+                    return result;
+                }
+            }
+
+            u8 right = bc_gen_expression(builder, bin_expr->right, -1);
+            builder->free_register = mark;
+            u8 result = bc_target_register(builder, target);
+
+            BCOpcode bc_op;
+            bool is_arithmetic = true;
+            switch (op)
+            {
+                case TOKEN_ID_CMP_LESS:
+                    bc_op = is_unsigned ? BC_OP_LTU : BC_OP_LT;
+                    is_arithmetic = false;
+                    break;
+                case TOKEN_ID_CMP_GREATER:
+                    if (is_unsigned)
+                    {
+                        /* a > b is b < a */
+                        bc_emit(builder, BC_ABC(BC_OP_LTU, result, right, left));
+                        return result;
+                    }
+                    bc_op = BC_OP_GT;
+                    is_arithmetic = false;
+                    break;
+                case TOKEN_ID_CMP_EQ:
+                    bc_op = BC_OP_EQ;
+                    is_arithmetic = false;
+                    break;
+                case TOKEN_ID_PLUS:
+                    bc_op = BC_OP_ADD;
+                    break;
+                case TOKEN_ID_DASH:
+                    bc_op = BC_OP_SUB;
+                    break;
+                case TOKEN_ID_STAR:
+                    bc_op = BC_OP_MUL;
+                    break;
+                case TOKEN_ID_SLASH:
+                    bc_op = is_unsigned ? BC_OP_DIVU : BC_OP_DIV;
+                    break;
+                default:
+                    os_exit_with_message("Operator %s is not supported in the bytecode VM\n", token_name(op));
+                    return 0;
+            }
+
+            bc_emit(builder, BC_ABC(bc_op, result, left, right));
+            if (is_arithmetic)
+            {
+                bc_emit_normalize(builder, result, &type);
+            }
+            return result;
+        }
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            return bc_gen_fn_call(builder, &expression->fn_call_expr, target);
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            return bc_gen_intrinsic(builder, &expression->intrinsic_expr, target);
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+            os_exit_with_message("Array literals are only supported in local declarations in the bytecode VM\n");
+            return 0;
+        default:
+            os_exit_with_message("%s expressions are not supported in the bytecode VM\n", bc_expression_type_names[expression->type]);
+            return 0;
+    }
+}
+
+static inline void bc_gen_compound_statement(BCBuilder* builder, IRCompoundStatement* compound_st)
+{
+    u32 st_count = compound_st->stmts.len;
+    for (u32 i = 0; i < st_count; i++)
+    {
+        bc_gen_statement(builder, &compound_st->stmts.ptr[i]);
+    }
+}
+
+static inline void bc_gen_sym_decl(BCBuilder* builder, IRSymDeclStatement* decl_st)
+{
+    /* Same order as fn_definition->sym_declarations, the way the LLVM backend fills its alloca buffer */
+    redassert(builder->local_count < builder->ir_fn->sym_declarations.len);
+    u16 register_count = bc_check_type(&decl_st->type, true, "Variable", decl_st->name);
+    u8 first_register = bc_reserve_local_registers(builder, register_count);
+    builder->local_registers[builder->local_count++] = first_register;
+
+    IRExpression* value = &decl_st->value;
+    switch (value->type)
+    {
+        case IR_EXPRESSION_TYPE_VOID:
+            break;
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+        {
+            IRArrayLiteral* array_lit = &value->array_literal;
+            redassert(array_lit->expression_count <= register_count);
+            for (u64 i = 0; i < array_lit->expression_count; i++)
+            {
+                bc_gen_expression(builder, &array_lit->expressions[i], first_register + (s32)i);
+            }
+            break;
+        }
+        default:
+            redassert(register_count == 1);
+            bc_gen_expression(builder, value, first_register);
+            break;
+    }
+}
+
+static inline void bc_gen_assign(BCBuilder* builder, IRSymAssignStatement* assign_st)
+{
+    IRExpression* left = assign_st->left;
+    redassert(left->type == IR_EXPRESSION_TYPE_SYM_EXPR);
+    IRSymExpr* sym_expr = &left->sym_expr;
+    IRExpression* subscript = sym_expr->subscript;
+
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_PARAM:
+            redassert(!subscript);
+            bc_gen_expression(builder, assign_st->right, (u8)(sym_expr->param_decl - builder->ir_fn->proto->params));
+            break;
+        case IR_SYM_EXPR_TYPE_SYM:
+        {
+            u8 local_register = bc_local_register(builder, sym_expr->sym_decl);
+            if (subscript)
+            {
+                redassert(sym_expr->sym_decl->type.kind == TYPE_KIND_ARRAY);
+                u8 index_register = bc_gen_expression(builder, subscript, -1);
+                u8 value_register = bc_gen_expression(builder, assign_st->right, -1);
+                bc_emit(builder, BC_ABC(BC_OP_SETINDEX, local_register, index_register, value_register));
+            }
+            else
+            {
+                bc_gen_expression(builder, assign_st->right, local_register);
+            }
+            break;
+        }
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+        {
+            redassert(!subscript);
+            u32 global_index = (u32)(sym_expr->global_sym_decl - builder->ir_module->global_sym_decls.ptr);
+            u8 value_register = bc_gen_expression(builder, assign_st->right, -1);
+            bc_emit(builder, BC_ABX(BC_OP_SETGLOBAL, value_register, global_index));
+            break;
+        }
+        default:
+            os_exit_with_message("Struct and module member accesses are not supported in the bytecode VM\n");
+            break;
+    }
+}
+
+/* Switch dispatch follows the clusters of ir_switch_lowering(): a binary search over the clusters, then per cluster a compare, a bit test or a jump table.
+ * Case bodies are emitted after the dispatch, so every jump to a body is recorded and patched once the bodies are placed */
+#define BC_SWITCH_LINEAR_CLUSTER_COUNT 3
+
+typedef struct BCSwitchJump
+{
+    u32 instruction;
+    /* -1 jumps to the default case */
+    s32 case_index;
+} BCSwitchJump;
+
+typedef struct BCSwitchBuilder
+{
+    IRSwitchLowering* lowering;
+    BCSwitchJump* jumps;
+    u32 jump_count;
+    u32* jump_tables;
+    u32* jump_table_instructions;
+    u32 jump_table_count;
+    u8 value_register;
+} BCSwitchBuilder;
+
+static inline void bc_switch_jump(BCBuilder* builder, BCSwitchBuilder* switch_builder, BCOpcode op, u8 a, s32 case_index)
+{
+    switch_builder->jumps[switch_builder->jump_count++] = (const BCSwitchJump) { .instruction = bc_emit_jump(builder, op, a), .case_index = case_index, };
+}
+
+static inline void bc_gen_switch_cluster(BCBuilder* builder, BCSwitchBuilder* switch_builder, IRSwitchCluster* cluster)
+{
+    IRSwitchCaseValue* values = &switch_builder->lowering->values[cluster->first_value];
+    u8 value_register = switch_builder->value_register;
+    switch (cluster->kind)
+    {
+        case IR_SWITCH_CLUSTER_VALUE:
+        {
+            u8 case_register = bc_new_register(builder);
+            bc_emit_load_constant(builder, case_register, (s64)cluster->low);
+            bc_emit(builder, BC_ABC(BC_OP_EQ, case_register, value_register, case_register));
+            bc_switch_jump(builder, switch_builder, BC_OP_JMPT, case_register, (s32)values[0].case_index);
+            break;
+        }
+        case IR_SWITCH_CLUSTER_BIT_TEST:
+        {
+            u8 bit_register = bc_new_register(builder);
+            u8 mask_register = bc_new_register(builder);
+            s64 low = (s64)cluster->low;
+            if (low >= INT8_MIN && low <= INT8_MAX)
+            {
+                bc_emit(builder, BC_ABC(BC_OP_ADDI, bit_register, value_register, (s8)-low));
+            }
+            else
+            {
+                bc_emit_load_constant(builder, bit_register, low);
+                bc_emit(builder, BC_ABC(BC_OP_SUB, bit_register, value_register, bit_register));
+            }
+
+            /* One test per target, values sharing a body share a mask */
+            for (u32 i = 0; i < cluster->value_count; i++)
+            {
+                bool is_first_of_target = true;
+                for (u32 j = 0; j < i; j++)
+                {
+                    is_first_of_target = is_first_of_target && values[j].case_index != values[i].case_index;
+                }
+                if (!is_first_of_target)
+                {
+                    continue;
+                }
+
+                u64 mask = 0;
+                for (u32 j = i; j < cluster->value_count; j++)
+                {
+                    if (values[j].case_index == values[i].case_index)
+                    {
+                        mask |= (u64)1 << (values[j].value - cluster->low);
+                    }
+                }
+                bc_emit_load_constant(builder, mask_register, (s64)mask);
+                bc_emit(builder, BC_ABC(BC_OP_BTEST, mask_register, bit_register, mask_register));
+                bc_switch_jump(builder, switch_builder, BC_OP_JMPT, mask_register, (s32)values[i].case_index);
+            }
+            break;
+        }
+        case IR_SWITCH_CLUSTER_JUMP_TABLE:
+        {
+            BCJumpTableBuffer* jump_tables = &builder->module->jump_tables;
+            u32 table_index = jump_tables->len;
+            if (table_index > UINT16_MAX)
+            {
+                RED_PANIC("Too many bytecode jump tables\n");
+            }
+
+            /* Entries hold case indices until the bodies are placed */
+            u32 entry_count = (u32)(cluster->high - cluster->low) + 1;
+            s32* entries = NEW(s32, entry_count);
+            for (u32 i = 0; i < entry_count; i++)
+            {
+                entries[i] = -1;
+            }
+            for (u32 i = 0; i < cluster->value_count; i++)
+            {
+                entries[values[i].value - cluster->low] = (s32)values[i].case_index;
+            }
+            bc_jump_table_append(jump_tables, (const BCJumpTable) { .low = (s64)cluster->low, .offsets = entries, .entry_count = entry_count, });
+
+            u32 switch_table_index = switch_builder->jump_table_count++;
+            switch_builder->jump_tables[switch_table_index] = table_index;
+            switch_builder->jump_table_instructions[switch_table_index] = bc_emit(builder, BC_ABX(BC_OP_JMPTAB, value_register, table_index));
+            break;
+        }
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+
+    builder->free_register = builder->local_top;
+}
+
+static void bc_gen_switch_dispatch(BCBuilder* builder, BCSwitchBuilder* switch_builder, u32 first_cluster, u32 cluster_count)
+{
+    IRSwitchLowering* lowering = switch_builder->lowering;
+    if (cluster_count <= BC_SWITCH_LINEAR_CLUSTER_COUNT)
+    {
+        for (u32 i = 0; i < cluster_count; i++)
+        {
+            bc_gen_switch_cluster(builder, switch_builder, &lowering->clusters[first_cluster + i]);
+        }
+        bc_switch_jump(builder, switch_builder, BC_OP_JMP, 0, -1);
+        return;
+    }
+
+    u32 left_count = cluster_count / 2;
+    u8 condition_register = bc_new_register(builder);
+    bc_emit_load_constant(builder, condition_register, (s64)lowering->clusters[first_cluster + left_count].low);
+    bc_emit(builder, BC_ABC(lowering->is_signed ? BC_OP_LT : BC_OP_LTU, condition_register, switch_builder->value_register, condition_register));
+    builder->free_register = builder->local_top;
+    u32 jump_to_right = bc_emit_jump(builder, BC_OP_JMPF, condition_register);
+    bc_gen_switch_dispatch(builder, switch_builder, first_cluster, left_count);
+    bc_patch_jump_here(builder, jump_to_right);
+    bc_gen_switch_dispatch(builder, switch_builder, first_cluster + left_count, cluster_count - left_count);
+}
+
+static inline void bc_gen_switch(BCBuilder* builder, IRSwitchStatement* switch_st)
+{
+    IRSwitchLowering* lowering = ir_switch_lowering(switch_st);
+    /* The switch value must survive the dispatch */
+    u8 value_register = bc_reserve_local_registers(builder, 1);
+    bc_gen_expression(builder, &switch_st->switch_expr, value_register);
+
+    u32 case_count = switch_st->cases.len;
+    BCSwitchBuilder switch_builder =
+    {
+        .lowering = lowering,
+        .jumps = NEW(BCSwitchJump, (lowering->value_count + lowering->cluster_count + 1)),
+        .jump_tables = NEW(u32, (lowering->cluster_count + 1)),
+        .jump_table_instructions = NEW(u32, (lowering->cluster_count + 1)),
+        .value_register = value_register,
+    };
+    bc_gen_switch_dispatch(builder, &switch_builder, 0, lowering->cluster_count);
+
+    u32* case_starts = NEW(u32, (case_count + 1));
+    u32* jumps_to_end = NEW(u32, (case_count + 1));
+    u32 jump_to_end_count = 0;
+    for (u32 i = 0; i < case_count; i++)
+    {
+        case_starts[i] = builder->fn->code.len;
+        bc_gen_compound_statement(builder, &switch_st->cases.ptr[i].case_body);
+        if (i + 1 < case_count)
+        {
+            jumps_to_end[jump_to_end_count++] = bc_emit_jump(builder, BC_OP_JMP, 0);
+        }
+    }
+
+    u32 end = builder->fn->code.len;
+    u32 default_start = lowering->default_case >= 0 ? case_starts[lowering->default_case] : end;
+    for (u32 i = 0; i < switch_builder.jump_count; i++)
+    {
+        BCSwitchJump* jump = &switch_builder.jumps[i];
+        bc_patch_jump(builder, jump->instruction, jump->case_index >= 0 ? case_starts[jump->case_index] : default_start);
+    }
+    for (u32 i = 0; i < jump_to_end_count; i++)
+    {
+        bc_patch_jump(builder, jumps_to_end[i], end);
+    }
+    for (u32 i = 0; i < switch_builder.jump_table_count; i++)
+    {
+        BCJumpTable* table = &builder->module->jump_tables.ptr[switch_builder.jump_tables[i]];
+        s64 base = (s64)switch_builder.jump_table_instructions[i] + 1;
+        for (u32 entry = 0; entry < table->entry_count; entry++)
+        {
+            s32 case_index = table->offsets[entry];
+            table->offsets[entry] = (s32)((s64)(case_index >= 0 ? case_starts[case_index] : default_start) - base);
+        }
+    }
+}
+
+static void bc_gen_statement(BCBuilder* builder, IRStatement* st)
+{
+    switch (st->type)
+    {
+        case IR_ST_TYPE_COMPOUND_ST:
+            bc_gen_compound_statement(builder, &st->compound_st);
+            break;
+        case IR_ST_TYPE_RETURN_ST:
+        {
+            IRExpression* expression = &st->return_st.expression;
+            if (expression->type == IR_EXPRESSION_TYPE_VOID)
+            {
+                bc_emit(builder, BC_ABC(BC_OP_RET0, 0, 0, 0));
+            }
+            else
+            {
+                u8 value_register = bc_gen_expression(builder, expression, -1);
+                bc_emit(builder, BC_ABC(BC_OP_RET, value_register, 0, 0));
+            }
+            break;
+        }
+        case IR_ST_TYPE_BRANCH_ST:
+        {
+            IRBranchStatement* branch_st = &st->branch_st;
+            u8 condition_register = bc_gen_expression(builder, &branch_st->condition, -1);
+            builder->free_register = builder->local_top;
+            u32 jump_to_else = bc_emit_jump(builder, BC_OP_JMPF, condition_register);
+            bc_gen_compound_statement(builder, &branch_st->if_block);
+            if (branch_st->else_block)
+            {
+                u32 jump_to_end = bc_emit_jump(builder, BC_OP_JMP, 0);
+                bc_patch_jump_here(builder, jump_to_else);
+                bc_gen_statement(builder, branch_st->else_block);
+                bc_patch_jump_here(builder, jump_to_end);
+            }
+            else
+            {
+                bc_patch_jump_here(builder, jump_to_else);
+            }
+            break;
+        }
+        case IR_ST_TYPE_SWITCH_ST:
+            bc_gen_switch(builder, &st->switch_st);
+            break;
+        case IR_ST_TYPE_SYM_DECL_ST:
+            bc_gen_sym_decl(builder, &st->sym_decl_st);
+            break;
+        case IR_ST_TYPE_ASSIGN_ST:
+            bc_gen_assign(builder, &st->sym_assign_st);
+            break;
+        case IR_ST_TYPE_FN_CALL_ST:
+            bc_gen_fn_call(builder, &st->fn_call_st, -1);
+            break;
+        case IR_ST_TYPE_LOOP_ST:
+        {
+            IRLoopStatement* loop_st = &st->loop_st;
+            u32 loop_start = builder->fn->code.len;
+            u8 condition_register = bc_gen_expression(builder, &loop_st->condition, -1);
+            builder->free_register = builder->local_top;
+            u32 jump_to_end = bc_emit_jump(builder, BC_OP_JMPF, condition_register);
+            bc_gen_compound_statement(builder, &loop_st->body);
+            u32 jump_to_start = bc_emit_jump(builder, BC_OP_JMP, 0);
+            bc_patch_jump(builder, jump_to_start, loop_start);
+            bc_patch_jump_here(builder, jump_to_end);
+            break;
+        }
+        case IR_ST_TYPE_SUSPEND_ST:
+        case IR_ST_TYPE_RESUME_ST:
+        case IR_ST_TYPE_AWAIT_ST:
+            os_exit_with_message("suspend, resume and await are not supported in the bytecode VM\n");
+            break;
+        case IR_ST_TYPE_INTRINSIC_ST:
+            /* #assume, #prefetch, #unreachable and #fence are hints the single threaded interpreter has no use for.
+             * Registers hold no vectors, and there are no opcodes for the other atomics yet */
+            if (intrinsic_is_vector_op(st->intrinsic_st.id) || (intrinsic_is_atomic_op(st->intrinsic_st.id) && st->intrinsic_st.id != INTRINSIC_FENCE))
+            {
+                os_exit_with_message("#%s is not supported in the bytecode VM\n", intrinsic_name(st->intrinsic_st.id));
+            }
+            break;
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+
+    builder->free_register = builder->local_top;
+}
+
+static inline void bc_gen_fn_definition(BCModule* module, IRModule* ir_module, IRFunctionDefinition* ir_fn, BCFunction* fn)
+{
+    u32 sym_decl_count = ir_fn->sym_declarations.len;
+    BCBuilder builder =
+    {
+        .module = module,
+        .ir_module = ir_module,
+        .ir_fn = ir_fn,
+        .fn = fn,
+        .local_registers = sym_decl_count ? NEW(u16, sym_decl_count) : null,
+        .local_top = fn->param_count,
+        .free_register = fn->param_count,
+    };
+
+    bc_gen_compound_statement(&builder, &ir_fn->body);
+    BCOpcode last_op = fn->code.len ? BC_GET_OP(*bc_code_last(&fn->code)) : BC_OP_COUNT;
+    if (last_op != BC_OP_RET && last_op != BC_OP_RET0)
+    {
+        bc_emit(&builder, BC_ABC(BC_OP_RET0, 0, 0, 0));
+    }
+#if RED_IR_VERBOSE
+    bc_print_function(fn);
+#endif
+}
+
+BCModule bc_module_from_ir(IRModule* ir_module)
+{
+    BCModule module = { .name = ir_module->name, };
+
+    u32 global_count = ir_module->global_sym_decls.len;
+    for (u32 i = 0; i < global_count; i++)
+    {
+        IRSymDeclStatement* global_sym = &ir_module->global_sym_decls.ptr[i];
+        bc_check_type(&global_sym->type, false, "Global", global_sym->name);
+        s64 value = 0;
+        /* Globals are initialized when the module is built, there is no code that runs before main */
+        if (global_sym->value.type != IR_EXPRESSION_TYPE_VOID && !bc_constant_expression_value(&global_sym->value, &value))
+        {
+            os_exit_with_message("Global %s: initializers other than literals are not supported in the bytecode VM\n", sb_ptr(global_sym->name));
+        }
+        s64_append(&module.globals, value);
+    }
+
+    /* Function indices follow ir_module->fn_definitions, so calls can be lowered before their callee */
+    u32 fn_count = ir_module->fn_definitions.len;
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        IRFunctionPrototype* proto = ir_module->fn_definitions.ptr[i].proto;
+        if (proto->attributes.is_async)
+        {
+            os_exit_with_message("Async function %s is not supported in the bytecode VM\n", sb_ptr(proto->name));
+        }
+        bc_check_signature(proto);
+        bc_add_function(&module, sb_ptr(proto->name), proto->param_count);
+    }
+
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        bc_gen_fn_definition(&module, ir_module, &ir_module->fn_definitions.ptr[i], &module.functions.ptr[i]);
+    }
+
+    return module;
+}
+
+/* Extern calls pass every argument as a 64-bit integer, which covers integer and pointer signatures on both Win64 and System V.
+ * Results of void functions are read from the return register and discarded */
+typedef s64 BCTrampoline(void* address, const s64* args);
+typedef s64 BCNative0(void);
+typedef s64 BCNative1(s64);
+typedef s64 BCNative2(s64, s64);
+typedef s64 BCNative3(s64, s64, s64);
+typedef s64 BCNative4(s64, s64, s64, s64);
+typedef s64 BCNative5(s64, s64, s64, s64, s64);
+typedef s64 BCNative6(s64, s64, s64, s64, s64, s64);
+typedef s64 BCNative7(s64, s64, s64, s64, s64, s64, s64);
+typedef s64 BCNative8(s64, s64, s64, s64, s64, s64, s64, s64);
+
+static s64 bc_trampoline_0(void* address, const s64* args)
+{
+    UNUSED_ELEM(args);
+    return ((BCNative0*)address)();
+}
+
+static s64 bc_trampoline_1(void* address, const s64* args)
+{
+    return ((BCNative1*)address)(args[0]);
+}
+
+static s64 bc_trampoline_2(void* address, const s64* args)
+{
+    return ((BCNative2*)address)(args[0], args[1]);
+}
+
+static s64 bc_trampoline_3(void* address, const s64* args)
+{
+    return ((BCNative3*)address)(args[0], args[1], args[2]);
+}
+
+static s64 bc_trampoline_4(void* address, const s64* args)
+{
+    return ((BCNative4*)address)(args[0], args[1], args[2], args[3]);
+}
+
+static s64 bc_trampoline_5(void* address, const s64* args)
+{
+    return ((BCNative5*)address)(args[0], args[1], args[2], args[3], args[4]);
+}
+
+static s64 bc_trampoline_6(void* address, const s64* args)
+{
+    return ((BCNative6*)address)(args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static s64 bc_trampoline_7(void* address, const s64* args)
+{
+    return ((BCNative7*)address)(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+}
+
+static s64 bc_trampoline_8(void* address, const s64* args)
+{
+    return ((BCNative8*)address)(args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7]);
+}
+
+static BCTrampoline* const bc_trampolines[BC_MAX_EXTERN_PARAM_COUNT + 1] =
+{
+    bc_trampoline_0,
+    bc_trampoline_1,
+    bc_trampoline_2,
+    bc_trampoline_3,
+    bc_trampoline_4,
+    bc_trampoline_5,
+    bc_trampoline_6,
+    bc_trampoline_7,
+    bc_trampoline_8,
+};
+
+/* Interpreter */
+#define BC_VALUE_STACK_SIZE (1 << 20)
+#define BC_FRAME_STACK_SIZE (1 << 16)
+
+typedef struct BCFrame
+{
+    const BCInstruction* return_pc;
+    s64* base;
+} BCFrame;
+
+static s64 bc_value_stack[BC_VALUE_STACK_SIZE];
+static BCFrame bc_frame_stack[BC_FRAME_STACK_SIZE];
+
+/* Threaded dispatch: every handler ends in its own indirect jump, which predicts much better than the single one of a switch.
+ * Needs the labels-as-values extension; define BC_THREADED_DISPATCH to 0 to compare against the switch loop */
+#ifndef BC_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define BC_THREADED_DISPATCH 1
+#else
+#define BC_THREADED_DISPATCH 0
+#endif
+#endif
+
+#if BC_THREADED_DISPATCH
+#define BC_HANDLER(op) op##_handler:
+#define BC_DISPATCH() i = *pc++; goto *dispatch_table[BC_GET_OP(i)]
+#else
+#define BC_HANDLER(op) case op:
+#define BC_DISPATCH() continue
+#endif
+
+s64 bc_run(BCModule* module, u32 fn_index, const s64* args, u8 arg_count)
+{
+    redassert(fn_index < module->functions.len);
+    BCFunction* entry = &module->functions.ptr[fn_index];
+    redassert(arg_count == entry->param_count);
+
+    u32 extern_count = module->extern_functions.len;
+    for (u32 e = 0; e < extern_count; e++)
+    {
+        if (!module->extern_functions.ptr[e].address)
+        {
+            RED_PANIC("Extern function %s is not bound\n", module->extern_functions.ptr[e].name);
+        }
+    }
+
+    BCFunction* functions = module->functions.ptr;
+    BCExternFunction* extern_functions = module->extern_functions.ptr;
+    s64* constants = module->constants.ptr;
+    s64* globals = module->globals.ptr;
+    BCJumpTable* jump_tables = module->jump_tables.ptr;
+    s64* const stack_end = bc_value_stack + BC_VALUE_STACK_SIZE;
+    BCFrame* const frame_end = bc_frame_stack + BC_FRAME_STACK_SIZE;
+
+    /* The entry function returns into bc_value_stack[0], the same slot a CALL result would use */
+    s64* R = bc_value_stack + 1;
+    BCFrame* frame = bc_frame_stack;
+    const BCInstruction* pc = entry->code.ptr;
+    memcpy(R, args, arg_count * sizeof(s64));
+
+    BCInstruction i;
+#if BC_THREADED_DISPATCH
+    static const void* dispatch_table[] =
+    {
+        [BC_OP_MOV] = &&BC_OP_MOV_handler,
+        [BC_OP_LOADI] = &&BC_OP_LOADI_handler,
+        [BC_OP_LOADK] = &&BC_OP_LOADK_handler,
+        [BC_OP_GETGLOBAL] = &&BC_OP_GETGLOBAL_handler,
+        [BC_OP_SETGLOBAL] = &&BC_OP_SETGLOBAL_handler,
+        [BC_OP_GETINDEX] = &&BC_OP_GETINDEX_handler,
+        [BC_OP_SETINDEX] = &&BC_OP_SETINDEX_handler,
+        [BC_OP_ADD] = &&BC_OP_ADD_handler,
+        [BC_OP_ADDI] = &&BC_OP_ADDI_handler,
+        [BC_OP_SUB] = &&BC_OP_SUB_handler,
+        [BC_OP_MUL] = &&BC_OP_MUL_handler,
+        [BC_OP_DIV] = &&BC_OP_DIV_handler,
+        [BC_OP_DIVU] = &&BC_OP_DIVU_handler,
+        [BC_OP_SEXT] = &&BC_OP_SEXT_handler,
+        [BC_OP_ZEXT] = &&BC_OP_ZEXT_handler,
+        [BC_OP_POPCNT] = &&BC_OP_POPCNT_handler,
+        [BC_OP_CLZ] = &&BC_OP_CLZ_handler,
+        [BC_OP_CTZ] = &&BC_OP_CTZ_handler,
+        [BC_OP_BSWAP] = &&BC_OP_BSWAP_handler,
+        [BC_OP_ROTL] = &&BC_OP_ROTL_handler,
+        [BC_OP_ROTR] = &&BC_OP_ROTR_handler,
+        [BC_OP_LT] = &&BC_OP_LT_handler,
+        [BC_OP_GT] = &&BC_OP_GT_handler,
+        [BC_OP_EQ] = &&BC_OP_EQ_handler,
+        [BC_OP_LTU] = &&BC_OP_LTU_handler,
+        [BC_OP_BTEST] = &&BC_OP_BTEST_handler,
+        [BC_OP_JMP] = &&BC_OP_JMP_handler,
+        [BC_OP_JMPF] = &&BC_OP_JMPF_handler,
+        [BC_OP_JMPT] = &&BC_OP_JMPT_handler,
+        [BC_OP_JMPTAB] = &&BC_OP_JMPTAB_handler,
+        [BC_OP_CALL] = &&BC_OP_CALL_handler,
+        [BC_OP_CALLX] = &&BC_OP_CALLX_handler,
+        [BC_OP_RET] = &&BC_OP_RET_handler,
+        [BC_OP_RET0] = &&BC_OP_RET0_handler,
+    };
+    static_assert(array_length(dispatch_table) == BC_OP_COUNT, "Every opcode must have a handler");
+
+    BC_DISPATCH();
+#else
+    for (;;)
+    {
+        i = *pc++;
+        switch (BC_GET_OP(i))
+        {
+#endif
+    BC_HANDLER(BC_OP_MOV)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_LOADI)
+        R[BC_GET_A(i)] = BC_GET_SBX(i);
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_LOADK)
+        R[BC_GET_A(i)] = constants[BC_GET_BX(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_GETGLOBAL)
+        R[BC_GET_A(i)] = globals[BC_GET_BX(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_SETGLOBAL)
+        globals[BC_GET_BX(i)] = R[BC_GET_A(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_GETINDEX)
+        R[BC_GET_A(i)] = R[BC_GET_B(i) + R[BC_GET_C(i)]];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_SETINDEX)
+        R[BC_GET_A(i) + R[BC_GET_B(i)]] = R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_ADD)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] + R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_ADDI)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] + BC_GET_SC(i);
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_SUB)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] - R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_MUL)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] * R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_DIV)
+    {
+        s64 dividend = R[BC_GET_B(i)];
+        s64 divisor = R[BC_GET_C(i)];
+        if (divisor == 0)
+        {
+            os_exit_with_message("Division by zero in bytecode\n");
+        }
+        /* The quotient doesn't fit and the host division would trap */
+        if (dividend == INT64_MIN && divisor == -1)
+        {
+            os_exit_with_message("Integer overflow dividing INT64_MIN by -1 in bytecode\n");
+        }
+        R[BC_GET_A(i)] = dividend / divisor;
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_DIVU)
+    {
+        u64 divisor = (u64)R[BC_GET_C(i)];
+        if (divisor == 0)
+        {
+            os_exit_with_message("Division by zero in bytecode\n");
+        }
+        R[BC_GET_A(i)] = (s64)((u64)R[BC_GET_B(i)] / divisor);
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_SEXT)
+        R[BC_GET_A(i)] = bc_sign_extend(R[BC_GET_B(i)], BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_ZEXT)
+        R[BC_GET_A(i)] = bc_zero_extend(R[BC_GET_B(i)], BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_POPCNT)
+        R[BC_GET_A(i)] = bc_popcount((u64)bc_zero_extend(R[BC_GET_B(i)], BC_GET_C(i)));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_CLZ)
+        R[BC_GET_A(i)] = bc_clz((u64)bc_zero_extend(R[BC_GET_B(i)], BC_GET_C(i)), BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_CTZ)
+        R[BC_GET_A(i)] = bc_ctz((u64)bc_zero_extend(R[BC_GET_B(i)], BC_GET_C(i)), BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_BSWAP)
+        R[BC_GET_A(i)] = bc_bswap((u64)bc_zero_extend(R[BC_GET_B(i)], BC_GET_C(i)), BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_ROTL)
+        R[BC_GET_A(i)] = bc_rotl(R[BC_GET_A(i)], R[BC_GET_B(i)], BC_GET_C(i));
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_ROTR)
+    {
+        /* Rotating right by n is rotating left by the bit count minus n */
+        u32 bit_count = BC_GET_C(i);
+        u64 amount = (u64)bc_zero_extend(R[BC_GET_B(i)], bit_count) % bit_count;
+        R[BC_GET_A(i)] = bc_rotl(R[BC_GET_A(i)], (s64)((bit_count - amount) % bit_count), bit_count);
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_LT)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] < R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_GT)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] > R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_EQ)
+        R[BC_GET_A(i)] = R[BC_GET_B(i)] == R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_LTU)
+        R[BC_GET_A(i)] = (u64)R[BC_GET_B(i)] < (u64)R[BC_GET_C(i)];
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_BTEST)
+    {
+        u64 bit = (u64)R[BC_GET_B(i)];
+        R[BC_GET_A(i)] = bit < 64 && (((u64)R[BC_GET_C(i)] >> bit) & 1);
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_JMP)
+        pc += BC_GET_SAX(i);
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_JMPF)
+        if (!R[BC_GET_A(i)])
+        {
+            pc += BC_GET_SBX(i);
+        }
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_JMPT)
+        if (R[BC_GET_A(i)])
+        {
+            pc += BC_GET_SBX(i);
+        }
+        BC_DISPATCH();
+    BC_HANDLER(BC_OP_JMPTAB)
+    {
+        BCJumpTable* table = &jump_tables[BC_GET_BX(i)];
+        u64 index = (u64)R[BC_GET_A(i)] - (u64)table->low;
+        if (index < table->entry_count)
+        {
+            pc += table->offsets[index];
+        }
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_CALL)
+    {
+        BCFunction* callee = &functions[BC_GET_BX(i)];
+        s64* callee_base = R + BC_GET_A(i) + 1;
+        if (callee_base + callee->register_count > stack_end || frame == frame_end)
+        {
+            RED_PANIC("Bytecode stack overflow calling %s\n", callee->name);
+        }
+        frame->return_pc = pc;
+        frame->base = R;
+        frame++;
+        R = callee_base;
+        pc = callee->code.ptr;
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_CALLX)
+    {
+        BCExternFunction* callee = &extern_functions[BC_GET_BX(i)];
+        s64* callee_args = R + BC_GET_A(i) + 1;
+        R[BC_GET_A(i)] = bc_trampolines[callee->param_count](callee->address, callee_args);
+        BC_DISPATCH();
+    }
+    BC_HANDLER(BC_OP_RET)
+        R[-1] = R[BC_GET_A(i)];
+    BC_HANDLER(BC_OP_RET0)
+        if (frame == bc_frame_stack)
+        {
+            return bc_value_stack[0];
+        }
+        frame--;
+        pc = frame->return_pc;
+        R = frame->base;
+        BC_DISPATCH();
+#if !BC_THREADED_DISPATCH
+            default:
+                RED_UNREACHABLE;
+                return 0;
+        }
+    }
+#endif
+}
+
+/* Runs main of the module in the interpreter, with extern functions resolved in the C runtime */
+s64 bc_run_main(IRModule* ir_module)
+{
+    BCModule module = bc_module_from_ir(ir_module);
+    s32 main_index = bc_find_function(&module, "main");
+    if (main_index < 0 || module.functions.ptr[main_index].param_count != 0)
+    {
+        os_exit_with_message("The bytecode VM needs a main function without parameters\n");
+    }
+
+    u32 extern_count = module.extern_functions.len;
+    if (extern_count > 0)
+    {
+        s32 crt = os_load_dynamic_library("msvcrt.dll");
+        for (u32 e = 0; e < extern_count; e++)
+        {
+            BCExternFunction* extern_fn = &module.extern_functions.ptr[e];
+            extern_fn->address = os_load_procedure_from_dynamic_library(crt, extern_fn->name);
+            if (!extern_fn->address)
+            {
+                os_exit_with_message("Extern function %s was not found in the C runtime\n", extern_fn->name);
+            }
+        }
+    }
+
+    return bc_run(&module, (u32)main_index, null, 0);
+}
+
+#if RED_BYTECODE_BENCHMARK
+static s64 bc_benchmark_native_add(s64 a, s64 b)
+{
+    return a + b;
+}
+
+static s64 bc_benchmark_native_fib(s64 n)
+{
+    return n < 2 ? n : bc_benchmark_native_fib(n - 1) + bc_benchmark_native_fib(n - 2);
+}
+
+static inline BCFunction* bc_benchmark_function(BCModule* module, const char* name, u8 param_count, u16 register_count, const BCInstruction* code, u32 instruction_count)
+{
+    BCFunction* fn = bc_add_function(module, name, param_count);
+    fn->register_count = register_count;
+    for (u32 i = 0; i < instruction_count; i++)
+    {
+        bc_code_append(&fn->code, code[i]);
+    }
+    return fn;
+}
+
+static inline void bc_benchmark(BCModule* module, const char* name, s64 arg, s64 expected)
+{
+    s32 fn_index = bc_find_function(module, name);
+    redassert(fn_index >= 0);
+    s64 start = os_performance_counter();
+    s64 result = bc_run(module, (u32)fn_index, &arg, 1);
+    s64 end = os_performance_counter();
+    print("[BYTECODE] %-10s(%lld) = %lld\t%Lf ms.\n", name, arg, result, os_compute_ms(start, end));
+    redassert(result == expected);
+}
+
+/* Hand-assembled kernels, one per interpreter path: plain arithmetic and branches, calls, register-indexed arrays and extern trampolines */
+void bc_run_benchmarks(void)
+{
+    BCModule module = { .name = "benchmarks", };
+
+    /* r0: n, r1: sum, r2: i, r3: condition */
+    const BCInstruction sum_code[] =
+    {
+        BC_ABX(BC_OP_LOADI, 1, 0),
+        BC_ABX(BC_OP_LOADI, 2, 0),
+        BC_ABC(BC_OP_LT, 3, 2, 0),
+        BC_ABX(BC_OP_JMPF, 3, 3),
+        BC_ABC(BC_OP_ADD, 1, 1, 2),
+        BC_ABC(BC_OP_ADDI, 2, 2, 1),
+        BC_AX(BC_OP_JMP, -5),
+        BC_ABC(BC_OP_RET, 1, 0, 0),
+    };
+    bc_benchmark_function(&module, "sum", 1, 4, sum_code, array_length(sum_code));
+
+    /* r0: n, r1: fib(n - 1), r2: fib(n - 2) */
+    const BCInstruction fib_code[] =
+    {
+        BC_ABX(BC_OP_LOADI, 1, 2),
+        BC_ABC(BC_OP_LT, 1, 0, 1),
+        BC_ABX(BC_OP_JMPF, 1, 1),
+        BC_ABC(BC_OP_RET, 0, 0, 0),
+        BC_ABC(BC_OP_ADDI, 2, 0, -1),
+        BC_ABX(BC_OP_CALL, 1, 1),
+        BC_ABC(BC_OP_ADDI, 3, 0, -2),
+        BC_ABX(BC_OP_CALL, 2, 1),
+        BC_ABC(BC_OP_ADD, 1, 1, 2),
+        BC_ABC(BC_OP_RET, 1, 0, 0),
+    };
+    bc_benchmark_function(&module, "fib", 1, 4, fib_code, array_length(fib_code));
+
+    /* r0: rounds, r1: sum, r2-r65: array, r66: i, r67: round, r68: temporary, r69: 64 */
+    const BCInstruction array_code[] =
+    {
+        BC_ABX(BC_OP_LOADI, 1, 0),
+        BC_ABX(BC_OP_LOADI, 67, 0),
+        BC_ABX(BC_OP_LOADI, 69, 64),
+        BC_ABC(BC_OP_LT, 68, 67, 0),
+        BC_ABX(BC_OP_JMPF, 68, 15),
+        BC_ABX(BC_OP_LOADI, 66, 0),
+        BC_ABC(BC_OP_LT, 68, 66, 69),
+        BC_ABX(BC_OP_JMPF, 68, 3),
+        BC_ABC(BC_OP_SETINDEX, 2, 66, 66),
+        BC_ABC(BC_OP_ADDI, 66, 66, 1),
+        BC_AX(BC_OP_JMP, -5),
+        BC_ABX(BC_OP_LOADI, 66, 0),
+        BC_ABC(BC_OP_LT, 68, 66, 69),
+        BC_ABX(BC_OP_JMPF, 68, 4),
+        BC_ABC(BC_OP_GETINDEX, 68, 2, 66),
+        BC_ABC(BC_OP_ADD, 1, 1, 68),
+        BC_ABC(BC_OP_ADDI, 66, 66, 1),
+        BC_AX(BC_OP_JMP, -6),
+        BC_ABC(BC_OP_ADDI, 67, 67, 1),
+        BC_AX(BC_OP_JMP, -17),
+        BC_ABC(BC_OP_RET, 1, 0, 0),
+    };
+    bc_benchmark_function(&module, "array", 1, 70, array_code, array_length(array_code));
+
+    /* r0: n, r1: sum, r2: i, r3: call result and condition, r4-r5: extern arguments */
+    u32 add_index = bc_add_extern(&module, "native_add", 2);
+    const BCInstruction extern_code[] =
+    {
+        BC_ABX(BC_OP_LOADI, 1, 0),
+        BC_ABX(BC_OP_LOADI, 2, 0),
+        BC_ABC(BC_OP_LT, 3, 2, 0),
+        BC_ABX(BC_OP_JMPF, 3, 6),
+        BC_ABC(BC_OP_MOV, 4, 1, 0),
+        BC_ABC(BC_OP_MOV, 5, 2, 0),
+        BC_ABX(BC_OP_CALLX, 3, add_index),
+        BC_ABC(BC_OP_MOV, 1, 3, 0),
+        BC_ABC(BC_OP_ADDI, 2, 2, 1),
+        BC_AX(BC_OP_JMP, -8),
+        BC_ABC(BC_OP_RET, 1, 0, 0),
+    };
+    bc_benchmark_function(&module, "extern", 1, 6, extern_code, array_length(extern_code));
+    bc_bind_extern(&module, "native_add", (void*)bc_benchmark_native_add);
+
+    const s64 n = 10 * 1000 * 1000;
+    const s64 fib_n = 27;
+    const s64 rounds = 100 * 1000;
+    bc_benchmark(&module, "sum", n, n * (n - 1) / 2);
+    bc_benchmark(&module, "fib", fib_n, bc_benchmark_native_fib(fib_n));
+    bc_benchmark(&module, "array", rounds, rounds * (63 * 64 / 2));
+    bc_benchmark(&module, "extern", n, n * (n - 1) / 2);
+
+    volatile s64 native_fib_n = fib_n;
+    s64 start = os_performance_counter();
+    s64 native_fib = bc_benchmark_native_fib(native_fib_n);
+    s64 end = os_performance_counter();
+    print("[NATIVE] %-10s(%lld) = %lld\t%Lf ms.\n", "fib", fib_n, native_fib, os_compute_ms(start, end));
+}
+#endif
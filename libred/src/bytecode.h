@@ -3,3 +3,122 @@
 //
 
 #pragma once
+
+#include "ir.h"
+
+/* Register machine. Every value is a 64-bit integer (pointers included) and each function owns a window of at most 256 registers on a flat value stack.
+ * Narrower integers are kept sign or zero-extended to 64 bits: arithmetic on them is followed by a SEXT or ZEXT */
+typedef enum BCOpcode
+{
+    BC_OP_MOV,          /* R[a] = R[b] */
+    BC_OP_LOADI,        /* R[a] = sbx */
+    BC_OP_LOADK,        /* R[a] = K[bx] */
+    BC_OP_GETGLOBAL,    /* R[a] = G[bx] */
+    BC_OP_SETGLOBAL,    /* G[bx] = R[a] */
+    BC_OP_GETINDEX,     /* R[a] = R[b + R[c]] */
+    BC_OP_SETINDEX,     /* R[a + R[b]] = R[c] */
+    BC_OP_ADD,          /* R[a] = R[b] + R[c] */
+    BC_OP_ADDI,         /* R[a] = R[b] + sc */
+    BC_OP_SUB,          /* R[a] = R[b] - R[c] */
+    BC_OP_MUL,          /* R[a] = R[b] * R[c] */
+    BC_OP_DIV,          /* R[a] = R[b] / R[c], traps on a zero divisor and on INT64_MIN / -1 */
+    BC_OP_DIVU,         /* R[a] = (u64)R[b] / (u64)R[c], traps on a zero divisor */
+    BC_OP_SEXT,         /* R[a] = low c bits of R[b], sign-extended */
+    BC_OP_ZEXT,         /* R[a] = low c bits of R[b], zero-extended */
+    BC_OP_POPCNT,       /* R[a] = bits set in the low c bits of R[b] */
+    BC_OP_CLZ,          /* R[a] = leading zeros in the low c bits of R[b], c for zero */
+    BC_OP_CTZ,          /* R[a] = trailing zeros in the low c bits of R[b], c for zero */
+    BC_OP_BSWAP,        /* R[a] = bytes of the low c bits of R[b] in reverse order */
+    BC_OP_ROTL,         /* R[a] = low c bits of R[a] rotated left by R[b] % c */
+    BC_OP_ROTR,         /* R[a] = low c bits of R[a] rotated right by R[b] % c */
+    BC_OP_LT,           /* R[a] = R[b] < R[c] */
+    BC_OP_GT,           /* R[a] = R[b] > R[c] */
+    BC_OP_EQ,           /* R[a] = R[b] == R[c] */
+    BC_OP_LTU,          /* R[a] = (u64)R[b] < (u64)R[c] */
+    BC_OP_BTEST,        /* R[a] = (u64)R[b] < 64 && ((u64)R[c] >> R[b]) & 1 */
+    BC_OP_JMP,          /* pc += sax */
+    BC_OP_JMPF,         /* if (!R[a]) pc += sbx */
+    BC_OP_JMPT,         /* if (R[a]) pc += sbx */
+    BC_OP_JMPTAB,       /* pc += JT[bx].offsets[R[a] - JT[bx].low], falls through when out of range */
+    BC_OP_CALL,         /* R[a] = F[bx](R[a + 1], ..., R[a + param_count]) */
+    BC_OP_CALLX,        /* R[a] = X[bx](R[a + 1], ..., R[a + param_count]) */
+    BC_OP_RET,          /* return R[a] */
+    BC_OP_RET0,         /* return */
+    BC_OP_COUNT,
+} BCOpcode;
+
+/* 32-bit instructions, opcode in the low byte:
+ * ABC: op | a << 8 | b << 16 | c << 24
+ * ABx: op | a << 8 | bx << 16 (sbx is bx sign-extended)
+ * Ax:  op | sax << 8 (24-bit signed)
+ * Jump offsets are relative to the instruction that follows the jump */
+typedef u32 BCInstruction;
+GEN_BUFFER_STRUCT(BCInstruction)
+
+#define BC_ABC(op, a, b, c) ((BCInstruction)(op) | ((BCInstruction)(u8)(a) << 8) | ((BCInstruction)(u8)(b) << 16) | ((BCInstruction)(u8)(c) << 24))
+#define BC_ABX(op, a, bx) ((BCInstruction)(op) | ((BCInstruction)(u8)(a) << 8) | ((BCInstruction)(u16)(bx) << 16))
+#define BC_AX(op, sax) ((BCInstruction)(op) | ((BCInstruction)(sax) << 8))
+
+#define BC_GET_OP(i) ((i) & 0xff)
+#define BC_GET_A(i) (((i) >> 8) & 0xff)
+#define BC_GET_B(i) (((i) >> 16) & 0xff)
+#define BC_GET_C(i) ((i) >> 24)
+#define BC_GET_SC(i) ((s64)(s8)((i) >> 24))
+#define BC_GET_BX(i) ((i) >> 16)
+#define BC_GET_SBX(i) ((s32)(s16)((i) >> 16))
+#define BC_GET_SAX(i) ((s32)(i) >> 8)
+
+#define BC_MAX_REGISTER_COUNT 256
+#define BC_MAX_EXTERN_PARAM_COUNT 8
+
+typedef struct BCFunction
+{
+    const char* name;
+    BCInstructionBuffer code;
+    u16 register_count;
+    u8 param_count;
+} BCFunction;
+GEN_BUFFER_STRUCT(BCFunction)
+
+/* Native function reached through the trampoline table. The address is bound by the host with bc_bind_extern() */
+typedef struct BCExternFunction
+{
+    const char* name;
+    void* address;
+    u8 param_count;
+} BCExternFunction;
+GEN_BUFFER_STRUCT(BCExternFunction)
+
+typedef s64 S64;
+GEN_BUFFER_STRUCT(S64)
+
+/* Dense switch cluster. Offsets are relative to the instruction that follows the JMPTAB */
+typedef struct BCJumpTable
+{
+    s64 low;
+    s32* offsets;
+    u32 entry_count;
+} BCJumpTable;
+GEN_BUFFER_STRUCT(BCJumpTable)
+
+typedef struct BCModule
+{
+    const char* name;
+    BCFunctionBuffer functions;
+    BCExternFunctionBuffer extern_functions;
+    S64Buffer constants;
+    S64Buffer globals;
+    BCJumpTableBuffer jump_tables;
+} BCModule;
+
+BCModule bc_module_from_ir(IRModule* ir_module);
+BCFunction* bc_add_function(BCModule* module, const char* name, u8 param_count);
+u32 bc_add_extern(BCModule* module, const char* name, u8 param_count);
+s32 bc_find_function(BCModule* module, const char* name);
+void bc_bind_extern(BCModule* module, const char* name, void* address);
+s64 bc_run(BCModule* module, u32 fn_index, const s64* args, u8 arg_count);
+s64 bc_run_main(IRModule* ir_module);
+void bc_print_function(BCFunction* fn);
+#if RED_BYTECODE_BENCHMARK
+void bc_run_benchmarks(void);
+#endif
@@ -9,6 +9,7 @@
 #include "parser.h"
 #include "ir.h"
 #include "bytecode.h"
+#include "x64_lowering.h"
 #include "llvm.h"
 
 typedef struct CompilerWorkQueue CompilerWorkQueue;
@@ -40,7 +41,7 @@ static inline IncludedFiles collect_included_files(TokenBuffer*tb);
 static inline ASTModuleBuffer load_lex_and_parse_included_modules(IncludedFiles* included_files);
 
 
-void compile_program(SB* build_src_file_buffer)
+void compile_program(SB* build_src_file_buffer, CompilerOptions* options)
 {
 #if RED_SRC_FILE_VERBOSE
     print("Src file:\n\n***\n\n%s\n\n***\n\n", sb_ptr(build_src_file_buffer));
@@ -70,22 +71,38 @@ void compile_program(SB* build_src_file_buffer)
     u32 system_module_count = included_files.system_modules.len;
     u32 user_module_count = included_files.user_modules.len;
     u32 total_module_count = system_module_count + user_module_count;
+    ASTModuleBuffer imported_modules = ZERO_INIT;
     if (total_module_count > 0)
     {
-        load_lex_and_parse_included_modules(&included_files);
+        imported_modules = load_lex_and_parse_included_modules(&included_files);
     }
 
     // Parse main module
     ASTModule ast = parse_module(&lexing_result.tokens, &module_sb);
     os_timer_end(&parser_dt);
 
-    // TODO: commented for now to make parser changes
-//    ExplicitTimer ir_dt = os_timer_start("IRGen");
-//    IRModule ir_tree = transform_ast_to_ir(&ast);
-//    os_timer_end(&ir_dt);
+    ExplicitTimer ir_dt = os_timer_start("IRGen");
+    IRModule ir_tree = transform_ast_to_ir(&ast, &imported_modules);
+    os_timer_end(&ir_dt);
 
-    // TODO: we are transitioning from a pseudo-IR into a bytecode
-    //llvm_gen_machine_code(&ir_tree);
+    if (options->run_in_vm)
+    {
+        ExplicitTimer vm_dt = os_timer_start("VM");
+        s64 result = bc_run_main(&ir_tree);
+        os_timer_end(&vm_dt);
+        print("main returned %lld\n", result);
+        return;
+    }
+    if (options->run_native_x64)
+    {
+        ExplicitTimer x64_dt = os_timer_start("x64");
+        s64 result = x64_run_main(&ir_tree, options->opt_level);
+        os_timer_end(&x64_dt);
+        print("main returned %" RED_PRI_s64 "\n", result);
+        return;
+    }
+
+    llvm_gen_machine_code(&ir_tree, options);
 }
 
 typedef struct ModuleThreadResult
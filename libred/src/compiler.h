@@ -7,5 +7,37 @@
 #include "types.h"
 #include "compiler_types.h"
 
-void compile_program(SB* build_src_file_buffer);
+/* Code sequence used to reach thread_local variables, from the most general to the fastest. See the ELF TLS ABI */
+typedef enum TLSModel
+{
+    TLS_MODEL_GLOBAL_DYNAMIC,
+    TLS_MODEL_LOCAL_DYNAMIC,
+    TLS_MODEL_INITIAL_EXEC,
+    TLS_MODEL_LOCAL_EXEC,
+} TLSModel;
+
+/* Command line options that change the generated code */
+typedef struct CompilerOptions
+{
+    /* -O<n>, from 0 to 3 */
+    u8 opt_level;
+    /* --pgo-generate[=<file>]: instrumented build that writes the raw profile to this file at exit */
+    const char* pgo_generate_path;
+    /* --pgo-use=<file>: indexed profile, merged from the raw ones with llvm-profdata */
+    const char* pgo_use_path;
+    /* -mcpu=<name|native>: null for the generic CPU of the target */
+    const char* cpu;
+    /* -mattr=+<feature>,-<feature>,... */
+    const char* features;
+    /* --tls-model=<global-dynamic|local-dynamic|initial-exec|local-exec> */
+    TLSModel tls_model;
+    /* --lto: every imported module is linked into one before optimizing, instead of one object per module */
+    bool lto;
+    /* --vm: main runs in the bytecode interpreter instead of being compiled */
+    bool run_in_vm;
+    /* --x64: main is compiled by the native x64 backend and run in process, without LLVM. -O1 and up run its peephole pass */
+    bool run_native_x64;
+} CompilerOptions;
+
+void compile_program(SB* build_src_file_buffer, CompilerOptions* options);
 
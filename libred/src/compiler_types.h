@@ -147,6 +147,8 @@ typedef enum TokenID
     TOKEN_ID_KEYWORD_AND,
     TOKEN_ID_KEYWORD_ANY,
     TOKEN_ID_KEYWORD_ANY_FRAME,
+    TOKEN_ID_KEYWORD_ASYNC,
+    TOKEN_ID_KEYWORD_AWAIT,
     TOKEN_ID_KEYWORD_CALL_CONV,
     TOKEN_ID_KEYWORD_COMPTIME,
     TOKEN_ID_KEYWORD_CONST,
@@ -170,9 +172,11 @@ typedef enum TokenID
     TOKEN_ID_KEYWORD_PACKED,
     TOKEN_ID_KEYWORD_PUB,
     TOKEN_ID_KEYWORD_RAW_STRING,
+    TOKEN_ID_KEYWORD_RESUME,
     TOKEN_ID_KEYWORD_RETURN,
     TOKEN_ID_KEYWORD_SECTION,
     TOKEN_ID_KEYWORD_STRUCT,
+    TOKEN_ID_KEYWORD_SUSPEND,
     TOKEN_ID_KEYWORD_SWITCH,
     TOKEN_ID_KEYWORD_TEST,
     TOKEN_ID_KEYWORD_THREAD_LOCAL,
@@ -305,9 +309,37 @@ typedef enum TypeKind
     TYPE_KIND_UNION,
     TYPE_KIND_ENUM,
     TYPE_KIND_ARRAY,
+    TYPE_KIND_VECTOR,
     TYPE_KIND_POINTER,
     TYPE_KIND_RAW_STRING,
+    TYPE_KIND_FRAME,
     TYPE_KIND_FUNCTION,
     TYPE_KIND_MODULE_NAMESPACE,
 } TypeKind;
 
+typedef enum InlineKind
+{
+    INLINE_KIND_DEFAULT,
+    INLINE_KIND_ALWAYS,
+    INLINE_KIND_NEVER,
+} InlineKind;
+
+typedef enum Visibility
+{
+    // Only visible inside its own module
+    VISIBILITY_PRIVATE,
+    // pub: other Red modules can use it
+    VISIBILITY_PUB,
+    // export: exported from the binary with the C ABI
+    VISIBILITY_EXPORT,
+} Visibility;
+
+// Loop directives, zero when the directive wasn't given
+typedef struct LoopHints
+{
+    u32 unroll_count;
+    u32 vectorize_width;
+    u32 interleave_count;
+    bool no_unroll;
+} LoopHints;
+
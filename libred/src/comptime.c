@@ -0,0 +1,1040 @@
+#include "types.h"
+#include "compiler_types.h"
+#include "lexer.h"
+#include "bigint.h"
+#include "ir.h"
+#include "comptime.h"
+#include <assert.h>
+
+#define CT_VALUE_STACK_SIZE (1 << 18)
+#define CT_SLOT_STACK_SIZE (1 << 16)
+#define CT_MAX_CALL_DEPTH 1024
+/* Loop iterations plus calls allowed for a single comptime expression before giving up */
+#define CT_MAX_STEP_COUNT (1 << 26)
+
+/* Storage of a parameter, local or return value: one element for scalars, one per element for arrays */
+typedef struct CTSlot
+{
+    BigInt* elements;
+    u32 count;
+    IRTypePrimitive type;
+} CTSlot;
+
+typedef struct CTInt
+{
+    BigInt value;
+    IRTypePrimitive type;
+} CTInt;
+
+typedef struct CTFrame
+{
+    IRFunctionDefinition* fn;
+    CTSlot* params;
+    /* Indexed like fn->sym_declarations */
+    CTSlot* locals;
+    CTSlot* return_slot;
+} CTFrame;
+
+typedef struct CTContext
+{
+    IRModule* module;
+    u64 step_count;
+    u32 value_top;
+    u32 slot_top;
+    u32 call_depth;
+} CTContext;
+
+typedef enum CTFlow
+{
+    CT_FLOW_NEXT,
+    CT_FLOW_RETURN,
+} CTFlow;
+
+static BigInt ct_value_stack[CT_VALUE_STACK_SIZE];
+static CTSlot ct_slot_stack[CT_SLOT_STACK_SIZE];
+
+static const u8 ct_primitive_bit_counts[] =
+{
+    [IR_TYPE_PRIMITIVE_U8] = 8,
+    [IR_TYPE_PRIMITIVE_U16] = 16,
+    [IR_TYPE_PRIMITIVE_U32] = 32,
+    [IR_TYPE_PRIMITIVE_U64] = 64,
+    [IR_TYPE_PRIMITIVE_S8] = 8,
+    [IR_TYPE_PRIMITIVE_S16] = 16,
+    [IR_TYPE_PRIMITIVE_S32] = 32,
+    [IR_TYPE_PRIMITIVE_S64] = 64,
+    [IR_TYPE_PRIMITIVE_F32] = 32,
+    [IR_TYPE_PRIMITIVE_F64] = 64,
+    [IR_TYPE_PRIMITIVE_F128] = 128,
+    [IR_TYPE_PRIMITIVE_BOOL] = 1,
+};
+static_assert(array_length(ct_primitive_bit_counts) == IR_TYPE_PRIMITIVE_COUNT, "Every primitive type must have a bit count");
+
+static void ct_resolve(CTContext* ctx, IRExpression* expression);
+static CTInt ct_eval_int(CTContext* ctx, CTFrame* frame, IRExpression* expression);
+static void ct_eval_into(CTContext* ctx, CTFrame* frame, IRExpression* expression, CTSlot* dst);
+static CTFlow ct_exec_compound(CTContext* ctx, CTFrame* frame, IRCompoundStatement* compound_st);
+
+static inline bool ct_primitive_is_signed(IRTypePrimitive type)
+{
+    return type >= IR_TYPE_PRIMITIVE_S8 && type <= IR_TYPE_PRIMITIVE_S64;
+}
+
+/* Every value is kept wrapped to its type, as the generated code would compute it */
+static inline void ct_wrap(BigInt* value, IRTypePrimitive type)
+{
+    if (type >= IR_TYPE_PRIMITIVE_F32 && type <= IR_TYPE_PRIMITIVE_F128)
+    {
+        os_exit_with_message("Floating point values can't be used at compile time yet\n");
+    }
+    BigInt_truncate(value, value, ct_primitive_bit_counts[type], ct_primitive_is_signed(type));
+}
+
+static inline void ct_step(CTContext* ctx)
+{
+    if (++ctx->step_count > CT_MAX_STEP_COUNT)
+    {
+        os_exit_with_message("Compile-time evaluation didn't finish after %u steps. Is there an infinite loop?\n", CT_MAX_STEP_COUNT);
+    }
+}
+
+static IRTypePrimitive ct_type_layout(IRType* type, u32* count)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_VOID:
+            *count = 0;
+            return IR_TYPE_PRIMITIVE_COUNT;
+        case TYPE_KIND_PRIMITIVE:
+            *count = 1;
+            return type->primitive_type;
+        case TYPE_KIND_ENUM:
+            *count = 1;
+            return type->enum_type->type.primitive_type;
+        case TYPE_KIND_ARRAY:
+        {
+            IRExpression* elem_count_expr = type->array_type.elem_count_expr;
+            redassert(elem_count_expr && elem_count_expr->type == IR_EXPRESSION_TYPE_INT_LIT);
+            redassert(elem_count_expr->int_literal.bigint.digit_count == 1);
+            u32 base_count;
+            IRTypePrimitive base_type = ct_type_layout(type->array_type.base_type, &base_count);
+            if (base_count != 1)
+            {
+                os_exit_with_message("Only arrays of integers are supported at compile time\n");
+            }
+            *count = (u32)elem_count_expr->int_literal.bigint.digit;
+            return base_type;
+        }
+        default:
+            os_exit_with_message("Only integer, enum and array values are supported at compile time\n");
+            return IR_TYPE_PRIMITIVE_COUNT;
+    }
+}
+
+static CTSlot* ct_push_slot(CTContext* ctx, IRType* type)
+{
+    u32 count;
+    IRTypePrimitive element_type = ct_type_layout(type, &count);
+    if (ctx->slot_top == CT_SLOT_STACK_SIZE || ctx->value_top + count > CT_VALUE_STACK_SIZE)
+    {
+        os_exit_with_message("Compile-time evaluation ran out of stack\n");
+    }
+
+    CTSlot* slot = &ct_slot_stack[ctx->slot_top++];
+    slot->elements = &ct_value_stack[ctx->value_top];
+    slot->count = count;
+    slot->type = element_type;
+    ctx->value_top += count;
+    /* All-zero bits are a normalized zero */
+    memset(slot->elements, 0, sizeof(BigInt) * count);
+
+    return slot;
+}
+
+static inline void ct_zero_slot(CTSlot* slot)
+{
+    memset(slot->elements, 0, sizeof(BigInt) * slot->count);
+}
+
+static inline void ct_store(CTSlot* slot, u32 index, BigInt value)
+{
+    ct_wrap(&value, slot->type);
+    slot->elements[index] = value;
+}
+
+static inline void ct_copy_slot(CTSlot* dst, CTSlot* src)
+{
+    if (dst->count != src->count)
+    {
+        os_exit_with_message("Can't copy %u elements into %u at compile time\n", src->count, dst->count);
+    }
+
+    for (u32 i = 0; i < src->count; i++)
+    {
+        ct_store(dst, i, src->elements[i]);
+    }
+}
+
+static inline u32 ct_index(u32 count, CTInt index, SB* name)
+{
+    if (index.value.is_negative || index.value.digit_count > 1 || (index.value.digit_count == 1 && index.value.digit >= count))
+    {
+        os_exit_with_message("Index out of bounds in %s (%u elements) at compile time\n", sb_ptr(name), count);
+    }
+
+    return index.value.digit_count ? (u32)index.value.digit : 0;
+}
+
+static inline bool ct_is_true(CTInt value)
+{
+    return BigInt_cmp_zero(&value.value) != CMP_EQ;
+}
+
+static CTSlot* ct_variable_slot(CTFrame* frame, IRSymExpr* sym_expr, SB** name)
+{
+    if (sym_expr->type == IR_SYM_EXPR_TYPE_PARAM)
+    {
+        IRFunctionPrototype* proto = frame->fn->proto;
+        usize param_index = sym_expr->param_decl - proto->params;
+        redassert(param_index < proto->param_count);
+        *name = sym_expr->param_decl->name;
+        return &frame->params[param_index];
+    }
+
+    redassert(sym_expr->type == IR_SYM_EXPR_TYPE_SYM);
+    if (!sym_expr->sym_decl)
+    {
+        os_exit_with_message("Unknown symbol in %s at compile time\n", sb_ptr(frame->fn->proto->name));
+    }
+
+    /* Resolved by name like find_symbol() does: the expression may point to a copy of the declaration */
+    SB* sym_name = sym_expr->sym_decl->name;
+    IRSymDeclStatementBuffer* sym_declarations = &frame->fn->sym_declarations;
+    for (u32 i = 0; i < sym_declarations->len; i++)
+    {
+        if (sb_cmp(sym_declarations->ptr[i].name, sym_name))
+        {
+            *name = sym_name;
+            return &frame->locals[i];
+        }
+    }
+
+    RED_UNREACHABLE;
+    return null;
+}
+
+static CTSlot* ct_local_slot(CTFrame* frame, SB* name)
+{
+    IRSymDeclStatementBuffer* sym_declarations = &frame->fn->sym_declarations;
+    for (u32 i = 0; i < sym_declarations->len; i++)
+    {
+        if (sb_cmp(sym_declarations->ptr[i].name, name))
+        {
+            return &frame->locals[i];
+        }
+    }
+
+    RED_UNREACHABLE;
+    return null;
+}
+
+static IRSymDeclStatement* ct_const_global(CTContext* ctx, IRSymDeclStatement* global)
+{
+    if (!global->is_const)
+    {
+        os_exit_with_message("Global %s is not const, it can't be read at compile time\n", sb_ptr(global->name));
+    }
+    if (global->value.type == IR_EXPRESSION_TYPE_COMPTIME_EXPR)
+    {
+        ct_resolve(ctx, &global->value);
+    }
+
+    return global;
+}
+
+static CTInt ct_enum_field_value(IREnumDecl* enum_decl, SB* field_name)
+{
+    IRTypePrimitive type = enum_decl->type.primitive_type;
+    for (usize i = 0; i < enum_decl->fields.len; i++)
+    {
+        IREnumField* field = &enum_decl->fields.ptr[i];
+        if (sb_cmp(field->name, field_name))
+        {
+            CTInt result = { .type = type };
+            switch (type)
+            {
+                case IR_TYPE_PRIMITIVE_U8:
+                    BigInt_init_unsigned(&result.value, field->value.unsigned8);
+                    break;
+                case IR_TYPE_PRIMITIVE_U16:
+                    BigInt_init_unsigned(&result.value, field->value.unsigned16);
+                    break;
+                case IR_TYPE_PRIMITIVE_U32:
+                    BigInt_init_unsigned(&result.value, field->value.unsigned32);
+                    break;
+                case IR_TYPE_PRIMITIVE_U64:
+                    BigInt_init_unsigned(&result.value, field->value.unsigned64);
+                    break;
+                case IR_TYPE_PRIMITIVE_S8:
+                    BigInt_init_signed(&result.value, field->value.signed8);
+                    break;
+                case IR_TYPE_PRIMITIVE_S16:
+                    BigInt_init_signed(&result.value, field->value.signed16);
+                    break;
+                case IR_TYPE_PRIMITIVE_S32:
+                    BigInt_init_signed(&result.value, field->value.signed32);
+                    break;
+                case IR_TYPE_PRIMITIVE_S64:
+                    BigInt_init_signed(&result.value, field->value.signed64);
+                    break;
+                default:
+                    RED_NOT_IMPLEMENTED;
+                    break;
+            }
+            ct_wrap(&result.value, type);
+            return result;
+        }
+    }
+
+    os_exit_with_message("Enum %s has no field %s\n", sb_ptr(enum_decl->name), sb_ptr(field_name));
+    return (CTInt) { 0 };
+}
+
+static CTInt ct_eval_sym(CTContext* ctx, CTFrame* frame, IRSymExpr* sym_expr)
+{
+    IRExpression* subscript = sym_expr->subscript;
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_SYM:
+        case IR_SYM_EXPR_TYPE_PARAM:
+        {
+            SB* name;
+            CTSlot* slot = ct_variable_slot(frame, sym_expr, &name);
+            u32 index = 0;
+            if (subscript)
+            {
+                index = ct_index(slot->count, ct_eval_int(ctx, frame, subscript), name);
+            }
+            else if (slot->count != 1)
+            {
+                os_exit_with_message("Array %s can't be used as an integer\n", sb_ptr(name));
+            }
+
+            CTInt result = { .value = slot->elements[index], .type = slot->type };
+            return result;
+        }
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+        {
+            IRSymDeclStatement* global = ct_const_global(ctx, sym_expr->global_sym_decl);
+            u32 count;
+            CTInt result = { .type = ct_type_layout(&global->type, &count) };
+            IRExpression* value = &global->value;
+            if (subscript)
+            {
+                u32 index = ct_index(count, ct_eval_int(ctx, frame, subscript), global->name);
+                if (value->type == IR_EXPRESSION_TYPE_ARRAY_LIT)
+                {
+                    if (index < value->array_literal.expression_count)
+                    {
+                        result.value = ct_eval_int(ctx, frame, &value->array_literal.expressions[index]).value;
+                    }
+                }
+                else if (value->type != IR_EXPRESSION_TYPE_VOID)
+                {
+                    os_exit_with_message("Global %s can't be indexed at compile time\n", sb_ptr(global->name));
+                }
+            }
+            else
+            {
+                if (count != 1)
+                {
+                    os_exit_with_message("Array %s can't be used as an integer\n", sb_ptr(global->name));
+                }
+                if (value->type != IR_EXPRESSION_TYPE_VOID)
+                {
+                    result.value = ct_eval_int(ctx, frame, value).value;
+                }
+            }
+
+            ct_wrap(&result.value, result.type);
+            return result;
+        }
+        case IR_SYM_EXPR_TYPE_ENUM:
+            redassert(subscript && subscript->type == IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS);
+            return ct_enum_field_value(sym_expr->enum_decl, subscript->subscript_access.name);
+        default:
+            os_exit_with_message("Symbol can't be used at compile time\n");
+            return (CTInt) { 0 };
+    }
+}
+
+static inline bool ct_compare(TokenID op, Cmp cmp)
+{
+    switch (op)
+    {
+        case TOKEN_ID_CMP_EQ:
+            return cmp == CMP_EQ;
+        case TOKEN_ID_CMP_NOT_EQ:
+            return cmp != CMP_EQ;
+        case TOKEN_ID_CMP_LESS:
+            return cmp == CMP_LESS;
+        case TOKEN_ID_CMP_LESS_OR_EQ:
+            return cmp != CMP_GREATER;
+        case TOKEN_ID_CMP_GREATER:
+            return cmp == CMP_GREATER;
+        case TOKEN_ID_CMP_GREATER_OR_EQ:
+            return cmp != CMP_LESS;
+        default:
+            RED_UNREACHABLE;
+            return false;
+    }
+}
+
+static CTInt ct_eval_binary(CTContext* ctx, CTFrame* frame, IRBinaryExpr* bin_expr)
+{
+    TokenID op = bin_expr->op;
+    CTInt left = ct_eval_int(ctx, frame, bin_expr->left);
+    CTInt result = { .type = left.type };
+
+    if (op == TOKEN_ID_KEYWORD_AND || op == TOKEN_ID_KEYWORD_OR)
+    {
+        bool value = ct_is_true(left);
+        if (value == (op == TOKEN_ID_KEYWORD_AND))
+        {
+            value = ct_is_true(ct_eval_int(ctx, frame, bin_expr->right));
+        }
+        BigInt_init_unsigned(&result.value, value);
+        result.type = IR_TYPE_PRIMITIVE_BOOL;
+        ct_wrap(&result.value, result.type);
+        return result;
+    }
+
+    CTInt right = ct_eval_int(ctx, frame, bin_expr->right);
+    switch (op)
+    {
+        case TOKEN_ID_PLUS:
+            BigInt_add(&result.value, &left.value, &right.value);
+            break;
+        case TOKEN_ID_DASH:
+            BigInt_sub(&result.value, &left.value, &right.value);
+            break;
+        case TOKEN_ID_STAR:
+            BigInt_mul(&result.value, &left.value, &right.value);
+            break;
+        case TOKEN_ID_SLASH:
+            if (BigInt_cmp_zero(&right.value) == CMP_EQ)
+            {
+                os_exit_with_message("Division by zero at compile time\n");
+            }
+            BigInt_div_trunc(&result.value, &left.value, &right.value);
+            break;
+        case TOKEN_ID_CMP_EQ:
+        case TOKEN_ID_CMP_NOT_EQ:
+        case TOKEN_ID_CMP_LESS:
+        case TOKEN_ID_CMP_LESS_OR_EQ:
+        case TOKEN_ID_CMP_GREATER:
+        case TOKEN_ID_CMP_GREATER_OR_EQ:
+            BigInt_init_unsigned(&result.value, ct_compare(op, BigInt_cmp(&left.value, &right.value)));
+            result.type = IR_TYPE_PRIMITIVE_BOOL;
+            break;
+        default:
+            os_exit_with_message("Operator %s can't be evaluated at compile time\n", token_name(op));
+            break;
+    }
+
+    ct_wrap(&result.value, result.type);
+    return result;
+}
+
+static IRFunctionDefinition* ct_find_definition(CTContext* ctx, IRFunctionPrototype* proto)
+{
+    IRFunctionDefinitionBuffer* fn_definitions = &ctx->module->fn_definitions;
+    for (u32 i = 0; i < fn_definitions->len; i++)
+    {
+        if (fn_definitions->ptr[i].proto == proto)
+        {
+            return &fn_definitions->ptr[i];
+        }
+    }
+
+    return null;
+}
+
+/* Arguments are evaluated in the caller frame. result must have the layout of the return type */
+static void ct_run(CTContext* ctx, CTFrame* caller, IRFunctionDefinition* fn, IRExpression* args, CTSlot* result)
+{
+    IRFunctionPrototype* proto = fn->proto;
+    if (++ctx->call_depth > CT_MAX_CALL_DEPTH)
+    {
+        os_exit_with_message("Compile-time evaluation exceeded %u nested calls in %s\n", CT_MAX_CALL_DEPTH, sb_ptr(proto->name));
+    }
+    ct_step(ctx);
+
+    u32 value_mark = ctx->value_top;
+    u32 slot_mark = ctx->slot_top;
+
+    CTFrame frame = { .fn = fn, .params = &ct_slot_stack[ctx->slot_top], };
+    for (u32 i = 0; i < proto->param_count; i++)
+    {
+        ct_push_slot(ctx, &proto->params[i].type);
+    }
+    for (u32 i = 0; i < proto->param_count; i++)
+    {
+        ct_eval_into(ctx, caller, &args[i], &frame.params[i]);
+    }
+
+    frame.locals = &ct_slot_stack[ctx->slot_top];
+    for (u32 i = 0; i < fn->sym_declarations.len; i++)
+    {
+        ct_push_slot(ctx, &fn->sym_declarations.ptr[i].type);
+    }
+    frame.return_slot = ct_push_slot(ctx, &proto->ret_type);
+
+    ct_exec_compound(ctx, &frame, &fn->body);
+    ct_copy_slot(result, frame.return_slot);
+
+    ctx->value_top = value_mark;
+    ctx->slot_top = slot_mark;
+    ctx->call_depth--;
+}
+
+static void ct_call(CTContext* ctx, CTFrame* caller, IRFunctionCallExpr* fn_call, CTSlot* result)
+{
+    IRFunctionDefinition* fn = ct_find_definition(ctx, fn_call->fn);
+    if (!fn)
+    {
+        os_exit_with_message("Function %s has no body in this module, it can't be called at compile time\n", sb_ptr(fn_call->fn->name));
+    }
+    if (fn_call->fn->attributes.is_async)
+    {
+        os_exit_with_message("Async function %s can't be called at compile time\n", sb_ptr(fn_call->fn->name));
+    }
+    redassert(fn_call->arg_count == fn_call->fn->param_count);
+
+    ct_run(ctx, caller, fn, fn_call->args, result);
+}
+
+static CTInt ct_eval_intrinsic(CTContext* ctx, CTFrame* frame, IRIntrinsicExpr* intrinsic)
+{
+    if (intrinsic_is_vector_op(intrinsic->id) || intrinsic_is_atomic_op(intrinsic->id))
+    {
+        os_exit_with_message("#%s is not supported at compile time\n", intrinsic_name(intrinsic->id));
+    }
+    CTInt value = ct_eval_int(ctx, frame, &intrinsic->args[0]);
+    if (intrinsic->id == INTRINSIC_EXPECT)
+    {
+        return value;
+    }
+
+    CTInt result = { .type = value.type };
+    CTInt amount = value;
+    if (intrinsic->arg_count == 2)
+    {
+        amount = ct_eval_int(ctx, frame, &intrinsic->args[1]);
+    }
+    ir_fold_bit_intrinsic(intrinsic->id, &value.value, &amount.value, ct_primitive_bit_counts[value.type], &result.value);
+    ct_wrap(&result.value, result.type);
+    return result;
+}
+
+static CTFlow ct_exec_intrinsic(CTContext* ctx, CTFrame* frame, IRIntrinsicStatement* intrinsic)
+{
+    switch (intrinsic->id)
+    {
+        case INTRINSIC_ASSUME:
+            if (!ct_is_true(ct_eval_int(ctx, frame, &intrinsic->args[0])))
+            {
+                os_exit_with_message("#assume condition is false at compile time\n");
+            }
+            return CT_FLOW_NEXT;
+        case INTRINSIC_PREFETCH:
+        // Compile-time execution is single threaded
+        case INTRINSIC_FENCE:
+            return CT_FLOW_NEXT;
+        case INTRINSIC_UNREACHABLE:
+            os_exit_with_message("#unreachable was reached at compile time\n");
+            return CT_FLOW_RETURN;
+        case INTRINSIC_VSTORE:
+        case INTRINSIC_VSTORE_ALIGNED:
+        case INTRINSIC_ATOMIC_STORE:
+        case INTRINSIC_ATOMIC_RMW:
+        case INTRINSIC_CMPXCHG:
+            os_exit_with_message("#%s is not supported at compile time\n", intrinsic_name(intrinsic->id));
+            return CT_FLOW_RETURN;
+        default:
+            RED_UNREACHABLE;
+            return CT_FLOW_NEXT;
+    }
+}
+
+static CTInt ct_eval_int(CTContext* ctx, CTFrame* frame, IRExpression* expression)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_INT_LIT:
+        {
+            CTInt result = { .value = expression->int_literal.bigint, .type = expression->int_literal.type };
+            ct_wrap(&result.value, result.type);
+            return result;
+        }
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+            return ct_eval_sym(ctx, frame, &expression->sym_expr);
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+            return ct_eval_binary(ctx, frame, &expression->bin_expr);
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+        {
+            IRFunctionCallExpr* fn_call = &expression->fn_call_expr;
+            u32 value_mark = ctx->value_top;
+            u32 slot_mark = ctx->slot_top;
+            CTSlot* result_slot = ct_push_slot(ctx, &fn_call->fn->ret_type);
+            if (result_slot->count != 1)
+            {
+                os_exit_with_message("Function %s doesn't return an integer\n", sb_ptr(fn_call->fn->name));
+            }
+            ct_call(ctx, frame, fn_call, result_slot);
+            CTInt result = { .value = result_slot->elements[0], .type = result_slot->type };
+            ctx->value_top = value_mark;
+            ctx->slot_top = slot_mark;
+            return result;
+        }
+        case IR_EXPRESSION_TYPE_COMPTIME_EXPR:
+            ct_resolve(ctx, expression);
+            return ct_eval_int(ctx, frame, expression);
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            return ct_eval_intrinsic(ctx, frame, &expression->intrinsic_expr);
+        default:
+            os_exit_with_message("Expression can't be evaluated at compile time\n");
+            return (CTInt) { 0 };
+    }
+}
+
+/* Evaluates expression into dst, which may be an array. The values are wrapped to the element type of dst */
+static void ct_eval_into(CTContext* ctx, CTFrame* frame, IRExpression* expression, CTSlot* dst)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_VOID:
+            ct_zero_slot(dst);
+            return;
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+        {
+            IRArrayLiteral* array_literal = &expression->array_literal;
+            if (array_literal->expression_count > dst->count)
+            {
+                os_exit_with_message("Array literal has %llu elements, but only %u fit\n", array_literal->expression_count, dst->count);
+            }
+            // The slot may hold the values of a previous iteration
+            ct_zero_slot(dst);
+            for (u32 i = 0; i < array_literal->expression_count; i++)
+            {
+                ct_store(dst, i, ct_eval_int(ctx, frame, &array_literal->expressions[i]).value);
+            }
+            return;
+        }
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+        {
+            IRSymExpr* sym_expr = &expression->sym_expr;
+            if (dst->count == 1 || sym_expr->subscript)
+            {
+                break;
+            }
+
+            if (sym_expr->type == IR_SYM_EXPR_TYPE_GLOBAL_SYM)
+            {
+                IRSymDeclStatement* global = ct_const_global(ctx, sym_expr->global_sym_decl);
+                ct_eval_into(ctx, frame, &global->value, dst);
+            }
+            else
+            {
+                SB* name;
+                ct_copy_slot(dst, ct_variable_slot(frame, sym_expr, &name));
+            }
+            return;
+        }
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            if (dst->count != 1)
+            {
+                IRFunctionCallExpr* fn_call = &expression->fn_call_expr;
+                u32 value_mark = ctx->value_top;
+                u32 slot_mark = ctx->slot_top;
+                CTSlot* result_slot = ct_push_slot(ctx, &fn_call->fn->ret_type);
+                ct_call(ctx, frame, fn_call, result_slot);
+                ct_copy_slot(dst, result_slot);
+                ctx->value_top = value_mark;
+                ctx->slot_top = slot_mark;
+                return;
+            }
+            break;
+        case IR_EXPRESSION_TYPE_COMPTIME_EXPR:
+            ct_resolve(ctx, expression);
+            ct_eval_into(ctx, frame, expression, dst);
+            return;
+        default:
+            break;
+    }
+
+    if (dst->count != 1)
+    {
+        os_exit_with_message("Expression can't initialize an array at compile time\n");
+    }
+    ct_store(dst, 0, ct_eval_int(ctx, frame, expression).value);
+}
+
+static void ct_exec_assign(CTContext* ctx, CTFrame* frame, IRSymAssignStatement* assign_st)
+{
+    redassert(assign_st->left->type == IR_EXPRESSION_TYPE_SYM_EXPR);
+    IRSymExpr* sym_expr = &assign_st->left->sym_expr;
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_SYM:
+        case IR_SYM_EXPR_TYPE_PARAM:
+        {
+            SB* name;
+            CTSlot* slot = ct_variable_slot(frame, sym_expr, &name);
+            if (sym_expr->subscript)
+            {
+                u32 index = ct_index(slot->count, ct_eval_int(ctx, frame, sym_expr->subscript), name);
+                ct_store(slot, index, ct_eval_int(ctx, frame, assign_st->right).value);
+            }
+            else
+            {
+                ct_eval_into(ctx, frame, assign_st->right, slot);
+            }
+            break;
+        }
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+            os_exit_with_message("Global %s can't be modified at compile time\n", sb_ptr(sym_expr->global_sym_decl->name));
+            break;
+        default:
+            os_exit_with_message("Only variables can be assigned at compile time\n");
+            break;
+    }
+}
+
+static CTFlow ct_exec_statement(CTContext* ctx, CTFrame* frame, IRStatement* st)
+{
+    switch (st->type)
+    {
+        case IR_ST_TYPE_COMPOUND_ST:
+            return ct_exec_compound(ctx, frame, &st->compound_st);
+        case IR_ST_TYPE_RETURN_ST:
+            if (st->return_st.expression.type != IR_EXPRESSION_TYPE_VOID)
+            {
+                ct_eval_into(ctx, frame, &st->return_st.expression, frame->return_slot);
+            }
+            return CT_FLOW_RETURN;
+        case IR_ST_TYPE_BRANCH_ST:
+        {
+            IRBranchStatement* branch_st = &st->branch_st;
+            if (ct_is_true(ct_eval_int(ctx, frame, &branch_st->condition)))
+            {
+                return ct_exec_compound(ctx, frame, &branch_st->if_block);
+            }
+            if (branch_st->else_block)
+            {
+                return ct_exec_statement(ctx, frame, branch_st->else_block);
+            }
+            return CT_FLOW_NEXT;
+        }
+        case IR_ST_TYPE_SWITCH_ST:
+        {
+            IRSwitchStatement* switch_st = &st->switch_st;
+            CTInt value = ct_eval_int(ctx, frame, &switch_st->switch_expr);
+            IRSwitchCase* default_case = null;
+            for (u32 i = 0; i < switch_st->cases.len; i++)
+            {
+                IRSwitchCase* switch_case = &switch_st->cases.ptr[i];
+                if (switch_case->case_expr.type == IR_EXPRESSION_TYPE_VOID)
+                {
+                    default_case = switch_case;
+                    continue;
+                }
+
+                CTInt case_value = ct_eval_int(ctx, frame, &switch_case->case_expr);
+                ct_wrap(&case_value.value, value.type);
+                if (BigInt_cmp(&value.value, &case_value.value) == CMP_EQ)
+                {
+                    return ct_exec_compound(ctx, frame, &switch_case->case_body);
+                }
+            }
+            if (default_case)
+            {
+                return ct_exec_compound(ctx, frame, &default_case->case_body);
+            }
+            return CT_FLOW_NEXT;
+        }
+        case IR_ST_TYPE_SYM_DECL_ST:
+        {
+            IRSymDeclStatement* sym_decl_st = &st->sym_decl_st;
+            ct_eval_into(ctx, frame, &sym_decl_st->value, ct_local_slot(frame, sym_decl_st->name));
+            return CT_FLOW_NEXT;
+        }
+        case IR_ST_TYPE_ASSIGN_ST:
+            ct_exec_assign(ctx, frame, &st->sym_assign_st);
+            return CT_FLOW_NEXT;
+        case IR_ST_TYPE_FN_CALL_ST:
+        {
+            u32 value_mark = ctx->value_top;
+            u32 slot_mark = ctx->slot_top;
+            CTSlot* result_slot = ct_push_slot(ctx, &st->fn_call_st.fn->ret_type);
+            ct_call(ctx, frame, &st->fn_call_st, result_slot);
+            ctx->value_top = value_mark;
+            ctx->slot_top = slot_mark;
+            return CT_FLOW_NEXT;
+        }
+        case IR_ST_TYPE_LOOP_ST:
+        {
+            IRLoopStatement* loop_st = &st->loop_st;
+            while (ct_is_true(ct_eval_int(ctx, frame, &loop_st->condition)))
+            {
+                ct_step(ctx);
+                if (ct_exec_compound(ctx, frame, &loop_st->body) == CT_FLOW_RETURN)
+                {
+                    return CT_FLOW_RETURN;
+                }
+            }
+            return CT_FLOW_NEXT;
+        }
+        case IR_ST_TYPE_INTRINSIC_ST:
+            return ct_exec_intrinsic(ctx, frame, &st->intrinsic_st);
+        case IR_ST_TYPE_SUSPEND_ST:
+        case IR_ST_TYPE_RESUME_ST:
+        case IR_ST_TYPE_AWAIT_ST:
+            os_exit_with_message("Coroutines are not supported at compile time\n");
+            return CT_FLOW_NEXT;
+        default:
+            RED_NOT_IMPLEMENTED;
+            return CT_FLOW_NEXT;
+    }
+}
+
+static CTFlow ct_exec_compound(CTContext* ctx, CTFrame* frame, IRCompoundStatement* compound_st)
+{
+    for (u32 i = 0; i < compound_st->stmts.len; i++)
+    {
+        if (ct_exec_statement(ctx, frame, &compound_st->stmts.ptr[i]) == CT_FLOW_RETURN)
+        {
+            return CT_FLOW_RETURN;
+        }
+    }
+
+    return CT_FLOW_NEXT;
+}
+
+static inline IRExpression ct_int_literal(BigInt value, IRTypePrimitive type)
+{
+    // The backends expect integer literals to have exactly one digit, zero included
+    if (value.digit_count == 0)
+    {
+        BigInt_init_unsigned(&value, 0);
+    }
+
+    IRExpression literal = { .type = IR_EXPRESSION_TYPE_INT_LIT, };
+    literal.int_literal.bigint = value;
+    literal.int_literal.type = type;
+    return literal;
+}
+
+static IRExpression ct_slot_to_literal(CTSlot* slot, IRType* type)
+{
+    if (type->kind == TYPE_KIND_VOID)
+    {
+        return (IRExpression) { .type = IR_EXPRESSION_TYPE_VOID, };
+    }
+    if (type->kind == TYPE_KIND_ARRAY)
+    {
+        IRExpression literal = { .type = IR_EXPRESSION_TYPE_ARRAY_LIT, };
+        literal.array_literal.expressions = NEW(IRExpression, slot->count);
+        literal.array_literal.expression_count = slot->count;
+        for (u32 i = 0; i < slot->count; i++)
+        {
+            literal.array_literal.expressions[i] = ct_int_literal(slot->elements[i], slot->type);
+        }
+        return literal;
+    }
+
+    redassert(slot->count == 1);
+    return ct_int_literal(slot->elements[0], slot->type);
+}
+
+static IRExpression ct_evaluate(CTContext* ctx, IRFunctionDefinition* fn)
+{
+    redassert(fn->proto->param_count == 0);
+    // Nested comptime expressions share the budget of the outermost one
+    if (ctx->call_depth == 0)
+    {
+        ctx->step_count = 0;
+    }
+
+    u32 value_mark = ctx->value_top;
+    u32 slot_mark = ctx->slot_top;
+    CTSlot* result = ct_push_slot(ctx, &fn->proto->ret_type);
+    ct_run(ctx, null, fn, null, result);
+    IRExpression literal = ct_slot_to_literal(result, &fn->proto->ret_type);
+    ctx->value_top = value_mark;
+    ctx->slot_top = slot_mark;
+
+#if RED_IR_VERBOSE
+    print("Comptime expression at line %zu evaluated in %llu steps\n", fn->proto->debug.line, ctx->step_count);
+#endif
+
+    return literal;
+}
+
+static void ct_resolve(CTContext* ctx, IRExpression* expression)
+{
+    redassert(expression->type == IR_EXPRESSION_TYPE_COMPTIME_EXPR);
+    *expression = ct_evaluate(ctx, expression->comptime_expr.fn);
+}
+
+IRExpression comptime_evaluate(IRModule* module, IRFunctionDefinition* fn)
+{
+    CTContext ctx = { .module = module, };
+    return ct_evaluate(&ctx, fn);
+}
+
+static void ct_resolve_expression(CTContext* ctx, IRExpression* expression);
+
+static void ct_resolve_fn_call(CTContext* ctx, IRFunctionCallExpr* fn_call)
+{
+    for (u32 i = 0; i < fn_call->arg_count; i++)
+    {
+        ct_resolve_expression(ctx, &fn_call->args[i]);
+    }
+}
+
+static void ct_resolve_intrinsic(CTContext* ctx, IRIntrinsicExpr* intrinsic)
+{
+    for (u32 i = 0; i < intrinsic->arg_count; i++)
+    {
+        ct_resolve_expression(ctx, &intrinsic->args[i]);
+    }
+}
+
+static void ct_resolve_expression(CTContext* ctx, IRExpression* expression)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_COMPTIME_EXPR:
+            ct_resolve(ctx, expression);
+            break;
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+            for (u32 i = 0; i < expression->array_literal.expression_count; i++)
+            {
+                ct_resolve_expression(ctx, &expression->array_literal.expressions[i]);
+            }
+            break;
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+        {
+            IRExpression* subscript = expression->sym_expr.subscript;
+            if (subscript && subscript->type != IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS)
+            {
+                ct_resolve_expression(ctx, subscript);
+            }
+            break;
+        }
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+            ct_resolve_expression(ctx, expression->bin_expr.left);
+            ct_resolve_expression(ctx, expression->bin_expr.right);
+            break;
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            ct_resolve_fn_call(ctx, &expression->fn_call_expr);
+            break;
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            ct_resolve_intrinsic(ctx, &expression->intrinsic_expr);
+            break;
+        case IR_EXPRESSION_TYPE_AWAIT_EXPR:
+            ct_resolve_expression(ctx, expression->await_expr.frame);
+            break;
+        default:
+            break;
+    }
+}
+
+static void ct_resolve_statement(CTContext* ctx, IRStatement* st);
+
+static void ct_resolve_compound(CTContext* ctx, IRCompoundStatement* compound_st)
+{
+    for (u32 i = 0; i < compound_st->stmts.len; i++)
+    {
+        ct_resolve_statement(ctx, &compound_st->stmts.ptr[i]);
+    }
+}
+
+static void ct_resolve_statement(CTContext* ctx, IRStatement* st)
+{
+    switch (st->type)
+    {
+        case IR_ST_TYPE_COMPOUND_ST:
+            ct_resolve_compound(ctx, &st->compound_st);
+            break;
+        case IR_ST_TYPE_RETURN_ST:
+            ct_resolve_expression(ctx, &st->return_st.expression);
+            break;
+        case IR_ST_TYPE_BRANCH_ST:
+            ct_resolve_expression(ctx, &st->branch_st.condition);
+            ct_resolve_compound(ctx, &st->branch_st.if_block);
+            if (st->branch_st.else_block)
+            {
+                ct_resolve_statement(ctx, st->branch_st.else_block);
+            }
+            break;
+        case IR_ST_TYPE_SWITCH_ST:
+            ct_resolve_expression(ctx, &st->switch_st.switch_expr);
+            for (u32 i = 0; i < st->switch_st.cases.len; i++)
+            {
+                ct_resolve_expression(ctx, &st->switch_st.cases.ptr[i].case_expr);
+                ct_resolve_compound(ctx, &st->switch_st.cases.ptr[i].case_body);
+            }
+            break;
+        case IR_ST_TYPE_SYM_DECL_ST:
+            ct_resolve_expression(ctx, &st->sym_decl_st.value);
+            break;
+        case IR_ST_TYPE_ASSIGN_ST:
+            ct_resolve_expression(ctx, st->sym_assign_st.left);
+            ct_resolve_expression(ctx, st->sym_assign_st.right);
+            break;
+        case IR_ST_TYPE_FN_CALL_ST:
+            ct_resolve_fn_call(ctx, &st->fn_call_st);
+            break;
+        case IR_ST_TYPE_LOOP_ST:
+            ct_resolve_expression(ctx, &st->loop_st.condition);
+            ct_resolve_compound(ctx, &st->loop_st.body);
+            break;
+        case IR_ST_TYPE_INTRINSIC_ST:
+            ct_resolve_intrinsic(ctx, &st->intrinsic_st);
+            break;
+        case IR_ST_TYPE_SUSPEND_ST:
+            break;
+        case IR_ST_TYPE_RESUME_ST:
+            ct_resolve_expression(ctx, st->resume_st.frame);
+            break;
+        case IR_ST_TYPE_AWAIT_ST:
+            ct_resolve_expression(ctx, st->await_st.frame);
+            break;
+        default:
+            RED_NOT_IMPLEMENTED;
+            break;
+    }
+}
+
+void comptime_resolve_module(IRModule* module)
+{
+    CTContext ctx = { .module = module, };
+
+    for (u32 i = 0; i < module->global_sym_decls.len; i++)
+    {
+        ct_resolve_expression(&ctx, &module->global_sym_decls.ptr[i].value);
+    }
+
+    for (u32 i = 0; i < module->fn_definitions.len; i++)
+    {
+        IRFunctionDefinition* fn = &module->fn_definitions.ptr[i];
+        ct_resolve_compound(&ctx, &fn->body);
+        // Declarations are copied into the statements, so their values are resolved separately
+        for (u32 j = 0; j < fn->sym_declarations.len; j++)
+        {
+            ct_resolve_expression(&ctx, &fn->sym_declarations.ptr[j].value);
+        }
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "ir.h"
+
+/* Compile-time evaluation. A tree-walking interpreter over the IR: integers are BigInt values wrapped to the width of their type after every operation,
+ * so results match what the generated code computes at runtime */
+IRExpression comptime_evaluate(IRModule* module, IRFunctionDefinition* fn);
+/* Replaces every comptime expression in the globals and function bodies of the module with the literal it evaluates to */
+void comptime_resolve_module(IRModule* module);
@@ -11,6 +11,12 @@
 #define RED_RUN_NOT_PASSING 1
 
 #define RED_JIT 1
+// Runs the bytecode interpreter microbenchmarks at startup
+#define RED_BYTECODE_BENCHMARK 0
+// Reuses the object of a previous build when the lowered IR and the target machine didn't change
+#define RED_LLVM_OBJECT_CACHE 1
+// Prints the size and padding of every struct, and what reordering its fields would save
+#define RED_STRUCT_LAYOUT_REPORT 0
 
 #define RED_SRC_FILE_VERBOSE 0
 #define RED_ALLOCATION_VERBOSE 0
@@ -18,6 +24,7 @@
 #define RED_PARSER_VERBOSE 0
 #define RED_IR_VERBOSE 0
 #define RED_LLVM_VERBOSE 1
+#define RED_X64_VERBOSE 0
 #define RED_CWD_VERBOSE 0
 #define RED_TIMESTAMPS 1
 
@@ -3,7 +3,9 @@
 #include "bigint.h"
 #include "lexer.h"
 #include "ir.h"
+#include "comptime.h"
 #include "os.h"
+#include <stdlib.h>
 
 GEN_BUFFER_FUNCTIONS(decl, db, IRSymDeclStatementBuffer, IRSymDeclStatement)
 GEN_BUFFER_FUNCTIONS(ir_stmtb, sb, IRStatementBuffer, IRStatement)
@@ -26,6 +28,7 @@ const char* primitive_types_str[] =
 static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, IRLoadStoreCfg use_type, IRType* expected_type);
 static inline IRFunctionPrototype* ast_to_ir_find_fn_proto(IRModule* module, SB* fn_name);
 static inline IRFunctionCallExpr ast_to_ir_fn_call_expr(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, IRFunctionPrototype* called_fn);
+static inline IRComptimeExpr ast_to_ir_comptime_expr(ASTNode* node, IRModule* module, IRType* expected_type);
 
 static const IRType primitive_types[] = {
     [IR_TYPE_PRIMITIVE_U8] =
@@ -128,6 +131,227 @@ static inline IRType resolve_basic_type(ASTNode* node)
     return resolve_basic_type_str(node->type_expr.name);
 }
 
+// The size LLVM gives the vector: lanes times the element size, one bit per lane for masks. Both are powers of two, so it is also the alignment
+static inline IRType ir_vector_type(IRTypePrimitive element_type, u32 element_count)
+{
+    IRType type = ZERO_INIT;
+    type.kind = TYPE_KIND_VECTOR;
+    type.vector_type.element_type = element_type;
+    type.vector_type.element_count = element_count;
+    if (element_type == IR_TYPE_PRIMITIVE_BOOL)
+    {
+        type.size = element_count > 8 ? element_count / 8 : 1;
+    }
+    else
+    {
+        type.size = primitive_types[element_type].size * element_count;
+    }
+
+    return type;
+}
+
+static inline IRType resolve_vector_type(ASTNode* node)
+{
+    redassert(node->type_expr.kind == TYPE_KIND_VECTOR);
+    ASTVectorType* ast_vector = &node->type_expr.vector_;
+    IRType element_type = resolve_basic_type_str(ast_vector->element_type);
+    if (red_type_is_invalid(&element_type) || element_type.primitive_type == IR_TYPE_PRIMITIVE_F128)
+    {
+        os_exit_with_message("Invalid vector element type %s\n", sb_ptr(ast_vector->element_type));
+    }
+
+    IRType type = ir_vector_type(element_type.primitive_type, ast_vector->element_count);
+    if (type.size > 64)
+    {
+        os_exit_with_message("Vector type %s is wider than 512 bits\n", sb_ptr(node->type_expr.name));
+    }
+
+    return type;
+}
+
+static inline IRType ir_vector_element_type(IRType* vector_type)
+{
+    redassert(vector_type->kind == TYPE_KIND_VECTOR);
+    return primitive_types[vector_type->vector_type.element_type];
+}
+
+// Result of comparing two vectors: one bool per lane
+static inline IRType ir_vector_mask_type(IRType* vector_type)
+{
+    redassert(vector_type->kind == TYPE_KIND_VECTOR);
+    return ir_vector_type(IR_TYPE_PRIMITIVE_BOOL, vector_type->vector_type.element_count);
+}
+
+static inline bool ir_type_is_vector_mask(IRType* type)
+{
+    return type->kind == TYPE_KIND_VECTOR && type->vector_type.element_type == IR_TYPE_PRIMITIVE_BOOL;
+}
+
+static inline usize align_forward(usize offset, u32 alignment)
+{
+    redassert(alignment && (alignment & (alignment - 1)) == 0);
+    return (offset + alignment - 1) & ~((usize)alignment - 1);
+}
+
+static inline u32 ir_soa_alignment(IRStructDecl* struct_decl);
+
+// Natural alignment, the same the target data layout gives to the LLVM type
+u32 ir_type_alignment(IRType* type)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_PRIMITIVE:
+        case TYPE_KIND_VECTOR:
+            return (u32)type->size;
+        case TYPE_KIND_POINTER:
+        case TYPE_KIND_RAW_STRING:
+        case TYPE_KIND_FRAME:
+            return 8;
+        case TYPE_KIND_ENUM:
+            return (u32)type->enum_type->type.size;
+        case TYPE_KIND_STRUCT:
+            return type->struct_type->alignment;
+        case TYPE_KIND_ARRAY:
+            if (type->array_type.is_soa)
+            {
+                return ir_soa_alignment(type->array_type.base_type->struct_type);
+            }
+            return ir_type_alignment(type->array_type.base_type);
+        default:
+            RED_NOT_IMPLEMENTED;
+            return 1;
+    }
+}
+
+// Structs with an explicit layout are packed LLVM structs, with an LLVM alignment of 1. Anything that embeds one needs the explicit layout too,
+// or LLVM would place it at offsets the IR layout doesn't agree with
+bool ir_type_has_explicit_layout(IRType* type)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_STRUCT:
+            return type->struct_type->has_explicit_layout;
+        case TYPE_KIND_ARRAY:
+            return ir_type_has_explicit_layout(type->array_type.base_type);
+        default:
+            return false;
+    }
+}
+
+static inline u32 ir_field_alignment(IRStructDecl* struct_decl, IRFieldDecl* field)
+{
+    u32 field_alignment = struct_decl->is_packed ? 1 : ir_type_alignment(&field->type);
+    if (field->alignment > field_alignment)
+    {
+        field_alignment = field->alignment;
+    }
+
+    return field_alignment;
+}
+
+// Fields are laid out in the order of the array like C does, unless the struct is packed. align(N) raises the alignment of a field or of the whole struct, also in packed ones
+static inline void ir_struct_layout(IRStructDecl* struct_decl)
+{
+    usize offset = 0;
+    u32 alignment = 1;
+    bool has_explicit_layout = struct_decl->is_packed || struct_decl->explicit_alignment;
+    for (u32 i = 0; i < struct_decl->field_count; i++)
+    {
+        IRFieldDecl* field = &struct_decl->fields[i];
+        u32 field_alignment = ir_field_alignment(struct_decl, field);
+        has_explicit_layout = has_explicit_layout || field->alignment || ir_type_has_explicit_layout(&field->type);
+
+        offset = align_forward(offset, field_alignment);
+        field->offset = offset;
+        offset += field->type.size;
+        if (field_alignment > alignment)
+        {
+            alignment = field_alignment;
+        }
+    }
+
+    if (struct_decl->explicit_alignment > alignment)
+    {
+        alignment = struct_decl->explicit_alignment;
+    }
+    struct_decl->alignment = alignment;
+    struct_decl->size = align_forward(offset, alignment);
+    struct_decl->has_explicit_layout = has_explicit_layout;
+}
+
+// Stable sort by decreasing alignment. Every size is a multiple of its alignment, so this leaves no padding between fields, only at the tail.
+// Field lookups go by name and GEP indices by position in the array, so accesses stay correct
+static inline void ir_struct_reorder_fields(IRStructDecl* struct_decl)
+{
+    IRFieldDecl* fields = struct_decl->fields;
+    for (u32 i = 1; i < struct_decl->field_count; i++)
+    {
+        IRFieldDecl field = fields[i];
+        u32 field_alignment = ir_field_alignment(struct_decl, &field);
+        u32 j = i;
+        while (j > 0 && ir_field_alignment(struct_decl, &fields[j - 1]) < field_alignment)
+        {
+            fields[j] = fields[j - 1];
+            j--;
+        }
+        fields[j] = field;
+    }
+    ir_struct_layout(struct_decl);
+}
+
+#if RED_STRUCT_LAYOUT_REPORT
+static inline void ir_struct_layout_report(IRStructDecl* struct_decl, usize declared_size)
+{
+    usize field_size = 0;
+    for (u32 i = 0; i < struct_decl->field_count; i++)
+    {
+        field_size += struct_decl->fields[i].type.size;
+    }
+
+    if (struct_decl->reorder_fields)
+    {
+        print("struct %s: %zu bytes in declaration order, %zu reordered (%zu of padding)\n", sb_ptr(&struct_decl->name), declared_size, struct_decl->size, struct_decl->size - field_size);
+    }
+    else
+    {
+        IRStructDecl reordered = *struct_decl;
+        reordered.fields = NEW(IRFieldDecl, struct_decl->field_count);
+        memcpy(reordered.fields, struct_decl->fields, sizeof(IRFieldDecl) * struct_decl->field_count);
+        ir_struct_reorder_fields(&reordered);
+        print("struct %s: %zu bytes (%zu of padding), %zu with #reorder_fields\n", sb_ptr(&struct_decl->name), struct_decl->size, struct_decl->size - field_size, reordered.size);
+    }
+}
+#endif
+
+// A #soa array is a struct with one [N]field array per field, so it gets the alignment of the widest field type. Field align(N) and packed don't apply to array elements
+static inline u32 ir_soa_alignment(IRStructDecl* struct_decl)
+{
+    u32 alignment = 1;
+    for (u32 i = 0; i < struct_decl->field_count; i++)
+    {
+        u32 field_alignment = ir_type_alignment(&struct_decl->fields[i].type);
+        if (field_alignment > alignment)
+        {
+            alignment = field_alignment;
+        }
+    }
+
+    return alignment;
+}
+
+static inline usize ir_soa_size(IRStructDecl* struct_decl, u64 elem_count)
+{
+    usize size = 0;
+    for (u32 i = 0; i < struct_decl->field_count; i++)
+    {
+        IRFieldDecl* field = &struct_decl->fields[i];
+        size = align_forward(size, ir_type_alignment(&field->type));
+        size += elem_count * field->type.size;
+    }
+
+    return align_forward(size, ir_soa_alignment(struct_decl));
+}
+
 static inline IRType resolve_array_type(ASTNode* node, IRFunctionDefinition* parent_fn, IRModule* ir_module)
 {
     ASTArrayType* array_type = &node->type_expr.array;
@@ -141,9 +365,19 @@ static inline IRType resolve_array_type(ASTNode* node, IRFunctionDefinition* par
 
     IRType type = ZERO_INIT;
     type.kind = TYPE_KIND_ARRAY;
-    type.size = 0;
+    // Counts computed by comptime blocks are only known after comptime_resolve_module()
+    type.size = elem_count_expr->type == IR_EXPRESSION_TYPE_INT_LIT ? BigInt_as_u64(&elem_count_expr->int_literal.bigint) * base_type->size : 0;
     type.array_type.base_type = base_type;
     type.array_type.elem_count_expr = elem_count_expr;
+    type.array_type.is_soa = array_type->is_soa;
+    if (type.array_type.is_soa)
+    {
+        if (base_type->kind != TYPE_KIND_STRUCT)
+        {
+            os_exit_with_message("#soa arrays need a struct element type\n");
+        }
+        type.size = elem_count_expr->type == IR_EXPRESSION_TYPE_INT_LIT ? ir_soa_size(base_type->struct_type, BigInt_as_u64(&elem_count_expr->int_literal.bigint)) : 0;
+    }
     return type;
 }
 
@@ -162,7 +396,7 @@ static inline IRType resolve_struct_type_str(SB* type_str, IRModule* module)
             IRType type = ZERO_INIT;
             type.struct_type = struct_decl;
             type.kind = TYPE_KIND_STRUCT;
-            type.size = 0;
+            type.size = struct_decl->size;
             return type;
         }
     }
@@ -240,6 +474,7 @@ static inline IRType ast_to_ir_resolve_pointer_type(ASTNode* node, IRFunctionDef
     
     IRType type = ZERO_INIT;
     type.kind = TYPE_KIND_POINTER;
+    type.size = 8;
     type.pointer_type.base_type = NEW(IRType, 1);
     *type.pointer_type.base_type = pointer_type_ir;
 
@@ -253,6 +488,21 @@ static inline IRType ast_to_ir_resolve_raw_string_type(ASTNode* node, IRFunction
     return type;
 }
 
+static inline IRType ast_to_ir_resolve_frame_type(ASTNode* node, IRFunctionDefinition* parent_fn, IRModule* module)
+{
+    IRType type = ZERO_INIT;
+    type.kind = TYPE_KIND_FRAME;
+    type.size = 8;
+    ASTNode* result_type = node->type_expr.frame_.result_type;
+    if (result_type)
+    {
+        type.frame_type.result_type = NEW(IRType, 1);
+        *type.frame_type.result_type = ast_to_ir_resolve_type(result_type, parent_fn, module);
+    }
+
+    return type;
+}
+
 static inline IRType ast_to_ir_resolve_type(ASTNode* node, IRFunctionDefinition* parent_fn, IRModule* ir_tree)
 {
     redassert(node->node_id == AST_TYPE_TYPE_EXPR);
@@ -263,6 +513,8 @@ static inline IRType ast_to_ir_resolve_type(ASTNode* node, IRFunctionDefinition*
             return resolve_basic_type(node);
         case TYPE_KIND_ARRAY:
             return resolve_array_type(node, parent_fn, ir_tree);
+        case TYPE_KIND_VECTOR:
+            return resolve_vector_type(node);
         case TYPE_KIND_STRUCT:
             return resolve_struct_type(node, ir_tree);
         case TYPE_KIND_ENUM:
@@ -273,6 +525,8 @@ static inline IRType ast_to_ir_resolve_type(ASTNode* node, IRFunctionDefinition*
             return ast_to_ir_resolve_pointer_type(node, parent_fn, ir_tree);
         case TYPE_KIND_RAW_STRING:
             return ast_to_ir_resolve_raw_string_type(node, parent_fn, ir_tree);
+        case TYPE_KIND_FRAME:
+            return ast_to_ir_resolve_frame_type(node, parent_fn, ir_tree);
         default:
             RED_NOT_IMPLEMENTED;
             return (const IRType)ZERO_INIT;
@@ -373,6 +627,15 @@ static inline IRIntLiteral ast_to_ir_size_expr(ASTNode* node, IRModule* module,
             break;
         default:
         {
+            // A struct name parses as a symbol: #size(my_struct)
+            if (expr_node->node_id == AST_TYPE_SYM_EXPR && !expr_node->sym_expr.subscript)
+            {
+                type = resolve_struct_type_str(expr_node->sym_expr.name, module);
+                if (type.kind == TYPE_KIND_STRUCT)
+                {
+                    break;
+                }
+            }
             IRExpression expr = ast_to_ir_expression(expr_node, module, parent_fn, LOAD, expected_type);
             type = ast_to_ir_find_expression_type(&expr);
             if (red_type_is_invalid(&type))
@@ -410,6 +673,12 @@ static inline IRIntLiteral ast_to_ir_int_lit_expr(ASTNode* node, IRType* expecte
         {
             expected_type = expected_type->pointer_type.base_type;
         }
+        // Splatted to every lane
+        if (expected_type->kind == TYPE_KIND_VECTOR)
+        {
+            lit.type = expected_type->vector_type.element_type;
+            return lit;
+        }
         redassert(!(expected_type->primitive_type < 0) && expected_type->primitive_type < IR_TYPE_PRIMITIVE_COUNT);
         lit.type = expected_type->primitive_type;
     }
@@ -530,11 +799,31 @@ static inline IRSymExpr find_symbol(SB* symbol, IRModule* module, IRFunctionDefi
     return (const IRSymExpr)ZERO_INIT;
 }
 
-static inline IRArrayLiteral ast_to_ir_array_lit(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn) 
+static inline IRArrayLiteral ast_to_ir_array_lit(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, IRType* expected_type)
 {
     redassert(node->node_id == AST_TYPE_ARRAY_LIT);
     IRArrayLiteral array_lit = ZERO_INIT;
     u64 lit_count = node->array_lit.values.len;
+    IRType* elem_type = NULL;
+    IRType vector_elem_type;
+    if (expected_type && expected_type->kind == TYPE_KIND_VECTOR)
+    {
+        vector_elem_type = ir_vector_element_type(expected_type);
+        elem_type = &vector_elem_type;
+        if (lit_count > expected_type->vector_type.element_count)
+        {
+            os_exit_with_message("Vector literal has %llu elements, more than the %u lanes of its type\n", lit_count, expected_type->vector_type.element_count);
+        }
+    }
+    else if (expected_type && expected_type->kind == TYPE_KIND_ARRAY)
+    {
+        elem_type = expected_type->array_type.base_type;
+        IRExpression* elem_count_expr = expected_type->array_type.elem_count_expr;
+        if (elem_count_expr->type == IR_EXPRESSION_TYPE_INT_LIT && lit_count > BigInt_as_u64(&elem_count_expr->int_literal.bigint))
+        {
+            os_exit_with_message("Array literal has %llu elements, more than its array type\n", lit_count);
+        }
+    }
     if (lit_count > 0)
     {
         array_lit.expressions = NEW(IRExpression, lit_count);
@@ -543,7 +832,7 @@ static inline IRArrayLiteral ast_to_ir_array_lit(ASTNode* node, IRModule* module
         for (u64 i = 0; i < lit_count; i++)
         {
             ASTNode* lit = lit_arr[i];
-            array_lit.expressions[i] = ast_to_ir_expression(lit, module, parent_fn, LOAD, NULL);
+            array_lit.expressions[i] = ast_to_ir_expression(lit, module, parent_fn, LOAD, elem_type);
         }
     }
 
@@ -558,6 +847,22 @@ static inline IRStringLiteral ast_to_ir_string_lit(ASTNode* node, IRModule* modu
     return string_lit;
 }
 
+static inline IRType* ir_sym_expr_decl_type(IRSymExpr* sym_expr)
+{
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_PARAM:
+            return &sym_expr->param_decl->type;
+        case IR_SYM_EXPR_TYPE_SYM:
+            return &sym_expr->sym_decl->type;
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+            return &sym_expr->global_sym_decl->type;
+        default:
+            RED_NOT_IMPLEMENTED;
+            return NULL;
+    }
+}
+
 static inline void ast_to_ir_field_use(ASTNode* node, IRExpression* expr, IRFunctionDefinition* parent_fn, IRLoadStoreCfg use_type)
 {
     AST_ID id = node->node_id;
@@ -580,18 +885,16 @@ static inline void ast_to_ir_field_use(ASTNode* node, IRExpression* expr, IRFunc
         switch (sym_type)
         {
             case IR_SYM_EXPR_TYPE_PARAM:
-                RED_NOT_IMPLEMENTED;
-                break;
             case IR_SYM_EXPR_TYPE_SYM:
             {
-                IRSymDeclStatement* sym_decl = ir_it->sym_expr.sym_decl;
-                redassert(sym_decl);
-                TypeKind type_kind = sym_decl->type.kind;
+                IRType* decl_type = ir_sym_expr_decl_type(&ir_it->sym_expr);
+                redassert(decl_type);
+                TypeKind type_kind = decl_type->kind;
                 new_ir_expr->subscript_access.parent.type = type_kind;
                 switch (type_kind)
                 {
                     case TYPE_KIND_STRUCT:
-                        new_ir_expr->subscript_access.parent.struct_p = sym_decl->type.struct_type;
+                        new_ir_expr->subscript_access.parent.struct_p = decl_type->struct_type;
                         break;
                     default:
                         RED_NOT_IMPLEMENTED;
@@ -634,6 +937,417 @@ static inline void ast_to_ir_field_use(ASTNode* node, IRExpression* expr, IRFunc
     }
 }
 
+// a[i].f. In #soa arrays the element doesn't exist in memory, so this is the only way to access them
+static inline void ast_to_ir_element_field_use(ASTNode* node, IRSymExpr* sym_expr)
+{
+    IRType* array_type = ir_sym_expr_decl_type(sym_expr);
+    SB* field_name = node->sym_expr.element_field;
+    if (!field_name)
+    {
+        if (array_type->kind == TYPE_KIND_ARRAY && array_type->array_type.is_soa)
+        {
+            os_exit_with_message("Elements of #soa array %s can only be accessed by field\n", sb_ptr(node->sym_expr.name));
+        }
+        return;
+    }
+
+    if (array_type->kind != TYPE_KIND_ARRAY || array_type->array_type.base_type->kind != TYPE_KIND_STRUCT)
+    {
+        os_exit_with_message("%s is not an array of structs\n", sb_ptr(node->sym_expr.name));
+    }
+
+    IRStructDecl* struct_decl = array_type->array_type.base_type->struct_type;
+    for (u32 i = 0; i < struct_decl->field_count; i++)
+    {
+        IRFieldDecl* field = &struct_decl->fields[i];
+        if (sb_cmp(field->name, field_name))
+        {
+            sym_expr->element_field = field;
+            return;
+        }
+    }
+
+    os_exit_with_message("Struct field %s not found\n", sb_ptr(field_name));
+}
+
+static inline bool ir_type_is_integer(IRType* type)
+{
+    return type->kind == TYPE_KIND_PRIMITIVE && type->primitive_type >= IR_TYPE_PRIMITIVE_U8 && type->primitive_type <= IR_TYPE_PRIMITIVE_S64;
+}
+
+static inline bool ir_is_int_lit_at_most(IRExpression* expression, u64 max)
+{
+    if (expression->type != IR_EXPRESSION_TYPE_INT_LIT)
+    {
+        return false;
+    }
+
+    BigInt* bigint = &expression->int_literal.bigint;
+    return !bigint->is_negative && bigint->digit_count <= 1 && BigInt_as_u64(bigint) <= max;
+}
+
+static inline bool is_equal_type(IRType* type1, IRType* type2);
+
+// A pointer is used as is. A variable or array element is accessed through the address a store would use. Returns the type at the address
+static inline IRType ir_intrinsic_address_arg(IRExpression* arg, IntrinsicID id)
+{
+    IRType address_type = ast_to_ir_find_expression_type(arg);
+    if (address_type.kind == TYPE_KIND_POINTER)
+    {
+        return *address_type.pointer_type.base_type;
+    }
+
+    IRSymExprType sym_type = arg->sym_expr.type;
+    if (arg->type != IR_EXPRESSION_TYPE_SYM_EXPR || (sym_type != IR_SYM_EXPR_TYPE_SYM && sym_type != IR_SYM_EXPR_TYPE_GLOBAL_SYM))
+    {
+        os_exit_with_message("#%s expects a pointer or a variable\n", intrinsic_name(id));
+    }
+    arg->sym_expr.use_type = STORE;
+
+    return address_type;
+}
+
+// #vload(a[i]) and #vstore(a[i], v) access the lanes starting at a[i], which must be of the element type of the vector
+static inline void ir_vector_check_address_arg(IRExpression* arg, IntrinsicID id, IRType* vector_type)
+{
+    IRType element_type = ir_intrinsic_address_arg(arg, id);
+    if (element_type.kind != TYPE_KIND_PRIMITIVE || element_type.primitive_type != vector_type->vector_type.element_type)
+    {
+        os_exit_with_message("#%s accesses memory of the vector element type\n", intrinsic_name(id));
+    }
+
+    IRSymExpr* sym_expr = &arg->sym_expr;
+    if (arg->type != IR_EXPRESSION_TYPE_SYM_EXPR || !sym_expr->subscript)
+    {
+        return;
+    }
+    IRType* array_type = ir_sym_expr_decl_type(sym_expr);
+    // In a #soa array the field of consecutive elements is contiguous, in a regular one it is not
+    if (sym_expr->element_field && !array_type->array_type.is_soa)
+    {
+        os_exit_with_message("#%s needs contiguous lanes, a[i].f only has them in #soa arrays\n", intrinsic_name(id));
+    }
+    if (sym_expr->subscript->type != IR_EXPRESSION_TYPE_INT_LIT)
+    {
+        return;
+    }
+    IRExpression* elem_count_expr = array_type->array_type.elem_count_expr;
+    if (array_type->kind == TYPE_KIND_ARRAY && elem_count_expr->type == IR_EXPRESSION_TYPE_INT_LIT)
+    {
+        u64 end = BigInt_as_u64(&sym_expr->subscript->int_literal.bigint) + vector_type->vector_type.element_count;
+        if (end > BigInt_as_u64(&elem_count_expr->int_literal.bigint))
+        {
+            os_exit_with_message("#%s goes past the end of array %s\n", intrinsic_name(id), sb_ptr(sym_expr->sym_decl->name));
+        }
+    }
+}
+
+static inline IRType ir_vector_arg(IRExpression* arg, IntrinsicID id)
+{
+    IRType type = ast_to_ir_find_expression_type(arg);
+    if (type.kind != TYPE_KIND_VECTOR)
+    {
+        os_exit_with_message("#%s expects a vector\n", intrinsic_name(id));
+    }
+
+    return type;
+}
+
+// #shuffle(a, b, [indices]): lane i of the result is lane indices[i] of a and b put one after the other
+static inline void ast_to_ir_shuffle(ASTIntrinsicExpr* ast_intrinsic, IRIntrinsicExpr* intrinsic, IRModule* module, IRFunctionDefinition* parent_fn)
+{
+    IRExpression* args = intrinsic->args;
+    args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+    IRType type = ir_vector_arg(&args[0], intrinsic->id);
+    args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, &type);
+    IRType second_type = ir_vector_arg(&args[1], intrinsic->id);
+    if (!is_equal_type(&type, &second_type))
+    {
+        os_exit_with_message("Both vectors of #shuffle must have the same type\n");
+    }
+
+    if (ast_intrinsic->args[2]->node_id != AST_TYPE_ARRAY_LIT)
+    {
+        os_exit_with_message("The lane indices of #shuffle must be an array literal\n");
+    }
+    IRType u32_type = primitive_types[IR_TYPE_PRIMITIVE_U32];
+    args[2] = ast_to_ir_expression(ast_intrinsic->args[2], module, parent_fn, LOAD, null);
+    IRArrayLiteral* indices = &args[2].array_literal;
+    u32 lane_count = type.vector_type.element_count;
+    for (u64 i = 0; i < indices->expression_count; i++)
+    {
+        if (!ir_is_int_lit_at_most(&indices->expressions[i], lane_count * 2 - 1))
+        {
+            os_exit_with_message("#shuffle lane indices must be constants below %u\n", lane_count * 2);
+        }
+        indices->expressions[i].int_literal.type = u32_type.primitive_type;
+    }
+
+    u64 result_lane_count = indices->expression_count;
+    if (result_lane_count < 2 || result_lane_count > 64 || (result_lane_count & (result_lane_count - 1)))
+    {
+        os_exit_with_message("#shuffle must produce a power of two between 2 and 64 lanes\n");
+    }
+    intrinsic->type = ir_vector_type(type.vector_type.element_type, (u32)result_lane_count);
+    if (intrinsic->type.size > 64)
+    {
+        os_exit_with_message("#shuffle result is wider than 512 bits\n");
+    }
+}
+
+// The first argument is the address, the values after it (stored, operand, expected and desired) have the type stored there.
+// Everything but the store returns the value that was in memory before
+static inline void ast_to_ir_atomic(ASTIntrinsicExpr* ast_intrinsic, IRIntrinsicExpr* intrinsic, IRModule* module, IRFunctionDefinition* parent_fn)
+{
+    IRExpression* args = intrinsic->args;
+    IntrinsicID id = intrinsic->id;
+    args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+    IRType type = ir_intrinsic_address_arg(&args[0], id);
+    if (!ir_type_is_integer(&type))
+    {
+        os_exit_with_message("#%s expects an integer variable or a pointer to an integer\n", intrinsic_name(id));
+    }
+
+    for (u8 i = 1; i < intrinsic->arg_count; i++)
+    {
+        args[i] = ast_to_ir_expression(ast_intrinsic->args[i], module, parent_fn, LOAD, &type);
+        if (args[i].type != IR_EXPRESSION_TYPE_INT_LIT)
+        {
+            IRType value_type = ast_to_ir_find_expression_type(&args[i]);
+            if (!is_equal_type(&type, &value_type))
+            {
+                os_exit_with_message("The values of #%s must have the type of the memory it accesses\n", intrinsic_name(id));
+            }
+        }
+    }
+
+    if (id != INTRINSIC_ATOMIC_STORE)
+    {
+        intrinsic->type = type;
+    }
+}
+
+// Folds the bit operations and #expect when the arguments are constant
+static inline IRExpression ast_to_ir_intrinsic_expr(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, IRType* expected_type)
+{
+    redassert(node->node_id == AST_TYPE_INTRINSIC_EXPR);
+    ASTIntrinsicExpr* ast_intrinsic = &node->intrinsic_expr;
+    IntrinsicID id = ast_intrinsic->id;
+
+    IRExpression expression = ZERO_INIT;
+    expression.type = IR_EXPRESSION_TYPE_INTRINSIC_EXPR;
+    IRIntrinsicExpr* intrinsic = &expression.intrinsic_expr;
+    intrinsic->id = id;
+    intrinsic->arg_count = intrinsic_arg_count(id);
+    intrinsic->args = intrinsic->arg_count ? NEW(IRExpression, intrinsic->arg_count) : null;
+    intrinsic->type.kind = TYPE_KIND_VOID;
+    intrinsic->rmw_op = ast_intrinsic->rmw_op;
+    intrinsic->ordering = ast_intrinsic->ordering;
+    intrinsic->failure_ordering = ast_intrinsic->failure_ordering;
+    IRExpression* args = intrinsic->args;
+
+    switch (id)
+    {
+        case INTRINSIC_UNREACHABLE:
+            break;
+        case INTRINSIC_ASSUME:
+        {
+            IRType bool_type = primitive_types[IR_TYPE_PRIMITIVE_BOOL];
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, &bool_type);
+            break;
+        }
+        case INTRINSIC_PREFETCH:
+        {
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+            ir_intrinsic_address_arg(&args[0], id);
+
+            IRType u32_type = primitive_types[IR_TYPE_PRIMITIVE_U32];
+            args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, &u32_type);
+            args[2] = ast_to_ir_expression(ast_intrinsic->args[2], module, parent_fn, LOAD, &u32_type);
+            if (!ir_is_int_lit_at_most(&args[1], 1))
+            {
+                os_exit_with_message("#prefetch rw must be 0 (read) or 1 (write)\n");
+            }
+            if (!ir_is_int_lit_at_most(&args[2], 3))
+            {
+                os_exit_with_message("#prefetch locality must be a constant between 0 and 3\n");
+            }
+            break;
+        }
+        case INTRINSIC_SHUFFLE:
+            ast_to_ir_shuffle(ast_intrinsic, intrinsic, module, parent_fn);
+            break;
+        case INTRINSIC_SELECT:
+        {
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+            IRType mask_type = ir_vector_arg(&args[0], id);
+            args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, expected_type);
+            intrinsic->type = ir_vector_arg(&args[1], id);
+            if (!ir_type_is_vector_mask(&mask_type) || mask_type.vector_type.element_count != intrinsic->type.vector_type.element_count)
+            {
+                os_exit_with_message("#select expects a mask with as many lanes as the vectors\n");
+            }
+            args[2] = ast_to_ir_expression(ast_intrinsic->args[2], module, parent_fn, LOAD, &intrinsic->type);
+            if (args[2].type != IR_EXPRESSION_TYPE_INT_LIT)
+            {
+                IRType else_type = ast_to_ir_find_expression_type(&args[2]);
+                if (!is_equal_type(&intrinsic->type, &else_type))
+                {
+                    os_exit_with_message("Both vectors of #select must have the same type\n");
+                }
+            }
+            break;
+        }
+        case INTRINSIC_REDUCE_ADD:
+        case INTRINSIC_REDUCE_MUL:
+        case INTRINSIC_REDUCE_MIN:
+        case INTRINSIC_REDUCE_MAX:
+        case INTRINSIC_REDUCE_AND:
+        case INTRINSIC_REDUCE_OR:
+        case INTRINSIC_REDUCE_XOR:
+        {
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+            IRType type = ir_vector_arg(&args[0], id);
+            intrinsic->type = ir_vector_element_type(&type);
+            bool is_bitwise = id == INTRINSIC_REDUCE_AND || id == INTRINSIC_REDUCE_OR || id == INTRINSIC_REDUCE_XOR;
+            if (is_bitwise && !ir_type_is_integer(&intrinsic->type) && !ir_type_is_vector_mask(&type))
+            {
+                os_exit_with_message("#%s expects a vector of integers or a mask\n", intrinsic_name(id));
+            }
+            if (!is_bitwise && ir_type_is_vector_mask(&type))
+            {
+                os_exit_with_message("#%s doesn't apply to masks\n", intrinsic_name(id));
+            }
+            break;
+        }
+        case INTRINSIC_VLOAD:
+        case INTRINSIC_VLOAD_ALIGNED:
+            // The vector type comes from where the value goes: x: v8f32 = #vload(a[i])
+            if (!expected_type || expected_type->kind != TYPE_KIND_VECTOR)
+            {
+                os_exit_with_message("#%s needs a vector type from its context, like the type of a declaration\n", intrinsic_name(id));
+            }
+            intrinsic->type = *expected_type;
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+            ir_vector_check_address_arg(&args[0], id, &intrinsic->type);
+            break;
+        case INTRINSIC_VSTORE:
+        case INTRINSIC_VSTORE_ALIGNED:
+        {
+            args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, null);
+            IRType type = ir_vector_arg(&args[1], id);
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, null);
+            ir_vector_check_address_arg(&args[0], id, &type);
+            break;
+        }
+        case INTRINSIC_ATOMIC_LOAD:
+        case INTRINSIC_ATOMIC_STORE:
+        case INTRINSIC_ATOMIC_RMW:
+        case INTRINSIC_CMPXCHG:
+            ast_to_ir_atomic(ast_intrinsic, intrinsic, module, parent_fn);
+            break;
+        case INTRINSIC_FENCE:
+            break;
+        case INTRINSIC_EXPECT:
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, expected_type);
+            intrinsic->type = ast_to_ir_find_expression_type(&args[0]);
+            args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, &intrinsic->type);
+            if (args[1].type != IR_EXPRESSION_TYPE_INT_LIT)
+            {
+                os_exit_with_message("The expected value of #expect must be a constant\n");
+            }
+            if (args[0].type == IR_EXPRESSION_TYPE_INT_LIT)
+            {
+                return args[0];
+            }
+            break;
+        default:
+        {
+            args[0] = ast_to_ir_expression(ast_intrinsic->args[0], module, parent_fn, LOAD, expected_type);
+            IRType type = ast_to_ir_find_expression_type(&args[0]);
+            if (!ir_type_is_integer(&type))
+            {
+                os_exit_with_message("#%s expects an integer\n", intrinsic_name(id));
+            }
+            u32 bit_count = (u32)primitive_types[type.primitive_type].size * 8;
+            if (id == INTRINSIC_BSWAP && bit_count < 16)
+            {
+                os_exit_with_message("#bswap needs an integer of at least 16 bits\n");
+            }
+            intrinsic->type = type;
+
+            bool is_constant = args[0].type == IR_EXPRESSION_TYPE_INT_LIT;
+            if (intrinsic->arg_count == 2)
+            {
+                args[1] = ast_to_ir_expression(ast_intrinsic->args[1], module, parent_fn, LOAD, &type);
+                is_constant = is_constant && args[1].type == IR_EXPRESSION_TYPE_INT_LIT;
+            }
+            if (is_constant)
+            {
+                IRExpression folded = ZERO_INIT;
+                folded.type = IR_EXPRESSION_TYPE_INT_LIT;
+                folded.int_literal.type = type.primitive_type;
+                ir_fold_bit_intrinsic(id, &args[0].int_literal.bigint, intrinsic->arg_count == 2 ? &args[1].int_literal.bigint : null, bit_count, &folded.int_literal.bigint);
+                bool is_signed = type.primitive_type >= IR_TYPE_PRIMITIVE_S8;
+                BigInt_truncate(&folded.int_literal.bigint, &folded.int_literal.bigint, bit_count, is_signed);
+                // The backends expect integer literals to have exactly one digit, zero included
+                if (folded.int_literal.bigint.digit_count == 0)
+                {
+                    BigInt_init_unsigned(&folded.int_literal.bigint, 0);
+                }
+                return folded;
+            }
+            break;
+        }
+    }
+
+    return expression;
+}
+
+// Calling an async function runs it until the first suspend and returns the handle to its frame
+static inline IRType ir_fn_call_type(IRFunctionPrototype* fn)
+{
+    if (!fn->attributes.is_async)
+    {
+        return fn->ret_type;
+    }
+
+    IRType type = ZERO_INIT;
+    type.kind = TYPE_KIND_FRAME;
+    type.size = 8;
+    type.frame_type.result_type = &fn->ret_type;
+    return type;
+}
+
+static inline IRExpression ast_to_ir_frame_operand(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, const char* operation)
+{
+    IRExpression frame = ast_to_ir_expression(node->frame_expr.frame, module, parent_fn, LOAD, NULL);
+    IRType frame_type = ast_to_ir_find_expression_type(&frame);
+    if (frame_type.kind != TYPE_KIND_FRAME)
+    {
+        os_exit_with_message("%s expects a frame handle, returned by calling an async function\n", operation);
+    }
+
+    return frame;
+}
+
+// Outside an async function there is nobody to suspend, so the awaited frame must have already finished
+static inline IRAwaitExpr ast_to_ir_await_expr(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn)
+{
+    redassert(node->node_id == AST_TYPE_AWAIT_EXPR);
+    IRAwaitExpr await_expr = ZERO_INIT;
+    await_expr.frame = NEW(IRExpression, 1);
+    *await_expr.frame = ast_to_ir_frame_operand(node, module, parent_fn, "await");
+    IRType frame_type = ast_to_ir_find_expression_type(await_expr.frame);
+    if (!frame_type.frame_type.result_type)
+    {
+        os_exit_with_message("await needs the result type of the frame: use anyframe->T instead of anyframe\n");
+    }
+    await_expr.result_type = *frame_type.frame_type.result_type;
+
+    return await_expr;
+}
+
 static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module, IRFunctionDefinition* parent_fn, IRLoadStoreCfg use_type, IRType* expected_type)
 {
     IRExpression expression = ZERO_INIT;
@@ -648,7 +1362,7 @@ static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module,
                 return expression;
             case AST_TYPE_ARRAY_LIT:
                 expression.type = IR_EXPRESSION_TYPE_ARRAY_LIT;
-                expression.array_literal = ast_to_ir_array_lit(node, module, parent_fn);
+                expression.array_literal = ast_to_ir_array_lit(node, module, parent_fn, expected_type);
                 return expression;
             case AST_TYPE_STRING_LIT:
                 expression.type = IR_EXPRESSION_TYPE_STRING_LIT;
@@ -663,19 +1377,22 @@ static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module,
                 {
                     switch (node->sym_expr.subscript_type)
                     {
-                        case AST_SYMBOL_SUBSCRIPT_TYPE_FIELD_ACCESS:
-                            expression.sym_expr = expr;
-                            ast_to_ir_field_use(node, &expression, parent_fn, use_type);
-                            return expression;
-                        case AST_SYMBOL_SUBSCRIPT_TYPE_ARRAY_ACCESS:
+                        case AST_SYMBOL_SUBSCRIPT_TYPE_BRACKET_ACCESS:
                             expression.sym_expr = expr;
                             expression.sym_expr.subscript = NEW(IRExpression, 1);
-                            expression.sym_expr.subscript->subscript_access.subscript_type = AST_SYMBOL_SUBSCRIPT_TYPE_ARRAY_ACCESS;
-                            *expression.sym_expr.subscript = ast_to_ir_expression(node->sym_expr.subscript, module, parent_fn, use_type, expected_type);
+                            // The index is a plain expression, field accesses are the IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS ones
+                            *expression.sym_expr.subscript = ast_to_ir_expression(node->sym_expr.subscript, module, parent_fn, LOAD, NULL);
+                            ast_to_ir_element_field_use(node, &expression.sym_expr);
                             return expression;
-                        case AST_SYMBOL_SUBSCRIPT_TYPE_MODULE_NAMESPACE:
+                        case AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS:
                         {
-                            //expression.
+                            if (expr.type != IR_SYM_EXPR_TYPE_MODULE_REF)
+                            {
+                                expression.sym_expr = expr;
+                                ast_to_ir_field_use(node, &expression, parent_fn, use_type);
+                                return expression;
+                            }
+
                             IRModule* module_ref = expr.module_ref;
                             ASTNode* subscript_node = node->sym_expr.subscript;
                             AST_ID id = subscript_node->node_id;
@@ -686,7 +1403,12 @@ static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module,
                                     IRFunctionPrototype* called_fn = ast_to_ir_find_fn_proto(module_ref, &subscript_node->fn_call.name);
                                     if (!called_fn)
                                     {
-                                        RED_UNREACHABLE;
+                                        RED_UNREACHABLE;
+                                    }
+                                    // Private functions get internal linkage, so other modules can't link against them
+                                    if (called_fn->has_body && called_fn->attributes.visibility == VISIBILITY_PRIVATE)
+                                    {
+                                        os_exit_with_message("Function %s is not pub in module %s\n", sb_ptr(called_fn->name), module_ref->name);
                                     }
 
                                     expression.type = IR_EXPRESSION_TYPE_FN_CALL_EXPR;
@@ -719,6 +1441,25 @@ static inline IRExpression ast_to_ir_expression(ASTNode* node, IRModule* module,
                 expression.type = IR_EXPRESSION_TYPE_INT_LIT;
                 expression.int_literal = ast_to_ir_size_expr(node, module, parent_fn, expected_type);
                 return expression;
+            case AST_TYPE_COMPTIME_EXPR:
+                expression.type = IR_EXPRESSION_TYPE_COMPTIME_EXPR;
+                expression.comptime_expr = ast_to_ir_comptime_expr(node, module, expected_type);
+                return expression;
+            case AST_TYPE_INTRINSIC_EXPR:
+                expression = ast_to_ir_intrinsic_expr(node, module, parent_fn, expected_type);
+                if (expression.type == IR_EXPRESSION_TYPE_INTRINSIC_EXPR && expression.intrinsic_expr.type.kind == TYPE_KIND_VOID)
+                {
+                    os_exit_with_message("#%s doesn't produce a value\n", intrinsic_name(node->intrinsic_expr.id));
+                }
+                return expression;
+            case AST_TYPE_AWAIT_EXPR:
+                expression.type = IR_EXPRESSION_TYPE_AWAIT_EXPR;
+                expression.await_expr = ast_to_ir_await_expr(node, module, parent_fn);
+                if (expression.await_expr.result_type.kind == TYPE_KIND_VOID)
+                {
+                    os_exit_with_message("await of a void async function doesn't produce a value\n");
+                }
+                return expression;
             default:
                 RED_NOT_IMPLEMENTED;
                 return (IRExpression)ZERO_INIT;
@@ -752,10 +1493,14 @@ IRType ast_to_ir_find_expression_type(IRExpression* expression)
 
             if (sym_expr->subscript)
             {
-                switch (sym_expr->subscript->subscript_access.subscript_type)
+                switch (ir_sym_expr_subscript_type(sym_expr))
                 {
-                    case AST_SYMBOL_SUBSCRIPT_TYPE_ARRAY_ACCESS:
+                    case AST_SYMBOL_SUBSCRIPT_TYPE_BRACKET_ACCESS:
                     {
+                        if (sym_expr->element_field)
+                        {
+                            return sym_expr->element_field->type;
+                        }
                         IRType type = ZERO_INIT;
                         switch (sym_type)
                         {
@@ -765,12 +1510,15 @@ IRType ast_to_ir_find_expression_type(IRExpression* expression)
                             case IR_SYM_EXPR_TYPE_SYM:
                                 type = *sym_expr->sym_decl->type.array_type.base_type;
                                 break;
+                            case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+                                type = *sym_expr->global_sym_decl->type.array_type.base_type;
+                                break;
                             default:
                                 RED_NOT_IMPLEMENTED;
                         }
                         return type;
                     }
-                    case AST_SYMBOL_SUBSCRIPT_TYPE_FIELD_ACCESS:
+                    case AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS:
                     {
                         SB* field_name = sym_expr->subscript->subscript_access.name;
                         TypeKind field_parent_type = sym_expr->subscript->subscript_access.parent.type;
@@ -817,7 +1565,29 @@ IRType ast_to_ir_find_expression_type(IRExpression* expression)
             return (const IRType)ZERO_INIT;
         }
         case IR_EXPRESSION_TYPE_BIN_EXPR:
-            return ast_to_ir_find_expression_type(expression->bin_expr.left);
+        {
+            IRType type = ast_to_ir_find_expression_type(expression->bin_expr.left);
+            // 2 * v: the literal is splatted to the vector on the right
+            if (expression->bin_expr.left->type == IR_EXPRESSION_TYPE_INT_LIT)
+            {
+                IRType right_type = ast_to_ir_find_expression_type(expression->bin_expr.right);
+                if (right_type.kind == TYPE_KIND_VECTOR)
+                {
+                    type = right_type;
+                }
+            }
+            if (type.kind == TYPE_KIND_VECTOR && token_is_comparison(expression->bin_expr.op))
+            {
+                return ir_vector_mask_type(&type);
+            }
+            return type;
+        }
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            return ir_fn_call_type(expression->fn_call_expr.fn);
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            return expression->intrinsic_expr.type;
+        case IR_EXPRESSION_TYPE_AWAIT_EXPR:
+            return expression->await_expr.result_type;
         default:
             RED_NOT_IMPLEMENTED;
             return (const IRType)ZERO_INIT;
@@ -921,6 +1691,12 @@ static inline IRReturnStatement ast_to_ir_return_st(ASTNode* node, IRModule* mod
             ret_st.expression.fn_call_expr = ast_to_ir_fn_call_expr(expr_node, module, parent_fn, NULL);
             return ret_st;
         }
+        case AST_TYPE_COMPTIME_EXPR:
+        case AST_TYPE_INTRINSIC_EXPR:
+        case AST_TYPE_AWAIT_EXPR:
+            ret_st.red_type = ret_type;
+            ret_st.expression = ast_to_ir_expression(expr_node, module, parent_fn, LOAD, &ret_type);
+            return ret_st;
         default:
             RED_NOT_IMPLEMENTED;
             return ret_st;
@@ -935,6 +1711,18 @@ static inline bool is_equal_type(IRType* type1, IRType* type2)
         return true;
     }
 
+    // The result type lives behind a pointer, compare what it points to
+    if (type1->kind == TYPE_KIND_FRAME && type2->kind == TYPE_KIND_FRAME)
+    {
+        IRType* result1 = type1->frame_type.result_type;
+        IRType* result2 = type2->frame_type.result_type;
+        if (!result1 || !result2)
+        {
+            return result1 == result2;
+        }
+        return is_equal_type(result1, result2);
+    }
+
     return memcmp(type1, type2, sizeof(IRType)) == 0;
 }
 
@@ -954,6 +1742,51 @@ static inline bool is_suitable_operation(TokenID op, IRType* type1, IRType* type
     return is_operation_allowed(op, type1);
 }
 
+// Lane-wise: both sides have the vector type, or are an integer literal splatted to all lanes. and/or only combine masks
+static inline void ir_vector_check_binary_expr(TokenID op, IRType* vector_type, IRExpression* left, IRExpression* right)
+{
+    IRExpression* operands[] = { left, right, };
+    for (u32 i = 0; i < array_length(operands); i++)
+    {
+        if (operands[i]->type == IR_EXPRESSION_TYPE_INT_LIT)
+        {
+            continue;
+        }
+        IRType operand_type = ast_to_ir_find_expression_type(operands[i]);
+        if (!is_equal_type(&operand_type, vector_type))
+        {
+            os_exit_with_message("Both operands of a vector operation must have the same vector type\n");
+        }
+    }
+
+    bool is_mask = ir_type_is_vector_mask(vector_type);
+    switch (op)
+    {
+        case TOKEN_ID_KEYWORD_AND:
+        case TOKEN_ID_KEYWORD_OR:
+            if (!is_mask)
+            {
+                os_exit_with_message("and/or only apply to vector masks\n");
+            }
+            break;
+        case TOKEN_ID_PLUS:
+        case TOKEN_ID_DASH:
+        case TOKEN_ID_STAR:
+        case TOKEN_ID_SLASH:
+            if (is_mask)
+            {
+                os_exit_with_message("Vector masks don't support arithmetic\n");
+            }
+            break;
+        default:
+            if (!token_is_comparison(op))
+            {
+                os_exit_with_message("Operation not supported on vectors\n");
+            }
+            break;
+    }
+}
+
 static inline IRBinaryExpr ast_to_ir_binary_expr(ASTBinExpr* bin_expr, IRModule* module, IRFunctionDefinition* parent_fn, IRType* expected_type)
 {
     IRType type;
@@ -961,7 +1794,7 @@ static inline IRBinaryExpr ast_to_ir_binary_expr(ASTBinExpr* bin_expr, IRModule*
     ASTNode* right = bin_expr->right;
     TokenID op = bin_expr->op;
 
-    if (expected_type && expected_type->primitive_type == IR_TYPE_PRIMITIVE_BOOL)
+    if (expected_type && (expected_type->primitive_type == IR_TYPE_PRIMITIVE_BOOL || ir_type_is_vector_mask(expected_type)))
     {
         expected_type = NULL;
     }
@@ -975,6 +1808,10 @@ static inline IRBinaryExpr ast_to_ir_binary_expr(ASTBinExpr* bin_expr, IRModule*
         expected_type = &type;
     }
     IRExpression ir_right = ast_to_ir_expression(right, module, parent_fn, LOAD, expected_type);
+    if (expected_type->kind == TYPE_KIND_VECTOR)
+    {
+        ir_vector_check_binary_expr(op, expected_type, &ir_left, &ir_right);
+    }
 
     result.left = NEW(IRExpression, 1);
     result.right = NEW(IRExpression, 1);
@@ -1080,8 +1917,16 @@ static inline IRSymDeclStatement ast_to_ir_sym_decl_st(ASTNode* node, IRFunction
 {
     IRSymDeclStatement st;
     st.is_const = node->sym_decl.is_const;
+    st.is_undefined = node->sym_decl.is_undefined;
+    st.is_thread_local = node->sym_decl.is_thread_local;
+    st.visibility = node->sym_decl.visibility;
+    st.alignment = node->sym_decl.alignment;
     st.name = node->sym_decl.sym->sym_expr.name;
     st.type = ast_to_ir_resolve_type(node->sym_decl.type, parent_fn, module);
+    if (st.type.kind == TYPE_KIND_ARRAY && st.type.array_type.is_soa && node->sym_decl.value)
+    {
+        os_exit_with_message("#soa array %s can't have an initializer\n", sb_ptr(st.name));
+    }
     st.value = ast_to_ir_expression(node->sym_decl.value, module, parent_fn, LOAD, &st.type);
 
     return st;
@@ -1114,6 +1959,241 @@ static inline IRSwitchStatement ast_to_ir_switch_st(ASTNode* node, IRFunctionDef
     return st;
 }
 
+#define IR_SWITCH_JUMP_TABLE_MIN_VALUES 4
+// Percentage of the table entries that must be cases
+#define IR_SWITCH_JUMP_TABLE_MIN_DENSITY 40
+#define IR_SWITCH_JUMP_TABLE_MAX_SIZE 4096
+#define IR_SWITCH_BIT_TEST_MIN_VALUES 3
+#define IR_SWITCH_BIT_TEST_MAX_TARGETS 3
+
+// Truncates to the switch type and extends back to 64 bits, so case values and the switch value agree on the bits
+static inline u64 ir_switch_extend(u64 value, u64 size, bool is_signed)
+{
+    if (size >= 8)
+    {
+        return value;
+    }
+
+    u32 shift = 64 - (u32)size * 8;
+    return is_signed ? (u64)((s64)(value << shift) >> shift) : (value << shift) >> shift;
+}
+
+static inline u64 ir_switch_case_value(IRExpression* case_expr)
+{
+    switch (case_expr->type)
+    {
+        case IR_EXPRESSION_TYPE_INT_LIT:
+        {
+            BigInt* bigint = &case_expr->int_literal.bigint;
+            return bigint->is_negative ? (u64)BigInt_as_signed(bigint) : BigInt_as_u64(bigint);
+        }
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+        {
+            IRSymExpr* sym_expr = &case_expr->sym_expr;
+            switch (sym_expr->type)
+            {
+                case IR_SYM_EXPR_TYPE_ENUM_FIELD:
+                    return sym_expr->enum_field->value.unsigned64;
+                case IR_SYM_EXPR_TYPE_ENUM:
+                {
+                    IREnumDecl* enum_decl = sym_expr->enum_decl;
+                    SB* field_name = sym_expr->subscript->subscript_access.name;
+                    for (u32 i = 0; i < enum_decl->fields.len; i++)
+                    {
+                        IREnumField* field = &enum_decl->fields.ptr[i];
+                        if (sb_cmp(field->name, field_name))
+                        {
+                            return field->value.unsigned64;
+                        }
+                    }
+                    os_exit_with_message("Enum field %s not found\n", sb_ptr(field_name));
+                    return 0;
+                }
+                default:
+                    break;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    os_exit_with_message("Switch case values must be integer literals or enum fields\n");
+    return 0;
+}
+
+static int ir_switch_value_cmp_signed(const void* a, const void* b)
+{
+    s64 left = (s64)((const IRSwitchCaseValue*)a)->value;
+    s64 right = (s64)((const IRSwitchCaseValue*)b)->value;
+    return (left > right) - (left < right);
+}
+
+static int ir_switch_value_cmp_unsigned(const void* a, const void* b)
+{
+    u64 left = ((const IRSwitchCaseValue*)a)->value;
+    u64 right = ((const IRSwitchCaseValue*)b)->value;
+    return (left > right) - (left < right);
+}
+
+// Longest run of values starting at first that a single cluster of the given kind can cover. Values are sorted, so high - low never wraps
+static inline u32 ir_switch_cluster_extent(IRSwitchLowering* lowering, u32 first, IRSwitchClusterKind kind)
+{
+    IRSwitchCaseValue* values = lowering->values;
+    u32 targets[IR_SWITCH_BIT_TEST_MAX_TARGETS];
+    u32 target_count = 0;
+    u32 extent = 0;
+    for (u32 i = first; i < lowering->value_count; i++)
+    {
+        u64 span = values[i].value - values[first].value;
+        u32 count = i - first + 1;
+        if (kind == IR_SWITCH_CLUSTER_JUMP_TABLE)
+        {
+            if (span >= IR_SWITCH_JUMP_TABLE_MAX_SIZE)
+            {
+                break;
+            }
+            if (count >= IR_SWITCH_JUMP_TABLE_MIN_VALUES && (u64)count * 100 >= (span + 1) * IR_SWITCH_JUMP_TABLE_MIN_DENSITY)
+            {
+                extent = count;
+            }
+        }
+        else
+        {
+            if (span >= 64)
+            {
+                break;
+            }
+            bool is_new_target = true;
+            for (u32 t = 0; t < target_count; t++)
+            {
+                is_new_target = is_new_target && targets[t] != values[i].case_index;
+            }
+            if (is_new_target)
+            {
+                if (target_count == IR_SWITCH_BIT_TEST_MAX_TARGETS)
+                {
+                    break;
+                }
+                targets[target_count++] = values[i].case_index;
+            }
+            if (count >= IR_SWITCH_BIT_TEST_MIN_VALUES)
+            {
+                extent = count;
+            }
+        }
+    }
+
+    return extent;
+}
+
+void ir_fold_bit_intrinsic(IntrinsicID id, const BigInt* value, const BigInt* amount, u32 bit_count, BigInt* result)
+{
+    BigInt unsigned_value;
+    BigInt_truncate(&unsigned_value, value, bit_count, false);
+
+    switch (id)
+    {
+        case INTRINSIC_POPCOUNT:
+            BigInt_init_unsigned(result, BigInt_popcount_signed(value, bit_count));
+            break;
+        case INTRINSIC_CLZ:
+            BigInt_init_unsigned(result, BigInt_clz(&unsigned_value, bit_count));
+            break;
+        case INTRINSIC_CTZ:
+            BigInt_init_unsigned(result, BigInt_ctz(&unsigned_value, bit_count));
+            break;
+        case INTRINSIC_BSWAP:
+            BigInt_bswap(result, value, bit_count);
+            break;
+        case INTRINSIC_ROTL:
+            BigInt_rotl(result, value, amount, bit_count);
+            break;
+        case INTRINSIC_ROTR:
+            BigInt_rotr(result, value, amount, bit_count);
+            break;
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+}
+
+// Sorts the case values and splits them greedily into clusters. A bit test wins over a jump table covering the same values, it needs no table in memory
+IRSwitchLowering* ir_switch_lowering(IRSwitchStatement* switch_st)
+{
+    if (switch_st->lowering)
+    {
+        return switch_st->lowering;
+    }
+
+    IRType type = ast_to_ir_find_expression_type(&switch_st->switch_expr);
+    if (type.kind == TYPE_KIND_ENUM)
+    {
+        type = type.enum_type->type;
+    }
+    redassert(type.kind == TYPE_KIND_PRIMITIVE);
+
+    IRSwitchLowering* lowering = NEW(IRSwitchLowering, 1);
+    memset(lowering, 0, sizeof(IRSwitchLowering));
+    lowering->is_signed = type.primitive_type >= IR_TYPE_PRIMITIVE_S8 && type.primitive_type <= IR_TYPE_PRIMITIVE_S64;
+    lowering->default_case = -1;
+
+    u32 case_count = switch_st->cases.len;
+    lowering->values = NEW(IRSwitchCaseValue, (case_count + 1));
+    lowering->clusters = NEW(IRSwitchCluster, (case_count + 1));
+    for (u32 i = 0; i < case_count; i++)
+    {
+        IRExpression* case_expr = &switch_st->cases.ptr[i].case_expr;
+        if (case_expr->type == IR_EXPRESSION_TYPE_VOID)
+        {
+            lowering->default_case = (s32)i;
+            continue;
+        }
+
+        IRSwitchCaseValue* value = &lowering->values[lowering->value_count++];
+        value->value = ir_switch_extend(ir_switch_case_value(case_expr), type.size, lowering->is_signed);
+        value->case_index = i;
+    }
+
+    qsort(lowering->values, lowering->value_count, sizeof(IRSwitchCaseValue), lowering->is_signed ? ir_switch_value_cmp_signed : ir_switch_value_cmp_unsigned);
+    for (u32 i = 1; i < lowering->value_count; i++)
+    {
+        if (lowering->values[i].value == lowering->values[i - 1].value)
+        {
+            os_exit_with_message(lowering->is_signed ? "Duplicate switch case value %lld\n" : "Duplicate switch case value %llu\n", lowering->values[i].value);
+        }
+    }
+
+    for (u32 i = 0; i < lowering->value_count;)
+    {
+        IRSwitchCluster* cluster = &lowering->clusters[lowering->cluster_count++];
+        u32 bit_test_extent = ir_switch_cluster_extent(lowering, i, IR_SWITCH_CLUSTER_BIT_TEST);
+        u32 jump_table_extent = ir_switch_cluster_extent(lowering, i, IR_SWITCH_CLUSTER_JUMP_TABLE);
+        if (bit_test_extent && bit_test_extent >= jump_table_extent)
+        {
+            cluster->kind = IR_SWITCH_CLUSTER_BIT_TEST;
+            cluster->value_count = bit_test_extent;
+        }
+        else if (jump_table_extent)
+        {
+            cluster->kind = IR_SWITCH_CLUSTER_JUMP_TABLE;
+            cluster->value_count = jump_table_extent;
+        }
+        else
+        {
+            cluster->kind = IR_SWITCH_CLUSTER_VALUE;
+            cluster->value_count = 1;
+        }
+        cluster->first_value = i;
+        cluster->low = lowering->values[i].value;
+        cluster->high = lowering->values[i + cluster->value_count - 1].value;
+        i += cluster->value_count;
+    }
+
+    switch_st->lowering = lowering;
+    return lowering;
+}
+
 static inline IRCompoundStatement ast_to_ir_compound_st(ASTNode* node, IRFunctionDefinition* parent_fn, IRModule* module)
 {
     redassert(node->node_id == AST_TYPE_COMPOUND_STATEMENT);
@@ -1176,6 +2256,7 @@ static inline IRCompoundStatement ast_to_ir_compound_st(ASTNode* node, IRFunctio
                     bool_type.kind = TYPE_KIND_PRIMITIVE;
                     st_it->loop_st.condition = ast_to_ir_expression(st_node->loop_expr.condition, module, parent_fn, LOAD, &bool_type);
                     st_it->loop_st.body = ast_to_ir_compound_st(st_node->loop_expr.body, parent_fn, module);
+                    st_it->loop_st.hints = st_node->loop_expr.hints;
                     break;
                 }
                 case AST_TYPE_FN_CALL:
@@ -1184,6 +2265,37 @@ static inline IRCompoundStatement ast_to_ir_compound_st(ASTNode* node, IRFunctio
                     st_it->fn_call_st = ast_to_ir_fn_call_expr(st_node, module, parent_fn, NULL);
                     break;
                 }
+                case AST_TYPE_INTRINSIC_EXPR:
+                {
+                    IRExpression expr = ast_to_ir_intrinsic_expr(st_node, module, parent_fn, NULL);
+                    // The old value of a read-modify-write can be dropped, it is done for the side effect
+                    IntrinsicID intrinsic_id = st_node->intrinsic_expr.id;
+                    bool is_rmw = intrinsic_id == INTRINSIC_ATOMIC_RMW || intrinsic_id == INTRINSIC_CMPXCHG;
+                    if (expr.type != IR_EXPRESSION_TYPE_INTRINSIC_EXPR || (expr.intrinsic_expr.type.kind != TYPE_KIND_VOID && !is_rmw))
+                    {
+                        os_exit_with_message("The result of #%s is unused\n", intrinsic_name(st_node->intrinsic_expr.id));
+                    }
+                    st_it->type = IR_ST_TYPE_INTRINSIC_ST;
+                    st_it->intrinsic_st = expr.intrinsic_expr;
+                    break;
+                }
+                case AST_TYPE_SUSPEND_STATEMENT:
+                    if (!parent_fn->proto->attributes.is_async)
+                    {
+                        os_exit_with_message("suspend can only be used inside an async function, %s is not async\n", sb_ptr(parent_fn->proto->name));
+                    }
+                    st_it->type = IR_ST_TYPE_SUSPEND_ST;
+                    break;
+                case AST_TYPE_RESUME_STATEMENT:
+                    st_it->type = IR_ST_TYPE_RESUME_ST;
+                    st_it->resume_st.frame = NEW(IRExpression, 1);
+                    *st_it->resume_st.frame = ast_to_ir_frame_operand(st_node, module, parent_fn, "resume");
+                    st_it->resume_st.result_type.kind = TYPE_KIND_VOID;
+                    break;
+                case AST_TYPE_AWAIT_EXPR:
+                    st_it->type = IR_ST_TYPE_AWAIT_ST;
+                    st_it->await_st = ast_to_ir_await_expr(st_node, module, parent_fn);
+                    break;
                 case AST_TYPE_SYM_EXPR:
                 {
                     IRExpression expr = ast_to_ir_expression(st_node, module, parent_fn, LOAD, NULL);
@@ -1269,6 +2381,109 @@ static inline IRCompoundStatement ast_to_ir_compound_st(ASTNode* node, IRFunctio
     return result;
 }
 
+// Local declarations nested anywhere in the body. Comptime blocks are lowered into their own function and don't count
+static u32 ast_count_sym_decls(ASTNode* node)
+{
+    if (!node)
+    {
+        return 0;
+    }
+
+    u32 count = 0;
+    switch (node->node_id)
+    {
+        case AST_TYPE_SYM_DECL:
+            return 1;
+        case AST_TYPE_COMPOUND_STATEMENT:
+            for (u32 i = 0; i < node->compound_statement.statements.len; i++)
+            {
+                count += ast_count_sym_decls(node->compound_statement.statements.ptr[i]);
+            }
+            return count;
+        case AST_TYPE_BRANCH_EXPR:
+            return ast_count_sym_decls(node->branch_expr.if_block) + ast_count_sym_decls(node->branch_expr.else_block);
+        case AST_TYPE_LOOP_EXPR:
+            return ast_count_sym_decls(node->loop_expr.body);
+        case AST_TYPE_SWITCH_STATEMENT:
+            for (u32 i = 0; i < node->switch_expr.cases.len; i++)
+            {
+                count += ast_count_sym_decls(node->switch_expr.cases.ptr[i]->switch_case.case_body);
+            }
+            return count;
+        default:
+            return 0;
+    }
+}
+
+// Sym expressions point into parent_fn->sym_declarations, so the buffer must not move while the body is lowered
+static inline IRCompoundStatement ast_to_ir_fn_body(ASTNode* body, IRFunctionDefinition* fn, IRModule* module)
+{
+    decl_ensure_capacity(&fn->sym_declarations, ast_count_sym_decls(body));
+    return ast_to_ir_compound_st(body, fn, module);
+}
+
+// The comptime block can't see the locals of the enclosing function, only globals and functions
+static inline IRComptimeExpr ast_to_ir_comptime_expr(ASTNode* node, IRModule* module, IRType* expected_type)
+{
+    redassert(node->node_id == AST_TYPE_COMPTIME_EXPR);
+    ASTNode* expr_node = node->comptime_expr.expr;
+
+    IRType ret_type = ZERO_INIT;
+    if (expected_type)
+    {
+        ret_type = *expected_type;
+    }
+    else if (expr_node->node_id == AST_TYPE_FN_CALL)
+    {
+        IRFunctionPrototype* called_fn = ast_to_ir_find_fn_proto(module, &expr_node->fn_call.name);
+        if (!called_fn)
+        {
+            os_exit_with_message("Can't find function %s\n", sb_ptr(&expr_node->fn_call.name));
+        }
+        ret_type = called_fn->ret_type;
+    }
+    else
+    {
+        os_exit_with_message("The type of the comptime block at line %u can't be inferred\n", node->node_line + 1);
+    }
+
+    SB* name = sb_alloc();
+    sb_append_str(name, "comptime");
+    IRFunctionPrototype* proto = NEW(IRFunctionPrototype, 1);
+    *proto = (const IRFunctionPrototype)
+    {
+        .module = module,
+        .name = name,
+        .ret_type = ret_type,
+        .debug.line = node->node_line,
+        .has_body = true,
+    };
+
+    IRFunctionDefinition* fn = NEW(IRFunctionDefinition, 1);
+    *fn = (const IRFunctionDefinition)
+    {
+        .proto = proto,
+    };
+
+    if (expr_node->node_id == AST_TYPE_COMPOUND_STATEMENT)
+    {
+        fn->body = ast_to_ir_fn_body(expr_node, fn, module);
+    }
+    else
+    {
+        IRStatement* ret_st = ir_stmtb_add_one(&fn->body.stmts);
+        ret_st->type = IR_ST_TYPE_RETURN_ST;
+        ret_st->return_st.red_type = ret_type;
+        ret_st->return_st.expression = ast_to_ir_expression(expr_node, module, fn, LOAD, &proto->ret_type);
+    }
+
+    IRComptimeExpr comptime_expr =
+    {
+        .fn = fn,
+    };
+    return comptime_expr;
+}
+
 static void ast_to_ir_global_symbols(IRModule* module, ASTNodeBuffer* globals_buffer)
 {
     u64 global_count = globals_buffer->len;
@@ -1315,6 +2530,11 @@ static IRFunctionPrototype ast_to_ir_fn_proto(ASTNode* node, IRModule* module)
             }
 
             params[i].name = param_name(param);
+            params[i].is_noalias = param->param_decl.is_noalias;
+            if (params[i].is_noalias && red_type.kind != TYPE_KIND_POINTER)
+            {
+                os_exit_with_message("noalias parameter %s in function %s is not a pointer\n", sb_ptr(params[i].name), sb_ptr(fn_name));
+            }
         }
     }
 
@@ -1343,9 +2563,26 @@ static IRFunctionPrototype ast_to_ir_fn_proto(ASTNode* node, IRModule* module)
         .param_count = param_count,
         .params = params,
         .ret_type = ret_red_type,
+        .attributes.target_clones = fn_proto->attributes.target_clones,
+        .attributes.inline_kind = fn_proto->attributes.inline_kind,
+        .attributes.visibility = fn_proto->attributes.visibility,
+        .attributes.is_async = fn_proto->attributes.is_async,
         .debug.line = node->node_line,
     };
 
+    if (ir_proto.attributes.is_async)
+    {
+        if (strequal(sb_ptr(fn_name), "main"))
+        {
+            os_exit_with_message("main can't be async\n");
+        }
+        // The result is stored in the promise, which the frame keeps at a 16 byte aligned offset
+        if (ret_red_type.kind != TYPE_KIND_VOID && ir_type_alignment(&ret_red_type) > 16)
+        {
+            os_exit_with_message("The result of async function %s is aligned to more than 16 bytes\n", sb_ptr(fn_name));
+        }
+    }
+
     return ir_proto;
 }
 
@@ -1381,6 +2618,43 @@ static inline IRFunctionPrototype* ast_to_ir_find_fn_proto(IRModule* module, SB*
     return null;
 }
 
+static inline IRFunctionPrototype* ast_to_ir_frame_allocator(IRModule* module, SB* fn_name, SB* async_fn_name, bool is_alloc)
+{
+    if (!fn_name)
+    {
+        return null;
+    }
+
+    IRFunctionPrototype* fn = ast_to_ir_find_fn_proto(module, fn_name);
+    if (!fn)
+    {
+        os_exit_with_message("Can't find frame allocator function %s for %s\n", sb_ptr(fn_name), sb_ptr(async_fn_name));
+    }
+    if (fn->attributes.is_async)
+    {
+        os_exit_with_message("Frame allocator function %s can't be async\n", sb_ptr(fn_name));
+    }
+
+    // alloc = (size u64) &u8 and free = (frame &u8)
+    bool valid_signature = fn->param_count == 1;
+    if (valid_signature && is_alloc)
+    {
+        IRType* size_type = &fn->params[0].type;
+        valid_signature = size_type->kind == TYPE_KIND_PRIMITIVE && (size_type->primitive_type == IR_TYPE_PRIMITIVE_U64 || size_type->primitive_type == IR_TYPE_PRIMITIVE_S64) &&
+                          fn->ret_type.kind == TYPE_KIND_POINTER;
+    }
+    else if (valid_signature)
+    {
+        valid_signature = fn->params[0].type.kind == TYPE_KIND_POINTER && fn->ret_type.kind == TYPE_KIND_VOID;
+    }
+    if (!valid_signature)
+    {
+        os_exit_with_message("Frame %s function %s must be %s\n", is_alloc ? "alloc" : "free", sb_ptr(fn_name), is_alloc ? "(size u64) &u8" : "(frame &u8)");
+    }
+
+    return fn;
+}
+
 static void ast_to_ir_fn_definitions(IRModule* ir_module, ASTNodeBuffer* fb)
 {
     ASTNode** fn_ptr = fb->ptr;
@@ -1396,9 +2670,12 @@ static void ast_to_ir_fn_definitions(IRModule* ir_module, ASTNodeBuffer* fb)
             SB* fn_name = fn_proto_node->fn_proto.sym->sym_expr.name;
             IRFunctionPrototype* fn_proto = ast_to_ir_find_fn_proto(ir_module, fn_name);
             redassert(fn_proto);
+            ASTFnAttributes* attributes = &fn_proto_node->fn_proto.attributes;
+            fn_proto->attributes.frame_alloc_fn = ast_to_ir_frame_allocator(ir_module, attributes->frame_alloc_fn, fn_name, true);
+            fn_proto->attributes.frame_free_fn = ast_to_ir_frame_allocator(ir_module, attributes->frame_free_fn, fn_name, false);
             IRFunctionDefinition* fn_def = ir_fn_def_add_one(&ir_module->fn_definitions);
             fn_def->proto = fn_proto;
-            fn_def->body = ast_to_ir_compound_st(fn_body_node, fn_def, ir_module);
+            fn_def->body = ast_to_ir_fn_body(fn_body_node, fn_def, ir_module);
         }
     }
 }
@@ -1620,8 +2897,8 @@ static inline IRFieldDecl ast_to_ir_field_decl(ASTNode* node, ASTNode* parent_co
     ASTFieldDecl* field_decl = &node->field_decl;
     IRFieldDecl ir_field = ZERO_INIT;
     ir_field.type = ast_to_ir_resolve_type(field_decl->type, NULL, module);
-    redassert(ir_field.type.kind == TYPE_KIND_PRIMITIVE);
     ir_field.name = node->field_decl.sym->sym_expr.name;
+    ir_field.alignment = field_decl->alignment;
 
     if (red_type_is_invalid(&ir_field.type))
     {
@@ -1642,6 +2919,9 @@ static inline IRStructDecl ast_to_ir_struct_decl(ASTNode* node, IRModule* module
     redassert(node->node_id == AST_TYPE_STRUCT_DECL);
     ASTStructDecl* struct_decl = &node->struct_decl;
     ir_struct.name = struct_decl->name;
+    ir_struct.is_packed = struct_decl->is_packed;
+    ir_struct.reorder_fields = struct_decl->reorder_fields && !struct_decl->is_packed;
+    ir_struct.explicit_alignment = struct_decl->alignment;
     u32 field_count = struct_decl->fields.len;
     redassert(field_count > 0);
     if (field_count > 0)
@@ -1656,6 +2936,17 @@ static inline IRStructDecl ast_to_ir_struct_decl(ASTNode* node, IRModule* module
         }
         ir_struct.field_count = field_count;
     }
+    ir_struct_layout(&ir_struct);
+#if RED_STRUCT_LAYOUT_REPORT
+    usize declared_size = ir_struct.size;
+#endif
+    if (ir_struct.reorder_fields)
+    {
+        ir_struct_reorder_fields(&ir_struct);
+    }
+#if RED_STRUCT_LAYOUT_REPORT
+    ir_struct_layout_report(&ir_struct, declared_size);
+#endif
 
     return ir_struct;
 }
@@ -1755,8 +3046,9 @@ static inline void ast_to_ir_modules(IRModule* module, ASTModuleBuffer* ast_modu
     ASTModule* module_ptr = ast_modules->ptr;
     for (u32 i = 0; i < module_count; i++)
     {
+        // Only the main module can import others
         ASTModule* ast_module = &module_ptr[i];
-        IRModule new_module = transform_ast_to_ir(ast_module);
+        IRModule new_module = transform_ast_to_ir(ast_module, NULL);
         ir_module_append(&module->modules, new_module);
     }
 }
@@ -1793,15 +3085,20 @@ static inline void ast_to_ir_type_declarations(IRModule* ir_tree, ASTModule* ast
     }
 }
 
-IRModule transform_ast_to_ir(ASTModule* ast)
+IRModule transform_ast_to_ir(ASTModule* ast, ASTModuleBuffer* imported_modules)
 {
     IRModule module = ZERO_INIT;
-    module.name = ast->name;
-    ast_to_ir_modules(&module, &ast->modules);
+    module.name = sb_ptr(ast->name);
+    if (imported_modules)
+    {
+        ast_to_ir_modules(&module, imported_modules);
+    }
     ast_to_ir_type_declarations(&module, ast);
-    ast_to_ir_global_symbols(&module, &ast->global_sym_decls);
+    // Prototypes go first so comptime calls in global initializers can be resolved
     ast_to_ir_fn_prototypes(&module, &ast->fn_definitions);
+    ast_to_ir_global_symbols(&module, &ast->global_sym_decls);
     ast_to_ir_fn_definitions(&module, &ast->fn_definitions);
+    comptime_resolve_module(&module);
 
 #if RED_IR_VERBOSE
     print_ir_tree(&module);
@@ -10,6 +10,7 @@ typedef struct IRStatement IRStatement;
 typedef struct IRSymDeclStatement IRSymDeclStatement;
 typedef struct IRExpression IRExpression;
 typedef struct IRModule IRModule;
+typedef struct IRFunctionDefinition IRFunctionDefinition;
 GEN_BUFFER_STRUCT(IRStatement)
 GEN_BUFFER_STRUCT(IRSymDeclStatement)
 GEN_BUFFER_STRUCT(IRModule)
@@ -49,6 +50,7 @@ static inline const char* primitive_type_str(IRTypePrimitive primitive_type_id)
         case (IR_TYPE_PRIMITIVE_F32): return "f32";
         case (IR_TYPE_PRIMITIVE_F64): return "f64";
         case (IR_TYPE_PRIMITIVE_F128): return "f128";
+        case (IR_TYPE_PRIMITIVE_BOOL): return "bool";
         case (IR_TYPE_PRIMITIVE_POINTER):
         default:
             RED_NOT_IMPLEMENTED;
@@ -60,6 +62,8 @@ typedef struct IRArrayType
 {
     IRType* base_type;
     IRExpression* elem_count_expr;
+    // #soa: the element struct is stored as one array per field, so only a[i].f accesses are valid
+    bool is_soa;
 } IRArrayType;
 
 typedef struct IRPointerType
@@ -67,6 +71,19 @@ typedef struct IRPointerType
     IRType* base_type;
 } IRPointerType;
 
+// Lanes of a primitive type. Vectors of bool are comparison masks
+typedef struct IRVectorType
+{
+    IRTypePrimitive element_type;
+    u32 element_count;
+} IRVectorType;
+
+// Handle to the frame of an async call. Null result type for a plain anyframe, which can only be resumed
+typedef struct IRFrameType
+{
+    IRType* result_type;
+} IRFrameType;
+
 typedef struct IRType
 {
     TypeKind kind;
@@ -80,6 +97,8 @@ typedef struct IRType
         IRFunctionPrototype* fn_type;
         IRArrayType array_type;
         IRPointerType pointer_type;
+        IRVectorType vector_type;
+        IRFrameType frame_type;
     };
 } IRType;
 
@@ -93,12 +112,16 @@ typedef struct IRParamDecl
 {
     IRType type;
     SB* name;
+    bool is_noalias;
 } IRParamDecl;
 
 typedef struct IRFieldDecl
 {
     IRType type;
     SB* name;
+    usize offset;
+    // align(N), 0 if not given
+    u32 alignment;
 } IRFieldDecl;
 
 typedef struct IREnumField
@@ -139,6 +162,15 @@ typedef struct IRStructDecl
     SB name;
     IRFieldDecl* fields;
     u32 field_count;
+    usize size;
+    u32 alignment;
+    // align(N) on the struct, 0 if not given
+    u32 explicit_alignment;
+    bool is_packed;
+    // Packed or with some align(N): the backend can't rely on the natural layout of the field types
+    bool has_explicit_layout;
+    // #reorder_fields: fields are sorted by alignment, so their order here is not the declaration order
+    bool reorder_fields;
 } IRStructDecl;
 
 typedef struct IRConstValue
@@ -159,6 +191,19 @@ typedef enum IRLinkageType
     INTERN,
 } IRLinkageType;
 
+typedef struct IRFunctionAttributes
+{
+    // Targets to compile the function for besides the default one. Calls are dispatched to the best clone the running CPU supports
+    SBBuffer target_clones;
+    InlineKind inline_kind;
+    Visibility visibility;
+    // Calls return a frame handle instead of the result. The frame is allocated with frame_alloc_fn and freed with frame_free_fn,
+    // or with malloc and free when they are null
+    bool is_async;
+    IRFunctionPrototype* frame_alloc_fn;
+    IRFunctionPrototype* frame_free_fn;
+} IRFunctionAttributes;
+
 typedef struct IRFunctionPrototype
 {
     IRModule* module;
@@ -166,6 +211,7 @@ typedef struct IRFunctionPrototype
     SB* name;
     // TODO: remove
     IRType ret_type;
+    IRFunctionAttributes attributes;
     struct
     {
         usize line;
@@ -190,6 +236,10 @@ typedef enum IRStatementType
     IR_ST_TYPE_ASSIGN_ST,
     IR_ST_TYPE_FN_CALL_ST,
     IR_ST_TYPE_LOOP_ST,
+    IR_ST_TYPE_INTRINSIC_ST,
+    IR_ST_TYPE_SUSPEND_ST,
+    IR_ST_TYPE_RESUME_ST,
+    IR_ST_TYPE_AWAIT_ST,
 } IRStatementType;
 
 typedef enum IRExpressionType
@@ -202,6 +252,9 @@ typedef enum IRExpressionType
     IR_EXPRESSION_TYPE_BIN_EXPR,
     IR_EXPRESSION_TYPE_FN_CALL_EXPR,
     IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS,
+    IR_EXPRESSION_TYPE_COMPTIME_EXPR,
+    IR_EXPRESSION_TYPE_INTRINSIC_EXPR,
+    IR_EXPRESSION_TYPE_AWAIT_EXPR,
 } IRExpressionType;
 
 typedef struct IRIntLiteral
@@ -247,6 +300,8 @@ typedef struct IRSymExpr
     };
 
     IRExpression* subscript;
+    // a[i].f: field of the array element the subscript indexes
+    IRFieldDecl* element_field;
     IRSymExprType type;
     IRLoadStoreCfg use_type;
 } IRSymExpr;
@@ -286,6 +341,33 @@ typedef struct IRSubscriptAccess
     IRSymbolSubscriptType subscript_type;
 } IRSubscriptAccess;
 
+/* Anonymous function without parameters whose body is the comptime block, or a return of the comptime call.
+ * comptime_resolve_module() replaces the expression with the literal the function returns */
+typedef struct IRComptimeExpr
+{
+    IRFunctionDefinition* fn;
+} IRComptimeExpr;
+
+/* Calls with constant arguments are folded into literals before reaching the backends */
+typedef struct IRIntrinsicExpr
+{
+    IRExpression* args;
+    // Void for #assume, #prefetch, #unreachable, #vstore, #atomic_store and #fence
+    IRType type;
+    IntrinsicID id;
+    u8 arg_count;
+    AtomicRMWOp rmw_op;
+    AtomicOrdering ordering;
+    AtomicOrdering failure_ordering;
+} IRIntrinsicExpr, IRIntrinsicStatement;
+
+// await h and resume h. The result type is the one of the frame, void for resume
+typedef struct IRFrameExpr
+{
+    IRExpression* frame;
+    IRType result_type;
+} IRAwaitExpr, IRAwaitStatement, IRResumeStatement;
+
 typedef struct IRExpression
 {
     IRExpressionType type;
@@ -298,6 +380,9 @@ typedef struct IRExpression
         IRBinaryExpr bin_expr;
         IRFunctionCallExpr fn_call_expr;
         IRSubscriptAccess subscript_access;
+        IRComptimeExpr comptime_expr;
+        IRIntrinsicExpr intrinsic_expr;
+        IRAwaitExpr await_expr;
     };
 } IRExpression;
 
@@ -322,10 +407,51 @@ typedef struct IRSwitchCase
 
 GEN_BUFFER_STRUCT(IRSwitchCase)
 
+typedef enum IRSwitchClusterKind
+{
+    // A single case value
+    IR_SWITCH_CLUSTER_VALUE,
+    // Dense range: a table indexed by value - low
+    IR_SWITCH_CLUSTER_JUMP_TABLE,
+    // Range narrower than 64 values with few case bodies: one bit mask of value - low per body
+    IR_SWITCH_CLUSTER_BIT_TEST,
+} IRSwitchClusterKind;
+
+// Case value as the 64 bits of the switch type extended to 64, so the same bits compare as signed or unsigned
+typedef struct IRSwitchCaseValue
+{
+    u64 value;
+    u32 case_index;
+} IRSwitchCaseValue;
+
+typedef struct IRSwitchCluster
+{
+    IRSwitchClusterKind kind;
+    u64 low;
+    u64 high;
+    // Values of the cluster, in IRSwitchLowering.values
+    u32 first_value;
+    u32 value_count;
+} IRSwitchCluster;
+
+// How backends without their own switch lowering dispatch: a balanced compare tree over the clusters, which are sorted and disjoint
+typedef struct IRSwitchLowering
+{
+    IRSwitchCaseValue* values;
+    IRSwitchCluster* clusters;
+    u32 value_count;
+    u32 cluster_count;
+    // Index in IRSwitchStatement.cases, -1 if there is no default case
+    s32 default_case;
+    bool is_signed;
+} IRSwitchLowering;
+
 typedef struct IRSwitchStatement
 {
     IRExpression switch_expr;
     IRSwitchCaseBuffer cases;
+    // Computed on first use by ir_switch_lowering(), once comptime case values are resolved
+    IRSwitchLowering* lowering;
 } IRSwitchStatement;
 
 typedef struct IRSymDeclStatement
@@ -334,6 +460,13 @@ typedef struct IRSymDeclStatement
     SB* name;
     IRExpression value;
     bool is_const;
+    // = undefined. Without a value, symbols are zero-initialized
+    bool is_undefined;
+    bool is_thread_local;
+    // Only for globals
+    Visibility visibility;
+    // align(N), 0 if not given
+    u32 alignment;
 } IRSymDeclStatement;
 
 typedef struct IRSymAssignStatement
@@ -346,6 +479,7 @@ typedef struct IRLoopStatement
 {
     IRExpression condition;
     IRCompoundStatement body;
+    LoopHints hints;
 } IRLoopStatement;
 
 typedef struct IRStatement
@@ -361,6 +495,9 @@ typedef struct IRStatement
         IRSymAssignStatement sym_assign_st;
         IRFunctionCallStatement fn_call_st;
         IRLoopStatement loop_st;
+        IRIntrinsicStatement intrinsic_st;
+        IRResumeStatement resume_st;
+        IRAwaitStatement await_st;
     };
 } IRStatement;
 
@@ -390,6 +527,17 @@ typedef struct IRModule
     const char* prefix;
 } IRModule;
 
-IRModule transform_ast_to_ir(ASTModule* ast);
+// Array indices are plain expressions, struct and enum field accesses are IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS ones
+static inline IRSymbolSubscriptType ir_sym_expr_subscript_type(IRSymExpr* sym_expr)
+{
+    return sym_expr->subscript->type == IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS ? AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS : AST_SYMBOL_SUBSCRIPT_TYPE_BRACKET_ACCESS;
+}
+
+IRModule transform_ast_to_ir(ASTModule* ast, ASTModuleBuffer* imported_modules);
 
 IRType ast_to_ir_find_expression_type(IRExpression* expression);
+u32 ir_type_alignment(IRType* type);
+bool ir_type_has_explicit_layout(IRType* type);
+IRSwitchLowering* ir_switch_lowering(IRSwitchStatement* switch_st);
+// #popcount, #clz, #ctz, #bswap, #rotl and #rotr of constants, over the low bit_count bits
+void ir_fold_bit_intrinsic(IntrinsicID id, const BigInt* value, const BigInt* amount, u32 bit_count, BigInt* result);
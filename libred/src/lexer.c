@@ -127,22 +127,36 @@ void print_tokens(SB* src_buffer, TokenBuffer* tokens)
 /* TODO: SoA this*/
 static const struct RedKeyword red_keywords[] =
 {
+    { "align", TOKEN_ID_KEYWORD_ALIGN, },
     { "and", TOKEN_ID_KEYWORD_AND, },
+    { "anyframe", TOKEN_ID_KEYWORD_ANY_FRAME, },
+    { "async", TOKEN_ID_KEYWORD_ASYNC, },
+    { "await", TOKEN_ID_KEYWORD_AWAIT, },
+    { "comptime", TOKEN_ID_KEYWORD_COMPTIME, },
     { "const", TOKEN_ID_KEYWORD_CONST, },
     { "default", TOKEN_ID_KEYWORD_DEFAULT, },
     { "defer", TOKEN_ID_KEYWORD_DEFER, },
     { "else", TOKEN_ID_KEYWORD_ELSE, },
     { "enum", TOKEN_ID_KEYWORD_ENUM, },
+    { "export", TOKEN_ID_KEYWORD_EXPORT, },
     { "extern", TOKEN_ID_KEYWORD_EXTERN, },
     { "false", TOKEN_ID_KEYWORD_FALSE, },
     { "for", TOKEN_ID_KEYWORD_FOR, },
     { "if", TOKEN_ID_KEYWORD_IF, },
+    { "inline", TOKEN_ID_KEYWORD_INLINE, },
+    { "noalias", TOKEN_ID_KEYWORD_NO_ALIAS, },
+    { "noinline", TOKEN_ID_KEYWORD_NO_INLINE, },
     { "null", TOKEN_ID_KEYWORD_NULL, },
     { "or", TOKEN_ID_KEYWORD_OR, },
+    { "packed", TOKEN_ID_KEYWORD_PACKED, },
+    { "pub", TOKEN_ID_KEYWORD_PUB, },
     { "rawstring", TOKEN_ID_KEYWORD_RAW_STRING, },
+    { "resume", TOKEN_ID_KEYWORD_RESUME, },
     { "return", TOKEN_ID_KEYWORD_RETURN, },
     { "struct", TOKEN_ID_KEYWORD_STRUCT, },
+    { "suspend", TOKEN_ID_KEYWORD_SUSPEND, },
     { "switch", TOKEN_ID_KEYWORD_SWITCH, },
+    { "thread_local", TOKEN_ID_KEYWORD_THREAD_LOCAL, },
     { "true", TOKEN_ID_KEYWORD_TRUE, },
     { "undefined", TOKEN_ID_KEYWORD_UNDEFINED, },
     { "union", TOKEN_ID_KEYWORD_UNION, },
@@ -1228,13 +1242,15 @@ const char* token_name(TokenID id)
         case TOKEN_ID_FAT_ARROW: return "=>";
         case TOKEN_ID_FLOAT_LIT: return "FloatLiteral";
         case TOKEN_ID_INT_LIT: return "IntLiteral";
-        case TOKEN_ID_KEYWORD_ALIGN:
+        case TOKEN_ID_KEYWORD_ALIGN: return "align";
         case TOKEN_ID_KEYWORD_ALLOW_ZERO:
         case TOKEN_ID_KEYWORD_AND: return "and";
         case TOKEN_ID_KEYWORD_ANY:
-        case TOKEN_ID_KEYWORD_ANY_FRAME:
+        case TOKEN_ID_KEYWORD_ANY_FRAME: return "anyframe";
+        case TOKEN_ID_KEYWORD_ASYNC: return "async";
+        case TOKEN_ID_KEYWORD_AWAIT: return "await";
         case TOKEN_ID_KEYWORD_CALL_CONV:
-        case TOKEN_ID_KEYWORD_COMPTIME:
+        case TOKEN_ID_KEYWORD_COMPTIME: return "comptime";
         case TOKEN_ID_KEYWORD_CONST: return "const";
         case TOKEN_ID_KEYWORD_DEFAULT: return "default";
         case TOKEN_ID_KEYWORD_DEFER: return "defer";
@@ -1245,19 +1261,21 @@ const char* token_name(TokenID id)
         case TOKEN_ID_KEYWORD_FALSE: return "false";
         case TOKEN_ID_KEYWORD_FOR: return "for";
         case TOKEN_ID_KEYWORD_IF: return "if";
-        case TOKEN_ID_KEYWORD_INLINE:
-        case TOKEN_ID_KEYWORD_NO_ALIAS:
-        case TOKEN_ID_KEYWORD_NO_INLINE:
+        case TOKEN_ID_KEYWORD_INLINE: return "inline";
+        case TOKEN_ID_KEYWORD_NO_ALIAS: return "noalias";
+        case TOKEN_ID_KEYWORD_NO_INLINE: return "noinline";
         case TOKEN_ID_KEYWORD_NULL: "null";
         case TOKEN_ID_KEYWORD_OR: "or";
-        case TOKEN_ID_KEYWORD_PACKED: "packed";
+        case TOKEN_ID_KEYWORD_PACKED: return "packed";
         case TOKEN_ID_KEYWORD_PUB: return "pub";
+        case TOKEN_ID_KEYWORD_RESUME: return "resume";
         case TOKEN_ID_KEYWORD_RETURN: return "return";
         case TOKEN_ID_KEYWORD_SECTION: return "section";
         case TOKEN_ID_KEYWORD_STRUCT: return "struct";
+        case TOKEN_ID_KEYWORD_SUSPEND: return "suspend";
         case TOKEN_ID_KEYWORD_SWITCH: return "switch";
         case TOKEN_ID_KEYWORD_TEST: return "test";
-        case TOKEN_ID_KEYWORD_THREAD_LOCAL:
+        case TOKEN_ID_KEYWORD_THREAD_LOCAL: return "thread_local";
         case TOKEN_ID_KEYWORD_TRUE: return "true";
         case TOKEN_ID_KEYWORD_UNDEFINED: return "undefined";
         case TOKEN_ID_KEYWORD_UNION: return "union";
@@ -49,6 +49,16 @@ static inline bool token_is_binop_char(TokenID op)
                  op == TOKEN_ID_KEYWORD_AND;
     return is_it;
 }
+static inline bool token_is_comparison(TokenID op)
+{
+    bool is_it = op == TOKEN_ID_CMP_NOT_EQ ||
+                 op == TOKEN_ID_CMP_EQ ||
+                 op == TOKEN_ID_CMP_GREATER ||
+                 op == TOKEN_ID_CMP_GREATER_OR_EQ ||
+                 op == TOKEN_ID_CMP_LESS ||
+                 op == TOKEN_ID_CMP_LESS_OR_EQ;
+    return is_it;
+}
 static inline StringBuffer* token_buffer(Token* token)
 {
     if (!token)
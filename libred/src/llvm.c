@@ -1,8 +1,11 @@
 #include "llvm.h"
+#include "compiler.h"
 #include "compiler_types.h"
 #include "ir.h"
+#include "bigint.h"
 #include "os.h"
 
+#include <llvm/Config/llvm-config.h>
 #include <llvm-c/Core.h>
 #include <llvm-c/Analysis.h>
 #include <llvm-c/ExecutionEngine.h>
@@ -11,6 +14,9 @@
 #include <llvm-c/BitWriter.h>
 #include <llvm-c/DebugInfo.h>
 #include <llvm-c/Comdat.h>
+#include <llvm-c/IRReader.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/Support.h>
 #include <llvm-c/Transforms/PassManagerBuilder.h>
 #include <llvm-c/Transforms/AggressiveInstCombine.h>
 #include <llvm-c/Transforms/Coroutines.h>
@@ -22,8 +28,11 @@
 
 #include "microsoft_craziness.h"
 #include "lld.h"
+#include "profile.h"
+#include "target.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 typedef struct TypeDeclarationLLVM TypeDeclarationLLVM;
 
@@ -62,13 +71,46 @@ typedef struct LocalStringLLVM
     LLVMValueRef value;
 } LocalStringLLVM;
 
+// Pool entry: every literal gets its own global while the functions are generated; llvm_merge_string_tails folds them afterwards
+typedef struct PooledStringLLVM
+{
+    SB* str;
+    LLVMValueRef global;
+} PooledStringLLVM;
+
+// How a parameter or the return value crosses the call. Coerced structs travel in one or two registers as coerce_type, indirect ones through a pointer:
+// sret for the return value, a byval copy for C params or a pointer to the caller's temporary for Red ones
+typedef enum ABIArgKindLLVM
+{
+    ABI_ARG_DIRECT,
+    ABI_ARG_COERCE,
+    ABI_ARG_INDIRECT,
+} ABIArgKindLLVM;
+
+typedef struct ABIArgLLVM
+{
+    ABIArgKindLLVM kind;
+    LLVMTypeRef coerce_type;
+    bool by_val;
+    u8 int_register_count;
+    u8 sse_register_count;
+} ABIArgLLVM;
+
+typedef struct FnABILLVM
+{
+    ABIArgLLVM params[MAX_PARAM_COUNT];
+    ABIArgLLVM ret;
+} FnABILLVM;
+
 typedef struct FnProtoLLVM
 {
     struct
     {
         LLVMMetadataRef param_types[MAX_PARAM_COUNT];
     } debug;
-    LLVMTypeRef param_types[MAX_PARAM_COUNT];
+    FnABILLVM abi;
+    // LLVM signature: with an sret pointer first when the return value is indirect
+    LLVMTypeRef param_types[MAX_PARAM_COUNT + 1];
     LLVMTypeRef return_type;
     LLVMTypeRef fn_type;
     LLVMValueRef handle;
@@ -79,6 +121,8 @@ GEN_BUFFER_STRUCT(LLVMValueRef)
 GEN_BUFFER_FUNCTIONS(llvm_value, vb, LLVMValueRefBuffer, LLVMValueRef)
 GEN_BUFFER_STRUCT(LocalStringLLVM)
 GEN_BUFFER_FUNCTIONS(local_str, lsb, LocalStringLLVMBuffer, LocalStringLLVM)
+GEN_BUFFER_STRUCT(PooledStringLLVM)
+GEN_BUFFER_FUNCTIONS(pooled_str, psb, PooledStringLLVMBuffer, PooledStringLLVM)
 GEN_BUFFER_STRUCT(FnProtoLLVM)
 GEN_BUFFER_FUNCTIONS(llvm_fn_proto, llvm_fpb, FnProtoLLVMBuffer, FnProtoLLVM)
 GEN_BUFFER_STRUCT(LLVMTypeRef)
@@ -92,13 +136,26 @@ typedef struct TypeDeclarationLLVM
 GEN_BUFFER_STRUCT(TypeDeclarationLLVM)
 GEN_BUFFER_FUNCTIONS(llvm_type_decl, ltb, TypeDeclarationLLVMBuffer, TypeDeclarationLLVM)
 
+// Async functions only. The promise is { awaiter, result }: the frame to resume when this one finishes and the value it returns.
+// Suspending jumps to suspend_block, which returns the handle to whoever called or resumed the coroutine
+typedef struct CoroutineLLVM
+{
+    LLVMValueRef id;
+    LLVMValueRef handle;
+    LLVMValueRef promise;
+    LLVMBasicBlockRef final_block;
+    LLVMBasicBlockRef cleanup_block;
+    LLVMBasicBlockRef suspend_block;
+} CoroutineLLVM;
+
 typedef struct CurrentFnLLVM
 {
-    LLVMValueRef param_array[MAX_PARAM_COUNT];
+    LLVMValueRef param_array[MAX_PARAM_COUNT + 1];
     LLVMValueRef param_alloca_array[MAX_PARAM_COUNT];
     LLVMValueRefBuffer alloca_buffer;
     LocalStringLLVMBuffer local_string_buffer;
     FnProtoLLVM* proto;
+    CoroutineLLVM coro;
     bool return_already_emitted;
 } CurrentFnLLVM;
 
@@ -118,17 +175,117 @@ typedef struct ModuleContext
     TypeDeclarationLLVMBuffer type_declarations;
     LLVMValueRefBuffer global_sym_buffer;
     FnProtoLLVMBuffer fn_proto_buffer;
+    // Every string literal of the module, emitted once
+    PooledStringLLVMBuffer string_pool;
+    const char* target_features;
+    LLVMThreadLocalMode tls_mode;
+    // alwaysinline must be honored at -O0 too
+    bool has_always_inline;
+    // Nothing runs the loop passes at -O0
+    bool has_loop_hints;
+    // The coroutine passes split async functions and lower the llvm.coro intrinsics, at every optimization level
+    bool has_coroutines;
 } ModuleContext;
 
 typedef struct TargetLLVM
 {
     LLVMTargetRef handle;
     char* triple;
+    const char* cpu;
+    const char* features;
+    LLVMCodeGenOptLevel opt_level;
+    LLVMThreadLocalMode tls_mode;
     LLVMTargetMachineRef machine;
     LLVMTargetDataRef data;
 } TargetLLVM;
 
 static inline void llvm_verify_function(LLVMValueRef fn, const char* type, bool silent);
+
+static inline LLVMMetadataRef llvm_loop_hint_node(LLVMContextRef context, const char* name, LLVMValueRef value)
+{
+    LLVMMetadataRef operands[] = { LLVMMDStringInContext2(context, name, strlen(name)), LLVMValueAsMetadata(value), };
+    return LLVMMDNodeInContext2(context, operands, array_length(operands));
+}
+
+// The loop ID must be distinct and point to itself. The C API can't create distinct nodes, so the first operand starts as a temporary and the
+// replacement turns the node into a self-referencing (hence distinct) one
+static inline void llvm_set_loop_hints(LLVMContextRef context, ModuleContext* module, LLVMValueRef latch_branch, LoopHints* hints)
+{
+    LLVMValueRef i1_true = LLVMConstInt(LLVMInt1TypeInContext(context), 1, false);
+    LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+    LLVMMetadataRef operands[5];
+    u32 operand_count = 1;
+    if (hints->no_unroll)
+    {
+        LLVMMetadataRef disable = LLVMMDStringInContext2(context, "llvm.loop.unroll.disable", strlen("llvm.loop.unroll.disable"));
+        operands[operand_count++] = LLVMMDNodeInContext2(context, &disable, 1);
+    }
+    if (hints->unroll_count)
+    {
+        operands[operand_count++] = llvm_loop_hint_node(context, "llvm.loop.unroll.count", LLVMConstInt(i32_type, hints->unroll_count, false));
+    }
+    if (hints->vectorize_width)
+    {
+        operands[operand_count++] = llvm_loop_hint_node(context, "llvm.loop.vectorize.width", LLVMConstInt(i32_type, hints->vectorize_width, false));
+        if (hints->vectorize_width > 1)
+        {
+            operands[operand_count++] = llvm_loop_hint_node(context, "llvm.loop.vectorize.enable", i1_true);
+        }
+    }
+    if (hints->interleave_count)
+    {
+        operands[operand_count++] = llvm_loop_hint_node(context, "llvm.loop.interleave.count", LLVMConstInt(i32_type, hints->interleave_count, false));
+    }
+    if (operand_count == 1)
+    {
+        return;
+    }
+
+    LLVMMetadataRef self = LLVMTemporaryMDNode(context, null, 0);
+    operands[0] = self;
+    LLVMMetadataRef loop_id = LLVMMDNodeInContext2(context, operands, operand_count);
+    LLVMMetadataReplaceAllUsesWith(self, loop_id);
+    LLVMSetMetadata(latch_branch, LLVMGetMDKindIDInContext(context, "llvm.loop", strlen("llvm.loop")), LLVMMetadataAsValue(context, loop_id));
+    module->has_loop_hints = true;
+}
+static inline FnProtoLLVM llvm_gen_fn_proto(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto);
+
+// Index of the field in the LLVM struct, counting the padding elements llvm_gen_struct_type() inserts
+static inline u32 llvm_struct_element_index(IRStructDecl* struct_decl, u32 field_index)
+{
+    if (!struct_decl->has_explicit_layout)
+    {
+        return field_index;
+    }
+
+    u32 element_index = 0;
+    usize offset = 0;
+    for (u32 i = 0; i < field_index; i++)
+    {
+        IRFieldDecl* field = &struct_decl->fields[i];
+        element_index += field->offset > offset ? 2 : 1;
+        offset = field->offset + field->type.size;
+    }
+
+    return element_index + (struct_decl->fields[field_index].offset > offset);
+}
+
+// Alignment to set on globals and allocas. 0 leaves the ABI alignment of the LLVM type, which is only wrong for packed LLVM structs and arrays of them
+static inline u32 llvm_sym_alignment(IRSymDeclStatement* sym_decl)
+{
+    u32 alignment = sym_decl->alignment;
+    if (ir_type_has_explicit_layout(&sym_decl->type))
+    {
+        u32 type_alignment = ir_type_alignment(&sym_decl->type);
+        if (type_alignment > alignment)
+        {
+            alignment = type_alignment;
+        }
+    }
+
+    return alignment;
+}
+
 static inline void llvm_debug_fn(LLVMValueRef fn)
 {
     print("Debugging function\n\n%s\n\n", LLVMPrintValueToString(fn));
@@ -152,6 +309,84 @@ static inline LocalStringLLVM* find_local_string(LocalStringLLVMBuffer* local_st
     return null;
 }
 
+static inline bool sb_ends_with(SB* str, SB* suffix)
+{
+    return sb_len(str) >= sb_len(suffix) && memcmp(sb_ptr(str) + sb_len(str) - sb_len(suffix), sb_ptr(suffix), sb_len(suffix)) == 0;
+}
+
+static inline LLVMValueRef llvm_string_pointer(LLVMContextRef context, LLVMValueRef global, u64 offset)
+{
+    LLVMValueRef indices[2] =
+    {
+        LLVMConstNull(LLVMInt32TypeInContext(context)),
+        LLVMConstInt(LLVMInt32TypeInContext(context), offset, false),
+    };
+    return LLVMConstInBoundsGEP(global, indices, array_length(indices));
+}
+
+// Each literal gets a private unnamed_addr global. Sharing is left to llvm_merge_string_tails, once no generated value refers to them anymore
+static inline LLVMValueRef llvm_gen_string_literal(LLVMContextRef context, ModuleContext* module, SB* str)
+{
+    LLVMValueRef string_constant = LLVMConstStringInContext(context, sb_ptr(str), sb_len(str), false);
+    LLVMValueRef global = LLVMAddGlobal(module->handle, LLVMTypeOf(string_constant), "str");
+    LLVMSetInitializer(global, string_constant);
+    LLVMSetGlobalConstant(global, true);
+    LLVMSetLinkage(global, LLVMPrivateLinkage);
+    LLVMSetUnnamedAddress(global, LLVMGlobalUnnamedAddr);
+    LLVMSetAlignment(global, 1);
+
+    pooled_str_append(&module->string_pool, (const PooledStringLLVM) { .str = str, .global = global });
+    return llvm_string_pointer(context, global, 0);
+}
+
+// Orders by the reversed contents, greatest first, so a literal comes right after the longer ones it is a tail of
+static int llvm_pooled_string_cmp(const void* a, const void* b)
+{
+    SB* left = ((const PooledStringLLVM*)a)->str;
+    SB* right = ((const PooledStringLLVM*)b)->str;
+    usize left_len = sb_len(left);
+    usize right_len = sb_len(right);
+    usize len = left_len < right_len ? left_len : right_len;
+    for (usize i = 1; i <= len; i++)
+    {
+        u8 l = (u8)sb_ptr(left)[left_len - i];
+        u8 r = (u8)sb_ptr(right)[right_len - i];
+        if (l != r)
+        {
+            return l > r ? -1 : 1;
+        }
+    }
+
+    return (left_len < right_len) - (left_len > right_len);
+}
+
+// Identical literals and literals that end a longer one point into a single global. Run after every function of the module is generated:
+// replacing a global destroys the constant expressions built on it, which are only safe to drop once codegen holds none of them.
+// Across modules the linker merges them (ELF string sections), and with --lto the constant merge pass does
+static inline void llvm_merge_string_tails(LLVMContextRef context, ModuleContext* module)
+{
+    PooledStringLLVMBuffer* pool = &module->string_pool;
+    qsort(pool->ptr, pool->len, sizeof(PooledStringLLVM), llvm_pooled_string_cmp);
+
+    PooledStringLLVM* root = null;
+    for (u32 i = 0; i < pool->len; i++)
+    {
+        PooledStringLLVM* pooled = &pool->ptr[i];
+        // Whatever the previous entry is a tail of, root ends with it too, so one comparison finds every tail
+        if (root && sb_ends_with(root->str, pooled->str))
+        {
+            u64 offset = sb_len(root->str) - sb_len(pooled->str);
+            LLVMReplaceAllUsesWith(pooled->global, LLVMConstBitCast(llvm_string_pointer(context, root->global, offset), LLVMTypeOf(pooled->global)));
+            LLVMDeleteGlobal(pooled->global);
+            pooled->global = root->global;
+        }
+        else
+        {
+            root = pooled;
+        }
+    }
+}
+
 static inline LLVMTypeRef llvm_gen_type(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRType* type)
 {
     if (type)
@@ -167,8 +402,9 @@ static inline LLVMTypeRef llvm_gen_type(LLVMContextRef context, ModuleContext* m
             }
             case TYPE_KIND_ARRAY:
             {
-                LLVMTypeRef base_type = llvm_gen_type(context, module, ir_module, type->array_type.base_type);
-                IRExpression* elem_count = type->array_type.elem_count_expr;
+                IRArrayType* ir_array_type = &type->array_type;
+                LLVMTypeRef base_type = llvm_gen_type(context, module, ir_module, ir_array_type->base_type);
+                IRExpression* elem_count = ir_array_type->elem_count_expr;
                 IRExpressionType type = elem_count->type;
                 u64 arr_elem_count;
                 switch (type)
@@ -182,9 +418,25 @@ static inline LLVMTypeRef llvm_gen_type(LLVMContextRef context, ModuleContext* m
                         RED_NOT_IMPLEMENTED;
                         return null;
                 }
+                if (ir_array_type->is_soa)
+                {
+                    // { [N x field0], [N x field1], ... }, so a loop over one field walks contiguous memory
+                    IRStructDecl* struct_decl = ir_array_type->base_type->struct_type;
+                    LLVMTypeRef* field_arrays = NEW(LLVMTypeRef, struct_decl->field_count);
+                    for (u32 i = 0; i < struct_decl->field_count; i++)
+                    {
+                        field_arrays[i] = LLVMArrayType(llvm_gen_type(context, module, ir_module, &struct_decl->fields[i].type), arr_elem_count);
+                    }
+                    return LLVMStructTypeInContext(context, field_arrays, struct_decl->field_count, false);
+                }
                 LLVMTypeRef array_type = LLVMArrayType(base_type, arr_elem_count);
                 return array_type;
             }
+            case TYPE_KIND_VECTOR:
+            {
+                IRVectorType* ir_vector_type = &type->vector_type;
+                return LLVMVectorType(llvm_primitive_types[ir_vector_type->element_type], ir_vector_type->element_count);
+            }
             case TYPE_KIND_STRUCT:
             {
                 if (type->struct_type)
@@ -221,6 +473,12 @@ static inline LLVMTypeRef llvm_gen_type(LLVMContextRef context, ModuleContext* m
                 LLVMTypeRef string_type = LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0);
                 return string_type;
             }
+            case TYPE_KIND_FRAME:
+            {
+                // The coroutine handle the llvm.coro intrinsics work with
+                LLVMTypeRef frame_type = LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0);
+                return frame_type;
+            }
             default:
                 RED_NOT_IMPLEMENTED;
                 return null;
@@ -280,965 +538,3699 @@ static inline bool llvm_verify_module(LLVMModuleRef module)
     return !errors;
 }
 
-// add extra checks
-// This works both for fn call expression and fn call statement
-static inline LLVMValueRef llvm_gen_fn_call(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRFunctionCallExpr* fn_call)
+// extern functions, exported ones and main are called from C. The rest are only called from Red code, so they can use fastcc
+static inline bool llvm_fn_has_c_abi(IRFunctionPrototype* ir_proto)
 {
-    redassert(sizeof(IRFunctionCallExpr) == sizeof(IRFunctionCallStatement));
-    IRModule* ref_module = fn_call->fn->module;
-    if (ref_module != ir_module)
+    return !ir_proto->has_body || ir_proto->attributes.visibility == VISIBILITY_EXPORT || strequal(sb_ptr(ir_proto->name), "main");
+}
+
+// Works on functions and on calls
+static inline void llvm_add_int_attribute(LLVMContextRef context, LLVMValueRef value, LLVMAttributeIndex index, const char* name, u64 int_value)
+{
+    u32 kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+    redassert(kind);
+    LLVMAttributeRef attribute = LLVMCreateEnumAttribute(context, kind, int_value);
+    if (LLVMIsACallInst(value))
+    {
+        LLVMAddCallSiteAttribute(value, index, attribute);
+    }
+    else
     {
-        RED_NOT_IMPLEMENTED;
+        LLVMAddAttributeAtIndex(value, index, attribute);
     }
-    LLVMValueRef fn = LLVMGetNamedFunction(module->handle, sb_ptr(fn_call->fn->name)); // <- @this is bullshit
+}
 
-    LLVMValueRef arg_values[256];
-    LLVMValueRef* arg_ptr = fn_call->arg_count > 0 ? arg_values : NULL;
-    for (u32 i = 0; i < fn_call->arg_count; i++)
+static inline void llvm_add_enum_attribute(LLVMContextRef context, LLVMValueRef fn, LLVMAttributeIndex index, const char* name)
+{
+    llvm_add_int_attribute(context, fn, index, name, 0);
+}
+
+// sret and byval are type attributes since LLVM 12: they carry the type the pointer param points to. Up to LLVM 11 they are plain enum
+// attributes and the pointee type is implied
+static inline void llvm_add_type_attribute(LLVMContextRef context, LLVMValueRef value, LLVMAttributeIndex index, const char* name)
+{
+#if LLVM_VERSION_MAJOR >= 12
+    u32 kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+    redassert(kind);
+    bool is_call = LLVMIsACallInst(value) != null;
+    LLVMTypeRef fn_type = is_call ? LLVMGetCalledFunctionType(value) : LLVMGlobalGetValueType(value);
+    LLVMTypeRef param_types[MAX_PARAM_COUNT + 1];
+    LLVMGetParamTypes(fn_type, param_types);
+    LLVMAttributeRef attribute = LLVMCreateTypeAttribute(context, kind, LLVMGetElementType(param_types[index - 1]));
+    if (is_call)
     {
-        redassert(i < 256);
-        IRExpression* arg_expr = &fn_call->args[i];
-        arg_values[i] = llvm_gen_expression(context, module, ir_module, current_fn, arg_expr, NULL);
+        LLVMAddCallSiteAttribute(value, index, attribute);
     }
-    LLVMValueRef fn_call_value = LLVMBuildCall(module->builder, fn, arg_ptr, fn_call->arg_count, sb_ptr(fn_call->fn->name));
-    return fn_call_value;
+    else
+    {
+        LLVMAddAttributeAtIndex(value, index, attribute);
+    }
+#else
+    llvm_add_enum_attribute(context, value, index, name);
+#endif
 }
 
-static inline LLVMValueRef llvm_gen_expression(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRExpression* expression, IRType* expected_type)
+// x86-64 System V classes in merge order: an eightbyte with no fields takes the class of the rest, INTEGER wins over SSE and MEMORY over everything
+typedef enum ABIClassLLVM
 {
-    IRExpressionType type = expression->type;
-    switch (type)
+    ABI_CLASS_NONE,
+    ABI_CLASS_SSE,
+    ABI_CLASS_INTEGER,
+    ABI_CLASS_MEMORY,
+} ABIClassLLVM;
+
+typedef struct ABIEightbytesLLVM
+{
+    ABIClassLLVM classes[2];
+    // SSE eightbytes holding only f32 go as <2 x float> or float instead of double
+    bool f32_only[2];
+} ABIEightbytesLLVM;
+
+static inline void llvm_abi_merge(ABIEightbytesLLVM* eightbytes, usize offset, usize size, ABIClassLLVM abi_class, bool is_f32)
+{
+    for (usize i = offset / 8; i <= (offset + size - 1) / 8 && i < array_length(eightbytes->classes); i++)
     {
-        case IR_EXPRESSION_TYPE_BIN_EXPR:
+        if (abi_class > eightbytes->classes[i])
         {
-            IRBinaryExpr* bin_expr = &expression->bin_expr;
-            LLVMValueRef left = llvm_gen_expression(context, module, ir_module, current_fn, bin_expr->left, NULL);
-            LLVMValueRef right = llvm_gen_expression(context, module, ir_module, current_fn, bin_expr->right, NULL);
-            TokenID op = bin_expr->op;
+            eightbytes->classes[i] = abi_class;
+        }
+        eightbytes->f32_only[i] = eightbytes->f32_only[i] && is_f32;
+    }
+}
 
-            switch (op)
+// Misaligned fields, which only packed structs have, send the whole struct to memory
+static inline void llvm_abi_classify_type(ABIEightbytesLLVM* eightbytes, IRType* type, usize offset)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_PRIMITIVE:
+        {
+            IRTypePrimitive primitive_type = type->primitive_type;
+            bool is_sse = primitive_type == IR_TYPE_PRIMITIVE_F32 || primitive_type == IR_TYPE_PRIMITIVE_F64;
+            // f128 is SSE + SSEUP, which only a 16-byte register holds
+            bool is_memory = primitive_type == IR_TYPE_PRIMITIVE_F128 || offset % type->size;
+            llvm_abi_merge(eightbytes, offset, type->size, is_memory ? ABI_CLASS_MEMORY : (is_sse ? ABI_CLASS_SSE : ABI_CLASS_INTEGER), primitive_type == IR_TYPE_PRIMITIVE_F32);
+            break;
+        }
+        case TYPE_KIND_ENUM:
+            llvm_abi_classify_type(eightbytes, &type->enum_type->type, offset);
+            break;
+        case TYPE_KIND_POINTER:
+        case TYPE_KIND_RAW_STRING:
+        case TYPE_KIND_FRAME:
+            llvm_abi_merge(eightbytes, offset, 8, offset % 8 ? ABI_CLASS_MEMORY : ABI_CLASS_INTEGER, false);
+            break;
+        case TYPE_KIND_VECTOR:
+        {
+            IRTypePrimitive element_type = type->vector_type.element_type;
+            // Boolean vectors are bitmasks in memory
+            bool is_memory = element_type == IR_TYPE_PRIMITIVE_BOOL || offset % type->size;
+            llvm_abi_merge(eightbytes, offset, type->size, is_memory ? ABI_CLASS_MEMORY : ABI_CLASS_SSE, element_type == IR_TYPE_PRIMITIVE_F32);
+            break;
+        }
+        case TYPE_KIND_STRUCT:
+        {
+            IRStructDecl* struct_decl = type->struct_type;
+            for (u32 i = 0; i < struct_decl->field_count; i++)
             {
-                case TOKEN_ID_CMP_LESS:
-                    return LLVMBuildICmp(module->builder, LLVMIntSLT, left, right, "slt");
-                case TOKEN_ID_CMP_GREATER:
-                    return LLVMBuildICmp(module->builder, LLVMIntSGT, left, right, "sgt");
-                case TOKEN_ID_CMP_EQ:
-                    return LLVMBuildICmp(module->builder, LLVMIntEQ, left, right, "eq");
-                case TOKEN_ID_PLUS:
-                    return LLVMBuildAdd(module->builder, left, right, "add");
-                case TOKEN_ID_DASH:
-                    return LLVMBuildSub(module->builder, left, right, "sub");
-                case TOKEN_ID_STAR:
-                    return LLVMBuildMul(module->builder, left, right, "mul");
-                case TOKEN_ID_SLASH:
-                    // TODO: which division we want to perform
-                    return LLVMBuildExactSDiv(module->builder, left, right, "exact_div");
-                default:
-                    RED_NOT_IMPLEMENTED;
-                    break;
+                IRFieldDecl* field = &struct_decl->fields[i];
+                llvm_abi_classify_type(eightbytes, &field->type, offset + field->offset);
             }
             break;
         }
-        case IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS:
+        case TYPE_KIND_ARRAY:
         {
-            IRSubscriptAccess* subscript_access = &expression->subscript_access;
-            IRSymbolSubscriptType subs_type = subscript_access->subscript_type;
-            TypeKind data_type = subscript_access->parent.type;
-            switch (subs_type)
+            IRType* base_type = type->array_type.base_type;
+            if (type->array_type.is_soa || !base_type->size)
             {
-                case AST_SYMBOL_SUBSCRIPT_TYPE_FIELD_ACCESS:
-                {
-                    switch (data_type)
-                    {
-                        case TYPE_KIND_STRUCT:
-                        {
-                            IRFieldDecl* field_ptr = subscript_access->parent.struct_p->fields;
-                            u32 field_count = subscript_access->parent.struct_p->field_count;
-
-                            if (field_count > 0)
-                            {
-                                for (u32 i = 0; i < field_count; i++)
-                                {
-                                    IRFieldDecl* field = &field_ptr[i];
-                                    if (sb_cmp(field->name, subscript_access->name))
-                                    {
-                                        return LLVMConstInt(LLVMInt32TypeInContext(context), i, false);
-                                    }
-                                }
-                            }
-                            RED_NOT_IMPLEMENTED;
-                            break;
-                        }
-                        default:
-                            RED_NOT_IMPLEMENTED;
-                            break;
-                    }
-                }
-                default:
-                    RED_NOT_IMPLEMENTED;
-                    break;
+                llvm_abi_merge(eightbytes, offset, type->size, ABI_CLASS_MEMORY, false);
+                break;
             }
-            if (subscript_access->subscript)
+            for (usize element_offset = 0; element_offset < type->size; element_offset += base_type->size)
             {
-                llvm_gen_expression(context, module, ir_module, current_fn, subscript_access->subscript, NULL);
+                llvm_abi_classify_type(eightbytes, base_type, offset + element_offset);
             }
-            return null;
+            break;
         }
-        case IR_EXPRESSION_TYPE_SYM_EXPR:
+        default:
+            llvm_abi_merge(eightbytes, offset, type->size ? type->size : 1, ABI_CLASS_MEMORY, false);
+            break;
+    }
+}
+
+static inline LLVMTypeRef llvm_abi_eightbyte_type(LLVMContextRef context, ABIEightbytesLLVM* eightbytes, u32 index, usize size)
+{
+    usize byte_count = size - index * 8 < 8 ? size - index * 8 : 8;
+    if (eightbytes->classes[index] == ABI_CLASS_SSE)
+    {
+        LLVMTypeRef f32_type = llvm_primitive_types[IR_TYPE_PRIMITIVE_F32];
+        if (!eightbytes->f32_only[index])
         {
-            IRSymExpr* sym_expr = &expression->sym_expr;
-            IRSymExprType se_type = sym_expr->type;
-            IRExpression* subscript = sym_expr->subscript;
-            if (subscript)
-            {
-                IRSymbolSubscriptType subscript_type = sym_expr->subscript->subscript_access.subscript_type;
-                switch (subscript_type)
-                {
-                    case AST_SYMBOL_SUBSCRIPT_TYPE_ARRAY_ACCESS:
-                    {
-                        //RedType base_type = ast_to_ir_find_expression_type(expression);
-                        switch (se_type)
-                        {
-                            case IR_SYM_EXPR_TYPE_PARAM:
-                                RED_NOT_IMPLEMENTED;
-                                return null;
-                            case IR_SYM_EXPR_TYPE_SYM:
-                            {
-                                IRSymDeclStatement* sym = sym_expr->sym_decl;
-                                IRSymDeclStatement* base_ptr = current_fn->sym_declarations.ptr;
-                                u32 index = sym - base_ptr;
-                                LLVMValueRef arr_alloca = module->current_fn->alloca_buffer.ptr[index];
-                                LLVMValueRef zero = LLVMConstInt(LLVMIntTypeInContext(context, 32), 0, true);
-                                LLVMValueRef index_value = llvm_gen_expression(context, module, ir_module, current_fn, sym_expr->subscript, NULL);
-                                LLVMValueRef indices[2] =
-                                {
-                                    zero,
-                                    index_value,
-                                };
-                                //LLVMTypeRef llvm_base_type = llvm_gen_type(llvm, &base_type);
-                                ;
-                                //array_subscript_value = LLVMBuildInBoundsGEP2(llvm->builder, llvm_base_type, arr_alloca, indices, array_length(indices), "arr_subscript_access");
-                                LLVMValueRef array_subscript_value = LLVMBuildInBoundsGEP(module->builder, arr_alloca, indices, array_length(indices), "arridxaccess");
-                                switch (sym_expr->use_type)
-                                {
-                                    case LOAD:
-                                        return LLVMBuildLoad(module->builder, array_subscript_value, "arridxload");
-                                    case STORE:
-                                        // The store takes place in the assign statement
-                                        // TODO: this probably is buggy
-                                        return array_subscript_value;
-                                    default:
-                                        RED_NOT_IMPLEMENTED;
-                                        return null;
-                                }
-                            }
-                            default:
-                                RED_NOT_IMPLEMENTED;
-                                return null;
-                        }
-                    }
-                    case AST_SYMBOL_SUBSCRIPT_TYPE_FIELD_ACCESS:
-                        switch (se_type)
-                        {
-                            case IR_SYM_EXPR_TYPE_SYM:
-                            {
-                                IRSymDeclStatement* sym = sym_expr->sym_decl;
-                                IRSymDeclStatement* base_ptr = current_fn->sym_declarations.ptr;
-                                u32 index = sym - base_ptr;
-                                LLVMValueRef alloca = module->current_fn->alloca_buffer.ptr[index];
-                                LLVMValueRef zero = LLVMConstInt(LLVMIntTypeInContext(context, 32), 0, true);
-                                LLVMValueRef index_value = llvm_gen_expression(context, module, ir_module, current_fn, sym_expr->subscript, NULL);
-                                LLVMValueRef indices[2] =
-                                {
-                                    zero,
-                                    index_value,
-                                };
+            return llvm_primitive_types[IR_TYPE_PRIMITIVE_F64];
+        }
+        return byte_count <= 4 ? f32_type : LLVMVectorType(f32_type, 2);
+    }
 
-                                return LLVMBuildInBoundsGEP(module->builder, alloca, indices, array_length(indices), "struct_field_access");
-                            }
-                            case IR_SYM_EXPR_TYPE_ENUM:
-                            {
-                                IREnumDecl* enum_decl = sym_expr->enum_decl;
-                                redassert(enum_decl->type.kind == TYPE_KIND_PRIMITIVE);
-                                IRTypePrimitive primitive_type = enum_decl->type.primitive_type;
-                                // TODO: we should put this before LLVM Codegen
-                                // TODO: even better: for enums, don't store names but the value
-                                SB* field_name = sym_expr->subscript->subscript_access.name;
+    return LLVMIntTypeInContext(context, (u32)byte_count * 8);
+}
 
-                                u32 field_count = enum_decl->fields.len;
-                                IREnumField* field_ptr = enum_decl->fields.ptr;
-                                for (u32 i = 0; i < field_count; i++)
-                                {
-                                    IREnumField* field = &field_ptr[i];
-                                    if (sb_cmp(field->name, field_name))
-                                    {
-                                        switch (primitive_type)
-                                        {
-                                            case IR_TYPE_PRIMITIVE_U32:
-                                                return LLVMConstInt(llvm_primitive_types[IR_TYPE_PRIMITIVE_U32], field->value.unsigned64, false);
-                                            default:
-                                                RED_NOT_IMPLEMENTED;
-                                                break;
-                                        }
-                                    }
-                                }
-                            }
-                            default:
-                                RED_NOT_IMPLEMENTED;
-                                break;
-                        }
-                        RED_NOT_IMPLEMENTED;
-                        return null;
-                    default:
-                        RED_NOT_IMPLEMENTED;
-                        return null;
-                }
-                RED_NOT_IMPLEMENTED;
-                return null;
-            }
-            else
-            {
-                switch (se_type)
-                {
-                    case IR_SYM_EXPR_TYPE_PARAM:
-                    {
-                        IRParamDecl* param = sym_expr->param_decl;
-                        u8 index = (u8)(param - current_fn->proto->params);
-                        switch (sym_expr->use_type)
-                        {
-                            case LOAD:
-                                return LLVMBuildLoad(module->builder, module->current_fn->param_alloca_array[index], sb_ptr(param->name));
-                            case STORE:
-                                //return LLVMBuildStore(module->builder, llvm->llvm_current_fn->param_arr[index], llvm->llvm_current_fn->param_alloca_array[index]);
-                                return module->current_fn->param_alloca_array[index];
-                                break;
-                            default:
-                                RED_NOT_IMPLEMENTED;
-                                break;
-                        }
-                    }
-                    case IR_SYM_EXPR_TYPE_SYM:
-                    {
-                        IRSymDeclStatement* sym = sym_expr->sym_decl;
-                        if (sym->type.kind == TYPE_KIND_RAW_STRING)
-                        {
-                            LocalStringLLVM* local_string = find_local_string(&module->current_fn->local_string_buffer, sym);
-                            redassert(local_string);
-                            return local_string->value;
-                        }
-                        else
-                        {
-                            IRSymDeclStatement* base_ptr = current_fn->sym_declarations.ptr;
-                            u64 index = sym - base_ptr;
+// x86-64 System V: a struct of up to 16 bytes goes in one register per eightbyte, INTEGER ones in general purpose registers and SSE ones in xmm
+// registers. Bigger structs and the ones with a field no register can hold go in memory
+static inline ABIArgLLVM llvm_abi_classify(LLVMContextRef context, IRType* type)
+{
+    ABIArgLLVM arg = ZERO_INIT;
+    if (type->kind != TYPE_KIND_STRUCT || !type->size)
+    {
+        arg.kind = ABI_ARG_DIRECT;
+        return arg;
+    }
+    if (type->size > 16)
+    {
+        arg.kind = ABI_ARG_INDIRECT;
+        return arg;
+    }
 
-                            switch (sym_expr->use_type)
-                            {
-                                case LOAD:
-                                    return LLVMBuildLoad(module->builder, module->current_fn->alloca_buffer.ptr[index], sb_ptr(sym->name));
-                                case STORE:
-                                    return module->current_fn->alloca_buffer.ptr[index];
-                                default:
-                                    RED_NOT_IMPLEMENTED;
-                                    return null;
-                            }
-                        }
-                    }
-                    case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
-                    {
-                        IRSymDeclStatement* global_sym = sym_expr->global_sym_decl;
-                        IRSymDeclStatement* base_ptr = ir_module->global_sym_decls.ptr;
-                        u64 index = global_sym - base_ptr;
+    ABIEightbytesLLVM eightbytes = { .f32_only = { true, true } };
+    llvm_abi_classify_type(&eightbytes, type, 0);
+    if (eightbytes.classes[0] == ABI_CLASS_MEMORY || eightbytes.classes[1] == ABI_CLASS_MEMORY)
+    {
+        arg.kind = ABI_ARG_INDIRECT;
+        return arg;
+    }
 
-                        switch (sym_expr->use_type)
-                        {
-                            case LOAD:
-                                return LLVMBuildLoad(module->builder, module->global_sym_buffer.ptr[index], sb_ptr(global_sym->name));
-                                /* TODO: probably buggy */
-                            case STORE:
-                                return module->global_sym_buffer.ptr[index];
-                            default:
-                                RED_NOT_IMPLEMENTED;
-                                return null;
-                        }
-                    }
-                    default:
-                        RED_NOT_IMPLEMENTED;
-                        break;
-                }
-            }
+    arg.kind = ABI_ARG_COERCE;
+    IRStructDecl* struct_decl = type->struct_type;
+    IRType* first_field_type = &struct_decl->fields[0].type;
+    // A 16-byte vector alone is SSE + SSEUP: a single xmm register
+    if (struct_decl->field_count == 1 && first_field_type->kind == TYPE_KIND_VECTOR && first_field_type->size == 16)
+    {
+        arg.coerce_type = LLVMVectorType(llvm_primitive_types[first_field_type->vector_type.element_type], first_field_type->vector_type.element_count);
+        arg.sse_register_count = 1;
+        return arg;
+    }
+
+    LLVMTypeRef eightbyte_types[2];
+    u32 eightbyte_count = type->size > 8 && eightbytes.classes[1] != ABI_CLASS_NONE ? 2 : 1;
+    for (u32 i = 0; i < eightbyte_count; i++)
+    {
+        eightbyte_types[i] = llvm_abi_eightbyte_type(context, &eightbytes, i, type->size);
+        if (eightbytes.classes[i] == ABI_CLASS_SSE)
+        {
+            arg.sse_register_count++;
+        }
+        else
+        {
+            arg.int_register_count++;
+        }
+    }
+    arg.coerce_type = eightbyte_count == 1 ? eightbyte_types[0] : LLVMStructTypeInContext(context, eightbyte_types, eightbyte_count, false);
+
+    return arg;
+}
+
+// Microsoft x64: structs of 1, 2, 4 or 8 bytes go in an integer register, the rest through a pointer to a copy the caller makes
+static inline ABIArgLLVM llvm_abi_classify_win64(LLVMContextRef context, IRType* type)
+{
+    ABIArgLLVM arg = ZERO_INIT;
+    if (type->kind != TYPE_KIND_STRUCT)
+    {
+        arg.kind = ABI_ARG_DIRECT;
+        return arg;
+    }
+
+    switch (type->size)
+    {
+        case 1: case 2: case 4: case 8:
+            arg.kind = ABI_ARG_COERCE;
+            arg.coerce_type = LLVMIntTypeInContext(context, (u32)type->size * 8);
+            break;
+        default:
+            arg.kind = ABI_ARG_INDIRECT;
             break;
+    }
+
+    return arg;
+}
+
+// Both sides of a call work this out from the IR prototype, so a call from another module agrees with the definition.
+// C functions follow the C ABI of the target, which is only modeled for x86-64. Red functions use the System V rules on every target, with a pointer to
+// the caller's temporary instead of a byval copy: the callee reads big structs in place
+static inline void llvm_fn_abi(LLVMContextRef context, ModuleContext* module, IRFunctionPrototype* ir_proto, FnABILLVM* abi)
+{
+    const char* triple = LLVMGetTarget(module->handle);
+    bool is_x86_64 = strncmp(triple, "x86_64", strlen("x86_64")) == 0;
+    bool has_c_abi = llvm_fn_has_c_abi(ir_proto);
+    bool is_classified = !has_c_abi || is_x86_64;
+    bool is_win64 = has_c_abi && is_x86_64 && strstr(triple, "windows");
+    ABIArgLLVM direct = ZERO_INIT;
+
+    // Async functions return the handle to their frame
+    if (!is_classified || ir_proto->attributes.is_async)
+    {
+        abi->ret = direct;
+    }
+    else
+    {
+        abi->ret = is_win64 ? llvm_abi_classify_win64(context, &ir_proto->ret_type) : llvm_abi_classify(context, &ir_proto->ret_type);
+    }
+
+    // The sret pointer takes the first integer register
+    u32 int_registers = abi->ret.kind == ABI_ARG_INDIRECT ? 5 : 6;
+    u32 sse_registers = 8;
+    for (u32 i = 0; i < ir_proto->param_count; i++)
+    {
+        IRType* type = &ir_proto->params[i].type;
+        ABIArgLLVM* param = &abi->params[i];
+        if (!is_classified)
+        {
+            *param = direct;
+            continue;
         }
-        case IR_EXPRESSION_TYPE_INT_LIT:
+        if (is_win64)
         {
-            IRIntLiteral* int_lit = &expression->int_literal;
-            redassert(int_lit->bigint.digit_count == 1);
-            u64 n = int_lit->bigint.digit;
-            // TODO: fix type
-            redassert(int_lit->type < IR_TYPE_PRIMITIVE_COUNT);
-            return LLVMConstInt(llvm_primitive_types[int_lit->type], n, int_lit->bigint.is_negative);
+            *param = llvm_abi_classify_win64(context, type);
+            continue;
         }
-        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+
+        *param = llvm_abi_classify(context, type);
+        if (!has_c_abi)
         {
-            IRArrayLiteral* array_lit = &expression->array_literal;
-            u64 lit_count = array_lit->expression_count;
-            LLVMValueRef* lit_arr = NEW(LLVMValueRef, lit_count);
-            for (s32 i = 0; i < lit_count; i++)
-            {
-                lit_arr[i] = llvm_gen_expression(context, module, ir_module, current_fn, &array_lit->expressions[i], NULL);
-            }
-            LLVMTypeRef lit_type = LLVMTypeOf(lit_arr[0]);
-            LLVMValueRef llvm_array_lit = LLVMConstArray(lit_type, lit_arr, lit_count);
-            return llvm_array_lit;
+            continue;
         }
-        case IR_EXPRESSION_TYPE_STRING_LIT:
+
+        if (param->kind == ABI_ARG_DIRECT)
         {
-            IRStringLiteral* string_lit = &expression->string_literal;
-            LLVMValueRef string_lit_llvm = LLVMBuildGlobalStringPtr(module->builder, sb_ptr(string_lit->str_lit), "string_lit");
-            return string_lit_llvm;
+            bool is_sse = type->kind == TYPE_KIND_VECTOR || (type->kind == TYPE_KIND_PRIMITIVE && (type->primitive_type == IR_TYPE_PRIMITIVE_F32 || type->primitive_type == IR_TYPE_PRIMITIVE_F64));
+            param->sse_register_count = is_sse;
+            param->int_register_count = !is_sse;
         }
-        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+        // A struct is never split between registers and the stack: if all of it doesn't fit in the registers left, it goes to memory
+        if (param->int_register_count <= int_registers && param->sse_register_count <= sse_registers)
         {
-            IRFunctionCallExpr* fn_call = &expression->fn_call_expr;
-            LLVMValueRef fn_call_llvm = llvm_gen_fn_call(context, module, ir_module, current_fn, fn_call);
-            return fn_call_llvm;
+            int_registers -= param->int_register_count;
+            sse_registers -= param->sse_register_count;
         }
-        case IR_EXPRESSION_TYPE_VOID:
-            return null;
-        default:
-            RED_NOT_IMPLEMENTED;
-            break;
+        else if (param->kind == ABI_ARG_COERCE)
+        {
+            param->kind = ABI_ARG_INDIRECT;
+        }
+        param->by_val = param->kind == ABI_ARG_INDIRECT;
     }
-    return null;
 }
 
-static inline LLVMValueRef llvm_gen_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRStatement* st);
-
-static inline void llvm_gen_compound_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRCompoundStatement* compound_st)
+// byval and sret change how the call is lowered, so they go on the calls too. Indirect calls only have the call attributes
+static inline void llvm_add_abi_attributes(LLVMContextRef context, LLVMValueRef value, FnABILLVM* abi, IRFunctionPrototype* ir_proto)
 {
-    IRStatementBuffer* st_bf = &compound_st->stmts;
-    IRStatement* st_it = st_bf->ptr;
-    u32 st_count = st_bf->len;
-    if (st_count > 0)
+    // Parameter attributes start at 1
+    u32 param_offset = 1;
+    if (abi->ret.kind == ABI_ARG_INDIRECT)
     {
-        for (u32 i = 0; i < st_count; i++)
+        llvm_add_type_attribute(context, value, param_offset, "sret");
+        llvm_add_enum_attribute(context, value, param_offset, "noalias");
+        param_offset++;
+    }
+
+    for (u32 i = 0; i < ir_proto->param_count; i++)
+    {
+        IRParamDecl* param_decl = &ir_proto->params[i];
+        ABIArgLLVM* param = &abi->params[i];
+        LLVMAttributeIndex index = i + param_offset;
+        if (param_decl->is_noalias)
         {
-            IRStatement* st = &st_it[i];
-            llvm_gen_statement(context, module, ir_module, current_fn, st);
+            llvm_add_enum_attribute(context, value, index, "noalias");
+        }
+        if (param->kind != ABI_ARG_INDIRECT)
+        {
+            continue;
+        }
+
+        if (param->by_val)
+        {
+            u32 alignment = ir_type_alignment(&param_decl->type);
+            llvm_add_type_attribute(context, value, index, "byval");
+            llvm_add_int_attribute(context, value, index, "align", alignment > 8 ? alignment : 8);
+        }
+        else
+        {
+            // The caller's temporary lives only for the call
+            llvm_add_enum_attribute(context, value, index, "noalias");
+            llvm_add_enum_attribute(context, value, index, "nocapture");
+            llvm_add_int_attribute(context, value, index, "dereferenceable", param_decl->type.size);
         }
     }
+}
+
+// Temporaries go to the entry block: an alloca inside a loop would grow the stack on every iteration
+static inline LLVMValueRef llvm_build_entry_alloca(LLVMContextRef context, ModuleContext* module, LLVMTypeRef type, const char* name)
+{
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(module->current_fn->proto->handle);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+    LLVMValueRef first_instruction = LLVMGetFirstInstruction(entry);
+    if (first_instruction)
+    {
+        LLVMPositionBuilderBefore(builder, first_instruction);
+    }
     else
     {
-        RED_UNREACHABLE;
+        LLVMPositionBuilderAtEnd(builder, entry);
     }
+    LLVMValueRef alloca = LLVMBuildAlloca(builder, type, name);
+    LLVMDisposeBuilder(builder);
+
+    return alloca;
 }
 
-typedef struct LLVMSwitchCases
+// Reinterprets the bytes of value as type through a temporary that fits both, which is how structs get in and out of their coerced register types
+static inline LLVMValueRef llvm_build_coerce(LLVMContextRef context, ModuleContext* module, LLVMValueRef value, LLVMTypeRef type)
 {
-    LLVMBasicBlockRef bb;
-    LLVMValueRef block;
-} LLVMSwitchCases;
+    LLVMTargetDataRef data_layout = LLVMGetModuleDataLayout(module->handle);
+    LLVMTypeRef value_type = LLVMTypeOf(value);
+    bool is_value_bigger = LLVMABISizeOfType(data_layout, value_type) > LLVMABISizeOfType(data_layout, type);
+    u32 value_alignment = LLVMABIAlignmentOfType(data_layout, value_type);
+    u32 type_alignment = LLVMABIAlignmentOfType(data_layout, type);
 
-static inline LLVMValueRef llvm_gen_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRStatement* st)
+    LLVMValueRef temp = llvm_build_entry_alloca(context, module, is_value_bigger ? value_type : type, "coerce");
+    LLVMSetAlignment(temp, value_alignment > type_alignment ? value_alignment : type_alignment);
+    LLVMBuildStore(module->builder, value, LLVMBuildBitCast(module->builder, temp, LLVMPointerType(value_type, 0), ""));
+    return LLVMBuildLoad(module->builder, LLVMBuildBitCast(module->builder, temp, LLVMPointerType(type, 0), ""), "");
+}
+
+static inline LLVMValueRef llvm_fn_handle(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto)
 {
-    IRStatementType type = st->type;
-    switch (type)
+    LLVMValueRef fn = LLVMGetNamedFunction(module->handle, sb_ptr(ir_proto->name)); // <- @this is bullshit
+    if (!fn)
     {
-        case IR_ST_TYPE_RETURN_ST:
+        // Defined in another module: each one is a separate LLVM module, so declare it here and let the linker (or LTO) resolve it
+        IRFunctionPrototypeBuffer* fn_prototypes = &ir_module->fn_prototypes;
+        redassert(!(ir_proto >= fn_prototypes->ptr && ir_proto < fn_prototypes->ptr + fn_prototypes->len));
+        fn = llvm_gen_fn_proto(context, module, ir_module, ir_proto).handle;
+    }
+
+    return fn;
+}
+
+// add extra checks
+// This works both for fn call expression and fn call statement
+static inline LLVMValueRef llvm_gen_fn_call(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRFunctionCallExpr* fn_call)
+{
+    redassert(sizeof(IRFunctionCallExpr) == sizeof(IRFunctionCallStatement));
+    IRFunctionPrototype* ir_proto = fn_call->fn;
+    LLVMValueRef fn = llvm_fn_handle(context, module, ir_module, ir_proto);
+    FnABILLVM abi;
+    llvm_fn_abi(context, module, ir_proto, &abi);
+
+    LLVMValueRef arg_values[MAX_PARAM_COUNT + 1];
+    u32 arg_count = 0;
+    LLVMValueRef ret_temp = null;
+    if (abi.ret.kind == ABI_ARG_INDIRECT)
+    {
+        ret_temp = llvm_build_entry_alloca(context, module, llvm_gen_type(context, module, ir_module, &ir_proto->ret_type), "sret");
+        arg_values[arg_count++] = ret_temp;
+    }
+    for (u32 i = 0; i < fn_call->arg_count; i++)
+    {
+        redassert(i < MAX_PARAM_COUNT);
+        IRExpression* arg_expr = &fn_call->args[i];
+        // A literal passed to a vector parameter is splatted, as in v = 0
+        IRType* param_type = &ir_proto->params[i].type;
+        LLVMValueRef arg_value = llvm_gen_expression(context, module, ir_module, current_fn, arg_expr, param_type->kind == TYPE_KIND_VECTOR ? param_type : NULL);
+        switch (abi.params[i].kind)
         {
-            IRReturnStatement* ret_st = &st->return_st;
-            IRExpression* expr = &ret_st->expression;
-            LLVMValueRef ret;
-            if (module->current_fn->proto->return_type != LLVMVoidTypeInContext(context))
-            {
-                LLVMValueRef ret_value = llvm_gen_expression(context, module, ir_module, current_fn, expr, NULL);
-                redassert(ret_value);
-                LLVMTypeRef expr_type = LLVMTypeOf(ret_value);
-                bool type_mismatch = expr_type != module->current_fn->proto->return_type;
-                if (type_mismatch)
-                {
-                    ret_value = LLVMBuildBitCast(module->builder, ret_value, module->current_fn->proto->return_type, "cast");
-                }
-                ret = LLVMBuildRet(module->builder, ret_value);
-            }
-            else
+            case ABI_ARG_DIRECT:
+                break;
+            case ABI_ARG_COERCE:
+                arg_value = llvm_build_coerce(context, module, arg_value, abi.params[i].coerce_type);
+                break;
+            case ABI_ARG_INDIRECT:
             {
-                ret = LLVMBuildRetVoid(module->builder);
+                // The callee reads it in place, or the call copies it with byval
+                LLVMValueRef arg_temp = llvm_build_entry_alloca(context, module, LLVMTypeOf(arg_value), "arg");
+                LLVMBuildStore(module->builder, arg_value, arg_temp);
+                arg_value = arg_temp;
+                break;
             }
-            module->current_fn->return_already_emitted = true;
-            return ret;
+            default:
+                RED_UNREACHABLE;
+                break;
         }
-        case IR_ST_TYPE_BRANCH_ST:
-        {
-            IRBranchStatement* branch_st = &st->branch_st;
+        arg_values[arg_count++] = arg_value;
+    }
+    LLVMValueRef* arg_ptr = arg_count > 0 ? arg_values : NULL;
+    // Calls that produce no value can't be named
+    bool is_void = ret_temp || ir_proto->ret_type.kind == TYPE_KIND_VOID;
+    LLVMValueRef fn_call_value = LLVMBuildCall(module->builder, fn, arg_ptr, arg_count, is_void ? "" : sb_ptr(ir_proto->name));
+    LLVMSetInstructionCallConv(fn_call_value, LLVMGetFunctionCallConv(fn));
+    llvm_add_abi_attributes(context, fn_call_value, &abi, ir_proto);
 
-            LLVMValueRef condition_value = llvm_gen_expression(context, module, ir_module, current_fn, &branch_st->condition, NULL);
-            redassert(condition_value);
+    switch (abi.ret.kind)
+    {
+        case ABI_ARG_COERCE:
+            return llvm_build_coerce(context, module, fn_call_value, llvm_gen_type(context, module, ir_module, &ir_proto->ret_type));
+        case ABI_ARG_INDIRECT:
+            return LLVMBuildLoad(module->builder, ret_temp, "");
+        default:
+            return fn_call_value;
+    }
+}
 
-            LLVMBasicBlockRef llvm_if_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if");
-            redassert(llvm_if_bb);
-            LLVMBasicBlockRef llvm_else_bb = null;
-            bool else_statement = st->branch_st.else_block;
-            LLVMBasicBlockRef llvm_if_end_bb = null;
-            if (else_statement)
-            {
-                llvm_else_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "else");
-                redassert(llvm_else_bb);
-            }
-            else
-            {
-                llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
-            }
+static inline LLVMValueRef llvm_build_i8_ptr(ModuleContext* module, LLVMValueRef pointer)
+{
+    return LLVMBuildBitCast(module->builder, pointer, LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0), "");
+}
 
-            LLVMValueRef cond_br = LLVMBuildCondBr(module->builder, condition_value, llvm_if_bb, else_statement ? llvm_else_bb : llvm_if_end_bb);
-            redassert(cond_br);
-            LLVMPositionBuilderAtEnd(module->builder, llvm_if_bb);
+// Some intrinsics were overloaded in later LLVM versions (llvm.prefetch on the pointer type), so the overload types are only passed when needed
+static inline LLVMValueRef llvm_build_intrinsic_call(ModuleContext* module, const char* name, LLVMTypeRef* overload_types, u32 overload_type_count, LLVMValueRef* args, u32 arg_count)
+{
+    u32 intrinsic_id = LLVMLookupIntrinsicID(name, strlen(name));
+    redassert(intrinsic_id);
+    bool is_overloaded = LLVMIntrinsicIsOverloaded(intrinsic_id);
+    LLVMValueRef intrinsic_fn = LLVMGetIntrinsicDeclaration(module->handle, intrinsic_id, overload_types, is_overloaded ? overload_type_count : 0);
+    return LLVMBuildCall(module->builder, intrinsic_fn, args, arg_count, "");
+}
 
-            module->current_fn->return_already_emitted = false;
+static inline LLVMValueRef llvm_gen_int_lit_as(LLVMTypeRef type, IRIntLiteral* int_lit)
+{
+    u64 n = int_lit->bigint.digit_count ? int_lit->bigint.digit : 0;
+    // There are no float literals yet, so integer literals given a float type are converted
+    if (LLVMGetTypeKind(type) != LLVMIntegerTypeKind)
+    {
+        return LLVMConstReal(type, int_lit->bigint.is_negative ? -(double)n : (double)n);
+    }
+    return LLVMConstInt(type, int_lit->bigint.is_negative ? ~n + 1 : n, int_lit->bigint.is_negative);
+}
 
-            llvm_gen_compound_statement(context, module, ir_module, current_fn, &branch_st->if_block);
+static inline bool llvm_primitive_is_float(IRTypePrimitive primitive_type)
+{
+    return primitive_type >= IR_TYPE_PRIMITIVE_F32 && primitive_type <= IR_TYPE_PRIMITIVE_F128;
+}
 
-            bool return_emitted_in_all_branches_if = module->current_fn->return_already_emitted && else_statement;
-            if (module->current_fn->return_already_emitted)
-            {
-                module->current_fn->return_already_emitted = false;
-            }
-            else
-            {
-                if (!llvm_if_end_bb)
-                {
-                    llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
-                }
-                redassert(llvm_if_end_bb);
-                LLVMValueRef end_if_jmp = LLVMBuildBr(module->builder, llvm_if_end_bb);
-                redassert(end_if_jmp);
-            }
+static inline bool llvm_primitive_is_signed(IRTypePrimitive primitive_type)
+{
+    return primitive_type >= IR_TYPE_PRIMITIVE_S8 && primitive_type <= IR_TYPE_PRIMITIVE_S64;
+}
 
-            bool return_emitted_in_all_branches_else = false;
-            if (else_statement)
-            {
-                LLVMPositionBuilderAtEnd(module->builder, llvm_else_bb);
+// An integer literal is splatted to every lane. Array literals leave the missing lanes zero and insert the lanes with runtime values one by one
+static inline LLVMValueRef llvm_gen_vector_literal(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRExpression* expression, IRType* vector_type)
+{
+    LLVMTypeRef element_type = llvm_primitive_types[vector_type->vector_type.element_type];
+    u32 lane_count = vector_type->vector_type.element_count;
+    LLVMValueRef* lanes = NEW(LLVMValueRef, lane_count);
+    if (expression->type == IR_EXPRESSION_TYPE_INT_LIT)
+    {
+        LLVMValueRef lane = llvm_gen_int_lit_as(element_type, &expression->int_literal);
+        for (u32 i = 0; i < lane_count; i++)
+        {
+            lanes[i] = lane;
+        }
+        return LLVMConstVector(lanes, lane_count);
+    }
 
-                llvm_gen_statement(context, module, ir_module, current_fn, branch_st->else_block);
+    redassert(expression->type == IR_EXPRESSION_TYPE_ARRAY_LIT);
+    IRArrayLiteral* array_lit = &expression->array_literal;
+    for (u32 i = 0; i < lane_count; i++)
+    {
+        bool is_constant = i < array_lit->expression_count && array_lit->expressions[i].type == IR_EXPRESSION_TYPE_INT_LIT;
+        lanes[i] = is_constant ? llvm_gen_int_lit_as(element_type, &array_lit->expressions[i].int_literal) : LLVMConstNull(element_type);
+    }
+    LLVMValueRef vector = LLVMConstVector(lanes, lane_count);
+    for (u32 i = 0; i < array_lit->expression_count; i++)
+    {
+        if (array_lit->expressions[i].type != IR_EXPRESSION_TYPE_INT_LIT)
+        {
+            LLVMValueRef lane = llvm_gen_expression(context, module, ir_module, current_fn, &array_lit->expressions[i], NULL);
+            vector = LLVMBuildInsertElement(module->builder, vector, lane, LLVMConstInt(LLVMInt32TypeInContext(context), i, false), "lane");
+        }
+    }
 
-                return_emitted_in_all_branches_else = module->current_fn->return_already_emitted;
+    return vector;
+}
 
-                if (module->current_fn->return_already_emitted)
-                {
-                    module->current_fn->return_already_emitted = false;
-                }
-                else
-                {
-                    if (!llvm_if_end_bb)
-                    {
-                        llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
-                    }
-                    redassert(llvm_if_end_bb);
-                    LLVMValueRef end_else_jmp = LLVMBuildBr(module->builder, llvm_if_end_bb);
-                    redassert(end_else_jmp);
-                }
+static inline LLVMIntPredicate llvm_int_predicate(TokenID op, bool is_signed)
+{
+    switch (op)
+    {
+        case TOKEN_ID_CMP_EQ:
+            return LLVMIntEQ;
+        case TOKEN_ID_CMP_NOT_EQ:
+            return LLVMIntNE;
+        case TOKEN_ID_CMP_LESS:
+            return is_signed ? LLVMIntSLT : LLVMIntULT;
+        case TOKEN_ID_CMP_LESS_OR_EQ:
+            return is_signed ? LLVMIntSLE : LLVMIntULE;
+        case TOKEN_ID_CMP_GREATER:
+            return is_signed ? LLVMIntSGT : LLVMIntUGT;
+        case TOKEN_ID_CMP_GREATER_OR_EQ:
+            return is_signed ? LLVMIntSGE : LLVMIntUGE;
+        default:
+            RED_UNREACHABLE;
+            return LLVMIntEQ;
+    }
+}
+
+// Ordered, so lanes holding a NaN compare false, except in != which is true
+static inline LLVMRealPredicate llvm_real_predicate(TokenID op)
+{
+    switch (op)
+    {
+        case TOKEN_ID_CMP_EQ:
+            return LLVMRealOEQ;
+        case TOKEN_ID_CMP_NOT_EQ:
+            return LLVMRealUNE;
+        case TOKEN_ID_CMP_LESS:
+            return LLVMRealOLT;
+        case TOKEN_ID_CMP_LESS_OR_EQ:
+            return LLVMRealOLE;
+        case TOKEN_ID_CMP_GREATER:
+            return LLVMRealOGT;
+        case TOKEN_ID_CMP_GREATER_OR_EQ:
+            return LLVMRealOGE;
+        default:
+            RED_UNREACHABLE;
+            return LLVMRealOEQ;
+    }
+}
+
+// The element type picks the float, signed or unsigned instruction. Comparisons produce a <N x i1> mask
+static inline LLVMValueRef llvm_build_lane_op(ModuleContext* module, TokenID op, LLVMValueRef left, LLVMValueRef right, IRTypePrimitive element_type)
+{
+    bool is_float = llvm_primitive_is_float(element_type);
+    bool is_signed = llvm_primitive_is_signed(element_type);
+    switch (op)
+    {
+        case TOKEN_ID_PLUS:
+            return is_float ? LLVMBuildFAdd(module->builder, left, right, "vadd") : LLVMBuildAdd(module->builder, left, right, "vadd");
+        case TOKEN_ID_DASH:
+            return is_float ? LLVMBuildFSub(module->builder, left, right, "vsub") : LLVMBuildSub(module->builder, left, right, "vsub");
+        case TOKEN_ID_STAR:
+            return is_float ? LLVMBuildFMul(module->builder, left, right, "vmul") : LLVMBuildMul(module->builder, left, right, "vmul");
+        case TOKEN_ID_SLASH:
+            if (is_float)
+            {
+                return LLVMBuildFDiv(module->builder, left, right, "vdiv");
             }
-            if (llvm_if_end_bb)
+            return is_signed ? LLVMBuildSDiv(module->builder, left, right, "vdiv") : LLVMBuildUDiv(module->builder, left, right, "vdiv");
+        case TOKEN_ID_KEYWORD_AND:
+            return LLVMBuildAnd(module->builder, left, right, "vand");
+        case TOKEN_ID_KEYWORD_OR:
+            return LLVMBuildOr(module->builder, left, right, "vor");
+        case TOKEN_ID_CARET:
+            return LLVMBuildXor(module->builder, left, right, "vxor");
+        default:
+            if (is_float)
             {
-                LLVMPositionBuilderAtEnd(module->builder, llvm_if_end_bb);
+                return LLVMBuildFCmp(module->builder, llvm_real_predicate(op), left, right, "vfcmp");
             }
+            return LLVMBuildICmp(module->builder, llvm_int_predicate(op, is_signed), left, right, "vicmp");
+    }
+}
 
-            module->current_fn->return_already_emitted = return_emitted_in_all_branches_if && return_emitted_in_all_branches_else;
+static inline LLVMValueRef llvm_gen_vector_binary_expr(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRBinaryExpr* bin_expr, LLVMValueRef left, LLVMValueRef right)
+{
+    bool is_left_vector = LLVMGetTypeKind(LLVMTypeOf(left)) == LLVMVectorTypeKind;
+    IRType vector_type = ast_to_ir_find_expression_type(is_left_vector ? bin_expr->left : bin_expr->right);
+    // The scalar side is an integer literal, generated again as a splat of the lane type
+    if (!is_left_vector)
+    {
+        left = llvm_gen_vector_literal(context, module, ir_module, current_fn, bin_expr->left, &vector_type);
+    }
+    else if (LLVMGetTypeKind(LLVMTypeOf(right)) != LLVMVectorTypeKind)
+    {
+        right = llvm_gen_vector_literal(context, module, ir_module, current_fn, bin_expr->right, &vector_type);
+    }
 
-            return null;
+    return llvm_build_lane_op(module, bin_expr->op, left, right, vector_type.vector_type.element_type);
+}
+
+// Halves the vector until one lane is left: log2(lanes) shuffles and lane operations, the shape instruction selection turns into horizontal
+// instructions. Float lanes are thus added in pairs, not in lane order
+static inline LLVMValueRef llvm_gen_vector_reduce(LLVMContextRef context, ModuleContext* module, IntrinsicID id, LLVMValueRef vector, IRVectorType* vector_type)
+{
+    LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+    u32 lane_count = vector_type->element_count;
+    IRTypePrimitive element_type = vector_type->element_type;
+    LLVMValueRef* indices = NEW(LLVMValueRef, lane_count);
+    for (u32 half = lane_count / 2; half > 0; half /= 2)
+    {
+        for (u32 i = 0; i < lane_count; i++)
+        {
+            indices[i] = i < half ? LLVMConstInt(i32_type, i + half, false) : LLVMGetUndef(i32_type);
         }
-        case IR_ST_TYPE_SWITCH_ST:
+        LLVMValueRef upper = LLVMBuildShuffleVector(module->builder, vector, LLVMGetUndef(LLVMTypeOf(vector)), LLVMConstVector(indices, lane_count), "reduce_upper");
+        switch (id)
         {
-            IRSwitchStatement* sw_st = &st->switch_st;
-            IRSwitchCaseBuffer* swcb = &sw_st->cases;
-            u32 sw_case_count = swcb->len;
-            IRSwitchCase* sw_case_ptr = swcb->ptr;
-            IRSwitchCase* sw_default = null;
-
-            for (u32 i = 0; i < sw_case_count; i++)
+            case INTRINSIC_REDUCE_ADD:
+                vector = llvm_build_lane_op(module, TOKEN_ID_PLUS, vector, upper, element_type);
+                break;
+            case INTRINSIC_REDUCE_MUL:
+                vector = llvm_build_lane_op(module, TOKEN_ID_STAR, vector, upper, element_type);
+                break;
+            case INTRINSIC_REDUCE_MIN:
+            case INTRINSIC_REDUCE_MAX:
             {
-                IRSwitchCase* sw_case = &sw_case_ptr[i];
-                // If default
-                if (sw_case->case_expr.type == IR_EXPRESSION_TYPE_VOID)
-                {
-                    sw_default = sw_case;
-                    break;
-                }
+                TokenID op = id == INTRINSIC_REDUCE_MIN ? TOKEN_ID_CMP_LESS : TOKEN_ID_CMP_GREATER;
+                LLVMValueRef keep = llvm_build_lane_op(module, op, vector, upper, element_type);
+                vector = LLVMBuildSelect(module->builder, keep, vector, upper, "reduce_select");
+                break;
             }
+            case INTRINSIC_REDUCE_AND:
+                vector = llvm_build_lane_op(module, TOKEN_ID_KEYWORD_AND, vector, upper, element_type);
+                break;
+            case INTRINSIC_REDUCE_OR:
+                vector = llvm_build_lane_op(module, TOKEN_ID_KEYWORD_OR, vector, upper, element_type);
+                break;
+            case INTRINSIC_REDUCE_XOR:
+                vector = llvm_build_lane_op(module, TOKEN_ID_CARET, vector, upper, element_type);
+                break;
+            default:
+                RED_UNREACHABLE;
+                break;
+        }
+    }
 
-            LLVMValueRef sw_expr = llvm_gen_expression(context, module, ir_module, current_fn, &sw_st->switch_expr, NULL);
+    return LLVMBuildExtractElement(module->builder, vector, LLVMConstNull(i32_type), "reduce");
+}
 
-            //LLVMBasicBlockRef sw_def_bb = sw_default ? LLVMAppendBasicBlockInContext(llvm->context, llvm->llvm_current_fn.fn_handle, "default_sw_case") : null;
-            //LLVMBasicBlockRef sw_end_bb = LLVMAppendBasicBlockInContext(llvm->context, llvm->llvm_current_fn.fn_handle, "sw_end");
-            LLVMBasicBlockRef sw_def_bb = sw_default ? LLVMCreateBasicBlockInContext(context, "default_sw_case") : null;
-            LLVMBasicBlockRef sw_end_bb = LLVMCreateBasicBlockInContext(context, "sw_end");
-            LLVMValueRef llvm_switch = LLVMBuildSwitch(module->builder, sw_expr, sw_def_bb ? sw_def_bb : sw_end_bb, sw_case_count);
+// The address points to the first lane. Unaligned accesses only assume the alignment of the element type
+static inline LLVMValueRef llvm_gen_vector_address(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRExpression* address_arg, LLVMTypeRef vector_type)
+{
+    LLVMValueRef address = llvm_gen_expression(context, module, ir_module, current_fn, address_arg, NULL);
+    return LLVMBuildBitCast(module->builder, address, LLVMPointerType(vector_type, 0), "vector_address");
+}
 
-            bool return_emitted_in_all_branches = true;
-            for (u32 i = 0; i < sw_case_count; i++)
-            {
-                IRSwitchCase* sw_case = &sw_case_ptr[i];
-                // If not default
-                if (sw_case->case_expr.type != IR_EXPRESSION_TYPE_VOID)
-                {
-                    module->current_fn->return_already_emitted = false;
-                    LLVMBasicBlockRef case_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "sw_case");
-                    LLVMPositionBuilderAtEnd(module->builder, case_bb);
-                    llvm_gen_compound_statement(context, module, ir_module, current_fn, &sw_case->case_body);
-                    if (!module->current_fn->return_already_emitted)
-                    {
-                        return_emitted_in_all_branches = false;
-                        LLVMBuildBr(module->builder, sw_end_bb);
-                    }
-                    LLVMAddCase(llvm_switch, llvm_gen_expression(context, module, ir_module, current_fn, &sw_case->case_expr, NULL), case_bb);
-                }
-            }
+static inline u32 llvm_vector_access_alignment(ModuleContext* module, LLVMTypeRef vector_type, bool is_aligned)
+{
+    LLVMTargetDataRef data_layout = LLVMGetModuleDataLayout(module->handle);
+    return LLVMABIAlignmentOfType(data_layout, is_aligned ? vector_type : LLVMGetElementType(vector_type));
+}
 
-            if (sw_def_bb)
+static inline LLVMValueRef llvm_gen_vector_intrinsic(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRIntrinsicExpr* intrinsic)
+{
+    IRExpression* args = intrinsic->args;
+    IntrinsicID id = intrinsic->id;
+    switch (id)
+    {
+        case INTRINSIC_SHUFFLE:
+        {
+            LLVMValueRef first = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            LLVMValueRef second = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            IRArrayLiteral* indices = &args[2].array_literal;
+            LLVMValueRef* mask = NEW(LLVMValueRef, indices->expression_count);
+            for (u64 i = 0; i < indices->expression_count; i++)
             {
-                LLVMAppendExistingBasicBlock(module->current_fn->proto->handle, sw_def_bb);
-                module->current_fn->return_already_emitted = false;
-                LLVMPositionBuilderAtEnd(module->builder, sw_def_bb);
-                llvm_gen_compound_statement(context, module, ir_module, current_fn, &sw_default->case_body);
-                if (!module->current_fn->return_already_emitted)
-                {
-                    return_emitted_in_all_branches = false;
-                    LLVMBuildBr(module->builder, sw_end_bb);
-                }
+                mask[i] = llvm_gen_int_lit_as(LLVMInt32TypeInContext(context), &indices->expressions[i].int_literal);
             }
+            return LLVMBuildShuffleVector(module->builder, first, second, LLVMConstVector(mask, (u32)indices->expression_count), "shuffle");
+        }
+        case INTRINSIC_SELECT:
+        {
+            LLVMValueRef mask = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            LLVMValueRef if_true = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            LLVMValueRef if_false = llvm_gen_expression(context, module, ir_module, current_fn, &args[2], &intrinsic->type);
+            return LLVMBuildSelect(module->builder, mask, if_true, if_false, "select");
+        }
+        case INTRINSIC_VLOAD:
+        case INTRINSIC_VLOAD_ALIGNED:
+        {
+            LLVMTypeRef vector_type = llvm_gen_type(context, module, ir_module, &intrinsic->type);
+            LLVMValueRef address = llvm_gen_vector_address(context, module, ir_module, current_fn, &args[0], vector_type);
+            LLVMValueRef load = LLVMBuildLoad(module->builder, address, "vload");
+            LLVMSetAlignment(load, llvm_vector_access_alignment(module, vector_type, id == INTRINSIC_VLOAD_ALIGNED));
+            return load;
+        }
+        case INTRINSIC_VSTORE:
+        case INTRINSIC_VSTORE_ALIGNED:
+        {
+            LLVMValueRef value = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            LLVMTypeRef vector_type = LLVMTypeOf(value);
+            LLVMValueRef address = llvm_gen_vector_address(context, module, ir_module, current_fn, &args[0], vector_type);
+            LLVMValueRef store = LLVMBuildStore(module->builder, value, address);
+            LLVMSetAlignment(store, llvm_vector_access_alignment(module, vector_type, id == INTRINSIC_VSTORE_ALIGNED));
+            return store;
+        }
+        default:
+        {
+            LLVMValueRef vector = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            IRType vector_type = ast_to_ir_find_expression_type(&args[0]);
+            return llvm_gen_vector_reduce(context, module, id, vector, &vector_type.vector_type);
+        }
+    }
+}
 
-            LLVMAppendExistingBasicBlock(module->current_fn->proto->handle, sw_end_bb);
-            LLVMPositionBuilderAtEnd(module->builder, sw_end_bb);
-            if (return_emitted_in_all_branches)
-            {
-                LLVMBuildUnreachable(module->builder);
-            }
+static inline LLVMAtomicOrdering llvm_atomic_ordering(AtomicOrdering ordering)
+{
+    switch (ordering)
+    {
+        // LLVM calls C11 relaxed monotonic, its unordered is weaker than anything the language offers
+        case ATOMIC_ORDERING_RELAXED: return LLVMAtomicOrderingMonotonic;
+        case ATOMIC_ORDERING_ACQUIRE: return LLVMAtomicOrderingAcquire;
+        case ATOMIC_ORDERING_RELEASE: return LLVMAtomicOrderingRelease;
+        case ATOMIC_ORDERING_ACQ_REL: return LLVMAtomicOrderingAcquireRelease;
+        case ATOMIC_ORDERING_SEQ_CST: return LLVMAtomicOrderingSequentiallyConsistent;
+        default:
+            RED_UNREACHABLE;
+            return LLVMAtomicOrderingSequentiallyConsistent;
+    }
+}
 
-            return llvm_switch;
+static inline LLVMAtomicRMWBinOp llvm_atomic_rmw_op(AtomicRMWOp op)
+{
+    switch (op)
+    {
+        case ATOMIC_RMW_OP_ADD: return LLVMAtomicRMWBinOpAdd;
+        case ATOMIC_RMW_OP_SUB: return LLVMAtomicRMWBinOpSub;
+        case ATOMIC_RMW_OP_XCHG: return LLVMAtomicRMWBinOpXchg;
+        case ATOMIC_RMW_OP_AND: return LLVMAtomicRMWBinOpAnd;
+        case ATOMIC_RMW_OP_OR: return LLVMAtomicRMWBinOpOr;
+        default:
+            RED_UNREACHABLE;
+            return LLVMAtomicRMWBinOpAdd;
+    }
+}
+
+// singleThread is always off: the orderings have to hold against other threads, not only signal handlers
+static inline LLVMValueRef llvm_gen_atomic_intrinsic(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRIntrinsicExpr* intrinsic)
+{
+    IRExpression* args = intrinsic->args;
+    LLVMAtomicOrdering ordering = llvm_atomic_ordering(intrinsic->ordering);
+    if (intrinsic->id == INTRINSIC_FENCE)
+    {
+        return LLVMBuildFence(module->builder, ordering, false, "");
+    }
+
+    LLVMValueRef address = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+    switch (intrinsic->id)
+    {
+        case INTRINSIC_ATOMIC_LOAD:
+        {
+            LLVMValueRef load = LLVMBuildLoad(module->builder, address, "atomic_load");
+            LLVMSetOrdering(load, ordering);
+            return load;
         }
-        case IR_ST_TYPE_SYM_DECL_ST:
+        case INTRINSIC_ATOMIC_STORE:
         {
-            IRSymDeclStatement* decl_st = &st->sym_decl_st;
-            if (decl_st->type.kind == TYPE_KIND_RAW_STRING)
+            LLVMValueRef value = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            LLVMValueRef store = LLVMBuildStore(module->builder, value, address);
+            LLVMSetOrdering(store, ordering);
+            return store;
+        }
+        case INTRINSIC_ATOMIC_RMW:
+        {
+            LLVMValueRef value = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            return LLVMBuildAtomicRMW(module->builder, llvm_atomic_rmw_op(intrinsic->rmw_op), address, value, ordering, false);
+        }
+        case INTRINSIC_CMPXCHG:
+        {
+            LLVMValueRef expected = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+            LLVMValueRef desired = llvm_gen_expression(context, module, ir_module, current_fn, &args[2], NULL);
+            LLVMValueRef cmpxchg = LLVMBuildAtomicCmpXchg(module->builder, address, expected, desired, ordering, llvm_atomic_ordering(intrinsic->failure_ordering), false);
+            // { old value, success }: the old value equals the expected one exactly when the exchange happened
+            return LLVMBuildExtractValue(module->builder, cmpxchg, 0, "cmpxchg_old");
+        }
+        default:
+            RED_UNREACHABLE;
+            return null;
+    }
+}
+
+static inline LLVMValueRef llvm_gen_intrinsic(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRIntrinsicExpr* intrinsic)
+{
+    IRExpression* args = intrinsic->args;
+    if (intrinsic_is_vector_op(intrinsic->id))
+    {
+        return llvm_gen_vector_intrinsic(context, module, ir_module, current_fn, intrinsic);
+    }
+    if (intrinsic_is_atomic_op(intrinsic->id))
+    {
+        return llvm_gen_atomic_intrinsic(context, module, ir_module, current_fn, intrinsic);
+    }
+    switch (intrinsic->id)
+    {
+        case INTRINSIC_UNREACHABLE:
+            // Terminates the block like a return does
+            module->current_fn->return_already_emitted = true;
+            return LLVMBuildUnreachable(module->builder);
+        case INTRINSIC_ASSUME:
+        {
+            LLVMValueRef condition = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            if (LLVMTypeOf(condition) != LLVMInt1TypeInContext(context))
             {
-                LLVMValueRef str_ptr = LLVMBuildGlobalStringPtr(module->builder, sb_ptr(decl_st->value.string_literal.str_lit), sb_ptr(decl_st->name));
-                local_str_append(&module->current_fn->local_string_buffer, (const LocalStringLLVM) { .decl_ptr = decl_st, .value = str_ptr });
-                return str_ptr;
+                condition = LLVMBuildICmp(module->builder, LLVMIntNE, condition, LLVMConstNull(LLVMTypeOf(condition)), "assume_cond");
             }
-            else
+            return llvm_build_intrinsic_call(module, "llvm.assume", null, 0, &condition, 1);
+        }
+        case INTRINSIC_PREFETCH:
+        {
+            LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+            LLVMValueRef address = llvm_build_i8_ptr(module, llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL));
+            LLVMTypeRef address_type = LLVMTypeOf(address);
+            LLVMValueRef prefetch_args[] =
             {
-                LLVMTypeRef llvm_type = llvm_gen_type(context, module, ir_module, &decl_st->type);
-                LLVMValueRef alloca = LLVMBuildAlloca(module->builder, llvm_type, sb_ptr(decl_st->name));
-                llvm_value_append(&module->current_fn->alloca_buffer, alloca);
-                LLVMValueRef value_expression = llvm_gen_expression(context, module, ir_module, current_fn, &decl_st->value, &decl_st->type);
-                if (value_expression)
+                address,
+                llvm_gen_int_lit_as(i32_type, &args[1].int_literal),
+                llvm_gen_int_lit_as(i32_type, &args[2].int_literal),
+                // Data cache
+                LLVMConstInt(i32_type, 1, false),
+            };
+            return llvm_build_intrinsic_call(module, "llvm.prefetch", &address_type, 1, prefetch_args, array_length(prefetch_args));
+        }
+        case INTRINSIC_EXPECT:
+        {
+            LLVMValueRef value = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            LLVMTypeRef value_type = LLVMTypeOf(value);
+            LLVMValueRef expect_args[] = { value, llvm_gen_int_lit_as(value_type, &args[1].int_literal), };
+            return llvm_build_intrinsic_call(module, "llvm.expect", &value_type, 1, expect_args, array_length(expect_args));
+        }
+        default:
+        {
+            LLVMValueRef value = llvm_gen_expression(context, module, ir_module, current_fn, &args[0], NULL);
+            LLVMTypeRef value_type = LLVMTypeOf(value);
+            // ctlz and cttz of zero are the bit count, as in the compile-time folding
+            LLVMValueRef is_zero_poison = LLVMConstInt(LLVMInt1TypeInContext(context), 0, false);
+            switch (intrinsic->id)
+            {
+                case INTRINSIC_POPCOUNT:
+                    return llvm_build_intrinsic_call(module, "llvm.ctpop", &value_type, 1, &value, 1);
+                case INTRINSIC_CLZ:
                 {
-                    LLVMBuildStore(module->builder, value_expression, alloca);
+                    LLVMValueRef ctlz_args[] = { value, is_zero_poison, };
+                    return llvm_build_intrinsic_call(module, "llvm.ctlz", &value_type, 1, ctlz_args, array_length(ctlz_args));
                 }
-                return null;
+                case INTRINSIC_CTZ:
+                {
+                    LLVMValueRef cttz_args[] = { value, is_zero_poison, };
+                    return llvm_build_intrinsic_call(module, "llvm.cttz", &value_type, 1, cttz_args, array_length(cttz_args));
+                }
+                case INTRINSIC_BSWAP:
+                    return llvm_build_intrinsic_call(module, "llvm.bswap", &value_type, 1, &value, 1);
+                case INTRINSIC_ROTL:
+                case INTRINSIC_ROTR:
+                {
+                    // A rotation is a funnel shift of the value with itself
+                    LLVMValueRef amount = llvm_gen_expression(context, module, ir_module, current_fn, &args[1], NULL);
+                    amount = LLVMBuildIntCast2(module->builder, amount, value_type, false, "rot_amount");
+                    LLVMValueRef funnel_args[] = { value, value, amount, };
+                    return llvm_build_intrinsic_call(module, intrinsic->id == INTRINSIC_ROTL ? "llvm.fshl" : "llvm.fshr", &value_type, 1, funnel_args, array_length(funnel_args));
+                }
+                default:
+                    RED_UNREACHABLE;
+                    return null;
             }
         }
-        case IR_ST_TYPE_ASSIGN_ST:
-        {
-            IRSymAssignStatement* assign_st = &st->sym_assign_st;
+    }
+}
 
-            IRExpression* left_expr = assign_st->left;
-            LLVMValueRef left_value = llvm_gen_expression(context, module, ir_module, current_fn, left_expr, NULL);
-            IRExpressionType left_expr_type = left_expr->type;
+// The promise is kept at this alignment in every frame, so llvm.coro.promise can find it without knowing the result type
+#define LLVM_PROMISE_ALIGNMENT 16
 
-            // If pointer type, emit a load
-            switch (left_expr_type)
+static inline LLVMTypeRef llvm_promise_type(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRType* result_type)
+{
+    LLVMTypeRef field_types[2] = { LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0), };
+    u32 field_count = 1;
+    if (result_type->kind != TYPE_KIND_VOID)
+    {
+        field_types[field_count++] = llvm_gen_type(context, module, ir_module, result_type);
+    }
+    return LLVMStructTypeInContext(context, field_types, field_count, false);
+}
+
+static inline LLVMValueRef llvm_frame_promise(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, LLVMValueRef frame, IRType* result_type)
+{
+    LLVMValueRef promise_args[] = { frame, LLVMConstInt(LLVMInt32TypeInContext(context), LLVM_PROMISE_ALIGNMENT, false), LLVMConstInt(LLVMInt1TypeInContext(context), 0, false) };
+    LLVMValueRef promise = llvm_build_intrinsic_call(module, "llvm.coro.promise", null, 0, promise_args, array_length(promise_args));
+    return LLVMBuildBitCast(module->builder, promise, LLVMPointerType(llvm_promise_type(context, module, ir_module, result_type), 0), "promise");
+}
+
+// Frames come from the #frame_allocator functions or from the C heap
+static inline LLVMValueRef llvm_frame_allocator_fn(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* allocator, const char* c_name, LLVMTypeRef c_fn_type)
+{
+    if (allocator)
+    {
+        return llvm_fn_handle(context, module, ir_module, allocator);
+    }
+
+    LLVMValueRef fn = LLVMGetNamedFunction(module->handle, c_name);
+    if (!fn)
+    {
+        fn = LLVMAddFunction(module->handle, c_name, c_fn_type);
+    }
+    return fn;
+}
+
+static inline LLVMValueRef llvm_build_frame_allocator_call(ModuleContext* module, LLVMValueRef fn, LLVMValueRef arg)
+{
+    LLVMTypeRef param_type;
+    LLVMGetParamTypes(LLVMGetElementType(LLVMTypeOf(fn)), &param_type);
+    if (LLVMTypeOf(arg) != param_type)
+    {
+        arg = LLVMBuildBitCast(module->builder, arg, param_type, "");
+    }
+    LLVMValueRef call = LLVMBuildCall(module->builder, fn, &arg, 1, "");
+    LLVMSetInstructionCallConv(call, LLVMGetFunctionCallConv(fn));
+    return call;
+}
+
+// Allocates the frame (unless the coroutine passes elide it into the caller) and starts the coroutine. The ramp function runs the body until the first suspend
+static inline void llvm_gen_coro_begin(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto)
+{
+    CoroutineLLVM* coro = &module->current_fn->coro;
+    LLVMValueRef fn = module->current_fn->proto->handle;
+    LLVMTypeRef i8_ptr_type = LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0);
+    LLVMTypeRef i64_type = llvm_primitive_types[IR_TYPE_PRIMITIVE_U64];
+    module->has_coroutines = true;
+    // CoroSplit only splits the functions marked by the frontend
+    LLVMAttributeRef presplit = LLVMCreateStringAttribute(context, "coroutine.presplit", strlen("coroutine.presplit"), "0", 1);
+    LLVMAddAttributeAtIndex(fn, LLVMAttributeFunctionIndex, presplit);
+
+    coro->promise = LLVMBuildAlloca(module->builder, llvm_promise_type(context, module, ir_module, &ir_proto->ret_type), "promise");
+    LLVMSetAlignment(coro->promise, LLVM_PROMISE_ALIGNMENT);
+    LLVMValueRef id_args[] = { LLVMConstInt(LLVMInt32TypeInContext(context), 0, false), llvm_build_i8_ptr(module, coro->promise), LLVMConstNull(i8_ptr_type), LLVMConstNull(i8_ptr_type) };
+    coro->id = llvm_build_intrinsic_call(module, "llvm.coro.id", null, 0, id_args, array_length(id_args));
+    LLVMValueRef needs_alloc = llvm_build_intrinsic_call(module, "llvm.coro.alloc", null, 0, &coro->id, 1);
+
+    LLVMBasicBlockRef entry_block = LLVMGetInsertBlock(module->builder);
+    LLVMBasicBlockRef alloc_block = LLVMAppendBasicBlockInContext(context, fn, "coro.alloc");
+    LLVMBasicBlockRef begin_block = LLVMAppendBasicBlockInContext(context, fn, "coro.begin");
+    LLVMBuildCondBr(module->builder, needs_alloc, alloc_block, begin_block);
+
+    LLVMPositionBuilderAtEnd(module->builder, alloc_block);
+    LLVMValueRef frame_size = llvm_build_intrinsic_call(module, "llvm.coro.size", &i64_type, 1, null, 0);
+    LLVMValueRef alloc_fn = llvm_frame_allocator_fn(context, module, ir_module, ir_proto->attributes.frame_alloc_fn, "malloc", LLVMFunctionType(i8_ptr_type, &i64_type, 1, false));
+    LLVMValueRef allocated_memory = llvm_build_i8_ptr(module, llvm_build_frame_allocator_call(module, alloc_fn, frame_size));
+    LLVMBuildBr(module->builder, begin_block);
+
+    LLVMPositionBuilderAtEnd(module->builder, begin_block);
+    LLVMValueRef memory = LLVMBuildPhi(module->builder, i8_ptr_type, "frame.memory");
+    LLVMValueRef incoming_values[] = { LLVMConstNull(i8_ptr_type), allocated_memory };
+    LLVMBasicBlockRef incoming_blocks[] = { entry_block, alloc_block };
+    LLVMAddIncoming(memory, incoming_values, incoming_blocks, array_length(incoming_values));
+    LLVMValueRef begin_args[] = { coro->id, memory };
+    coro->handle = llvm_build_intrinsic_call(module, "llvm.coro.begin", null, 0, begin_args, array_length(begin_args));
+    // Nobody awaits the frame yet
+    LLVMBuildStore(module->builder, LLVMConstNull(i8_ptr_type), LLVMBuildStructGEP(module->builder, coro->promise, 0, "awaiter"));
+
+    coro->final_block = LLVMCreateBasicBlockInContext(context, "coro.final");
+    coro->cleanup_block = LLVMCreateBasicBlockInContext(context, "coro.cleanup");
+    coro->suspend_block = LLVMCreateBasicBlockInContext(context, "coro.suspend");
+}
+
+// 0 resumes, 1 destroys the frame and anything else means the coroutine got suspended
+static inline void llvm_gen_coro_suspend(LLVMContextRef context, ModuleContext* module, LLVMBasicBlockRef resume_block)
+{
+    CoroutineLLVM* coro = &module->current_fn->coro;
+    LLVMTypeRef i8_type = llvm_primitive_types[IR_TYPE_PRIMITIVE_U8];
+    LLVMValueRef save = llvm_build_intrinsic_call(module, "llvm.coro.save", null, 0, &coro->handle, 1);
+    LLVMValueRef suspend_args[] = { save, LLVMConstInt(LLVMInt1TypeInContext(context), 0, false) };
+    LLVMValueRef suspend_result = llvm_build_intrinsic_call(module, "llvm.coro.suspend", null, 0, suspend_args, array_length(suspend_args));
+    LLVMValueRef suspend_switch = LLVMBuildSwitch(module->builder, suspend_result, coro->suspend_block, 2);
+    LLVMAddCase(suspend_switch, LLVMConstInt(i8_type, 0, false), resume_block);
+    LLVMAddCase(suspend_switch, LLVMConstInt(i8_type, 1, false), coro->cleanup_block);
+}
+
+// return v stores the result in the promise and goes to the final suspend
+static inline void llvm_gen_coro_return(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRReturnStatement* ret_st)
+{
+    CoroutineLLVM* coro = &module->current_fn->coro;
+    IRType* result_type = &current_fn->proto->ret_type;
+    if (result_type->kind != TYPE_KIND_VOID)
+    {
+        LLVMValueRef result = llvm_gen_expression(context, module, ir_module, current_fn, &ret_st->expression, result_type);
+        redassert(result);
+        LLVMValueRef result_ptr = LLVMBuildStructGEP(module->builder, coro->promise, 1, "result");
+        LLVMTypeRef llvm_result_type = LLVMGetElementType(LLVMTypeOf(result_ptr));
+        if (LLVMTypeOf(result) != llvm_result_type)
+        {
+            // A bitcast can't change the width, integers are truncated or extended as the result type says
+            if (LLVMGetTypeKind(LLVMTypeOf(result)) == LLVMIntegerTypeKind && LLVMGetTypeKind(llvm_result_type) == LLVMIntegerTypeKind)
             {
-                case IR_EXPRESSION_TYPE_SYM_EXPR:
+                bool is_signed = result_type->kind == TYPE_KIND_PRIMITIVE && llvm_primitive_is_signed(result_type->primitive_type);
+                result = LLVMBuildIntCast2(module->builder, result, llvm_result_type, is_signed, "cast");
+            }
+            else
+            {
+                result = LLVMBuildBitCast(module->builder, result, llvm_result_type, "cast");
+            }
+        }
+        LLVMBuildStore(module->builder, result, result_ptr);
+    }
+    LLVMBuildBr(module->builder, coro->final_block);
+    module->current_fn->return_already_emitted = true;
+}
+
+// The final suspend keeps the frame alive, so the awaiter can read the result before destroying it. Resuming a finished coroutine is undefined
+static inline void llvm_gen_coro_end(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto)
+{
+    CoroutineLLVM* coro = &module->current_fn->coro;
+    LLVMValueRef fn = module->current_fn->proto->handle;
+    LLVMTypeRef i8_type = llvm_primitive_types[IR_TYPE_PRIMITIVE_U8];
+    LLVMTypeRef i8_ptr_type = LLVMPointerType(i8_type, 0);
+    if (!module->current_fn->return_already_emitted)
+    {
+        LLVMBuildBr(module->builder, coro->final_block);
+    }
+
+    LLVMAppendExistingBasicBlock(fn, coro->final_block);
+    LLVMPositionBuilderAtEnd(module->builder, coro->final_block);
+    LLVMValueRef final_args[] = { LLVMConstNull(LLVMTokenTypeInContext(context)), LLVMConstInt(LLVMInt1TypeInContext(context), 1, false) };
+    LLVMValueRef final_result = llvm_build_intrinsic_call(module, "llvm.coro.suspend", null, 0, final_args, array_length(final_args));
+    LLVMBasicBlockRef finished_block = LLVMAppendBasicBlockInContext(context, fn, "coro.finished");
+    LLVMValueRef final_switch = LLVMBuildSwitch(module->builder, final_result, coro->suspend_block, 2);
+    LLVMAddCase(final_switch, LLVMConstInt(i8_type, 0, false), finished_block);
+    LLVMAddCase(final_switch, LLVMConstInt(i8_type, 1, false), coro->cleanup_block);
+    LLVMPositionBuilderAtEnd(module->builder, finished_block);
+    LLVMBuildUnreachable(module->builder);
+
+    // llvm.coro.free gives null when the frame was elided into the caller
+    LLVMAppendExistingBasicBlock(fn, coro->cleanup_block);
+    LLVMPositionBuilderAtEnd(module->builder, coro->cleanup_block);
+    LLVMValueRef free_args[] = { coro->id, coro->handle };
+    LLVMValueRef memory = llvm_build_intrinsic_call(module, "llvm.coro.free", null, 0, free_args, array_length(free_args));
+    LLVMBasicBlockRef free_block = LLVMAppendBasicBlockInContext(context, fn, "coro.free");
+    LLVMValueRef is_allocated = LLVMBuildICmp(module->builder, LLVMIntNE, memory, LLVMConstNull(i8_ptr_type), "is_allocated");
+    LLVMBuildCondBr(module->builder, is_allocated, free_block, coro->suspend_block);
+    LLVMPositionBuilderAtEnd(module->builder, free_block);
+    LLVMValueRef free_fn = llvm_frame_allocator_fn(context, module, ir_module, ir_proto->attributes.frame_free_fn, "free", LLVMFunctionType(LLVMVoidTypeInContext(context), &i8_ptr_type, 1, false));
+    llvm_build_frame_allocator_call(module, free_fn, memory);
+    LLVMBuildBr(module->builder, coro->suspend_block);
+
+    LLVMAppendExistingBasicBlock(fn, coro->suspend_block);
+    LLVMPositionBuilderAtEnd(module->builder, coro->suspend_block);
+    LLVMValueRef end_args[] = { coro->handle, LLVMConstInt(LLVMInt1TypeInContext(context), 0, false) };
+    llvm_build_intrinsic_call(module, "llvm.coro.end", null, 0, end_args, array_length(end_args));
+    LLVMBuildRet(module->builder, coro->handle);
+    module->current_fn->return_already_emitted = true;
+}
+
+// resume h runs h until it suspends again. If that finishes it, the frame awaiting it is resumed in turn, and so on up the chain. Generated once per module
+static inline LLVMValueRef llvm_gen_coro_resume_fn(LLVMContextRef context, ModuleContext* module)
+{
+    static const char* fn_name = "red.coro.resume";
+    LLVMValueRef fn = LLVMGetNamedFunction(module->handle, fn_name);
+    if (fn)
+    {
+        return fn;
+    }
+
+    LLVMTypeRef i8_ptr_type = LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0);
+    fn = LLVMAddFunction(module->handle, fn_name, LLVMFunctionType(LLVMVoidTypeInContext(context), &i8_ptr_type, 1, false));
+    LLVMSetLinkage(fn, LLVMInternalLinkage);
+    LLVMBasicBlockRef caller_block = LLVMGetInsertBlock(module->builder);
+    LLVMBasicBlockRef entry_block = LLVMAppendBasicBlockInContext(context, fn, "entry");
+    LLVMBasicBlockRef resume_block = LLVMAppendBasicBlockInContext(context, fn, "resume");
+    LLVMBasicBlockRef finished_block = LLVMAppendBasicBlockInContext(context, fn, "finished");
+    LLVMBasicBlockRef exit_block = LLVMAppendBasicBlockInContext(context, fn, "exit");
+
+    LLVMPositionBuilderAtEnd(module->builder, entry_block);
+    LLVMBuildBr(module->builder, resume_block);
+
+    LLVMPositionBuilderAtEnd(module->builder, resume_block);
+    LLVMValueRef frame = LLVMBuildPhi(module->builder, i8_ptr_type, "frame");
+    llvm_build_intrinsic_call(module, "llvm.coro.resume", null, 0, &frame, 1);
+    LLVMValueRef is_done = llvm_build_intrinsic_call(module, "llvm.coro.done", null, 0, &frame, 1);
+    LLVMBuildCondBr(module->builder, is_done, finished_block, exit_block);
+
+    // The awaiter is the first field of every promise
+    LLVMPositionBuilderAtEnd(module->builder, finished_block);
+    LLVMValueRef promise_args[] = { frame, LLVMConstInt(LLVMInt32TypeInContext(context), LLVM_PROMISE_ALIGNMENT, false), LLVMConstInt(LLVMInt1TypeInContext(context), 0, false) };
+    LLVMValueRef promise = llvm_build_intrinsic_call(module, "llvm.coro.promise", null, 0, promise_args, array_length(promise_args));
+    LLVMValueRef awaiter = LLVMBuildLoad(module->builder, LLVMBuildBitCast(module->builder, promise, LLVMPointerType(i8_ptr_type, 0), ""), "awaiter");
+    LLVMSetAlignment(awaiter, LLVM_PROMISE_ALIGNMENT);
+    LLVMValueRef has_awaiter = LLVMBuildICmp(module->builder, LLVMIntNE, awaiter, LLVMConstNull(i8_ptr_type), "has_awaiter");
+    LLVMBuildCondBr(module->builder, has_awaiter, resume_block, exit_block);
+
+    LLVMValueRef incoming_values[] = { LLVMGetParam(fn, 0), awaiter };
+    LLVMBasicBlockRef incoming_blocks[] = { entry_block, finished_block };
+    LLVMAddIncoming(frame, incoming_values, incoming_blocks, array_length(incoming_values));
+
+    LLVMPositionBuilderAtEnd(module->builder, exit_block);
+    LLVMBuildRetVoid(module->builder);
+
+    LLVMPositionBuilderAtEnd(module->builder, caller_block);
+    return fn;
+}
+
+static inline void llvm_gen_resume(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRResumeStatement* resume_st)
+{
+    module->has_coroutines = true;
+    LLVMValueRef frame = llvm_gen_expression(context, module, ir_module, current_fn, resume_st->frame, NULL);
+    LLVMBuildCall(module->builder, llvm_gen_coro_resume_fn(context, module), &frame, 1, "");
+}
+
+// If the frame hasn't finished, an async function stores itself as its awaiter and suspends until the frame resumes it.
+// Outside an async function there is nothing to suspend, so awaiting an unfinished frame traps. Awaiting destroys the frame
+static inline LLVMValueRef llvm_gen_await(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRAwaitExpr* await_expr)
+{
+    module->has_coroutines = true;
+    LLVMValueRef fn = module->current_fn->proto->handle;
+    LLVMValueRef frame = llvm_gen_expression(context, module, ir_module, current_fn, await_expr->frame, NULL);
+    LLVMValueRef is_done = llvm_build_intrinsic_call(module, "llvm.coro.done", null, 0, &frame, 1);
+    LLVMBasicBlockRef wait_block = LLVMAppendBasicBlockInContext(context, fn, "await.wait");
+    LLVMBasicBlockRef ready_block = LLVMAppendBasicBlockInContext(context, fn, "await.ready");
+    LLVMBuildCondBr(module->builder, is_done, ready_block, wait_block);
+
+    LLVMPositionBuilderAtEnd(module->builder, wait_block);
+    if (current_fn->proto->attributes.is_async)
+    {
+        LLVMValueRef promise = llvm_frame_promise(context, module, ir_module, frame, &await_expr->result_type);
+        LLVMBuildStore(module->builder, module->current_fn->coro.handle, LLVMBuildStructGEP(module->builder, promise, 0, "awaiter"));
+        llvm_gen_coro_suspend(context, module, ready_block);
+    }
+    else
+    {
+        llvm_build_intrinsic_call(module, "llvm.trap", null, 0, null, 0);
+        LLVMBuildUnreachable(module->builder);
+    }
+
+    LLVMPositionBuilderAtEnd(module->builder, ready_block);
+    LLVMValueRef result = null;
+    if (await_expr->result_type.kind != TYPE_KIND_VOID)
+    {
+        LLVMValueRef promise = llvm_frame_promise(context, module, ir_module, frame, &await_expr->result_type);
+        result = LLVMBuildLoad(module->builder, LLVMBuildStructGEP(module->builder, promise, 1, "result"), "result");
+    }
+    llvm_build_intrinsic_call(module, "llvm.coro.destroy", null, 0, &frame, 1);
+    return result;
+}
+
+static inline LLVMValueRef llvm_gen_expression(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRExpression* expression, IRType* expected_type)
+{
+    IRExpressionType type = expression->type;
+    switch (type)
+    {
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+        {
+            IRBinaryExpr* bin_expr = &expression->bin_expr;
+            LLVMValueRef left = llvm_gen_expression(context, module, ir_module, current_fn, bin_expr->left, NULL);
+            LLVMValueRef right = llvm_gen_expression(context, module, ir_module, current_fn, bin_expr->right, NULL);
+            TokenID op = bin_expr->op;
+            if (LLVMGetTypeKind(LLVMTypeOf(left)) == LLVMVectorTypeKind || LLVMGetTypeKind(LLVMTypeOf(right)) == LLVMVectorTypeKind)
+            {
+                return llvm_gen_vector_binary_expr(context, module, ir_module, current_fn, bin_expr, left, right);
+            }
+
+            // Unsigned operands compare and divide as unsigned, the way the bytecode VM does
+            IRType left_type = ast_to_ir_find_expression_type(bin_expr->left);
+            bool is_signed = left_type.kind != TYPE_KIND_PRIMITIVE || llvm_primitive_is_signed(left_type.primitive_type);
+            switch (op)
+            {
+                case TOKEN_ID_CMP_LESS:
+                case TOKEN_ID_CMP_GREATER:
+                    return LLVMBuildICmp(module->builder, llvm_int_predicate(op, is_signed), left, right, "cmp");
+                case TOKEN_ID_CMP_EQ:
+                    return LLVMBuildICmp(module->builder, LLVMIntEQ, left, right, "eq");
+                case TOKEN_ID_PLUS:
+                    return LLVMBuildAdd(module->builder, left, right, "add");
+                case TOKEN_ID_DASH:
+                    return LLVMBuildSub(module->builder, left, right, "sub");
+                case TOKEN_ID_STAR:
+                    return LLVMBuildMul(module->builder, left, right, "mul");
+                case TOKEN_ID_SLASH:
+                    // Not exact: the remainder is dropped
+                    return is_signed ? LLVMBuildSDiv(module->builder, left, right, "div") : LLVMBuildUDiv(module->builder, left, right, "div");
+                default:
+                    RED_NOT_IMPLEMENTED;
+                    break;
+            }
+            break;
+        }
+        case IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS:
+        {
+            IRSubscriptAccess* subscript_access = &expression->subscript_access;
+            IRSymbolSubscriptType subs_type = subscript_access->subscript_type;
+            TypeKind data_type = subscript_access->parent.type;
+            switch (subs_type)
+            {
+                case AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS:
                 {
-                    IRSymExprType left_expr_sym_expr_type = left_expr->sym_expr.type;
-                    switch (left_expr_sym_expr_type)
+                    switch (data_type)
                     {
-                        case IR_SYM_EXPR_TYPE_PARAM:
-                            if (left_expr->sym_expr.param_decl->type.kind == TYPE_KIND_POINTER)
-                            {
-                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
-                            }
-                            break;
-                        case IR_SYM_EXPR_TYPE_SYM:
-                            if (left_expr->sym_expr.sym_decl->type.kind == TYPE_KIND_POINTER)
-                            {
-                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
-                            }
-                            break;
-                        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
-                            if (left_expr->sym_expr.global_sym_decl->type.kind == TYPE_KIND_POINTER)
+                        case TYPE_KIND_STRUCT:
+                        {
+                            IRFieldDecl* field_ptr = subscript_access->parent.struct_p->fields;
+                            u32 field_count = subscript_access->parent.struct_p->field_count;
+
+                            if (field_count > 0)
                             {
-                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
+                                for (u32 i = 0; i < field_count; i++)
+                                {
+                                    IRFieldDecl* field = &field_ptr[i];
+                                    if (sb_cmp(field->name, subscript_access->name))
+                                    {
+                                        return LLVMConstInt(LLVMInt32TypeInContext(context), llvm_struct_element_index(subscript_access->parent.struct_p, i), false);
+                                    }
+                                }
                             }
+                            RED_NOT_IMPLEMENTED;
                             break;
+                        }
                         default:
                             RED_NOT_IMPLEMENTED;
                             break;
                     }
-                    break;
                 }
                 default:
                     RED_NOT_IMPLEMENTED;
                     break;
             }
+            if (subscript_access->subscript)
+            {
+                llvm_gen_expression(context, module, ir_module, current_fn, subscript_access->subscript, NULL);
+            }
+            return null;
+        }
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+        {
+            IRSymExpr* sym_expr = &expression->sym_expr;
+            IRSymExprType se_type = sym_expr->type;
+            IRExpression* subscript = sym_expr->subscript;
+            if (subscript)
+            {
+                IRSymbolSubscriptType subscript_type = ir_sym_expr_subscript_type(sym_expr);
+                switch (subscript_type)
+                {
+                    case AST_SYMBOL_SUBSCRIPT_TYPE_BRACKET_ACCESS:
+                    {
+                        //RedType base_type = ast_to_ir_find_expression_type(expression);
+                        switch (se_type)
+                        {
+                            case IR_SYM_EXPR_TYPE_PARAM:
+                                RED_NOT_IMPLEMENTED;
+                                return null;
+                            case IR_SYM_EXPR_TYPE_SYM:
+                            case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+                            {
+                                IRSymDeclStatement* sym;
+                                LLVMValueRef arr_alloca;
+                                if (se_type == IR_SYM_EXPR_TYPE_SYM)
+                                {
+                                    sym = sym_expr->sym_decl;
+                                    arr_alloca = module->current_fn->alloca_buffer.ptr[sym - current_fn->sym_declarations.ptr];
+                                }
+                                else
+                                {
+                                    // Tables precomputed by comptime are usually globals
+                                    sym = sym_expr->global_sym_decl;
+                                    arr_alloca = module->global_sym_buffer.ptr[sym - ir_module->global_sym_decls.ptr];
+                                }
+                                LLVMValueRef zero = LLVMConstInt(LLVMIntTypeInContext(context, 32), 0, true);
+                                LLVMValueRef index_value = llvm_gen_expression(context, module, ir_module, current_fn, sym_expr->subscript, NULL);
+                                LLVMValueRef indices[3] =
+                                {
+                                    zero,
+                                    index_value,
+                                };
+                                u32 index_count = 2;
+                                IRFieldDecl* element_field = sym_expr->element_field;
+                                if (element_field)
+                                {
+                                    IRStructDecl* struct_decl = sym->type.array_type.base_type->struct_type;
+                                    u32 field_index = element_field - struct_decl->fields;
+                                    if (sym->type.array_type.is_soa)
+                                    {
+                                        // a[i].f -> a.f[i]
+                                        indices[1] = LLVMConstInt(LLVMInt32TypeInContext(context), field_index, false);
+                                        indices[2] = index_value;
+                                    }
+                                    else
+                                    {
+                                        indices[2] = LLVMConstInt(LLVMInt32TypeInContext(context), llvm_struct_element_index(struct_decl, field_index), false);
+                                    }
+                                    index_count = 3;
+                                }
+                                //LLVMTypeRef llvm_base_type = llvm_gen_type(llvm, &base_type);
+                                ;
+                                //array_subscript_value = LLVMBuildInBoundsGEP2(llvm->builder, llvm_base_type, arr_alloca, indices, array_length(indices), "arr_subscript_access");
+                                LLVMValueRef array_subscript_value = LLVMBuildInBoundsGEP(module->builder, arr_alloca, indices, index_count, "arridxaccess");
+                                switch (sym_expr->use_type)
+                                {
+                                    case LOAD:
+                                        return LLVMBuildLoad(module->builder, array_subscript_value, "arridxload");
+                                    case STORE:
+                                        // The store takes place in the assign statement
+                                        // TODO: this probably is buggy
+                                        return array_subscript_value;
+                                    default:
+                                        RED_NOT_IMPLEMENTED;
+                                        return null;
+                                }
+                            }
+                            default:
+                                RED_NOT_IMPLEMENTED;
+                                return null;
+                        }
+                    }
+                    case AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS:
+                        switch (se_type)
+                        {
+                            case IR_SYM_EXPR_TYPE_PARAM:
+                            case IR_SYM_EXPR_TYPE_SYM:
+                            {
+                                LLVMValueRef alloca;
+                                if (se_type == IR_SYM_EXPR_TYPE_PARAM)
+                                {
+                                    // Big struct params are the caller's memory, the rest were copied to an alloca
+                                    alloca = module->current_fn->param_alloca_array[sym_expr->param_decl - current_fn->proto->params];
+                                }
+                                else
+                                {
+                                    IRSymDeclStatement* sym = sym_expr->sym_decl;
+                                    IRSymDeclStatement* base_ptr = current_fn->sym_declarations.ptr;
+                                    u32 index = sym - base_ptr;
+                                    alloca = module->current_fn->alloca_buffer.ptr[index];
+                                }
+                                LLVMValueRef zero = LLVMConstInt(LLVMIntTypeInContext(context, 32), 0, true);
+                                LLVMValueRef index_value = llvm_gen_expression(context, module, ir_module, current_fn, sym_expr->subscript, NULL);
+                                LLVMValueRef indices[2] =
+                                {
+                                    zero,
+                                    index_value,
+                                };
+
+                                LLVMValueRef field_pointer = LLVMBuildInBoundsGEP(module->builder, alloca, indices, array_length(indices), "struct_field_access");
+                                // Stores go through the pointer in the assign statement
+                                return sym_expr->use_type == LOAD ? LLVMBuildLoad(module->builder, field_pointer, "struct_field_load") : field_pointer;
+                            }
+                            case IR_SYM_EXPR_TYPE_ENUM:
+                            {
+                                IREnumDecl* enum_decl = sym_expr->enum_decl;
+                                redassert(enum_decl->type.kind == TYPE_KIND_PRIMITIVE);
+                                IRTypePrimitive primitive_type = enum_decl->type.primitive_type;
+                                // TODO: we should put this before LLVM Codegen
+                                // TODO: even better: for enums, don't store names but the value
+                                SB* field_name = sym_expr->subscript->subscript_access.name;
+
+                                u32 field_count = enum_decl->fields.len;
+                                IREnumField* field_ptr = enum_decl->fields.ptr;
+                                for (u32 i = 0; i < field_count; i++)
+                                {
+                                    IREnumField* field = &field_ptr[i];
+                                    if (sb_cmp(field->name, field_name))
+                                    {
+                                        switch (primitive_type)
+                                        {
+                                            case IR_TYPE_PRIMITIVE_U32:
+                                                return LLVMConstInt(llvm_primitive_types[IR_TYPE_PRIMITIVE_U32], field->value.unsigned64, false);
+                                            default:
+                                                RED_NOT_IMPLEMENTED;
+                                                break;
+                                        }
+                                    }
+                                }
+                            }
+                            default:
+                                RED_NOT_IMPLEMENTED;
+                                break;
+                        }
+                        RED_NOT_IMPLEMENTED;
+                        return null;
+                    default:
+                        RED_NOT_IMPLEMENTED;
+                        return null;
+                }
+                RED_NOT_IMPLEMENTED;
+                return null;
+            }
+            else
+            {
+                switch (se_type)
+                {
+                    case IR_SYM_EXPR_TYPE_PARAM:
+                    {
+                        IRParamDecl* param = sym_expr->param_decl;
+                        u8 index = (u8)(param - current_fn->proto->params);
+                        switch (sym_expr->use_type)
+                        {
+                            case LOAD:
+                                return LLVMBuildLoad(module->builder, module->current_fn->param_alloca_array[index], sb_ptr(param->name));
+                            case STORE:
+                                //return LLVMBuildStore(module->builder, llvm->llvm_current_fn->param_arr[index], llvm->llvm_current_fn->param_alloca_array[index]);
+                                return module->current_fn->param_alloca_array[index];
+                                break;
+                            default:
+                                RED_NOT_IMPLEMENTED;
+                                break;
+                        }
+                    }
+                    case IR_SYM_EXPR_TYPE_SYM:
+                    {
+                        IRSymDeclStatement* sym = sym_expr->sym_decl;
+                        if (sym->type.kind == TYPE_KIND_RAW_STRING)
+                        {
+                            LocalStringLLVM* local_string = find_local_string(&module->current_fn->local_string_buffer, sym);
+                            redassert(local_string);
+                            return local_string->value;
+                        }
+                        else
+                        {
+                            IRSymDeclStatement* base_ptr = current_fn->sym_declarations.ptr;
+                            u64 index = sym - base_ptr;
+
+                            switch (sym_expr->use_type)
+                            {
+                                case LOAD:
+                                    return LLVMBuildLoad(module->builder, module->current_fn->alloca_buffer.ptr[index], sb_ptr(sym->name));
+                                case STORE:
+                                    return module->current_fn->alloca_buffer.ptr[index];
+                                default:
+                                    RED_NOT_IMPLEMENTED;
+                                    return null;
+                            }
+                        }
+                    }
+                    case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+                    {
+                        IRSymDeclStatement* global_sym = sym_expr->global_sym_decl;
+                        IRSymDeclStatement* base_ptr = ir_module->global_sym_decls.ptr;
+                        u64 index = global_sym - base_ptr;
+
+                        switch (sym_expr->use_type)
+                        {
+                            case LOAD:
+                                return LLVMBuildLoad(module->builder, module->global_sym_buffer.ptr[index], sb_ptr(global_sym->name));
+                                /* TODO: probably buggy */
+                            case STORE:
+                                return module->global_sym_buffer.ptr[index];
+                            default:
+                                RED_NOT_IMPLEMENTED;
+                                return null;
+                        }
+                    }
+                    default:
+                        RED_NOT_IMPLEMENTED;
+                        break;
+                }
+            }
+            break;
+        }
+        case IR_EXPRESSION_TYPE_INT_LIT:
+        {
+            if (expected_type && expected_type->kind == TYPE_KIND_VECTOR)
+            {
+                return llvm_gen_vector_literal(context, module, ir_module, current_fn, expression, expected_type);
+            }
+            IRIntLiteral* int_lit = &expression->int_literal;
+            redassert(int_lit->bigint.digit_count == 1);
+            // TODO: fix type
+            redassert(int_lit->type < IR_TYPE_PRIMITIVE_COUNT);
+            return llvm_gen_int_lit_as(llvm_primitive_types[int_lit->type], int_lit);
+        }
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+        {
+            if (expected_type && expected_type->kind == TYPE_KIND_VECTOR)
+            {
+                return llvm_gen_vector_literal(context, module, ir_module, current_fn, expression, expected_type);
+            }
+            IRArrayLiteral* array_lit = &expression->array_literal;
+            u64 lit_count = array_lit->expression_count;
+            u64 elem_count = lit_count;
+            IRType* elem_type = NULL;
+            if (expected_type && expected_type->kind == TYPE_KIND_ARRAY)
+            {
+                // Missing trailing elements are zero
+                elem_count = LLVMGetArrayLength(llvm_gen_type(context, module, ir_module, expected_type));
+                elem_type = expected_type->array_type.base_type;
+            }
+            LLVMValueRef* lit_arr = NEW(LLVMValueRef, elem_count);
+            for (s32 i = 0; i < lit_count; i++)
+            {
+                lit_arr[i] = llvm_gen_expression(context, module, ir_module, current_fn, &array_lit->expressions[i], elem_type);
+            }
+            LLVMTypeRef lit_type = elem_type ? llvm_gen_type(context, module, ir_module, elem_type) : LLVMTypeOf(lit_arr[0]);
+            for (u64 i = lit_count; i < elem_count; i++)
+            {
+                lit_arr[i] = LLVMConstNull(lit_type);
+            }
+            LLVMValueRef llvm_array_lit = LLVMConstArray(lit_type, lit_arr, elem_count);
+            return llvm_array_lit;
+        }
+        case IR_EXPRESSION_TYPE_STRING_LIT:
+        {
+            IRStringLiteral* string_lit = &expression->string_literal;
+            LLVMValueRef string_lit_llvm = llvm_gen_string_literal(context, module, string_lit->str_lit);
+            return string_lit_llvm;
+        }
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+        {
+            IRFunctionCallExpr* fn_call = &expression->fn_call_expr;
+            LLVMValueRef fn_call_llvm = llvm_gen_fn_call(context, module, ir_module, current_fn, fn_call);
+            return fn_call_llvm;
+        }
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            return llvm_gen_intrinsic(context, module, ir_module, current_fn, &expression->intrinsic_expr);
+        case IR_EXPRESSION_TYPE_AWAIT_EXPR:
+            return llvm_gen_await(context, module, ir_module, current_fn, &expression->await_expr);
+        case IR_EXPRESSION_TYPE_VOID:
+            return null;
+        default:
+            RED_NOT_IMPLEMENTED;
+            break;
+    }
+    return null;
+}
+
+static inline LLVMValueRef llvm_gen_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRStatement* st);
+
+static inline void llvm_gen_compound_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRCompoundStatement* compound_st)
+{
+    IRStatementBuffer* st_bf = &compound_st->stmts;
+    IRStatement* st_it = st_bf->ptr;
+    u32 st_count = st_bf->len;
+    if (st_count > 0)
+    {
+        for (u32 i = 0; i < st_count; i++)
+        {
+            IRStatement* st = &st_it[i];
+            llvm_gen_statement(context, module, ir_module, current_fn, st);
+        }
+    }
+    else
+    {
+        RED_UNREACHABLE;
+    }
+}
+
+typedef struct LLVMSwitchCases
+{
+    LLVMBasicBlockRef bb;
+    LLVMValueRef block;
+} LLVMSwitchCases;
+
+static inline bool llvm_array_lit_is_constant(IRArrayLiteral* array_lit)
+{
+    for (u64 i = 0; i < array_lit->expression_count; i++)
+    {
+        IRExpression* element = &array_lit->expressions[i];
+        switch (element->type)
+        {
+            case IR_EXPRESSION_TYPE_INT_LIT:
+                break;
+            case IR_EXPRESSION_TYPE_ARRAY_LIT:
+                if (!llvm_array_lit_is_constant(&element->array_literal))
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Aggregates are never stored as a whole, that is one huge store per element for LLVM to split up. Constant literals are copied from a
+// private constant global, zeroes are a memset and literals with runtime values are stored element by element
+static inline void llvm_gen_local_initializer(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRSymDeclStatement* decl_st, LLVMValueRef alloca, LLVMTypeRef llvm_type)
+{
+    if (decl_st->is_undefined)
+    {
+        return;
+    }
+
+    IRExpression* value = &decl_st->value;
+    LLVMTypeKind type_kind = LLVMGetTypeKind(llvm_type);
+    bool is_aggregate = type_kind == LLVMArrayTypeKind || type_kind == LLVMStructTypeKind;
+    if (!is_aggregate)
+    {
+        LLVMValueRef value_expression = value->type == IR_EXPRESSION_TYPE_VOID ? LLVMConstNull(llvm_type) : llvm_gen_expression(context, module, ir_module, current_fn, value, &decl_st->type);
+        LLVMBuildStore(module->builder, value_expression, alloca);
+        return;
+    }
+
+    u32 alignment = LLVMGetAlignment(alloca);
+    LLVMValueRef size = LLVMConstInt(llvm_primitive_types[IR_TYPE_PRIMITIVE_U64], LLVMABISizeOfType(LLVMGetModuleDataLayout(module->handle), llvm_type), false);
+    LLVMValueRef zero_byte = LLVMConstNull(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8]);
+    switch (value->type)
+    {
+        case IR_EXPRESSION_TYPE_VOID:
+            LLVMBuildMemSet(module->builder, llvm_build_i8_ptr(module, alloca), zero_byte, size, alignment);
+            break;
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+        {
+            IRArrayLiteral* array_lit = &value->array_literal;
+            if (llvm_array_lit_is_constant(array_lit))
+            {
+                LLVMValueRef constant = llvm_gen_expression(context, module, ir_module, current_fn, value, &decl_st->type);
+                if (LLVMIsNull(constant))
+                {
+                    LLVMBuildMemSet(module->builder, llvm_build_i8_ptr(module, alloca), zero_byte, size, alignment);
+                    break;
+                }
+
+                SB* global_name = sb_alloc();
+                sb_append_str(global_name, sb_ptr(decl_st->name));
+                sb_append_str(global_name, ".init");
+                LLVMValueRef init_global = LLVMAddGlobal(module->handle, llvm_type, sb_ptr(global_name));
+                LLVMSetInitializer(init_global, constant);
+                LLVMSetGlobalConstant(init_global, true);
+                LLVMSetLinkage(init_global, LLVMPrivateLinkage);
+                LLVMSetUnnamedAddress(init_global, LLVMGlobalUnnamedAddr);
+                LLVMSetAlignment(init_global, alignment);
+                LLVMBuildMemCpy(module->builder, llvm_build_i8_ptr(module, alloca), alignment, llvm_build_i8_ptr(module, init_global), alignment, size);
+                break;
+            }
+
+            if (array_lit->expression_count < LLVMGetArrayLength(llvm_type))
+            {
+                LLVMBuildMemSet(module->builder, llvm_build_i8_ptr(module, alloca), zero_byte, size, alignment);
+            }
+            IRType* elem_type = decl_st->type.array_type.base_type;
+            LLVMValueRef zero = LLVMConstNull(LLVMInt32TypeInContext(context));
+            for (u64 i = 0; i < array_lit->expression_count; i++)
+            {
+                LLVMValueRef indices[2] =
+                {
+                    zero,
+                    LLVMConstInt(LLVMInt32TypeInContext(context), i, false),
+                };
+                LLVMValueRef element_ptr = LLVMBuildInBoundsGEP(module->builder, alloca, indices, array_length(indices), "arrlitelem");
+                LLVMBuildStore(module->builder, llvm_gen_expression(context, module, ir_module, current_fn, &array_lit->expressions[i], elem_type), element_ptr);
+            }
+            break;
+        }
+        default:
+        {
+            LLVMValueRef value_expression = llvm_gen_expression(context, module, ir_module, current_fn, value, &decl_st->type);
+            if (value_expression)
+            {
+                LLVMBuildStore(module->builder, value_expression, alloca);
+            }
+            break;
+        }
+    }
+}
+
+static inline LLVMValueRef llvm_gen_statement(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn, IRStatement* st)
+{
+    IRStatementType type = st->type;
+    switch (type)
+    {
+        case IR_ST_TYPE_RETURN_ST:
+        {
+            IRReturnStatement* ret_st = &st->return_st;
+            IRExpression* expr = &ret_st->expression;
+            LLVMValueRef ret;
+            if (current_fn->proto->attributes.is_async)
+            {
+                llvm_gen_coro_return(context, module, ir_module, current_fn, ret_st);
+                return null;
+            }
+            ABIArgLLVM* ret_abi = &module->current_fn->proto->abi.ret;
+            if (ret_abi->kind == ABI_ARG_INDIRECT)
+            {
+                LLVMValueRef ret_value = llvm_gen_expression(context, module, ir_module, current_fn, expr, NULL);
+                redassert(ret_value);
+                LLVMBuildStore(module->builder, ret_value, LLVMGetParam(module->current_fn->proto->handle, 0));
+                ret = LLVMBuildRetVoid(module->builder);
+            }
+            else if (module->current_fn->proto->return_type != LLVMVoidTypeInContext(context))
+            {
+                LLVMValueRef ret_value = llvm_gen_expression(context, module, ir_module, current_fn, expr, NULL);
+                redassert(ret_value);
+                LLVMTypeRef expr_type = LLVMTypeOf(ret_value);
+                bool type_mismatch = expr_type != module->current_fn->proto->return_type;
+                if (ret_abi->kind == ABI_ARG_COERCE)
+                {
+                    ret_value = llvm_build_coerce(context, module, ret_value, ret_abi->coerce_type);
+                }
+                else if (type_mismatch)
+                {
+                    ret_value = LLVMBuildBitCast(module->builder, ret_value, module->current_fn->proto->return_type, "cast");
+                }
+                ret = LLVMBuildRet(module->builder, ret_value);
+            }
+            else
+            {
+                ret = LLVMBuildRetVoid(module->builder);
+            }
+            module->current_fn->return_already_emitted = true;
+            return ret;
+        }
+        case IR_ST_TYPE_BRANCH_ST:
+        {
+            IRBranchStatement* branch_st = &st->branch_st;
+
+            LLVMValueRef condition_value = llvm_gen_expression(context, module, ir_module, current_fn, &branch_st->condition, NULL);
+            redassert(condition_value);
+
+            LLVMBasicBlockRef llvm_if_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if");
+            redassert(llvm_if_bb);
+            LLVMBasicBlockRef llvm_else_bb = null;
+            bool else_statement = st->branch_st.else_block;
+            LLVMBasicBlockRef llvm_if_end_bb = null;
+            if (else_statement)
+            {
+                llvm_else_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "else");
+                redassert(llvm_else_bb);
+            }
+            else
+            {
+                llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
+            }
+
+            LLVMValueRef cond_br = LLVMBuildCondBr(module->builder, condition_value, llvm_if_bb, else_statement ? llvm_else_bb : llvm_if_end_bb);
+            redassert(cond_br);
+            LLVMPositionBuilderAtEnd(module->builder, llvm_if_bb);
+
+            module->current_fn->return_already_emitted = false;
+
+            llvm_gen_compound_statement(context, module, ir_module, current_fn, &branch_st->if_block);
+
+            bool return_emitted_in_all_branches_if = module->current_fn->return_already_emitted && else_statement;
+            if (module->current_fn->return_already_emitted)
+            {
+                module->current_fn->return_already_emitted = false;
+            }
+            else
+            {
+                if (!llvm_if_end_bb)
+                {
+                    llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
+                }
+                redassert(llvm_if_end_bb);
+                LLVMValueRef end_if_jmp = LLVMBuildBr(module->builder, llvm_if_end_bb);
+                redassert(end_if_jmp);
+            }
+
+            bool return_emitted_in_all_branches_else = false;
+            if (else_statement)
+            {
+                LLVMPositionBuilderAtEnd(module->builder, llvm_else_bb);
+
+                llvm_gen_statement(context, module, ir_module, current_fn, branch_st->else_block);
+
+                return_emitted_in_all_branches_else = module->current_fn->return_already_emitted;
+
+                if (module->current_fn->return_already_emitted)
+                {
+                    module->current_fn->return_already_emitted = false;
+                }
+                else
+                {
+                    if (!llvm_if_end_bb)
+                    {
+                        llvm_if_end_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "if-end");
+                    }
+                    redassert(llvm_if_end_bb);
+                    LLVMValueRef end_else_jmp = LLVMBuildBr(module->builder, llvm_if_end_bb);
+                    redassert(end_else_jmp);
+                }
+            }
+            if (llvm_if_end_bb)
+            {
+                LLVMPositionBuilderAtEnd(module->builder, llvm_if_end_bb);
+            }
+
+            module->current_fn->return_already_emitted = return_emitted_in_all_branches_if && return_emitted_in_all_branches_else;
+
+            return null;
+        }
+        case IR_ST_TYPE_SWITCH_ST:
+        {
+            IRSwitchStatement* sw_st = &st->switch_st;
+            IRSwitchCaseBuffer* swcb = &sw_st->cases;
+            u32 sw_case_count = swcb->len;
+            IRSwitchCase* sw_case_ptr = swcb->ptr;
+            IRSwitchCase* sw_default = null;
+
+            for (u32 i = 0; i < sw_case_count; i++)
+            {
+                IRSwitchCase* sw_case = &sw_case_ptr[i];
+                // If default
+                if (sw_case->case_expr.type == IR_EXPRESSION_TYPE_VOID)
+                {
+                    sw_default = sw_case;
+                    break;
+                }
+            }
+
+            LLVMValueRef sw_expr = llvm_gen_expression(context, module, ir_module, current_fn, &sw_st->switch_expr, NULL);
+
+            //LLVMBasicBlockRef sw_def_bb = sw_default ? LLVMAppendBasicBlockInContext(llvm->context, llvm->llvm_current_fn.fn_handle, "default_sw_case") : null;
+            //LLVMBasicBlockRef sw_end_bb = LLVMAppendBasicBlockInContext(llvm->context, llvm->llvm_current_fn.fn_handle, "sw_end");
+            LLVMBasicBlockRef sw_def_bb = sw_default ? LLVMCreateBasicBlockInContext(context, "default_sw_case") : null;
+            LLVMBasicBlockRef sw_end_bb = LLVMCreateBasicBlockInContext(context, "sw_end");
+            LLVMValueRef llvm_switch = LLVMBuildSwitch(module->builder, sw_expr, sw_def_bb ? sw_def_bb : sw_end_bb, sw_case_count);
+
+            bool return_emitted_in_all_branches = true;
+            for (u32 i = 0; i < sw_case_count; i++)
+            {
+                IRSwitchCase* sw_case = &sw_case_ptr[i];
+                // If not default
+                if (sw_case->case_expr.type != IR_EXPRESSION_TYPE_VOID)
+                {
+                    module->current_fn->return_already_emitted = false;
+                    LLVMBasicBlockRef case_bb = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "sw_case");
+                    LLVMPositionBuilderAtEnd(module->builder, case_bb);
+                    llvm_gen_compound_statement(context, module, ir_module, current_fn, &sw_case->case_body);
+                    if (!module->current_fn->return_already_emitted)
+                    {
+                        return_emitted_in_all_branches = false;
+                        LLVMBuildBr(module->builder, sw_end_bb);
+                    }
+                    LLVMAddCase(llvm_switch, llvm_gen_expression(context, module, ir_module, current_fn, &sw_case->case_expr, NULL), case_bb);
+                }
+            }
+
+            if (sw_def_bb)
+            {
+                LLVMAppendExistingBasicBlock(module->current_fn->proto->handle, sw_def_bb);
+                module->current_fn->return_already_emitted = false;
+                LLVMPositionBuilderAtEnd(module->builder, sw_def_bb);
+                llvm_gen_compound_statement(context, module, ir_module, current_fn, &sw_default->case_body);
+                if (!module->current_fn->return_already_emitted)
+                {
+                    return_emitted_in_all_branches = false;
+                    LLVMBuildBr(module->builder, sw_end_bb);
+                }
+            }
+
+            LLVMAppendExistingBasicBlock(module->current_fn->proto->handle, sw_end_bb);
+            LLVMPositionBuilderAtEnd(module->builder, sw_end_bb);
+            if (return_emitted_in_all_branches)
+            {
+                LLVMBuildUnreachable(module->builder);
+            }
+
+            return llvm_switch;
+        }
+        case IR_ST_TYPE_SYM_DECL_ST:
+        {
+            IRSymDeclStatement* decl_st = &st->sym_decl_st;
+            if (decl_st->type.kind == TYPE_KIND_RAW_STRING)
+            {
+                LLVMValueRef str_ptr = llvm_gen_string_literal(context, module, decl_st->value.string_literal.str_lit);
+                local_str_append(&module->current_fn->local_string_buffer, (const LocalStringLLVM) { .decl_ptr = decl_st, .value = str_ptr });
+                return str_ptr;
+            }
+            else
+            {
+                LLVMTypeRef llvm_type = llvm_gen_type(context, module, ir_module, &decl_st->type);
+                LLVMValueRef alloca = LLVMBuildAlloca(module->builder, llvm_type, sb_ptr(decl_st->name));
+                u32 alignment = llvm_sym_alignment(decl_st);
+                if (alignment)
+                {
+                    LLVMSetAlignment(alloca, alignment);
+                }
+                llvm_value_append(&module->current_fn->alloca_buffer, alloca);
+                llvm_gen_local_initializer(context, module, ir_module, current_fn, decl_st, alloca, llvm_type);
+                return null;
+            }
+        }
+        case IR_ST_TYPE_ASSIGN_ST:
+        {
+            IRSymAssignStatement* assign_st = &st->sym_assign_st;
+
+            IRExpression* left_expr = assign_st->left;
+            LLVMValueRef left_value = llvm_gen_expression(context, module, ir_module, current_fn, left_expr, NULL);
+            IRExpressionType left_expr_type = left_expr->type;
+
+            // If pointer type, emit a load
+            switch (left_expr_type)
+            {
+                case IR_EXPRESSION_TYPE_SYM_EXPR:
+                {
+                    IRSymExprType left_expr_sym_expr_type = left_expr->sym_expr.type;
+                    switch (left_expr_sym_expr_type)
+                    {
+                        case IR_SYM_EXPR_TYPE_PARAM:
+                            if (left_expr->sym_expr.param_decl->type.kind == TYPE_KIND_POINTER)
+                            {
+                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
+                            }
+                            break;
+                        case IR_SYM_EXPR_TYPE_SYM:
+                            if (left_expr->sym_expr.sym_decl->type.kind == TYPE_KIND_POINTER)
+                            {
+                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
+                            }
+                            break;
+                        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+                            if (left_expr->sym_expr.global_sym_decl->type.kind == TYPE_KIND_POINTER)
+                            {
+                                left_value = LLVMBuildLoad(module->builder, left_value, "ptrload");
+                            }
+                            break;
+                        default:
+                            RED_NOT_IMPLEMENTED;
+                            break;
+                    }
+                    break;
+                }
+                default:
+                    RED_NOT_IMPLEMENTED;
+                    break;
+            }
+
+            IRExpression* right_expr = assign_st->right;
+            // Vector literals need the lane type, v = 0 splats the literal
+            IRType left_type = ast_to_ir_find_expression_type(left_expr);
+            LLVMValueRef right_value = llvm_gen_expression(context, module, ir_module, current_fn, right_expr, left_type.kind == TYPE_KIND_VECTOR ? &left_type : NULL);
+
+            LLVMValueRef store = LLVMBuildStore(module->builder, right_value, left_value);
+            return store;
+        }
+        case IR_ST_TYPE_LOOP_ST:
+        {
+            IRLoopStatement* loop_st = &st->loop_st;
+            LLVMBasicBlockRef condition_block = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "loop_condition");
+            LLVMBasicBlockRef loop_block = LLVMAppendBasicBlockInContext(context,      module->current_fn->proto->handle, "loop_block");
+            LLVMBasicBlockRef end_loop_block = LLVMAppendBasicBlockInContext(context,  module->current_fn->proto->handle, "end_loop_block");
+            LLVMBuildBr(module->builder, condition_block);
+
+            LLVMPositionBuilderAtEnd(module->builder, condition_block);
+            LLVMValueRef condition_value = llvm_gen_expression(context, module, ir_module, current_fn, &loop_st->condition, NULL);
+            LLVMBuildCondBr(module->builder, condition_value, loop_block, end_loop_block);
+
+            LLVMPositionBuilderAtEnd(module->builder, loop_block);
+            llvm_gen_compound_statement(context, module, ir_module, current_fn, &loop_st->body);
+            // Jump back to the top of the loop
+            LLVMValueRef latch_branch = LLVMBuildBr(module->builder, condition_block);
+            llvm_set_loop_hints(context, module, latch_branch, &loop_st->hints);
+
+            // Let the builder in a position where code after the loop can be written to
+            LLVMPositionBuilderAtEnd(module->builder, end_loop_block);
+
+            return null;
+        }
+        case IR_ST_TYPE_FN_CALL_ST:
+        {
+            IRFunctionCallStatement* fn_call_st = &st->fn_call_st;
+            LLVMValueRef fn_call_llvm = llvm_gen_fn_call(context, module, ir_module, current_fn, fn_call_st);
+            return fn_call_llvm;
+        }
+        case IR_ST_TYPE_COMPOUND_ST:
+            llvm_gen_compound_statement(context, module, ir_module, current_fn, &st->compound_st);
+            return null;
+        case IR_ST_TYPE_INTRINSIC_ST:
+            return llvm_gen_intrinsic(context, module, ir_module, current_fn, &st->intrinsic_st);
+        case IR_ST_TYPE_SUSPEND_ST:
+        {
+            LLVMBasicBlockRef resume_block = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "suspend.resume");
+            llvm_gen_coro_suspend(context, module, resume_block);
+            LLVMPositionBuilderAtEnd(module->builder, resume_block);
+            return null;
+        }
+        case IR_ST_TYPE_RESUME_ST:
+            llvm_gen_resume(context, module, ir_module, current_fn, &st->resume_st);
+            return null;
+        case IR_ST_TYPE_AWAIT_ST:
+            return llvm_gen_await(context, module, ir_module, current_fn, &st->await_st);
+        default:
+            RED_NOT_IMPLEMENTED;
+            return null;
+    }
+}
+
+// Structs with an explicit layout are emitted packed, with i8 arrays for the padding the IR layout computed, so the offsets don't depend on the data layout
+static inline TypeDeclarationLLVM llvm_gen_struct_type(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRStructDecl* struct_decl)
+{
+    TypeDeclarationLLVM type_decl = ZERO_INIT;
+    u32 field_count = struct_decl->field_count;
+    IRFieldDecl* field_ptr = struct_decl->fields;
+    usize offset = 0;
+    for (u32 i = 0; i < field_count; i++)
+    {
+        IRFieldDecl* field = &field_ptr[i];
+        if (struct_decl->has_explicit_layout && field->offset > offset)
+        {
+            llvm_type_append(&type_decl.child_types, LLVMArrayType(LLVMInt8TypeInContext(context), field->offset - offset));
+        }
+        llvm_type_append(&type_decl.child_types, llvm_gen_type(context, module, ir_module, &field->type));
+        offset = field->offset + field->type.size;
+    }
+    if (struct_decl->has_explicit_layout && struct_decl->size > offset)
+    {
+        llvm_type_append(&type_decl.child_types, LLVMArrayType(LLVMInt8TypeInContext(context), struct_decl->size - offset));
+    }
+    // TODO: Anonymous structs vs named structs
+    LLVMTypeRef type = LLVMStructCreateNamed(context, sb_ptr(&struct_decl->name));
+    LLVMStructSetBody(type, type_decl.child_types.ptr, type_decl.child_types.len, struct_decl->has_explicit_layout);
+    type_decl.type = type;
+    return type_decl;
+}
+
+static inline LLVMValueRef llvm_gen_global_sym(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRSymDeclStatement* sym_decl, LLVMLinkage linkage)
+{
+    LLVMValueRef result = LLVMAddGlobal(module->handle, llvm_gen_type(context, module, ir_module, &sym_decl->type), sb_ptr(sym_decl->name));
+    if (sym_decl->is_undefined)
+    {
+        LLVMSetInitializer(result, LLVMGetUndef(llvm_gen_type(context, module, ir_module, &sym_decl->type)));
+    }
+    else if (sym_decl->value.type != IR_EXPRESSION_TYPE_VOID)
+    {
+        LLVMSetInitializer(result, llvm_gen_expression(context, module, ir_module, NULL, &sym_decl->value, &sym_decl->type));
+    }
+    else
+    {
+        LLVMSetInitializer(result, LLVMConstNull(llvm_gen_type(context, module, ir_module, &sym_decl->type)));
+    }
+
+    LLVMSetLinkage(result, linkage);
+    LLVMSetGlobalConstant(result, sym_decl->is_const);
+    u32 alignment = llvm_sym_alignment(sym_decl);
+    if (alignment)
+    {
+        LLVMSetAlignment(result, alignment);
+    }
+    if (sym_decl->is_thread_local)
+    {
+        LLVMSetThreadLocal(result, true);
+        LLVMSetThreadLocalMode(result, module->tls_mode);
+    }
+    LLVMSetVisibility(result, LLVMDefaultVisibility);
+
+    return result;
+}
+
+// Also used for the target clones, which must behave like the function they come from
+static inline void llvm_add_fn_attributes(LLVMContextRef context, ModuleContext* module, LLVMValueRef fn, IRFunctionPrototype* ir_proto, FnABILLVM* abi)
+{
+    switch (ir_proto->attributes.inline_kind)
+    {
+        case INLINE_KIND_DEFAULT:
+            break;
+        case INLINE_KIND_ALWAYS:
+            llvm_add_enum_attribute(context, fn, LLVMAttributeFunctionIndex, "alwaysinline");
+            module->has_always_inline = true;
+            break;
+        case INLINE_KIND_NEVER:
+            llvm_add_enum_attribute(context, fn, LLVMAttributeFunctionIndex, "noinline");
+            break;
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+
+    llvm_add_abi_attributes(context, fn, abi, ir_proto);
+}
+
+static inline FnProtoLLVM llvm_gen_fn_proto(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto)
+{
+    FnProtoLLVM proto = ZERO_INIT;
+    proto.param_count = ir_proto->param_count;
+    redassert(proto.param_count < MAX_PARAM_COUNT);
+    llvm_fn_abi(context, module, ir_proto, &proto.abi);
+
+    u32 llvm_param_count = 0;
+    if (proto.abi.ret.kind == ABI_ARG_INDIRECT)
+    {
+        proto.param_types[llvm_param_count++] = LLVMPointerType(llvm_gen_type(context, module, ir_module, &ir_proto->ret_type), 0);
+    }
+
+    for (u32 i = 0; i < proto.param_count; i++)
+    {
+        IRType* red_type = &ir_proto->params[i].type;
+        LLVMTypeRef param_type = llvm_gen_type(context, module, ir_module, red_type);
+        switch (proto.abi.params[i].kind)
+        {
+            case ABI_ARG_DIRECT:
+                break;
+            case ABI_ARG_COERCE:
+                param_type = proto.abi.params[i].coerce_type;
+                break;
+            case ABI_ARG_INDIRECT:
+                param_type = LLVMPointerType(param_type, 0);
+                break;
+            default:
+                RED_UNREACHABLE;
+                break;
+        }
+        redassert(param_type);
+        proto.param_types[llvm_param_count++] = param_type;
+        if (module->debug.builder)
+        {
+            switch (red_type->kind)
+            {
+                case TYPE_KIND_PRIMITIVE:
+                    proto.debug.param_types[i] = LLVMDIBuilderCreateBasicType(module->debug.builder, primitive_type_str(red_type->primitive_type), strlen(primitive_type_str(red_type->primitive_type)), red_type->size * 8, dwarf_encodings[red_type->primitive_type], 0);
+                    redassert(proto.debug.param_types[i]);
+                    break;
+                case TYPE_KIND_VECTOR:
+                {
+                    IRTypePrimitive element_type = red_type->vector_type.element_type;
+                    const char* element_name = primitive_type_str(element_type);
+                    u64 element_bit_count = element_type == IR_TYPE_PRIMITIVE_BOOL ? 1 : LLVMSizeOfTypeInBits(LLVMGetModuleDataLayout(module->handle), llvm_primitive_types[element_type]);
+                    LLVMMetadataRef element_debug_type = LLVMDIBuilderCreateBasicType(module->debug.builder, element_name, strlen(element_name), element_bit_count, dwarf_encodings[element_type], 0);
+                    LLVMMetadataRef lanes = LLVMDIBuilderGetOrCreateSubrange(module->debug.builder, 0, red_type->vector_type.element_count);
+                    proto.debug.param_types[i] = LLVMDIBuilderCreateVectorType(module->debug.builder, red_type->size * 8, (u32)red_type->size * 8, element_debug_type, &lanes, 1);
+                    break;
+                }
+                case TYPE_KIND_FRAME:
+                    proto.debug.param_types[i] = LLVMDIBuilderCreateBasicType(module->debug.builder, "anyframe", strlen("anyframe"), 64, DW_ATE_address, 0);
+                    break;
+                default:
+                    RED_NOT_IMPLEMENTED;
+                    break;
+            }
+        }
+    }
+
+    // Async functions return the handle to their frame, the result goes to the promise
+    if (ir_proto->attributes.is_async)
+    {
+        proto.return_type = LLVMPointerType(llvm_primitive_types[IR_TYPE_PRIMITIVE_U8], 0);
+    }
+    else
+    {
+        switch (proto.abi.ret.kind)
+        {
+            case ABI_ARG_DIRECT:
+                proto.return_type = llvm_gen_type(context, module, ir_module, &ir_proto->ret_type);
+                break;
+            case ABI_ARG_COERCE:
+                proto.return_type = proto.abi.ret.coerce_type;
+                break;
+            case ABI_ARG_INDIRECT:
+                proto.return_type = LLVMVoidTypeInContext(context);
+                break;
+            default:
+                RED_UNREACHABLE;
+                break;
+        }
+    }
+    redassert(proto.return_type);
+    proto.fn_type = LLVMFunctionType(proto.return_type, proto.param_types, llvm_param_count, false);
+    proto.handle = LLVMAddFunction(module->handle, sb_ptr(ir_proto->name), proto.fn_type);
+    bool has_c_abi = llvm_fn_has_c_abi(ir_proto);
+    LLVMSetFunctionCallConv(proto.handle, has_c_abi ? LLVMCCallConv : LLVMFastCallConv);
+    LLVMSetVisibility(proto.handle, LLVMDefaultVisibility);
+    if (ir_proto->attributes.visibility == VISIBILITY_EXPORT && ir_proto->module == ir_module)
+    {
+        LLVMSetDLLStorageClass(proto.handle, LLVMDLLExportStorageClass);
+    }
+    llvm_add_fn_attributes(context, module, proto.handle, ir_proto, &proto.abi);
+
+    llvm_verify_function(proto.handle, "prototype", true);
+    // Private functions are internal so the optimizer can drop and specialize them. pub ones are called from other modules.
+    // Set after the verification: a declaration can't have internal linkage until its body is generated
+    LLVMSetLinkage(proto.handle, has_c_abi || ir_proto->attributes.visibility == VISIBILITY_PUB ? LLVMExternalLinkage : LLVMInternalLinkage);
+
+    return proto;
+}
+
+static inline void llvm_gen_fn_definition(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn)
+{
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "entry");
+    module->builder = LLVMCreateBuilderInContext(context);
+    LLVMPositionBuilderAtEnd(module->builder, entry);
+
+    IRFunctionPrototype* ir_proto = current_fn->proto;
+    u8 param_count = ir_proto->param_count;
+    LLVMValueRef* params = null;
+    IRParamDecl* ir_params = ir_proto->params;
+    // The parameters are copied after llvm.coro.begin, so they go to the frame
+    if (ir_proto->attributes.is_async)
+    {
+        llvm_gen_coro_begin(context, module, ir_module, ir_proto);
+    }
+
+    redassert(param_count < MAX_PARAM_COUNT);
+    if (param_count)
+    {
+        redassert(ir_params);
+        params = module->current_fn->param_array;
+        LLVMGetParams(module->current_fn->proto->handle, params);
+        // Skip the sret pointer
+        u32 param_offset = module->current_fn->proto->abi.ret.kind == ABI_ARG_INDIRECT;
+
+        for (usize i = 0; i < param_count; i++)
+        {
+            LLVMValueRef param = params[i + param_offset];
+            LLVMSetValueName(param, ir_params[i].name->ptr);
+            LLVMValueRef param_alloca;
+            switch (module->current_fn->proto->abi.params[i].kind)
+            {
+                case ABI_ARG_DIRECT:
+                    param_alloca = LLVMBuildAlloca(module->builder, LLVMTypeOf(param), "");
+                    LLVMBuildStore(module->builder, param, param_alloca);
+                    break;
+                case ABI_ARG_COERCE:
+                {
+                    LLVMTypeRef param_type = llvm_gen_type(context, module, ir_module, &ir_params[i].type);
+                    param_alloca = LLVMBuildAlloca(module->builder, param_type, "");
+                    LLVMBuildStore(module->builder, llvm_build_coerce(context, module, param, param_type), param_alloca);
+                    break;
+                }
+                case ABI_ARG_INDIRECT:
+                    // Used in place, except by async functions: the frame outlives the call and with it the caller's temporary
+                    param_alloca = param;
+                    if (ir_proto->attributes.is_async)
+                    {
+                        param_alloca = LLVMBuildAlloca(module->builder, LLVMGetElementType(LLVMTypeOf(param)), "");
+                        LLVMBuildStore(module->builder, LLVMBuildLoad(module->builder, param, ""), param_alloca);
+                    }
+                    break;
+                default:
+                    RED_UNREACHABLE;
+                    param_alloca = null;
+                    break;
+            }
+            module->current_fn->param_alloca_array[i] = param_alloca;
+        }
+    }
+
+    u32 st_count = current_fn->body.stmts.len;
+    if (st_count > 0)
+    {
+        IRCompoundStatement* body = &current_fn->body;
+        llvm_gen_compound_statement(context, module, ir_module, current_fn, body);
+        if (ir_proto->attributes.is_async)
+        {
+            llvm_gen_coro_end(context, module, ir_module, ir_proto);
+        }
+        else if (!module->current_fn->return_already_emitted && current_fn->proto->ret_type.kind == TYPE_KIND_VOID)
+        {
+            LLVMBuildRetVoid(module->builder);
+        }
+    }
+    else if (st_count == 0 && current_fn->proto->ret_type.kind == TYPE_KIND_VOID)
+    {
+        LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "entry");
+        LLVMBuildRetVoid(module->builder);
+    }
+    else
+    {
+        RED_UNREACHABLE;
+    }
+
+    if (module->debug.builder)
+    {
+        LLVMDIFlags flags = LLVMDIFlagZero;
+        // TODO: we need an extern decl for only prototyped functions for LLVMDIFlagPrototyped ????????????????????????
+        flags |= LLVMDIFlagPublic;
+        //flags |= LLVMDIFlagPrototyped;
+
+        LLVMMetadataRef function_type = LLVMDIBuilderCreateSubroutineType(module->debug.builder, module->debug.file, module->current_fn->proto->debug.param_types, module->current_fn->proto->param_count, 0);
+        LLVMMetadataRef di_function = LLVMDIBuilderCreateFunction(module->debug.builder, module->debug.file, sb_ptr(ir_proto->name), sb_len(ir_proto->name), sb_ptr(ir_proto->name), sb_len(ir_proto->name), module->debug.file, ir_proto->debug.line, function_type, false, true, ir_proto->debug.line, flags, false);
+        LLVMSetSubprogram(module->current_fn->proto->handle, di_function);
+    }
+#if RED_LLVM_VERBOSE
+    //llvm_verify_function(module->current_fn->proto->handle, "definition", false);
+#endif
+}
+
+// Targets accepted by #target_clones. At runtime, the dispatcher checks the cpuid bit of each one and, for the AVX family, that the OS saves the wider registers (XCR0)
+typedef struct TargetCloneLLVM
+{
+    const char* name;
+    const char* features;
+    u8 cpuid_leaf;
+    u8 cpuid_register;
+    u8 cpuid_bit;
+    u8 xcr0_mask;
+} TargetCloneLLVM;
+
+typedef enum CPUIDRegister
+{
+    CPUID_EAX,
+    CPUID_EBX,
+    CPUID_ECX,
+    CPUID_EDX,
+    CPUID_REGISTER_COUNT,
+} CPUIDRegister;
+
+#define XCR0_AVX_STATE 0x06
+#define XCR0_AVX512_STATE 0xe6
+
+static const TargetCloneLLVM llvm_target_clones[] =
+{
+    { "sse3", "+sse3", 1, CPUID_ECX, 0, 0 },
+    { "ssse3", "+ssse3", 1, CPUID_ECX, 9, 0 },
+    { "sse4.1", "+sse4.1", 1, CPUID_ECX, 19, 0 },
+    { "sse4.2", "+sse4.2", 1, CPUID_ECX, 20, 0 },
+    { "popcnt", "+popcnt", 1, CPUID_ECX, 23, 0 },
+    { "avx", "+avx", 1, CPUID_ECX, 28, XCR0_AVX_STATE },
+    { "fma", "+fma", 1, CPUID_ECX, 12, XCR0_AVX_STATE },
+    { "avx2", "+avx2", 7, CPUID_EBX, 5, XCR0_AVX_STATE },
+    { "bmi", "+bmi", 7, CPUID_EBX, 3, 0 },
+    { "bmi2", "+bmi2", 7, CPUID_EBX, 8, 0 },
+    { "avx512f", "+avx512f", 7, CPUID_EBX, 16, XCR0_AVX512_STATE },
+};
+
+static inline const TargetCloneLLVM* llvm_find_target_clone(const char* name)
+{
+    for (u32 i = 0; i < array_length(llvm_target_clones); i++)
+    {
+        if (strequal(llvm_target_clones[i].name, name))
+        {
+            return &llvm_target_clones[i];
+        }
+    }
+
+    return null;
+}
+
+static inline LLVMValueRef llvm_build_cpuid(LLVMContextRef context, LLVMBuilderRef builder, u32 leaf)
+{
+    LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+    LLVMTypeRef result_types[CPUID_REGISTER_COUNT] = { i32_type, i32_type, i32_type, i32_type };
+    LLVMTypeRef param_types[] = { i32_type, i32_type };
+    LLVMTypeRef fn_type = LLVMFunctionType(LLVMStructTypeInContext(context, result_types, CPUID_REGISTER_COUNT, false), param_types, array_length(param_types), false);
+    char assembly[] = "cpuid";
+    char constraints[] = "={ax},={bx},={cx},={dx},{ax},{cx},~{dirflag},~{fpsr},~{flags}";
+    LLVMValueRef cpuid = LLVMGetInlineAsm(fn_type, assembly, strlen(assembly), constraints, strlen(constraints), true, false, LLVMInlineAsmDialectATT);
+    LLVMValueRef args[] = { LLVMConstInt(i32_type, leaf, false), LLVMConstInt(i32_type, 0, false) };
+    return LLVMBuildCall(builder, cpuid, args, array_length(args), "cpuid");
+}
+
+// Returns a mask with the bit of every entry of llvm_target_clones the running CPU supports. Generated once per module
+static inline LLVMValueRef llvm_gen_cpu_features_fn(LLVMContextRef context, ModuleContext* module)
+{
+    static const char* fn_name = "red.cpu_features";
+    LLVMValueRef fn = LLVMGetNamedFunction(module->handle, fn_name);
+    if (fn)
+    {
+        return fn;
+    }
+
+    LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+    fn = LLVMAddFunction(module->handle, fn_name, LLVMFunctionType(i32_type, null, 0, false));
+    LLVMSetLinkage(fn, LLVMInternalLinkage);
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+    LLVMBasicBlockRef entry_block = LLVMAppendBasicBlockInContext(context, fn, "entry");
+    LLVMBasicBlockRef leaf7_block = LLVMAppendBasicBlockInContext(context, fn, "leaf7");
+    LLVMBasicBlockRef leaf7_end_block = LLVMAppendBasicBlockInContext(context, fn, "leaf7.end");
+    LLVMBasicBlockRef xgetbv_block = LLVMAppendBasicBlockInContext(context, fn, "xgetbv");
+    LLVMBasicBlockRef features_block = LLVMAppendBasicBlockInContext(context, fn, "features");
+    LLVMValueRef zero = LLVMConstInt(i32_type, 0, false);
+
+    // Leaf 7 only exists if the highest leaf reported by leaf 0 reaches it
+    LLVMPositionBuilderAtEnd(builder, entry_block);
+    LLVMValueRef max_leaf = LLVMBuildExtractValue(builder, llvm_build_cpuid(context, builder, 0), CPUID_EAX, "max_leaf");
+    LLVMValueRef leaf1 = llvm_build_cpuid(context, builder, 1);
+    LLVMValueRef leaf1_registers[CPUID_REGISTER_COUNT];
+    for (u32 i = 0; i < CPUID_REGISTER_COUNT; i++)
+    {
+        leaf1_registers[i] = LLVMBuildExtractValue(builder, leaf1, i, "");
+    }
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntUGE, max_leaf, LLVMConstInt(i32_type, 7, false), ""), leaf7_block, leaf7_end_block);
+
+    LLVMPositionBuilderAtEnd(builder, leaf7_block);
+    LLVMValueRef leaf7 = llvm_build_cpuid(context, builder, 7);
+    LLVMValueRef leaf7_values[CPUID_REGISTER_COUNT];
+    for (u32 i = 0; i < CPUID_REGISTER_COUNT; i++)
+    {
+        leaf7_values[i] = LLVMBuildExtractValue(builder, leaf7, i, "");
+    }
+    LLVMBuildBr(builder, leaf7_end_block);
+
+    LLVMPositionBuilderAtEnd(builder, leaf7_end_block);
+    LLVMValueRef leaf7_registers[CPUID_REGISTER_COUNT];
+    for (u32 i = 0; i < CPUID_REGISTER_COUNT; i++)
+    {
+        leaf7_registers[i] = LLVMBuildPhi(builder, i32_type, "");
+        LLVMValueRef incoming_values[] = { zero, leaf7_values[i] };
+        LLVMBasicBlockRef incoming_blocks[] = { entry_block, leaf7_block };
+        LLVMAddIncoming(leaf7_registers[i], incoming_values, incoming_blocks, array_length(incoming_values));
+    }
+    // xgetbv faults unless the OS enabled it (OSXSAVE)
+    LLVMValueRef osxsave = LLVMBuildAnd(builder, leaf1_registers[CPUID_ECX], LLVMConstInt(i32_type, 1u << 27, false), "");
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntNE, osxsave, zero, ""), xgetbv_block, features_block);
+
+    LLVMPositionBuilderAtEnd(builder, xgetbv_block);
+    LLVMTypeRef xgetbv_result_types[] = { i32_type, i32_type };
+    LLVMTypeRef xgetbv_type = LLVMFunctionType(LLVMStructTypeInContext(context, xgetbv_result_types, array_length(xgetbv_result_types), false), &i32_type, 1, false);
+    char xgetbv_assembly[] = "xgetbv";
+    char xgetbv_constraints[] = "={ax},={dx},{cx},~{dirflag},~{fpsr},~{flags}";
+    LLVMValueRef xgetbv = LLVMGetInlineAsm(xgetbv_type, xgetbv_assembly, strlen(xgetbv_assembly), xgetbv_constraints, strlen(xgetbv_constraints), true, false, LLVMInlineAsmDialectATT);
+    LLVMValueRef xcr0_value = LLVMBuildExtractValue(builder, LLVMBuildCall(builder, xgetbv, &zero, 1, "xgetbv"), 0, "");
+    LLVMBuildBr(builder, features_block);
+
+    LLVMPositionBuilderAtEnd(builder, features_block);
+    LLVMValueRef xcr0 = LLVMBuildPhi(builder, i32_type, "xcr0");
+    LLVMValueRef xcr0_incoming_values[] = { zero, xcr0_value };
+    LLVMBasicBlockRef xcr0_incoming_blocks[] = { leaf7_end_block, xgetbv_block };
+    LLVMAddIncoming(xcr0, xcr0_incoming_values, xcr0_incoming_blocks, array_length(xcr0_incoming_values));
+
+    LLVMValueRef features = zero;
+    for (u32 i = 0; i < array_length(llvm_target_clones); i++)
+    {
+        const TargetCloneLLVM* clone = &llvm_target_clones[i];
+        LLVMValueRef cpuid_register = clone->cpuid_leaf == 1 ? leaf1_registers[clone->cpuid_register] : leaf7_registers[clone->cpuid_register];
+        LLVMValueRef bit = LLVMBuildAnd(builder, cpuid_register, LLVMConstInt(i32_type, 1u << clone->cpuid_bit, false), "");
+        LLVMValueRef supported = LLVMBuildICmp(builder, LLVMIntNE, bit, zero, clone->name);
+        if (clone->xcr0_mask)
+        {
+            LLVMValueRef xcr0_mask = LLVMConstInt(i32_type, clone->xcr0_mask, false);
+            LLVMValueRef os_support = LLVMBuildICmp(builder, LLVMIntEQ, LLVMBuildAnd(builder, xcr0, xcr0_mask, ""), xcr0_mask, "");
+            supported = LLVMBuildAnd(builder, supported, os_support, "");
+        }
+        LLVMValueRef feature = LLVMBuildShl(builder, LLVMBuildZExt(builder, supported, i32_type, ""), LLVMConstInt(i32_type, i, false), "");
+        features = LLVMBuildOr(builder, features, feature, "");
+    }
+    LLVMBuildRet(builder, features);
+    LLVMDisposeBuilder(builder);
+
+    return fn;
+}
+
+// One body per target, named <fn>.<target> and compiled with its features. The function itself becomes a dispatcher:
+// the first call picks the first listed clone the CPU supports and caches it in <fn>.resolved. COFF has no ifuncs, so this works the same everywhere
+static inline void llvm_gen_target_clones(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn)
+{
+    IRFunctionPrototype* ir_proto = current_fn->proto;
+    SBBuffer* targets = &ir_proto->attributes.target_clones;
+    const char* triple = LLVMGetTarget(module->handle);
+    if (strncmp(triple, "x86_64", strlen("x86_64")) != 0)
+    {
+        os_exit_with_message("target_clones in %s needs an x86-64 target, not %s\n", sb_ptr(ir_proto->name), triple);
+    }
+
+    FnProtoLLVM* dispatcher = module->current_fn->proto;
+    LLVMValueRef clone_handles[array_length(llvm_target_clones) + 1];
+    const TargetCloneLLVM* clone_targets[array_length(llvm_target_clones) + 1];
+    LLVMValueRef default_handle = null;
+    redassert(targets->len <= array_length(clone_handles));
+
+    for (u32 i = 0; i < targets->len; i++)
+    {
+        const char* target_name = sb_ptr(targets->ptr[i]);
+        const TargetCloneLLVM* target = null;
+        if (!strequal(target_name, "default"))
+        {
+            target = llvm_find_target_clone(target_name);
+            if (!target)
+            {
+                os_exit_with_message("Unknown target_clones target in %s: %s\n", sb_ptr(ir_proto->name), target_name);
+            }
+        }
+
+        SB* clone_name = sb_alloc();
+        sb_append_str(clone_name, sb_ptr(ir_proto->name));
+        sb_append_char(clone_name, '.');
+        sb_append_str(clone_name, target_name);
+
+        FnProtoLLVM clone_proto = *dispatcher;
+        clone_proto.handle = LLVMAddFunction(module->handle, sb_ptr(clone_name), dispatcher->fn_type);
+        LLVMSetLinkage(clone_proto.handle, LLVMInternalLinkage);
+        // Only called through the dispatcher
+        LLVMSetFunctionCallConv(clone_proto.handle, LLVMFastCallConv);
+        llvm_add_fn_attributes(context, module, clone_proto.handle, ir_proto, &dispatcher->abi);
+        if (target)
+        {
+            SB* features = sb_alloc();
+            if (*module->target_features)
+            {
+                sb_append_str(features, module->target_features);
+                sb_append_char(features, ',');
+            }
+            sb_append_str(features, target->features);
+            LLVMAttributeRef attribute = LLVMCreateStringAttribute(context, "target-features", strlen("target-features"), sb_ptr(features), sb_len(features));
+            LLVMAddAttributeAtIndex(clone_proto.handle, LLVMAttributeFunctionIndex, attribute);
+        }
+        else
+        {
+            default_handle = clone_proto.handle;
+        }
+
+        CurrentFnLLVM clone_fn = ZERO_INIT;
+        clone_fn.proto = &clone_proto;
+        module->current_fn = &clone_fn;
+        llvm_gen_fn_definition(context, module, ir_module, current_fn);
+        clone_handles[i] = clone_proto.handle;
+        clone_targets[i] = target;
+    }
+    redassert(default_handle);
+
+    LLVMTypeRef i32_type = LLVMInt32TypeInContext(context);
+    LLVMTypeRef fn_pointer_type = LLVMPointerType(dispatcher->fn_type, 0);
+    SB* resolved_name = sb_alloc();
+    sb_append_str(resolved_name, sb_ptr(ir_proto->name));
+    sb_append_str(resolved_name, ".resolved");
+    LLVMValueRef resolved = LLVMAddGlobal(module->handle, fn_pointer_type, sb_ptr(resolved_name));
+    LLVMSetLinkage(resolved, LLVMInternalLinkage);
+    LLVMSetInitializer(resolved, LLVMConstNull(fn_pointer_type));
+
+    LLVMBuilderRef builder = LLVMCreateBuilderInContext(context);
+    LLVMBasicBlockRef entry_block = LLVMAppendBasicBlockInContext(context, dispatcher->handle, "entry");
+    LLVMBasicBlockRef resolve_block = LLVMAppendBasicBlockInContext(context, dispatcher->handle, "resolve");
+    LLVMBasicBlockRef call_block = LLVMAppendBasicBlockInContext(context, dispatcher->handle, "call");
+
+    // Threads racing on the first call all store the same pointer
+    LLVMPositionBuilderAtEnd(builder, entry_block);
+    LLVMValueRef cached = LLVMBuildLoad(builder, resolved, "cached");
+    LLVMSetOrdering(cached, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(cached, LLVMABIAlignmentOfType(LLVMGetModuleDataLayout(module->handle), fn_pointer_type));
+    LLVMBuildCondBr(builder, LLVMBuildIsNull(builder, cached, ""), resolve_block, call_block);
+
+    LLVMPositionBuilderAtEnd(builder, resolve_block);
+    LLVMValueRef features = LLVMBuildCall(builder, llvm_gen_cpu_features_fn(context, module), null, 0, "features");
+    LLVMValueRef chosen = default_handle;
+    // Walk backwards so the first listed target wins
+    for (s32 i = targets->len - 1; i >= 0; i--)
+    {
+        if (clone_targets[i])
+        {
+            LLVMValueRef feature_bit = LLVMConstInt(i32_type, 1u << (clone_targets[i] - llvm_target_clones), false);
+            LLVMValueRef supported = LLVMBuildICmp(builder, LLVMIntNE, LLVMBuildAnd(builder, features, feature_bit, ""), LLVMConstInt(i32_type, 0, false), "");
+            chosen = LLVMBuildSelect(builder, supported, clone_handles[i], chosen, "");
+        }
+    }
+    LLVMValueRef store = LLVMBuildStore(builder, chosen, resolved);
+    LLVMSetOrdering(store, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(store, LLVMABIAlignmentOfType(LLVMGetModuleDataLayout(module->handle), fn_pointer_type));
+    LLVMBuildBr(builder, call_block);
+
+    LLVMPositionBuilderAtEnd(builder, call_block);
+    LLVMValueRef callee = LLVMBuildPhi(builder, fn_pointer_type, "callee");
+    LLVMValueRef incoming_values[] = { cached, chosen };
+    LLVMBasicBlockRef incoming_blocks[] = { entry_block, resolve_block };
+    LLVMAddIncoming(callee, incoming_values, incoming_blocks, array_length(incoming_values));
+    LLVMValueRef params[MAX_PARAM_COUNT + 1];
+    LLVMGetParams(dispatcher->handle, params);
+    LLVMValueRef result = LLVMBuildCall(builder, callee, params, LLVMCountParams(dispatcher->handle), "");
+    LLVMSetInstructionCallConv(result, LLVMFastCallConv);
+    llvm_add_abi_attributes(context, result, &dispatcher->abi, ir_proto);
+    LLVMSetTailCall(result, true);
+    if (dispatcher->return_type == LLVMVoidTypeInContext(context))
+    {
+        LLVMBuildRetVoid(builder);
+    }
+    else
+    {
+        LLVMBuildRet(builder, result);
+    }
+    LLVMDisposeBuilder(builder);
+}
+
+// Checks the CPU and the comma-separated +/- feature list against the target. On failure, invalid_name gets the offending CPU or feature
+static inline Error llvm_validate_cpu_features(const char* triple, const char* cpu, const char* features, SB* invalid_name)
+{
+    if (*cpu && !llvm_target_has_cpu(triple, cpu))
+    {
+        sb_append_str(invalid_name, cpu);
+        return ERROR_UNKNOWN_CPU;
+    }
+
+    const char* it = features;
+    while (*it)
+    {
+        const char* feature = it;
+        while (*it && *it != ',')
+        {
+            it++;
+        }
+        sb_clear(invalid_name);
+        sb_resize(invalid_name, 0);
+        sb_append_mem(invalid_name, feature, (s32)(it - feature));
+        if ((*feature != '+' && *feature != '-') || it - feature < 2)
+        {
+            return ERROR_INVALID_CPU_FEATURES;
+        }
+        if (!llvm_target_has_feature(triple, sb_ptr(invalid_name) + 1))
+        {
+            return ERROR_UNKNOWN_CPU_FEATURE;
+        }
+        if (*it == ',')
+        {
+            it++;
+        }
+    }
+
+    sb_clear(invalid_name);
+    return ERROR_NONE;
+}
+
+// -mcpu=native takes the host CPU and every feature it reports, with the -mattr ones applied on top
+static inline void llvm_resolve_cpu_features(CompilerOptions* options, TargetLLVM* target)
+{
+    const char* cpu = options->cpu ? options->cpu : "";
+    const char* features = options->features ? options->features : "";
+    if (strequal(cpu, "native"))
+    {
+        cpu = LLVMGetHostCPUName();
+        char* host_features = LLVMGetHostCPUFeatures();
+        if (*features)
+        {
+            SB* all_features = sb_alloc();
+            sb_append_str(all_features, host_features);
+            sb_append_char(all_features, ',');
+            sb_append_str(all_features, features);
+            features = sb_ptr(all_features);
+            LLVMDisposeMessage(host_features);
+        }
+        else
+        {
+            features = host_features;
+        }
+    }
+
+    SB* invalid_name = sb_alloc();
+    switch (llvm_validate_cpu_features(target->triple, cpu, features, invalid_name))
+    {
+        case ERROR_NONE:
+            break;
+        case ERROR_UNKNOWN_CPU:
+            os_exit_with_message("Unknown CPU for target %s: %s\n", target->triple, sb_ptr(invalid_name));
+            break;
+        case ERROR_UNKNOWN_CPU_FEATURE:
+            os_exit_with_message("Unknown CPU feature for target %s: %s\n", target->triple, sb_ptr(invalid_name));
+            break;
+        case ERROR_INVALID_CPU_FEATURES:
+            os_exit_with_message("Invalid CPU feature \"%s\": expected +<feature> or -<feature>\n", sb_ptr(invalid_name));
+            break;
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+
+    target->cpu = cpu;
+    target->features = features;
+}
+
+static inline TargetLLVM target_create(CompilerOptions* options)
+{
+    TargetLLVM target = ZERO_INIT;
+    LLVMInitializeAllTargetInfos();
+    LLVMInitializeAllTargetMCs();
+    LLVMInitializeAllTargets();
+    LLVMInitializeAllAsmPrinters();
+    LLVMInitializeAllAsmParsers();
+    //LLVMInitializeAllDisassemblers();
+    target.triple = LLVMGetDefaultTargetTriple();
+    redassert(target.triple);
+
+    char* error_message = null;
+    if (LLVMGetTargetFromTriple(target.triple, &target.handle, &error_message))
+    {
+        os_exit_with_message("Couldn't create target: %s\n", error_message);
+    }
+    redassert(target.handle);
+
+    llvm_resolve_cpu_features(options, &target);
+    static const LLVMCodeGenOptLevel opt_levels[] = { LLVMCodeGenLevelNone, LLVMCodeGenLevelLess, LLVMCodeGenLevelDefault, LLVMCodeGenLevelAggressive };
+    redassert(options->opt_level < array_length(opt_levels));
+    target.opt_level = opt_levels[options->opt_level];
+    static const LLVMThreadLocalMode tls_modes[] = { LLVMGeneralDynamicTLSModel, LLVMLocalDynamicTLSModel, LLVMInitialExecTLSModel, LLVMLocalExecTLSModel };
+    redassert(options->tls_model < array_length(tls_modes));
+    target.tls_mode = tls_modes[options->tls_model];
+    LLVMRelocMode reloc_mode = LLVMRelocDefault;
+
+    target.machine = LLVMCreateTargetMachine(target.handle, target.triple, target.cpu, target.features, target.opt_level, reloc_mode, LLVMCodeModelDefault);
+    redassert(target.machine);
+
+    if (!target.machine)
+    {
+        os_exit_with_message("Failed to create target machine\n");
+    }
+
+    target.data = LLVMCreateTargetDataLayout(target.machine);
+    redassert(target.data);
+    
+    //char* target_triple = LLVMGetTargetMachineTriple(ctx.target_machine);
+
+    //LLVMDisposeMessage(target_triple);
+
+    return target;
+}
+
+static inline ModuleContext module_create(LLVMContextRef context, TargetLLVM target, IRModule* ir_module, const char* path, bool generate_debug_info, bool is_optimized)
+{
+    ModuleContext module = ZERO_INIT;
+    module.handle = LLVMModuleCreateWithNameInContext(ir_module->name, context);
+    LLVMSetModuleDataLayout(module.handle, target.data);
+    LLVMSetSourceFileName(module.handle, path, strlen(path));
+    LLVMSetTarget(module.handle, target.triple);
+    module.target_features = target.features;
+    module.tls_mode = target.tls_mode;
 
-            IRExpression* right_expr = assign_st->right;
-            LLVMValueRef right_value = llvm_gen_expression(context, module, ir_module, current_fn, right_expr, NULL);
+    if (generate_debug_info)
+    {
+        const char* flags = "";
+        s32 runtime_version = 1;
+        module.debug.builder = LLVMCreateDIBuilder(module.handle);
+        module.debug.file = LLVMDIBuilderCreateFile(module.debug.builder, ir_module->name, strlen(ir_module->name), path, strlen(path));
+        LLVMMetadataRef compile_unit = LLVMDIBuilderCreateCompileUnit(module.debug.builder, LLVMDWARFSourceLanguageC11, module.debug.file, "red", strlen("red"), is_optimized, flags, strlen(flags), runtime_version, "", 0, LLVMDWARFEmissionFull, 0, 0, 0, "", 0, "", 0);
 
-            LLVMValueRef store = LLVMBuildStore(module->builder, right_value, left_value);
-            return store;
-        }
-        case IR_ST_TYPE_LOOP_ST:
-        {
-            IRLoopStatement* loop_st = &st->loop_st;
-            LLVMBasicBlockRef condition_block = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "loop_condition");
-            LLVMBasicBlockRef loop_block = LLVMAppendBasicBlockInContext(context,      module->current_fn->proto->handle, "loop_block");
-            LLVMBasicBlockRef end_loop_block = LLVMAppendBasicBlockInContext(context,  module->current_fn->proto->handle, "end_loop_block");
-            LLVMBuildBr(module->builder, condition_block);
+    }
 
-            LLVMPositionBuilderAtEnd(module->builder, condition_block);
-            LLVMValueRef condition_value = llvm_gen_expression(context, module, ir_module, current_fn, &loop_st->condition, NULL);
-            LLVMBuildCondBr(module->builder, condition_value, loop_block, end_loop_block);
+    return module;
+}
 
-            LLVMPositionBuilderAtEnd(module->builder, loop_block);
-            llvm_gen_compound_statement(context, module, ir_module, current_fn, &loop_st->body);
-            // Jump back to the top of the loop
-            LLVMBuildBr(module->builder, condition_block);
+static inline void llvm_register_primitive_types(LLVMContextRef context)
+{
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_U8] = LLVMInt8TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_U16] = LLVMInt16TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_U32] = LLVMInt32TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_U64] = LLVMInt64TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_S8] = LLVMInt8TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_S16] = LLVMInt16TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_S32] = LLVMInt32TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_S64] = LLVMInt64TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_F32] = LLVMFloatTypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_F64] = LLVMDoubleTypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_F128] = LLVMFP128TypeInContext(context);
+    llvm_primitive_types[IR_TYPE_PRIMITIVE_BOOL] = LLVMInt1TypeInContext(context);
+}
 
-            // Let the builder in a position where code after the loop can be written to
-            LLVMPositionBuilderAtEnd(module->builder, end_loop_block);
+bool llvm_gen_module_ir(LLVMContextRef context, ModuleContext* module, IRModule* ir_module)
+{
+    ExplicitTimer ir_dt = os_timer_start("IRGen");
 
-            return null;
+    IRStructDeclBuffer* struct_decls = &ir_module->struct_decls;
+    u64 struct_count = struct_decls->len;
+    IRStructDecl* struct_decl_ptr = struct_decls->ptr;
+    for (usize i = 0; i < struct_count; i++)
+    {
+        IRStructDecl* struct_decl = &struct_decl_ptr[i];
+        llvm_type_decl_append(&module->type_declarations, llvm_gen_struct_type(context, module, ir_module, struct_decl));
+    }
+
+    IRSymDeclStatementBuffer* global_sym_decls = &ir_module->global_sym_decls;
+    u64 global_sym_decl_count = global_sym_decls->len;
+    IRSymDeclStatement* global_ptr = global_sym_decls->ptr;
+    for (u64 i = 0; i < global_sym_decl_count; i++)
+    {
+        IRSymDeclStatement* sym_decl = &global_ptr[i];
+        LLVMValueRef global_sym = llvm_gen_global_sym(context, module, ir_module, sym_decl, sym_decl->visibility == VISIBILITY_PRIVATE ? LLVMInternalLinkage : LLVMExternalLinkage);
+        if (sym_decl->visibility == VISIBILITY_EXPORT)
+        {
+            LLVMSetDLLStorageClass(global_sym, LLVMDLLExportStorageClass);
         }
-        case IR_ST_TYPE_FN_CALL_ST:
+        llvm_value_append(&module->global_sym_buffer, global_sym);
+    }
+
+    IRFunctionPrototypeBuffer* fn_proto_buffer = &ir_module->fn_prototypes;
+    u64 fn_proto_count = fn_proto_buffer->len;
+    IRFunctionPrototype* fn_proto_ptr = fn_proto_buffer->ptr;
+    for (u64 i = 0; i < fn_proto_count; i++)
+    {
+        IRFunctionPrototype* fn_proto = &fn_proto_ptr[i];
+        llvm_fn_proto_append(&module->fn_proto_buffer, llvm_gen_fn_proto(context, module, ir_module, fn_proto));
+    }
+
+    IRFunctionDefinitionBuffer* fn_defs = &ir_module->fn_definitions;
+    u32 fn_def_count = fn_defs->len;
+    for (usize i = 0; i < fn_def_count; i++)
+    {
+        CurrentFnLLVM current_fn = ZERO_INIT;
+        IRFunctionDefinition* fn_def_it = &fn_defs->ptr[i];
+        IRFunctionPrototype* fn_proto_ref = fn_def_it->proto;
+        u64 proto_index = fn_proto_ref - fn_proto_ptr;
+        module->current_fn = &current_fn;
+        module->current_fn->proto = &module->fn_proto_buffer.ptr[proto_index];
+        redassert(module->current_fn->proto);
+        if (fn_proto_ref->attributes.target_clones.len)
         {
-            IRFunctionCallStatement* fn_call_st = &st->fn_call_st;
-            LLVMValueRef fn_call_llvm = llvm_gen_fn_call(context, module, ir_module, current_fn, fn_call_st);
-            return fn_call_llvm;
+            llvm_gen_target_clones(context, module, ir_module, fn_def_it);
+        }
+        else
+        {
+            llvm_gen_fn_definition(context, module, ir_module, fn_def_it);
         }
-        case IR_ST_TYPE_COMPOUND_ST:
-            llvm_gen_compound_statement(context, module, ir_module, current_fn, &st->compound_st);
-            return null;
-        default:
-            RED_NOT_IMPLEMENTED;
-            return null;
     }
+
+    llvm_merge_string_tails(context, module);
+
+    bool result = llvm_verify_module(module->handle);
+
+    os_timer_end(&ir_dt);
+    return result;
 }
 
-static inline TypeDeclarationLLVM llvm_gen_struct_type(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRStructDecl* struct_decl)
+#if RED_LLVM_OBJECT_CACHE
+#define LLVM_CACHE_DIRECTORY "red_cache"
+// Part of the key. Bump it whenever the hashed walk or the code generated for the same IR changes, so stale objects aren't reused
+#define LLVM_CACHE_FORMAT_VERSION 1
+
+// FNV-1a over a structural walk of the lowered IR. Pointers are never hashed, only what they refer to, so the key is stable across runs.
+// 64 bits can collide, so every hashed byte is also kept and stored next to the object: a hit needs the same bytes, not only the same key
+typedef struct IRHash
 {
-    TypeDeclarationLLVM type_decl = ZERO_INIT;
-    u32 field_count = struct_decl->field_count;
-    IRFieldDecl* field_ptr = struct_decl->fields;
-    for (u32 i = 0; i < field_count; i++)
+    u64 value;
+    SB* material;
+} IRHash;
+
+static inline void ir_hash_bytes(IRHash* hash, const void* data, usize size)
+{
+    const u8* bytes = data;
+    u64 h = hash->value;
+    for (usize i = 0; i < size; i++)
     {
-        IRFieldDecl* field = &field_ptr[i];
-        llvm_type_append(&type_decl.child_types, llvm_gen_type(context, module, ir_module, &field->type));
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
     }
-    // TODO: Anonymous structs vs named structs
-    LLVMTypeRef type = LLVMStructCreateNamed(context, sb_ptr(&struct_decl->name));
-    LLVMStructSetBody(type, type_decl.child_types.ptr, type_decl.child_types.len, false);
-    type_decl.type = type;
-    return type_decl;
+    hash->value = h;
+    sb_append_mem(hash->material, data, (s32)size);
 }
 
-static inline LLVMValueRef llvm_gen_global_sym(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRSymDeclStatement* sym_decl, LLVMLinkage linkage)
+static inline void ir_hash_u64(IRHash* hash, u64 value)
 {
-    LLVMValueRef result = LLVMAddGlobal(module->handle, llvm_gen_type(context, module, ir_module, &sym_decl->type), sb_ptr(sym_decl->name));
-    if (sym_decl->value.type != IR_EXPRESSION_TYPE_VOID)
+    ir_hash_bytes(hash, &value, sizeof(value));
+}
+
+static inline void ir_hash_str(IRHash* hash, const char* str)
+{
+    if (str)
     {
-        LLVMSetInitializer(result, llvm_gen_expression(context, module, ir_module, NULL, &sym_decl->value, NULL));
+        ir_hash_bytes(hash, str, strlen(str) + 1);
     }
     else
     {
-        LLVMSetInitializer(result, LLVMConstNull(llvm_gen_type(context, module, ir_module, &sym_decl->type)));
+        ir_hash_u64(hash, 0);
     }
+}
 
-    LLVMSetLinkage(result, linkage);
-    LLVMSetGlobalConstant(result, sym_decl->is_const);
-    LLVMSetVisibility(result, LLVMDefaultVisibility);
+static inline void ir_hash_sb(IRHash* hash, SB* sb)
+{
+    ir_hash_str(hash, sb && sb->len ? sb->ptr : null);
+}
 
-    return result;
+static void ir_hash_expression(IRHash* hash, IRExpression* expression);
+static void ir_hash_compound(IRHash* hash, IRCompoundStatement* compound_st);
+static void ir_hash_intrinsic(IRHash* hash, IRIntrinsicExpr* intrinsic);
+
+static void ir_hash_type(IRHash* hash, IRType* type)
+{
+    ir_hash_u64(hash, type->kind);
+    switch (type->kind)
+    {
+        case TYPE_KIND_PRIMITIVE:
+            ir_hash_u64(hash, type->primitive_type);
+            break;
+        case TYPE_KIND_STRUCT:
+            // By name: the fields are hashed with the declaration, and pointers to the struct itself would recurse forever
+            ir_hash_sb(hash, &type->struct_type->name);
+            break;
+        case TYPE_KIND_ENUM:
+            ir_hash_sb(hash, type->enum_type->name);
+            break;
+        case TYPE_KIND_ARRAY:
+            ir_hash_type(hash, type->array_type.base_type);
+            ir_hash_expression(hash, type->array_type.elem_count_expr);
+            ir_hash_u64(hash, type->array_type.is_soa);
+            break;
+        case TYPE_KIND_POINTER:
+            ir_hash_type(hash, type->pointer_type.base_type);
+            break;
+        case TYPE_KIND_VECTOR:
+            ir_hash_u64(hash, type->vector_type.element_type);
+            ir_hash_u64(hash, type->vector_type.element_count);
+            break;
+        case TYPE_KIND_FUNCTION:
+            ir_hash_sb(hash, type->fn_type->name);
+            break;
+        case TYPE_KIND_FRAME:
+            ir_hash_u64(hash, type->frame_type.result_type != null);
+            if (type->frame_type.result_type)
+            {
+                ir_hash_type(hash, type->frame_type.result_type);
+            }
+            break;
+        default:
+            break;
+    }
 }
 
-static inline FnProtoLLVM llvm_gen_fn_proto(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionPrototype* ir_proto)
+static void ir_hash_sym_expr(IRHash* hash, IRSymExpr* sym_expr)
 {
-    FnProtoLLVM proto = ZERO_INIT;
-    proto.param_count = ir_proto->param_count;
-    redassert(proto.param_count < MAX_PARAM_COUNT);
+    ir_hash_u64(hash, sym_expr->type);
+    ir_hash_u64(hash, sym_expr->use_type);
+    ir_hash_sb(hash, sym_expr->element_field ? sym_expr->element_field->name : null);
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_SYM:
+            ir_hash_sb(hash, sym_expr->sym_decl ? sym_expr->sym_decl->name : null);
+            break;
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+            ir_hash_sb(hash, sym_expr->global_sym_decl->name);
+            break;
+        case IR_SYM_EXPR_TYPE_PARAM:
+            ir_hash_sb(hash, sym_expr->param_decl->name);
+            break;
+        case IR_SYM_EXPR_TYPE_ENUM:
+            ir_hash_sb(hash, sym_expr->enum_decl->name);
+            break;
+        case IR_SYM_EXPR_TYPE_ENUM_FIELD:
+            ir_hash_sb(hash, sym_expr->enum_field->name);
+            break;
+        case IR_SYM_EXPR_TYPE_STRUCT:
+            ir_hash_sb(hash, &sym_expr->struct_decl->name);
+            break;
+        case IR_SYM_EXPR_TYPE_MODULE_REF:
+            ir_hash_str(hash, sym_expr->module_ref->name);
+            break;
+        default:
+            break;
+    }
+    if (sym_expr->subscript)
+    {
+        ir_hash_expression(hash, sym_expr->subscript);
+    }
+}
 
-    for (u32 i = 0; i < proto.param_count; i++)
+// Calls used as statements and as expressions hash the same
+static void ir_hash_fn_call(IRHash* hash, IRFunctionCallExpr* fn_call)
+{
+    ir_hash_sb(hash, fn_call->fn->name);
+    // The callee may live in another module, and its visibility decides the calling convention of the call
+    ir_hash_u64(hash, fn_call->fn->has_body);
+    ir_hash_u64(hash, fn_call->fn->attributes.visibility);
+    ir_hash_u64(hash, fn_call->arg_count);
+    for (u32 i = 0; i < fn_call->arg_count; i++)
     {
-        IRType* red_type = &ir_proto->params[i].type;
-        proto.param_types[i] = llvm_gen_type(context, module, ir_module, red_type);
-        if (module->debug.builder)
+        ir_hash_expression(hash, &fn_call->args[i]);
+    }
+}
+
+static void ir_hash_expression(IRHash* hash, IRExpression* expression)
+{
+    ir_hash_u64(hash, expression->type);
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_VOID:
+            break;
+        case IR_EXPRESSION_TYPE_INT_LIT:
         {
-            switch (red_type->kind)
+            IRIntLiteral* int_lit = &expression->int_literal;
+            ir_hash_u64(hash, int_lit->type);
+            ir_hash_u64(hash, int_lit->bigint.is_negative);
+            ir_hash_u64(hash, int_lit->bigint.digit_count);
+            ir_hash_bytes(hash, bigint_ptr(&int_lit->bigint), sizeof(u64) * int_lit->bigint.digit_count);
+            break;
+        }
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+            ir_hash_u64(hash, expression->array_literal.expression_count);
+            for (u64 i = 0; i < expression->array_literal.expression_count; i++)
             {
-                case TYPE_KIND_PRIMITIVE:
-                    proto.debug.param_types[i] = LLVMDIBuilderCreateBasicType(module->debug.builder, primitive_type_str(red_type->primitive_type), strlen(primitive_type_str(red_type->primitive_type)), red_type->size * 8, dwarf_encodings[red_type->primitive_type], 0);
-                    redassert(proto.debug.param_types[i]);
-                    break;
-                default:
-                    RED_NOT_IMPLEMENTED;
-                    break;
+                ir_hash_expression(hash, &expression->array_literal.expressions[i]);
             }
-        }
-        redassert(proto.param_types[i]);
+            break;
+        case IR_EXPRESSION_TYPE_STRING_LIT:
+            ir_hash_sb(hash, expression->string_literal.str_lit);
+            break;
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+            ir_hash_sym_expr(hash, &expression->sym_expr);
+            break;
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+            ir_hash_u64(hash, expression->bin_expr.op);
+            ir_hash_expression(hash, expression->bin_expr.left);
+            ir_hash_expression(hash, expression->bin_expr.right);
+            break;
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            ir_hash_fn_call(hash, &expression->fn_call_expr);
+            break;
+        case IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS:
+            ir_hash_sb(hash, expression->subscript_access.name);
+            ir_hash_u64(hash, expression->subscript_access.subscript_type);
+            if (expression->subscript_access.subscript)
+            {
+                ir_hash_expression(hash, expression->subscript_access.subscript);
+            }
+            break;
+        case IR_EXPRESSION_TYPE_COMPTIME_EXPR:
+            ir_hash_compound(hash, &expression->comptime_expr.fn->body);
+            break;
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            ir_hash_intrinsic(hash, &expression->intrinsic_expr);
+            break;
+        case IR_EXPRESSION_TYPE_AWAIT_EXPR:
+            ir_hash_expression(hash, expression->await_expr.frame);
+            ir_hash_type(hash, &expression->await_expr.result_type);
+            break;
+        default:
+            RED_NOT_IMPLEMENTED;
+            break;
     }
+}
 
-    proto.return_type = llvm_gen_type(context, module, ir_module, &ir_proto->ret_type);
-    redassert(proto.return_type);
-    proto.fn_type = LLVMFunctionType(proto.return_type, proto.param_types, proto.param_count, false);
-    proto.handle = LLVMAddFunction(module->handle, sb_ptr(ir_proto->name), proto.fn_type);
-    LLVMSetFunctionCallConv(proto.handle, LLVMCCallConv);
-    LLVMSetLinkage(proto.handle, LLVMExternalLinkage);
-    LLVMSetVisibility(proto.handle, LLVMDefaultVisibility);
-
+static void ir_hash_intrinsic(IRHash* hash, IRIntrinsicExpr* intrinsic)
+{
+    ir_hash_u64(hash, intrinsic->id);
+    // #vload takes its vector type from the context
+    ir_hash_type(hash, &intrinsic->type);
+    if (intrinsic_is_atomic_op(intrinsic->id))
+    {
+        ir_hash_u64(hash, intrinsic->rmw_op);
+        ir_hash_u64(hash, intrinsic->ordering);
+        ir_hash_u64(hash, intrinsic->failure_ordering);
+    }
+    for (u32 i = 0; i < intrinsic->arg_count; i++)
+    {
+        ir_hash_expression(hash, &intrinsic->args[i]);
+    }
+}
 
-    llvm_verify_function(proto.handle, "prototype", true);
+static void ir_hash_sym_decl(IRHash* hash, IRSymDeclStatement* sym_decl)
+{
+    ir_hash_sb(hash, sym_decl->name);
+    ir_hash_type(hash, &sym_decl->type);
+    ir_hash_expression(hash, &sym_decl->value);
+    ir_hash_u64(hash, sym_decl->is_const);
+    ir_hash_u64(hash, sym_decl->is_undefined);
+    ir_hash_u64(hash, sym_decl->is_thread_local);
+    ir_hash_u64(hash, sym_decl->visibility);
+    ir_hash_u64(hash, sym_decl->alignment);
+}
 
-    return proto;
+static void ir_hash_statement(IRHash* hash, IRStatement* st)
+{
+    ir_hash_u64(hash, st->type);
+    switch (st->type)
+    {
+        case IR_ST_TYPE_COMPOUND_ST:
+            ir_hash_compound(hash, &st->compound_st);
+            break;
+        case IR_ST_TYPE_RETURN_ST:
+            ir_hash_expression(hash, &st->return_st.expression);
+            break;
+        case IR_ST_TYPE_BRANCH_ST:
+            ir_hash_expression(hash, &st->branch_st.condition);
+            ir_hash_compound(hash, &st->branch_st.if_block);
+            ir_hash_u64(hash, st->branch_st.else_block != null);
+            if (st->branch_st.else_block)
+            {
+                ir_hash_statement(hash, st->branch_st.else_block);
+            }
+            break;
+        case IR_ST_TYPE_SWITCH_ST:
+            ir_hash_expression(hash, &st->switch_st.switch_expr);
+            ir_hash_u64(hash, st->switch_st.cases.len);
+            for (u32 i = 0; i < st->switch_st.cases.len; i++)
+            {
+                ir_hash_expression(hash, &st->switch_st.cases.ptr[i].case_expr);
+                ir_hash_compound(hash, &st->switch_st.cases.ptr[i].case_body);
+            }
+            break;
+        case IR_ST_TYPE_SYM_DECL_ST:
+            ir_hash_sym_decl(hash, &st->sym_decl_st);
+            break;
+        case IR_ST_TYPE_ASSIGN_ST:
+            ir_hash_expression(hash, st->sym_assign_st.left);
+            ir_hash_expression(hash, st->sym_assign_st.right);
+            break;
+        case IR_ST_TYPE_FN_CALL_ST:
+            ir_hash_fn_call(hash, &st->fn_call_st);
+            break;
+        case IR_ST_TYPE_LOOP_ST:
+            ir_hash_expression(hash, &st->loop_st.condition);
+            ir_hash_compound(hash, &st->loop_st.body);
+            ir_hash_u64(hash, st->loop_st.hints.unroll_count);
+            ir_hash_u64(hash, st->loop_st.hints.vectorize_width);
+            ir_hash_u64(hash, st->loop_st.hints.interleave_count);
+            ir_hash_u64(hash, st->loop_st.hints.no_unroll);
+            break;
+        case IR_ST_TYPE_INTRINSIC_ST:
+            ir_hash_intrinsic(hash, &st->intrinsic_st);
+            break;
+        case IR_ST_TYPE_SUSPEND_ST:
+            break;
+        case IR_ST_TYPE_RESUME_ST:
+            ir_hash_expression(hash, st->resume_st.frame);
+            break;
+        case IR_ST_TYPE_AWAIT_ST:
+            ir_hash_expression(hash, st->await_st.frame);
+            ir_hash_type(hash, &st->await_st.result_type);
+            break;
+        default:
+            RED_NOT_IMPLEMENTED;
+            break;
+    }
 }
 
-static inline void llvm_gen_fn_definition(LLVMContextRef context, ModuleContext* module, IRModule* ir_module, IRFunctionDefinition* current_fn)
+static void ir_hash_compound(IRHash* hash, IRCompoundStatement* compound_st)
 {
-    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "entry");
-    module->builder = LLVMCreateBuilderInContext(context);
-    LLVMPositionBuilderAtEnd(module->builder, entry);
+    ir_hash_u64(hash, compound_st->stmts.len);
+    for (u32 i = 0; i < compound_st->stmts.len; i++)
+    {
+        ir_hash_statement(hash, &compound_st->stmts.ptr[i]);
+    }
+}
 
-    IRFunctionPrototype* ir_proto = current_fn->proto;
-    u8 param_count = ir_proto->param_count;
-    LLVMValueRef* params = null;
-    IRParamDecl* ir_params = ir_proto->params;
+static void ir_hash_module(IRHash* hash, IRModule* module)
+{
+    ir_hash_str(hash, module->name);
+    ir_hash_str(hash, module->prefix);
 
-    redassert(param_count < MAX_PARAM_COUNT);
-    if (param_count)
+    ir_hash_u64(hash, module->struct_decls.len);
+    for (u32 i = 0; i < module->struct_decls.len; i++)
     {
-        redassert(ir_params);
-        params = module->current_fn->param_array;
-        LLVMGetParams(module->current_fn->proto->handle, params);
-
-        for (usize i = 0; i < param_count; i++)
+        IRStructDecl* struct_decl = &module->struct_decls.ptr[i];
+        ir_hash_sb(hash, &struct_decl->name);
+        ir_hash_u64(hash, struct_decl->field_count);
+        for (u32 j = 0; j < struct_decl->field_count; j++)
         {
-            LLVMSetValueName(params[i], ir_params[i].name->ptr);
-            module->current_fn->param_alloca_array[i] = LLVMBuildAlloca(module->builder, LLVMTypeOf(params[i]), "");
-            LLVMBuildStore(module->builder, params[i], module->current_fn->param_alloca_array[i]);
+            ir_hash_sb(hash, struct_decl->fields[j].name);
+            ir_hash_type(hash, &struct_decl->fields[j].type);
+            ir_hash_u64(hash, struct_decl->fields[j].offset);
         }
+        ir_hash_u64(hash, struct_decl->size);
+        ir_hash_u64(hash, struct_decl->alignment);
+        ir_hash_u64(hash, struct_decl->has_explicit_layout);
     }
 
-    u32 st_count = current_fn->body.stmts.len;
-    if (st_count > 0)
+    ir_hash_u64(hash, module->enum_decls.len);
+    for (u32 i = 0; i < module->enum_decls.len; i++)
     {
-        IRCompoundStatement* body = &current_fn->body;
-        llvm_gen_compound_statement(context, module, ir_module, current_fn, body);
-        if (!module->current_fn->return_already_emitted && current_fn->proto->ret_type.kind == TYPE_KIND_VOID)
+        IREnumDecl* enum_decl = &module->enum_decls.ptr[i];
+        ir_hash_sb(hash, enum_decl->name);
+        ir_hash_type(hash, &enum_decl->type);
+        // Only the bytes of the enum type are written, the rest of the union is garbage
+        usize value_size = (usize)1 << (enum_decl->type.primitive_type % 4);
+        ir_hash_u64(hash, enum_decl->fields.len);
+        for (u32 j = 0; j < enum_decl->fields.len; j++)
         {
-            LLVMBuildRetVoid(module->builder);
+            ir_hash_sb(hash, enum_decl->fields.ptr[j].name);
+            ir_hash_bytes(hash, &enum_decl->fields.ptr[j].value, value_size);
         }
     }
-    else if (st_count == 0 && current_fn->proto->ret_type.kind == TYPE_KIND_VOID)
+
+    ir_hash_u64(hash, module->global_sym_decls.len);
+    for (u32 i = 0; i < module->global_sym_decls.len; i++)
     {
-        LLVMAppendBasicBlockInContext(context, module->current_fn->proto->handle, "entry");
-        LLVMBuildRetVoid(module->builder);
+        ir_hash_sym_decl(hash, &module->global_sym_decls.ptr[i]);
     }
-    else
+
+    ir_hash_u64(hash, module->fn_prototypes.len);
+    for (u32 i = 0; i < module->fn_prototypes.len; i++)
     {
-        RED_UNREACHABLE;
+        IRFunctionPrototype* proto = &module->fn_prototypes.ptr[i];
+        ir_hash_sb(hash, proto->name);
+        ir_hash_type(hash, &proto->ret_type);
+        ir_hash_u64(hash, proto->has_body);
+        ir_hash_u64(hash, proto->param_count);
+        for (u32 j = 0; j < proto->param_count; j++)
+        {
+            ir_hash_sb(hash, proto->params[j].name);
+            ir_hash_type(hash, &proto->params[j].type);
+            ir_hash_u64(hash, proto->params[j].is_noalias);
+        }
+        ir_hash_u64(hash, proto->attributes.inline_kind);
+        ir_hash_u64(hash, proto->attributes.visibility);
+        ir_hash_u64(hash, proto->attributes.target_clones.len);
+        for (u32 j = 0; j < proto->attributes.target_clones.len; j++)
+        {
+            ir_hash_sb(hash, proto->attributes.target_clones.ptr[j]);
+        }
+        ir_hash_u64(hash, proto->attributes.is_async);
+        ir_hash_sb(hash, proto->attributes.frame_alloc_fn ? proto->attributes.frame_alloc_fn->name : null);
+        ir_hash_sb(hash, proto->attributes.frame_free_fn ? proto->attributes.frame_free_fn->name : null);
     }
 
-    if (module->debug.builder)
+    ir_hash_u64(hash, module->fn_definitions.len);
+    for (u32 i = 0; i < module->fn_definitions.len; i++)
     {
-        LLVMDIFlags flags = LLVMDIFlagZero;
-        // TODO: we need an extern decl for only prototyped functions for LLVMDIFlagPrototyped ????????????????????????
-        flags |= LLVMDIFlagPublic;
-        //flags |= LLVMDIFlagPrototyped;
+        IRFunctionDefinition* fn = &module->fn_definitions.ptr[i];
+        ir_hash_sb(hash, fn->proto->name);
+        ir_hash_u64(hash, fn->sym_declarations.len);
+        for (u32 j = 0; j < fn->sym_declarations.len; j++)
+        {
+            ir_hash_sym_decl(hash, &fn->sym_declarations.ptr[j]);
+        }
+        ir_hash_compound(hash, &fn->body);
+    }
 
-        LLVMMetadataRef function_type = LLVMDIBuilderCreateSubroutineType(module->debug.builder, module->debug.file, module->current_fn->proto->debug.param_types, module->current_fn->proto->param_count, 0);
-        LLVMMetadataRef di_function = LLVMDIBuilderCreateFunction(module->debug.builder, module->debug.file, sb_ptr(ir_proto->name), sb_len(ir_proto->name), sb_ptr(ir_proto->name), sb_len(ir_proto->name), module->debug.file, ir_proto->debug.line, function_type, false, true, ir_proto->debug.line, flags, false);
-        LLVMSetSubprogram(module->current_fn->proto->handle, di_function);
+    ir_hash_u64(hash, module->modules.len);
+    for (u32 i = 0; i < module->modules.len; i++)
+    {
+        ir_hash_module(hash, &module->modules.ptr[i]);
     }
-#if RED_LLVM_VERBOSE
-    //llvm_verify_function(module->current_fn->proto->handle, "definition", false);
-#endif
 }
 
-static inline TargetLLVM target_create(void)
+typedef struct ObjectCacheLLVM
 {
-    TargetLLVM target = ZERO_INIT;
-    LLVMInitializeAllTargetInfos();
-    LLVMInitializeAllTargetMCs();
-    LLVMInitializeAllTargets();
-    LLVMInitializeAllAsmPrinters();
-    LLVMInitializeAllAsmParsers();
-    //LLVMInitializeAllDisassemblers();
-    target.triple = LLVMGetDefaultTargetTriple();
-    redassert(target.triple);
+    SB* object_path;
+    SB* bitcode_path;
+    SB* key_path;
+    SB* key_material;
+    u64 key;
+    bool hit;
+} ObjectCacheLLVM;
 
-    char* error_message = null;
-    if (LLVMGetTargetFromTriple(target.triple, &target.handle, &error_message))
+// The key covers everything that changes the emitted object: the IR, the target machine and the compiler build itself
+static inline ObjectCacheLLVM llvm_cache_lookup(IRModule* module_ir, bool is_root, TargetLLVM* target, CompilerOptions* options)
+{
+    ObjectCacheLLVM cache = ZERO_INIT;
+    IRHash hash = { .value = 0xcbf29ce484222325ULL, .material = sb_alloc(), };
+    ir_hash_str(&hash, RED_VERSION_STRING);
+    ir_hash_u64(&hash, LLVM_CACHE_FORMAT_VERSION);
+    ir_hash_str(&hash, target->triple);
+    ir_hash_str(&hash, target->cpu);
+    ir_hash_str(&hash, target->features);
+    ir_hash_u64(&hash, target->opt_level);
+    ir_hash_u64(&hash, target->tls_mode);
+    ir_hash_u64(&hash, options->opt_level);
+    ir_hash_str(&hash, options->pgo_generate_path);
+    ir_hash_str(&hash, options->pgo_use_path);
+    if (options->pgo_use_path)
     {
-        os_exit_with_message("Couldn't create target: %s\n", error_message);
+        // A new profile must produce a new object even if it keeps the same name
+        SB* profile = os_file_load(options->pgo_use_path);
+        if (profile)
+        {
+            ir_hash_bytes(&hash, profile->ptr, profile->len);
+        }
     }
-    redassert(target.handle);
+    ir_hash_u64(&hash, options->lto);
+    // The root module gets the profile runtime
+    ir_hash_u64(&hash, is_root);
+    // Includes the imported modules: a change in their prototypes changes the calls into them
+    ir_hash_module(&hash, module_ir);
+    cache.key = hash.value;
+    cache.key_material = hash.material;
 
-    LLVMCodeGenOptLevel opt_level = LLVMCodeGenLevelNone;
-    LLVMRelocMode reloc_mode = LLVMRelocDefault;
-    //const char* cpu = "generic";
+    if (!os_create_directory(LLVM_CACHE_DIRECTORY))
+    {
+        os_exit_with_message("Couldn't create the object cache directory %s\n", LLVM_CACHE_DIRECTORY);
+    }
 
-    target.machine = LLVMCreateTargetMachine(target.handle, target.triple, "", "", opt_level, reloc_mode, LLVMCodeModelDefault);
-    redassert(target.machine);
+    char buffer[64];
+    cache.object_path = sb_alloc();
+    snprintf(buffer, sizeof(buffer), LLVM_CACHE_DIRECTORY "/%016" PRIx64 ".obj", cache.key);
+    sb_append_str(cache.object_path, buffer);
+    cache.bitcode_path = sb_alloc();
+    snprintf(buffer, sizeof(buffer), LLVM_CACHE_DIRECTORY "/%016" PRIx64 ".bc", cache.key);
+    sb_append_str(cache.bitcode_path, buffer);
+    cache.key_path = sb_alloc();
+    snprintf(buffer, sizeof(buffer), LLVM_CACHE_DIRECTORY "/%016" PRIx64 ".key", cache.key);
+    sb_append_str(cache.key_path, buffer);
 
-    if (!target.machine)
+    if (os_file_exists(sb_ptr(cache.object_path)))
     {
-        os_exit_with_message("Failed to create target machine\n");
+        // Another input with the same key is a miss, and its object gets replaced
+        SB* stored_material = os_file_exists(sb_ptr(cache.key_path)) ? os_file_load(sb_ptr(cache.key_path)) : null;
+        cache.hit = stored_material && sb_len(stored_material) == sb_len(cache.key_material) && memcmp(sb_ptr(stored_material), sb_ptr(cache.key_material), sb_len(cache.key_material)) == 0;
     }
+#if RED_LLVM_VERBOSE
+    print("Object cache %s: %s\n", cache.hit ? "hit" : "miss", sb_ptr(cache.object_path));
+#endif
 
-    target.data = LLVMCreateTargetDataLayout(target.machine);
-    redassert(target.data);
-    
-    //char* target_triple = LLVMGetTargetMachineTriple(ctx.target_machine);
-
-    //LLVMDisposeMessage(target_triple);
+    return cache;
+}
 
-    return target;
+// Written under a temporary name and renamed, so an interrupted build never leaves a truncated object behind a valid key
+static inline bool llvm_cache_store(const char* temporary_path, const char* path)
+{
+    remove(path);
+    return rename(temporary_path, path) == 0;
 }
 
-static inline ModuleContext module_create(LLVMContextRef context, TargetLLVM target, IRModule* ir_module, const char* path, bool generate_debug_info, bool is_optimized)
+// Written after the object, so a key file always describes a complete object
+static inline bool llvm_cache_store_key(ObjectCacheLLVM* cache)
 {
-    ModuleContext module = ZERO_INIT;
-    module.handle = LLVMModuleCreateWithNameInContext(ir_module->name, context);
-    LLVMSetModuleDataLayout(module.handle, target.data);
-    LLVMSetSourceFileName(module.handle, path, strlen(path));
-    LLVMSetTarget(module.handle, target.triple);
+    SB* temporary_path = sb_alloc();
+    sb_append_str(temporary_path, sb_ptr(cache->key_path));
+    sb_append_str(temporary_path, ".tmp");
+    FILE* file = fopen(sb_ptr(temporary_path), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    usize written = fwrite(sb_ptr(cache->key_material), 1, sb_len(cache->key_material), file);
+    bool result = fclose(file) == 0 && written == sb_len(cache->key_material);
+    return result && llvm_cache_store(sb_ptr(temporary_path), sb_ptr(cache->key_path));
+}
+#endif
 
-    if (generate_debug_info)
+// Minimal replacement for the compiler-rt profile runtime, which we don't ship. The instrumentation puts the profile data, counters and names
+// in the .lprfd$M, .lprfc$M and .lprfn$M sections; the $A and $Z markers bound them once the linker sorts the groups. At exit the sections are
+// dumped in the raw profile format (version 5) that llvm-profdata merge reads. Value profiling is disabled, so there is no value data to write
+static const char llvm_profile_runtime_ir[] =
+    "%%red_prof_data = type { i64, i64, i64*, i8*, i8*, i32, [2 x i16] }\n"
+    "@__llvm_profile_runtime = global i32 0\n"
+    "@__llvm_profile_raw_version = external global i64\n"
+    "@red_prof_data_start = internal global %%red_prof_data zeroinitializer, section \".lprfd$A\", align 8\n"
+    "@red_prof_data_end = internal global %%red_prof_data zeroinitializer, section \".lprfd$Z\", align 8\n"
+    "@red_prof_counters_start = internal global i64 0, section \".lprfc$A\", align 8\n"
+    "@red_prof_counters_end = internal global i64 0, section \".lprfc$Z\", align 8\n"
+    "@red_prof_names_start = internal global i8 0, section \".lprfn$A\", align 1\n"
+    "@red_prof_names_end = internal global i8 0, section \".lprfn$Z\", align 1\n"
+    "@red_prof_zeros = private constant [8 x i8] zeroinitializer\n"
+    "@red_prof_path = private constant [%u x i8] c\"%s\\00\"\n"
+    "@red_prof_mode = private constant [3 x i8] c\"wb\\00\"\n"
+    "@llvm.global_ctors = appending global [1 x { i32, void ()*, i8* }] [{ i32, void ()*, i8* } { i32 65535, void ()* @red_prof_init, i8* null }]\n"
+    "declare i8* @fopen(i8*, i8*)\n"
+    "declare i64 @fwrite(i8*, i64, i64, i8*)\n"
+    "declare i32 @fclose(i8*)\n"
+    "declare i32 @atexit(void ()*)\n"
+    "define internal void @red_prof_init() {\n"
+    "  %%result = call i32 @atexit(void ()* @red_prof_write)\n"
+    "  ret void\n"
+    "}\n"
+    "define internal void @red_prof_write() {\n"
+    "entry:\n"
+    "  %%file = call i8* @fopen(i8* getelementptr ([%u x i8], [%u x i8]* @red_prof_path, i64 0, i64 0), i8* getelementptr ([3 x i8], [3 x i8]* @red_prof_mode, i64 0, i64 0))\n"
+    "  %%failed = icmp eq i8* %%file, null\n"
+    "  br i1 %%failed, label %%done, label %%write\n"
+    "write:\n"
+    "  %%data_begin = bitcast %%red_prof_data* getelementptr (%%red_prof_data, %%red_prof_data* @red_prof_data_start, i64 1) to i8*\n"
+    "  %%data_bytes = sub i64 ptrtoint (%%red_prof_data* @red_prof_data_end to i64), ptrtoint (%%red_prof_data* getelementptr (%%red_prof_data, %%red_prof_data* @red_prof_data_start, i64 1) to i64)\n"
+    "  %%data_count = udiv i64 %%data_bytes, ptrtoint (%%red_prof_data* getelementptr (%%red_prof_data, %%red_prof_data* null, i64 1) to i64)\n"
+    "  %%counters_begin = bitcast i64* getelementptr (i64, i64* @red_prof_counters_start, i64 1) to i8*\n"
+    "  %%counters_bytes = sub i64 ptrtoint (i64* @red_prof_counters_end to i64), ptrtoint (i64* getelementptr (i64, i64* @red_prof_counters_start, i64 1) to i64)\n"
+    "  %%counters_count = udiv i64 %%counters_bytes, 8\n"
+    "  %%names_begin = getelementptr i8, i8* @red_prof_names_start, i64 1\n"
+    "  %%names_size = sub i64 ptrtoint (i8* @red_prof_names_end to i64), ptrtoint (i8* getelementptr (i8, i8* @red_prof_names_start, i64 1) to i64)\n"
+    "  %%version = load i64, i64* @__llvm_profile_raw_version\n"
+    "  %%header = alloca [10 x i64], align 8\n"
+    "  %%magic_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 0\n"
+    "  store i64 -41534659755609471, i64* %%magic_ptr\n"
+    "  %%version_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 1\n"
+    "  store i64 %%version, i64* %%version_ptr\n"
+    "  %%data_count_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 2\n"
+    "  store i64 %%data_count, i64* %%data_count_ptr\n"
+    "  %%padding_before_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 3\n"
+    "  store i64 0, i64* %%padding_before_ptr\n"
+    "  %%counters_count_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 4\n"
+    "  store i64 %%counters_count, i64* %%counters_count_ptr\n"
+    "  %%padding_after_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 5\n"
+    "  store i64 0, i64* %%padding_after_ptr\n"
+    "  %%names_size_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 6\n"
+    "  store i64 %%names_size, i64* %%names_size_ptr\n"
+    "  %%counters_delta_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 7\n"
+    "  store i64 ptrtoint (i64* getelementptr (i64, i64* @red_prof_counters_start, i64 1) to i64), i64* %%counters_delta_ptr\n"
+    "  %%names_delta_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 8\n"
+    "  store i64 ptrtoint (i8* getelementptr (i8, i8* @red_prof_names_start, i64 1) to i64), i64* %%names_delta_ptr\n"
+    "  %%value_kind_last_ptr = getelementptr [10 x i64], [10 x i64]* %%header, i64 0, i64 9\n"
+    "  store i64 1, i64* %%value_kind_last_ptr\n"
+    "  %%header_bytes = bitcast [10 x i64]* %%header to i8*\n"
+    "  %%w0 = call i64 @fwrite(i8* %%header_bytes, i64 8, i64 10, i8* %%file)\n"
+    "  %%w1 = call i64 @fwrite(i8* %%data_begin, i64 1, i64 %%data_bytes, i8* %%file)\n"
+    "  %%w2 = call i64 @fwrite(i8* %%counters_begin, i64 1, i64 %%counters_bytes, i8* %%file)\n"
+    "  %%w3 = call i64 @fwrite(i8* %%names_begin, i64 1, i64 %%names_size, i8* %%file)\n"
+    "  %%names_tail = sub i64 8, %%names_size\n"
+    "  %%padding = and i64 %%names_tail, 7\n"
+    "  %%w4 = call i64 @fwrite(i8* getelementptr ([8 x i8], [8 x i8]* @red_prof_zeros, i64 0, i64 0), i64 1, i64 %%padding, i8* %%file)\n"
+    "  %%closed = call i32 @fclose(i8* %%file)\n"
+    "  br label %%done\n"
+    "done:\n"
+    "  ret void\n"
+    "}\n";
+
+static inline void llvm_link_profile_runtime(LLVMContextRef context, ModuleContext* module, TargetLLVM* target, const char* profile_path)
+{
+    SB* escaped_path = sb_alloc();
+    usize path_len = strlen(profile_path);
+    for (usize i = 0; i < path_len; i++)
     {
-        const char* flags = "";
-        s32 runtime_version = 1;
-        module.debug.builder = LLVMCreateDIBuilder(module.handle);
-        module.debug.file = LLVMDIBuilderCreateFile(module.debug.builder, ir_module->name, strlen(ir_module->name), path, strlen(path));
-        LLVMMetadataRef compile_unit = LLVMDIBuilderCreateCompileUnit(module.debug.builder, LLVMDWARFSourceLanguageC11, module.debug.file, "red", strlen("red"), is_optimized, flags, strlen(flags), runtime_version, "", 0, LLVMDWARFEmissionFull, 0, 0, 0, "", 0, "", 0);
+        u8 c = (u8)profile_path[i];
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\')
+        {
+            sb_append_char(escaped_path, c);
+        }
+        else
+        {
+            char escape[4];
+            snprintf(escape, sizeof(escape), "\\%02X", c);
+            sb_append_str(escaped_path, escape);
+        }
+    }
 
+    static char runtime_ir[sizeof(llvm_profile_runtime_ir) + 1024];
+    u32 path_array_len = (u32)path_len + 1;
+    s32 runtime_ir_len = snprintf(runtime_ir, sizeof(runtime_ir), llvm_profile_runtime_ir, path_array_len, sb_ptr(escaped_path), path_array_len, path_array_len);
+    if (runtime_ir_len < 0 || runtime_ir_len >= sizeof(runtime_ir))
+    {
+        os_exit_with_message("Profile path is too long: %s\n", profile_path);
     }
 
-    return module;
+    LLVMMemoryBufferRef runtime_buffer = LLVMCreateMemoryBufferWithMemoryRangeCopy(runtime_ir, runtime_ir_len, "profile_runtime");
+    LLVMModuleRef runtime = null;
+    char* error_message = null;
+    if (LLVMParseIRInContext(context, runtime_buffer, &runtime, &error_message))
+    {
+        RED_PANIC("Profile runtime doesn't parse: %s\n", error_message);
+    }
+    LLVMSetModuleDataLayout(runtime, target->data);
+    LLVMSetTarget(runtime, target->triple);
+    // Destroys the runtime module
+    if (LLVMLinkModules2(module->handle, runtime))
+    {
+        RED_PANIC("Profile runtime couldn't be linked\n");
+    }
 }
 
-static inline void llvm_register_primitive_types(LLVMContextRef context)
+// Only the entry point and what the program exports stay visible after LTO, so the IPO passes can inline, specialize and drop everything else
+static LLVMBool llvm_lto_must_preserve(LLVMValueRef value, void* context)
 {
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_U8] = LLVMInt8TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_U16] = LLVMInt16TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_U32] = LLVMInt32TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_U64] = LLVMInt64TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_S8] = LLVMInt8TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_S16] = LLVMInt16TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_S32] = LLVMInt32TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_S64] = LLVMInt64TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_F32] = LLVMFloatTypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_F64] = LLVMDoubleTypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_F128] = LLVMFP128TypeInContext(context);
-    llvm_primitive_types[IR_TYPE_PRIMITIVE_BOOL] = LLVMInt1TypeInContext(context);
+    usize name_len;
+    const char* name = LLVMGetValueName2(value, &name_len);
+    return strequal(name, "main") || LLVMGetDLLStorageClass(value) == LLVMDLLExportStorageClass;
 }
 
-bool llvm_gen_module_ir(LLVMContextRef context, ModuleContext* module, IRModule* ir_module)
+// The optimizer reports the loop directives it couldn't honor as warnings
+static void llvm_diagnostic_handler(LLVMDiagnosticInfoRef info, void* context)
 {
-    ExplicitTimer ir_dt = os_timer_start("IRGen");
-
-    u32 module_count = ir_module->modules.len;
-    IRModule* module_ptr = ir_module->modules.ptr;
-    for (u32 i = 0; i < module_count; i++)
+    char* description = LLVMGetDiagInfoDescription(info);
+    switch (LLVMGetDiagInfoSeverity(info))
     {
-        IRModule* module_it = &module_ptr[i];
-        // Copy module name as prefix
-        const char* module_prefix = module_it->name;
-        // Copy main module name to child modules
-        module_it->name = ir_module->name;
-
+        case LLVMDSError:
+            os_exit_with_message("LLVM error: %s\n", description);
+            break;
+        case LLVMDSWarning:
+            print("Warning: %s\n", description);
+            break;
+        default:
+            break;
     }
+    LLVMDisposeMessage(description);
+}
 
-    IRStructDeclBuffer* struct_decls = &ir_module->struct_decls;
-    u64 struct_count = struct_decls->len;
-    IRStructDecl* struct_decl_ptr = struct_decls->ptr;
-    for (usize i = 0; i < struct_count; i++)
+static inline void llvm_optimize_module(ModuleContext* module, TargetLLVM* target, CompilerOptions* options)
+{
+    LLVMPassManagerBuilderRef builder = LLVMPassManagerBuilderCreate();
+    LLVMPassManagerBuilderSetOptLevel(builder, options->opt_level);
+    if (options->opt_level > 1)
     {
-        IRStructDecl* struct_decl = &struct_decl_ptr[i];
-        llvm_type_decl_append(&module->type_declarations, llvm_gen_struct_type(context, module, ir_module, struct_decl));
+        LLVMPassManagerBuilderUseInlinerWithThreshold(builder, options->opt_level > 2 ? 275 : 225);
+    }
+    llvm_pass_manager_builder_set_pgo(builder, options->pgo_generate_path, options->pgo_use_path);
+    if (module->has_coroutines)
+    {
+        LLVMPassManagerBuilderAddCoroutinePassesToExtensionPoints(builder);
     }
 
-    IRSymDeclStatementBuffer* global_sym_decls = &ir_module->global_sym_decls;
-    u64 global_sym_decl_count = global_sym_decls->len;
-    IRSymDeclStatement* global_ptr = global_sym_decls->ptr;
-    for (u64 i = 0; i < global_sym_decl_count; i++)
+    LLVMPassManagerRef function_passes = LLVMCreateFunctionPassManagerForModule(module->handle);
+    LLVMAddAnalysisPasses(target->machine, function_passes);
+    LLVMPassManagerBuilderPopulateFunctionPassManager(builder, function_passes);
+    LLVMPassManagerRef module_passes = LLVMCreatePassManager();
+    LLVMAddAnalysisPasses(target->machine, module_passes);
+    if (options->opt_level <= 1)
     {
-        IRSymDeclStatement* sym_decl = &global_ptr[i];
-        llvm_value_append(&module->global_sym_buffer, llvm_gen_global_sym(context, module, ir_module, sym_decl, LLVMExternalLinkage));
+        // Without the regular inliner nothing would inline the functions marked inline
+        LLVMAddAlwaysInlinerPass(module_passes);
+    }
+    if (options->lto)
+    {
+        LLVMAddInternalizePassWithMustPreservePredicate(module_passes, null, llvm_lto_must_preserve);
+    }
+    LLVMPassManagerBuilderPopulateModulePassManager(builder, module_passes);
+    if (options->lto)
+    {
+        LLVMPassManagerBuilderPopulateLTOPassManager(builder, module_passes, false, true);
     }
 
-    IRFunctionPrototypeBuffer* fn_proto_buffer = &ir_module->fn_prototypes;
-    u64 fn_proto_count = fn_proto_buffer->len;
-    IRFunctionPrototype* fn_proto_ptr = fn_proto_buffer->ptr;
-    for (u64 i = 0; i < fn_proto_count; i++)
+    LLVMInitializeFunctionPassManager(function_passes);
+    for (LLVMValueRef fn = LLVMGetFirstFunction(module->handle); fn; fn = LLVMGetNextFunction(fn))
     {
-        IRFunctionPrototype* fn_proto = &fn_proto_ptr[i];
-        llvm_fn_proto_append(&module->fn_proto_buffer, llvm_gen_fn_proto(context, module, ir_module, fn_proto));
+        LLVMRunFunctionPassManager(function_passes, fn);
     }
+    LLVMFinalizeFunctionPassManager(function_passes);
+    LLVMRunPassManager(module_passes, module->handle);
 
-    IRFunctionDefinitionBuffer* fn_defs = &ir_module->fn_definitions;
-    u32 fn_def_count = fn_defs->len;
-    for (usize i = 0; i < fn_def_count; i++)
+    LLVMDisposePassManager(function_passes);
+    LLVMDisposePassManager(module_passes);
+    LLVMPassManagerBuilderDispose(builder);
+}
+
+// Must run before anything else touches LLVM: command line options can only be parsed once
+static inline void llvm_set_pgo_command_line(CompilerOptions* options)
+{
+    if (options->pgo_generate_path)
     {
-        CurrentFnLLVM current_fn = ZERO_INIT;
-        IRFunctionDefinition* fn_def_it = &fn_defs->ptr[i];
-        IRFunctionPrototype* fn_proto_ref = fn_def_it->proto;
-        u64 proto_index = fn_proto_ref - fn_proto_ptr;
-        module->current_fn = &current_fn;
-        module->current_fn->proto = &module->fn_proto_buffer.ptr[proto_index];
-        redassert(module->current_fn->proto);
-        llvm_gen_fn_definition(context, module, ir_module, fn_def_it);
+        // The runtime above doesn't write value profiles
+        const char* args[] = { "red", "-disable-vp" };
+        LLVMParseCommandLineOptions(array_length(args), args, null);
+    }
+    else if (options->pgo_use_path)
+    {
+        char error[512];
+        if (!llvm_profile_is_valid(options->pgo_use_path, error, sizeof(error)))
+        {
+            os_exit_with_message("Can't use profile %s: %s\n", options->pgo_use_path, error);
+        }
+        // Move the code the profile never reached out of the hot functions
+        const char* args[] = { "red", "-hot-cold-split" };
+        LLVMParseCommandLineOptions(array_length(args), args, null);
     }
+}
 
-    bool result = llvm_verify_module(module->handle);
+#define LLVM_MAX_MODULE_COUNT 256
 
-    os_timer_end(&ir_dt);
-    return result;
+static inline void llvm_collect_modules(IRModule* module_ir, IRModule** modules, u32* module_count)
+{
+    if (*module_count == LLVM_MAX_MODULE_COUNT)
+    {
+        os_exit_with_message("Too many modules, the maximum is %u\n", LLVM_MAX_MODULE_COUNT);
+    }
+    modules[(*module_count)++] = module_ir;
+    for (u32 i = 0; i < module_ir->modules.len; i++)
+    {
+        llvm_collect_modules(&module_ir->modules.ptr[i], modules, module_count);
+    }
 }
 
-void llvm_gen_machine_code(IRModule* module_ir)
+static inline bool llvm_gen_module(LLVMContextRef context, TargetLLVM* target, IRModule* module_ir, CompilerOptions* options, ModuleContext* module)
 {
-    ExplicitTimer llvm_init_dt = os_timer_start("MCI");
-    TargetLLVM target = target_create();
-    LLVMContextRef context = LLVMContextCreate();
-    ModuleContext module = module_create(context, target, module_ir, "badpath->fixme", false, false);
+    *module = module_create(context, *target, module_ir, "badpath->fixme", false, options->opt_level > 0);
+    LLVMAddModuleFlag(module->handle, LLVMModuleFlagBehaviorWarning, "CodeView", strlen("CodeView"), LLVMValueAsMetadata(LLVMConstInt(llvm_primitive_types[IR_TYPE_PRIMITIVE_U32], 1, false)));
 
-    os_timer_end(&llvm_init_dt);
+    if (!llvm_gen_module_ir(context, module, module_ir))
+    {
+        print("Could not generate LLVM IR for module %s\n", module_ir->name);
+        return false;
+    }
 
-    llvm_register_primitive_types(context);
-    LLVMAddModuleFlag(module.handle, LLVMModuleFlagBehaviorWarning, "CodeView", strlen("CodeView"), LLVMValueAsMetadata(LLVMConstInt(llvm_primitive_types[IR_TYPE_PRIMITIVE_U32], 1, false)));
+    print("LLVM IR generated successfully for module %s\n", module_ir->name);
+    return true;
+}
 
-    if (!llvm_gen_module_ir(context, &module, module_ir))
+// Emits a single object for the given modules. With more than one (LTO), the rest are linked into the first one before optimizing
+static inline bool llvm_emit_object(LLVMContextRef context, TargetLLVM* target, IRModule** modules, u32 module_count, bool is_root, CompilerOptions* options, const char* object_path, const char* bitcode_path)
+{
+    ModuleContext module;
+    if (!llvm_gen_module(context, target, modules[0], options, &module))
     {
-        print("Could not generate LLVM IR\n");
-        return;
+        return false;
     }
-    else
+
+    if (module_count > 1)
+    {
+        ExplicitTimer link_dt = os_timer_start("IRLink");
+        for (u32 i = 1; i < module_count; i++)
+        {
+            ModuleContext imported_module;
+            if (!llvm_gen_module(context, target, modules[i], options, &imported_module))
+            {
+                return false;
+            }
+            module.has_always_inline = module.has_always_inline || imported_module.has_always_inline;
+            module.has_loop_hints = module.has_loop_hints || imported_module.has_loop_hints;
+            module.has_coroutines = module.has_coroutines || imported_module.has_coroutines;
+            // Destroys the imported module
+            if (LLVMLinkModules2(module.handle, imported_module.handle))
+            {
+                print("Module %s couldn't be linked into %s\n", modules[i]->name, modules[0]->name);
+                return false;
+            }
+        }
+        os_timer_end(&link_dt);
+    }
+
+    if (options->opt_level > 0 || options->pgo_generate_path || options->pgo_use_path || options->lto || module.has_always_inline || module.has_coroutines)
+    {
+        ExplicitTimer opt_dt = os_timer_start("Opt");
+        llvm_optimize_module(&module, target, options);
+        if (options->pgo_generate_path && is_root)
+        {
+            llvm_link_profile_runtime(context, &module, target, options->pgo_generate_path);
+        }
+        os_timer_end(&opt_dt);
+    }
+    if (options->opt_level == 0 && module.has_loop_hints)
     {
-        print("LLVM IR generated successfully\n");
+        print("Warning: loop directives in %s are ignored without optimizations\n", modules[0]->name);
     }
 
     ExplicitTimer obj_gen_dt = os_timer_start("ObjWr");
     char* error_message = NULL;
-    LLVMBool obj_gen_errors = LLVMTargetMachineEmitToFile(target.machine, module.handle, "red_module.obj", LLVMObjectFile, &error_message);
+    LLVMBool obj_gen_errors = LLVMTargetMachineEmitToFile(target->machine, module.handle, (char*)object_path, LLVMObjectFile, &error_message);
     if (obj_gen_errors)
     {
         print("\nError generating machine code: \n%s\n\n", error_message);
     }
     else
     {
-        print("\nMachine code was generated successfully in %s\n\n", "red_module.obj");
+        print("\nMachine code was generated successfully in %s\n\n", object_path);
+    }
+    if (bitcode_path && LLVMWriteBitcodeToFile(module.handle, bitcode_path))
+    {
+        print("Error writing bitcode to %s\n", bitcode_path);
     }
     os_timer_end(&obj_gen_dt);
 
+    return !obj_gen_errors;
+}
+
+// Returns the path of the object, null on failure
+static inline const char* llvm_build_object(LLVMContextRef context, TargetLLVM* target, IRModule** modules, u32 module_count, bool is_root, CompilerOptions* options)
+{
+#if RED_LLVM_OBJECT_CACHE
+    ExplicitTimer cache_dt = os_timer_start("Cache");
+    ObjectCacheLLVM cache = llvm_cache_lookup(modules[0], is_root, target, options);
+    os_timer_end(&cache_dt);
+    const char* object_path = sb_ptr(cache.object_path);
+    if (!cache.hit)
+    {
+        SB* temporary_object_path = sb_alloc();
+        sb_append_str(temporary_object_path, object_path);
+        sb_append_str(temporary_object_path, ".tmp");
+        SB* temporary_bitcode_path = sb_alloc();
+        sb_append_str(temporary_bitcode_path, sb_ptr(cache.bitcode_path));
+        sb_append_str(temporary_bitcode_path, ".tmp");
+
+        if (!llvm_emit_object(context, target, modules, module_count, is_root, options, sb_ptr(temporary_object_path), sb_ptr(temporary_bitcode_path)))
+        {
+            return null;
+        }
+        llvm_cache_store(sb_ptr(temporary_bitcode_path), sb_ptr(cache.bitcode_path));
+        if (!llvm_cache_store(sb_ptr(temporary_object_path), object_path))
+        {
+            os_exit_with_message("Couldn't store the object in %s\n", object_path);
+        }
+        // Without its key the object is never reused, but this build can still link it
+        llvm_cache_store_key(&cache);
+    }
+#else
+    SB* object_path_sb = sb_alloc();
+    sb_append_str(object_path_sb, modules[0]->name);
+    sb_append_str(object_path_sb, ".obj");
+    const char* object_path = sb_ptr(object_path_sb);
+    if (!llvm_emit_object(context, target, modules, module_count, is_root, options, object_path, null))
+    {
+        return null;
+    }
+#endif
+
+    return object_path;
+}
+
+void llvm_gen_machine_code(IRModule* module_ir, CompilerOptions* options)
+{
+    llvm_set_pgo_command_line(options);
+    ExplicitTimer llvm_init_dt = os_timer_start("MCI");
+    TargetLLVM target = target_create(options);
+    LLVMContextRef context = LLVMContextCreate();
+    LLVMContextSetDiagnosticHandler(context, llvm_diagnostic_handler, null);
+    llvm_register_primitive_types(context);
+    os_timer_end(&llvm_init_dt);
+
+    // Root first, then every import
+    IRModule* modules[LLVM_MAX_MODULE_COUNT];
+    u32 module_count = 0;
+    llvm_collect_modules(module_ir, modules, &module_count);
+
+    const char* object_paths[LLVM_MAX_MODULE_COUNT];
+    u32 object_count = 0;
+    if (options->lto)
+    {
+        // A single object: every module is generated, linked into the root and optimized as a whole
+        if (!(object_paths[object_count++] = llvm_build_object(context, &target, modules, module_count, true, options)))
+        {
+            return;
+        }
+    }
+    else
+    {
+        for (u32 i = 0; i < module_count; i++)
+        {
+            if (!(object_paths[object_count++] = llvm_build_object(context, &target, &modules[i], 1, i == 0, options)))
+            {
+                return;
+            }
+        }
+    }
+
     ExplicitTimer vs_sdk_find_dt = os_timer_start("VSSDK");
     Find_Result result = find_visual_studio_and_windows_sdk();
     //usize windows_sdk_root_len = wcslen(result.windows_sdk_root);
@@ -1274,19 +4266,24 @@ void llvm_gen_machine_code(IRModule* module_ir)
     // TODO: Buggy shit. Find out what's going on
     redassert(!(windows_sdk_ucrt_path->ptr[sb_len(windows_sdk_ucrt_path) - 1] == 1));
 
-    const char* linker_args[] =
+    const char* linker_args[LLVM_MAX_MODULE_COUNT + 8] =
     {
-        "-subsystem:console", "/debug", "-out:red_module.exe", sb_ptr(windows_sdk_um_path), sb_ptr(windows_sdk_ucrt_path), sb_ptr(vs_lib_path), "red_module.obj", "libcmtd.lib", "libucrtd.lib"
+        "-subsystem:console", "/debug", "-out:red_module.exe", sb_ptr(windows_sdk_um_path), sb_ptr(windows_sdk_ucrt_path), sb_ptr(vs_lib_path), "libcmtd.lib", "libucrtd.lib"
     };
+    u32 linker_arg_count = 8;
+    for (u32 i = 0; i < object_count; i++)
+    {
+        linker_args[linker_arg_count++] = object_paths[i];
+    }
     os_timer_end(&vs_sdk_find_dt);
 
     print("Linker command:\n");
-    for (s32 i = 0; i < array_length(linker_args); i++)
+    for (u32 i = 0; i < linker_arg_count; i++)
     {
         print("%s ", linker_args[i]);
     }
     print("\n\n");
     ExplicitTimer linker_dt = os_timer_start("Link");
-    lld_linker_driver(linker_args, array_length(linker_args), LLD_BINARY_FORMAT_COFF);
+    lld_linker_driver(linker_args, linker_arg_count, LLD_BINARY_FORMAT_COFF);
     os_timer_end(&linker_dt);
 }
@@ -1,4 +1,5 @@
 #pragma once
 
 typedef struct IRModule IRModule;
-void llvm_gen_machine_code(IRModule* ir_tree);
\ No newline at end of file
+typedef struct CompilerOptions CompilerOptions;
+void llvm_gen_machine_code(IRModule* ir_tree, CompilerOptions* options);
\ No newline at end of file
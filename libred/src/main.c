@@ -5,6 +5,9 @@
 #include "compiler_types.h"
 #include "os.h"
 #include "compiler.h"
+#if RED_BYTECODE_BENCHMARK
+#include "bytecode.h"
+#endif
 
 typedef struct File
 {
@@ -13,19 +16,23 @@ typedef struct File
 } File;
 
 static inline void print_header(void);
-static File handle_main_arguments(s32 argc, char* argv[]);
+static File handle_main_arguments(s32 argc, char* argv[], CompilerOptions* options);
 
 s32 main(s32 argc, char* argv[])
 {
     os_init();
     print_header();
+#if RED_BYTECODE_BENCHMARK
+    bc_run_benchmarks();
+#endif
     s64 start = os_performance_counter();
 
     ExplicitTimer file_dt = os_timer_start("File");
-    File file = handle_main_arguments(argc, argv);
+    CompilerOptions options = ZERO_INIT;
+    File file = handle_main_arguments(argc, argv, &options);
     os_timer_end(&file_dt);
 
-    compile_program(file.file_buffer);
+    compile_program(file.file_buffer, &options);
 
     s64 end = os_performance_counter();
     f64 total_ms = os_compute_ms(start, end);
@@ -40,7 +47,14 @@ static inline void print_header(void)
     print("Red language compiler\n");
 }
 
-static File handle_main_arguments(s32 argc, char* argv[])
+// Returns what follows the prefix, or null if the argument doesn't start with it
+static inline const char* option_value(const char* arg, const char* prefix)
+{
+    usize prefix_len = strlen(prefix);
+    return strncmp(arg, prefix, prefix_len) == 0 ? arg + prefix_len : null;
+}
+
+static File handle_main_arguments(s32 argc, char* argv[], CompilerOptions* options)
 {
     //ExplicitTimer cwd_dt = et_start("cwd");
     //SB* cwd = os_get_cwd();
@@ -59,8 +73,91 @@ static File handle_main_arguments(s32 argc, char* argv[])
         return file;
     }
 
+    const char* value;
+    for (s32 i = 1; i < argc; i++)
+    {
+        char* arg = argv[i];
+        if (arg[0] != '-')
+        {
+            if (file.filename)
+            {
+                os_exit_with_message("Only one source file can be compiled, got %s and %s\n", file.filename, arg);
+            }
+            file.filename = arg;
+        }
+        else if (arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3' && arg[3] == 0)
+        {
+            options->opt_level = arg[2] - '0';
+        }
+        else if (strequal(arg, "--pgo-generate"))
+        {
+            options->pgo_generate_path = "default.profraw";
+        }
+        else if ((value = option_value(arg, "--pgo-generate=")))
+        {
+            options->pgo_generate_path = value;
+        }
+        else if ((value = option_value(arg, "--pgo-use=")))
+        {
+            options->pgo_use_path = value;
+        }
+        else if ((value = option_value(arg, "-mcpu=")))
+        {
+            options->cpu = value;
+        }
+        else if ((value = option_value(arg, "-mattr=")))
+        {
+            options->features = value;
+        }
+        else if ((value = option_value(arg, "--tls-model=")))
+        {
+            static const char* tls_models[] = { "global-dynamic", "local-dynamic", "initial-exec", "local-exec" };
+            u32 i;
+            for (i = 0; i < array_length(tls_models); i++)
+            {
+                if (strequal(value, tls_models[i]))
+                {
+                    break;
+                }
+            }
+            if (i == array_length(tls_models))
+            {
+                os_exit_with_message("Unknown TLS model: %s\n", value);
+            }
+            options->tls_model = (TLSModel)i;
+        }
+        else if (strequal(arg, "--lto"))
+        {
+            options->lto = true;
+        }
+        else if (strequal(arg, "--vm"))
+        {
+            options->run_in_vm = true;
+        }
+        else if (strequal(arg, "--x64"))
+        {
+            options->run_native_x64 = true;
+        }
+        else
+        {
+            os_exit_with_message("Unknown option: %s\n", arg);
+        }
+    }
+
+    if (options->pgo_generate_path && options->pgo_use_path)
+    {
+        os_exit_with_message("--pgo-generate and --pgo-use can't be used in the same build\n");
+    }
+    if (options->run_in_vm && options->run_native_x64)
+    {
+        os_exit_with_message("--vm and --x64 can't be used in the same build\n");
+    }
+    if (!file.filename)
+    {
+        os_exit_with_message("No source file\n");
+    }
+
     // TODO: check that file names are valid
-    file.filename = argv[1];
     file.file_buffer = os_file_load(file.filename);
     if (!file.file_buffer)
     {
@@ -7,6 +7,8 @@
 #ifdef RED_OS_LINUX
 #define RED_OS_POSIX
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <linux/limits.h>
 #elif defined RED_OS_WINDOWS
 #include <Windows.h>
@@ -129,6 +131,23 @@ void* os_ask_virtual_memory_block_with_address(void* target_address, size_t bloc
     return address;
 }
 
+void* os_ask_executable_memory_block(size_t block_bytes)
+{
+    void* address = NULL;
+#ifdef RED_OS_WINDOWS
+    address = VirtualAlloc(NULL, block_bytes, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#elif defined RED_OS_POSIX
+    address = mmap(NULL, block_bytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED)
+    {
+        address = NULL;
+    }
+#else
+#error
+#endif
+    return address;
+}
+
 void* os_ask_heap_memory(size_t size)
 {
     void* address = NULL;
@@ -339,6 +358,27 @@ StringBuffer* os_file_load(const char *name)
     return file_buffer;
 }
 
+bool os_file_exists(const char* name)
+{
+    FILE* file = fopen(name, "rb");
+    if (!file)
+    {
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+bool os_create_directory(const char* name)
+{
+#ifdef RED_OS_WINDOWS
+    return CreateDirectoryA(name, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(name, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
 #define CACHE_LINE_SIZE BYTE(64)
 #define MAX_ALLOCATED_BLOCK_COUNT 4
 #define BLOCK_ALIGNMENT CACHE_LINE_SIZE
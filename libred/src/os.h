@@ -171,6 +171,7 @@ void os_init();
 SB* os_get_cwd(void);
 void* os_ask_virtual_memory_block(size_t block_bytes);
 void* os_ask_virtual_memory_block_with_address(void* target_address, size_t block_bytes);
+void* os_ask_executable_memory_block(size_t block_bytes);
 void* os_ask_heap_memory(size_t size);
 size_t os_get_page_size(void);
 void os_spawn_process(const char* exe, os_arg_list args, Termination* termination);
@@ -183,6 +184,9 @@ f64 os_compute_ms(s64 pc_start, s64 pc_end);
 s32 os_load_dynamic_library(const char* dyn_lib_name);
 void* os_load_procedure_from_dynamic_library(s32 dyn_lib_index, const char* proc_name);
 StringBuffer* os_file_load(const char* name);
+bool os_file_exists(const char* name);
+/* Succeeds if the directory already exists */
+bool os_create_directory(const char* name);
 
 
 
@@ -1,6 +1,7 @@
 #include "compiler_types.h"
 #include "parser.h"
 #include "lexer.h"
+#include "bigint.h"
 #include "os.h"
 #include <stdarg.h>
 #include <stdio.h>
@@ -12,6 +13,7 @@ static inline ASTNode*parse_primary_expr(ParseContext*pc);
 static inline ASTNode*parse_compound_st(ParseContext*pc);
 static inline ASTNode*create_type_node(ParseContext*pc);
 static inline ASTNode*parse_statement(ParseContext*pc);
+static inline ASTNode*parse_fn_call_expr(ParseContext*pc);
 
 static inline void copy_base_node(ASTNode*dst, const ASTNode*src, AST_ID id)
 {
@@ -164,6 +166,26 @@ static inline ASTNode*create_type_node_array(ParseContext*pc)
     return node;
 }
 
+// #soa [N]T: one array per field of T instead of an array of T
+static inline ASTNode*create_type_node_soa_array(ParseContext*pc)
+{
+    expect_token(pc, TOKEN_ID_HASH);
+    Token*dir_token = expect_token(pc, TOKEN_ID_SYMBOL);
+    if (strcmp(sb_ptr(token_buffer(dir_token)), "soa") != 0)
+    {
+        error(pc, dir_token, "unknown type directive: '%s'", sb_ptr(token_buffer(dir_token)));
+    }
+    if (get_token(pc)->id != TOKEN_ID_LEFT_BRACKET)
+    {
+        error(pc, dir_token, "soa must be followed by an array type");
+    }
+
+    ASTNode*node = create_type_node_array(pc);
+    node->type_expr.array.is_soa = true;
+
+    return node;
+}
+
 const char*primitive_types[] =
         {
                 "u8", "u16", "u32", "u64",
@@ -186,6 +208,56 @@ static bool is_basic_type(Token*type_token)
     return false;
 }
 
+// v, the lane count and the element type: v4f32, v16u8. bool elements are the masks of vector comparisons
+static bool is_vector_type(Token*type_token, u32*element_count, const char**element_name)
+{
+    char*type_str = type_token->str_lit.str.ptr;
+    if (type_str[0] != 'v' || type_str[1] < '1' || type_str[1] > '9')
+    {
+        return false;
+    }
+
+    u32 count = 0;
+    char*it = type_str + 1;
+    while (*it >= '0' && *it <= '9' && count <= 64)
+    {
+        count = count * 10 + (*it - '0');
+        it++;
+    }
+
+    bool is_element_type = strcmp(it, "bool") == 0;
+    for (u32 i = 0; i < array_length(primitive_types) && !is_element_type; i++)
+    {
+        is_element_type = strcmp(it, primitive_types[i]) == 0;
+    }
+    if (!is_element_type)
+    {
+        return false;
+    }
+
+    *element_count = count;
+    *element_name = it;
+    return true;
+}
+
+static inline ASTNode*create_vector_type_node(ParseContext*pc, u32 element_count, const char*element_name)
+{
+    Token*token = consume_token(pc);
+    if (element_count < 2 || element_count > 64 || (element_count & (element_count - 1)))
+    {
+        error(pc, token, "vector lane count must be a power of two between 2 and 64");
+    }
+
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, token, AST_TYPE_TYPE_EXPR);
+    node->type_expr.kind = TYPE_KIND_VECTOR;
+    node->type_expr.name = &token->str_lit.str;
+    node->type_expr.vector_.element_type = sb_alloc();
+    sb_append_str(node->type_expr.vector_.element_type, element_name);
+    node->type_expr.vector_.element_count = element_count;
+    return node;
+}
+
 static inline ASTNode*create_complex_type_node(ParseContext*pc)
 {
     Token*token = consume_token_if(pc, TOKEN_ID_SYMBOL);
@@ -219,6 +291,20 @@ static inline ASTNode*create_type_node_raw_string_type(ParseContext*pc)
     return node;
 }
 
+static inline ASTNode*create_type_node_frame(ParseContext*pc)
+{
+    Token*frame_token = expect_token(pc, TOKEN_ID_KEYWORD_ANY_FRAME);
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, frame_token, AST_TYPE_TYPE_EXPR);
+    node->type_expr.kind = TYPE_KIND_FRAME;
+    if (consume_token_if(pc, TOKEN_ID_ARROW))
+    {
+        node->type_expr.frame_.result_type = create_type_node(pc);
+    }
+
+    return node;
+}
+
 static inline ASTNode*create_type_node(ParseContext*pc)
 {
     Token*token = get_token(pc);
@@ -226,20 +312,32 @@ static inline ASTNode*create_type_node(ParseContext*pc)
     switch (type)
     {
         case TOKEN_ID_SYMBOL:
+        {
+            u32 element_count;
+            const char*element_name;
             if (is_basic_type(token))
             {
                 return create_basic_type_node(pc);
             }
+            else if (is_vector_type(token, &element_count, &element_name))
+            {
+                return create_vector_type_node(pc, element_count, element_name);
+            }
             else
             {
                 return create_complex_type_node(pc);
             }
+        }
         case TOKEN_ID_LEFT_BRACKET:
             return create_type_node_array(pc);
+        case TOKEN_ID_HASH:
+            return create_type_node_soa_array(pc);
         case TOKEN_ID_AMPERSAND:
             return create_type_node_pointer(pc);
         case TOKEN_ID_KEYWORD_RAW_STRING:
             return create_type_node_raw_string_type(pc);
+        case TOKEN_ID_KEYWORD_ANY_FRAME:
+            return create_type_node_frame(pc);
         default:
         RED_NOT_IMPLEMENTED;
             return null;
@@ -248,6 +346,7 @@ static inline ASTNode*create_type_node(ParseContext*pc)
 
 static inline ASTNode*parse_param_decl(ParseContext*pc)
 {
+    Token*noalias_token = consume_token_if(pc, TOKEN_ID_KEYWORD_NO_ALIAS);
     Token*name = expect_token(pc, TOKEN_ID_SYMBOL);
     ASTNode*symbol_node = create_symbol_node(name);
     ASTNode*type_node = create_type_node(pc);
@@ -260,6 +359,7 @@ static inline ASTNode*parse_param_decl(ParseContext*pc)
     fill_base_node(param, name, AST_TYPE_PARAM_DECL);
     param->param_decl.sym = symbol_node;
     param->param_decl.type = type_node;
+    param->param_decl.is_noalias = noalias_token != null;
     return param;
 }
 
@@ -286,6 +386,34 @@ static inline ASTNodeBuffer parse_param_decl_list(ParseContext*pc)
     return nb;
 }
 
+// align(N) after a type. Returns 0 if there is none
+static inline u32 parse_align_attribute(ParseContext*pc)
+{
+    Token*align_token = consume_token_if(pc, TOKEN_ID_KEYWORD_ALIGN);
+    if (!align_token)
+    {
+        return 0;
+    }
+
+    expect_token(pc, TOKEN_ID_LEFT_PARENTHESIS);
+    Token*value_token = expect_token(pc, TOKEN_ID_INT_LIT);
+    expect_token(pc, TOKEN_ID_RIGHT_PARENTHESIS);
+
+    // Wider than 64 bits can't be a valid alignment either, and BigInt_as_u64 only takes one digit
+    BigInt* value = token_bigint(value_token);
+    if (value->digit_count > 1)
+    {
+        error(pc, align_token, "alignment must be a power of two up to 65536");
+    }
+    u64 alignment = BigInt_as_u64(value);
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > (1 << 16))
+    {
+        error(pc, align_token, "alignment must be a power of two up to 65536, found %llu", alignment);
+    }
+
+    return (u32)alignment;
+}
+
 static inline ASTNode*parse_sym_decl(ParseContext*pc)
 {
     Token*mut_token = consume_token_if(pc, TOKEN_ID_KEYWORD_CONST);
@@ -302,6 +430,7 @@ static inline ASTNode*parse_sym_decl(ParseContext*pc)
     Token*sym_name = expect_token(pc, TOKEN_ID_SYMBOL);
     // TODO: should flexibilize this in order to support type inferring in the future
     ASTNode*sym_type_node = create_type_node(pc);
+    u32 alignment = parse_align_attribute(pc);
 
     // TODO: This means no value assigned, uninitialized (left to the backend?????)
     ASTNode*sym_node = null;
@@ -313,11 +442,18 @@ static inline ASTNode*parse_sym_decl(ParseContext*pc)
         sym_node->sym_decl.is_const = is_const;
         sym_node->sym_decl.sym = create_symbol_node(sym_name);
         sym_node->sym_decl.type = sym_type_node;
+        sym_node->sym_decl.alignment = alignment;
         return sym_node;
     }
 
     expect_token(pc, TOKEN_ID_EQ);
-    ASTNode*expression = parse_expression(pc);
+    // = undefined: no value, and unlike a missing one not even zeroes
+    Token*undefined_token = consume_token_if(pc, TOKEN_ID_KEYWORD_UNDEFINED);
+    if (undefined_token && is_const)
+    {
+        error(pc, undefined_token, "constants can't be undefined");
+    }
+    ASTNode*expression = undefined_token ? null : parse_expression(pc);
     expect_token(pc, TOKEN_ID_SEMICOLON);
 
     sym_node = NEW(ASTNode, 1);
@@ -325,7 +461,9 @@ static inline ASTNode*parse_sym_decl(ParseContext*pc)
     sym_node->sym_decl.is_const = is_const;
     sym_node->sym_decl.sym = create_symbol_node(sym_name);
     sym_node->sym_decl.type = sym_type_node;
+    sym_node->sym_decl.alignment = alignment;
     sym_node->sym_decl.value = expression;
+    sym_node->sym_decl.is_undefined = undefined_token != null;
 
     return sym_node;
 }
@@ -388,11 +526,24 @@ static inline ASTNode*parse_symbol_expr(ParseContext*pc)
         expect_token(pc, TOKEN_ID_RIGHT_BRACKET);
         node->sym_expr.subscript_type = AST_SYMBOL_SUBSCRIPT_TYPE_BRACKET_ACCESS;
         node->sym_expr.subscript = bracket_access;
+        if (consume_token_if(pc, TOKEN_ID_DOT))
+        {
+            node->sym_expr.element_field = token_buffer(expect_token(pc, TOKEN_ID_SYMBOL));
+        }
     }
     else if (consume_token_if(pc, TOKEN_ID_DOT))
     {
-        // TODO: this parse_expression can generate problems if the it is a container field access
-        ASTNode*access = parse_expression(pc);
+        // Field (a.b.c) or function of an imported module (module.fn(...)). A full expression would swallow the rest of a.b = c
+        ASTNode*access = parse_fn_call_expr(pc);
+        if (!access)
+        {
+            Token*field_token = get_token(pc);
+            access = parse_symbol_expr(pc);
+            if (!access || access->node_id != AST_TYPE_SYM_EXPR)
+            {
+                error(pc, field_token, "expected a field name after '.'");
+            }
+        }
         node->sym_expr.subscript_type = AST_SYMBOL_SUBSCRIPT_TYPE_DOT_ACCESS;
         node->sym_expr.subscript = access;
     }
@@ -492,6 +643,50 @@ static inline ASTNode*parse_return_statement(ParseContext*pc)
     return node;
 }
 
+static inline ASTNode*parse_suspend_statement(ParseContext*pc)
+{
+    Token*suspend_token = consume_token_if(pc, TOKEN_ID_KEYWORD_SUSPEND);
+    if (!suspend_token)
+    {
+        return null;
+    }
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, suspend_token, AST_TYPE_SUSPEND_STATEMENT);
+    expect_token(pc, TOKEN_ID_SEMICOLON);
+    return node;
+}
+
+static inline ASTNode*parse_resume_statement(ParseContext*pc)
+{
+    Token*resume_token = consume_token_if(pc, TOKEN_ID_KEYWORD_RESUME);
+    if (!resume_token)
+    {
+        return null;
+    }
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, resume_token, AST_TYPE_RESUME_STATEMENT);
+    node->frame_expr.frame = parse_expression(pc);
+    if (!node->frame_expr.frame)
+    {
+        error(pc, resume_token, "resume expects a frame handle");
+    }
+    expect_token(pc, TOKEN_ID_SEMICOLON);
+    return node;
+}
+
+static inline ASTNode*parse_await_expr(ParseContext*pc)
+{
+    Token*await_token = expect_token(pc, TOKEN_ID_KEYWORD_AWAIT);
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, await_token, AST_TYPE_AWAIT_EXPR);
+    node->frame_expr.frame = parse_primary_expr(pc);
+    if (!node->frame_expr.frame)
+    {
+        error(pc, await_token, "await expects a frame handle");
+    }
+    return node;
+}
+
 static inline ASTNode*parse_while_expr(ParseContext*pc)
 {
     Token*token = expect_token(pc, TOKEN_ID_KEYWORD_WHILE);
@@ -711,21 +906,320 @@ static inline ASTNode*parse_size_directive(ParseContext*pc, Token*dir_token)
     return node;
 }
 
+static inline void parse_target_clones_directive(ParseContext*pc, Token*dir_token, ASTFnAttributes*attributes)
+{
+    if (attributes->target_clones.len)
+    {
+        error(pc, dir_token, "target_clones directive used twice");
+    }
+
+    expect_token(pc, TOKEN_ID_LEFT_PARENTHESIS);
+    bool has_default = false;
+    do
+    {
+        SB*target = token_buffer(expect_token(pc, TOKEN_ID_STRING_LIT));
+        for (u32 i = 0; i < attributes->target_clones.len; i++)
+        {
+            if (sb_cmp(attributes->target_clones.ptr[i], target))
+            {
+                error(pc, dir_token, "target %s repeated in target_clones", sb_ptr(target));
+            }
+        }
+        has_default = has_default || strequal(sb_ptr(target), "default");
+        sb_buffer_append(&attributes->target_clones, target);
+    } while (consume_token_if(pc, TOKEN_ID_COMMA));
+    expect_token(pc, TOKEN_ID_RIGHT_PARENTHESIS);
+
+    if (!has_default)
+    {
+        error(pc, dir_token, "target_clones needs a \"default\" target for the CPUs that have none of the others");
+    }
+}
+
+// #frame_allocator(alloc_fn, free_fn): alloc_fn = (size u64) &u8 and free_fn = (frame &u8) void
+static inline void parse_frame_allocator_directive(ParseContext*pc, Token*dir_token, ASTFnAttributes*attributes)
+{
+    if (attributes->frame_alloc_fn)
+    {
+        error(pc, dir_token, "frame_allocator directive used twice");
+    }
+
+    expect_token(pc, TOKEN_ID_LEFT_PARENTHESIS);
+    attributes->frame_alloc_fn = token_buffer(expect_token(pc, TOKEN_ID_SYMBOL));
+    expect_token(pc, TOKEN_ID_COMMA);
+    attributes->frame_free_fn = token_buffer(expect_token(pc, TOKEN_ID_SYMBOL));
+    expect_token(pc, TOKEN_ID_RIGHT_PARENTHESIS);
+}
+
+// Function directives go before the prototype and fill its attributes
+static inline bool parse_fn_directives(ParseContext*pc, ASTFnAttributes*attributes)
+{
+    bool found = false;
+    while (consume_token_if(pc, TOKEN_ID_HASH))
+    {
+        Token*dir_token = expect_token(pc, TOKEN_ID_SYMBOL);
+        if (strcmp(sb_ptr(token_buffer(dir_token)), "target_clones") == 0)
+        {
+            parse_target_clones_directive(pc, dir_token, attributes);
+        }
+        else if (strcmp(sb_ptr(token_buffer(dir_token)), "frame_allocator") == 0)
+        {
+            parse_frame_allocator_directive(pc, dir_token, attributes);
+        }
+        else
+        {
+            error(pc, dir_token, "unknown function directive: %s", sb_ptr(token_buffer(dir_token)));
+        }
+        found = true;
+    }
+
+    return found;
+}
+
+static inline u32 parse_loop_hint_count(ParseContext*pc, Token*dir_token)
+{
+    expect_token(pc, TOKEN_ID_LEFT_PARENTHESIS);
+    BigInt*count = token_bigint(expect_token(pc, TOKEN_ID_INT_LIT));
+    expect_token(pc, TOKEN_ID_RIGHT_PARENTHESIS);
+    if (count->is_negative || count->digit_count != 1 || count->digit == 0 || count->digit > UINT16_MAX)
+    {
+        error(pc, dir_token, "%s expects a count between 1 and %u", sb_ptr(token_buffer(dir_token)), UINT16_MAX);
+    }
+
+    return (u32)count->digit;
+}
+
+// Loop directives go right before while/for and can be chained: #unroll(4) #interleave(2) while ...
+static inline ASTNode*parse_loop_directive(ParseContext*pc, Token*dir_token)
+{
+    const char*name = sb_ptr(token_buffer(dir_token));
+    u32 count = strequal(name, "no_unroll") ? 0 : parse_loop_hint_count(pc, dir_token);
+
+    ASTNode*loop = parse_primary_expr(pc);
+    if (!loop || loop->node_id != AST_TYPE_LOOP_EXPR)
+    {
+        error(pc, dir_token, "%s must be followed by a while or for loop", name);
+    }
+
+    LoopHints*hints = &loop->loop_expr.hints;
+    if (strequal(name, "unroll") || strequal(name, "no_unroll"))
+    {
+        if (hints->unroll_count || hints->no_unroll)
+        {
+            error(pc, dir_token, "loop has more than one unroll directive");
+        }
+        hints->unroll_count = count;
+        hints->no_unroll = count == 0;
+    }
+    else if (strequal(name, "vectorize"))
+    {
+        if (hints->vectorize_width)
+        {
+            error(pc, dir_token, "vectorize directive used twice");
+        }
+        if (count & (count - 1))
+        {
+            error(pc, dir_token, "vectorize width must be a power of two");
+        }
+        hints->vectorize_width = count;
+    }
+    else
+    {
+        if (hints->interleave_count)
+        {
+            error(pc, dir_token, "interleave directive used twice");
+        }
+        hints->interleave_count = count;
+    }
+
+    return loop;
+}
+
+static inline AtomicOrdering parse_atomic_ordering(ParseContext*pc, Token*dir_token)
+{
+    Token*t = expect_token(pc, TOKEN_ID_SYMBOL);
+    const char*name = sb_ptr(token_buffer(t));
+    for (AtomicOrdering ordering = 0; ordering < ATOMIC_ORDERING_COUNT; ordering++)
+    {
+        if (strequal(name, atomic_ordering_name(ordering)))
+        {
+            return ordering;
+        }
+    }
+
+    error(pc, t, "%s: unknown memory ordering %s, expected relaxed, acquire, release, acq_rel or seq_cst", sb_ptr(token_buffer(dir_token)), name);
+    return ATOMIC_ORDERING_SEQ_CST;
+}
+
+// and and or are keywords, the other operations plain symbols
+static inline AtomicRMWOp parse_atomic_rmw_op(ParseContext*pc)
+{
+    Token*t = consume_token(pc);
+    switch (t->id)
+    {
+        case TOKEN_ID_KEYWORD_AND:
+            return ATOMIC_RMW_OP_AND;
+        case TOKEN_ID_KEYWORD_OR:
+            return ATOMIC_RMW_OP_OR;
+        case TOKEN_ID_SYMBOL:
+        {
+            const char*name = sb_ptr(token_buffer(t));
+            for (AtomicRMWOp op = 0; op < ATOMIC_RMW_OP_COUNT; op++)
+            {
+                if (strequal(name, atomic_rmw_op_name(op)))
+                {
+                    return op;
+                }
+            }
+        } break;
+        default:
+            break;
+    }
+
+    error(pc, t, "atomic_rmw expects add, sub, xchg, and or or as its operation");
+    return ATOMIC_RMW_OP_ADD;
+}
+
+// Same rules as C11: loads can't release, stores can't acquire, and a failed cmpxchg is only a load
+static inline void check_atomic_orderings(ParseContext*pc, Token*dir_token, ASTIntrinsicExpr*intrinsic)
+{
+    AtomicOrdering ordering = intrinsic->ordering;
+    switch (intrinsic->id)
+    {
+        case INTRINSIC_ATOMIC_LOAD:
+            if (ordering == ATOMIC_ORDERING_RELEASE || ordering == ATOMIC_ORDERING_ACQ_REL)
+            {
+                error(pc, dir_token, "atomic_load can't have %s ordering", atomic_ordering_name(ordering));
+            }
+            break;
+        case INTRINSIC_ATOMIC_STORE:
+            if (ordering == ATOMIC_ORDERING_ACQUIRE || ordering == ATOMIC_ORDERING_ACQ_REL)
+            {
+                error(pc, dir_token, "atomic_store can't have %s ordering", atomic_ordering_name(ordering));
+            }
+            break;
+        case INTRINSIC_FENCE:
+            if (ordering == ATOMIC_ORDERING_RELAXED)
+            {
+                error(pc, dir_token, "fence can't have relaxed ordering");
+            }
+            break;
+        case INTRINSIC_CMPXCHG:
+        {
+            AtomicOrdering failure = intrinsic->failure_ordering;
+            if (failure == ATOMIC_ORDERING_RELEASE || failure == ATOMIC_ORDERING_ACQ_REL)
+            {
+                error(pc, dir_token, "cmpxchg failure ordering can't be %s", atomic_ordering_name(failure));
+            }
+            if (failure > ordering || (failure == ATOMIC_ORDERING_ACQUIRE && ordering == ATOMIC_ORDERING_RELEASE))
+            {
+                error(pc, dir_token, "cmpxchg failure ordering can't be stronger than the success one");
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+static inline ASTNode*parse_intrinsic_directive(ParseContext*pc, Token*dir_token, IntrinsicID id)
+{
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, dir_token, AST_TYPE_INTRINSIC_EXPR);
+    node->intrinsic_expr.id = id;
+
+    u8 arg_count = intrinsic_arg_count(id);
+    bool is_atomic = intrinsic_is_atomic_op(id);
+    if (arg_count == 0 && !is_atomic)
+    {
+        return node;
+    }
+
+    expect_token(pc, TOKEN_ID_LEFT_PARENTHESIS);
+    bool needs_comma = false;
+    if (id == INTRINSIC_ATOMIC_RMW)
+    {
+        node->intrinsic_expr.rmw_op = parse_atomic_rmw_op(pc);
+        needs_comma = true;
+    }
+    for (u8 i = 0; i < arg_count; i++)
+    {
+        if (needs_comma)
+        {
+            expect_token(pc, TOKEN_ID_COMMA);
+        }
+        node->intrinsic_expr.args[i] = parse_expression(pc);
+        if (!node->intrinsic_expr.args[i])
+        {
+            error(pc, dir_token, "%s expects %u arguments", intrinsic_name(id), arg_count);
+        }
+        needs_comma = true;
+    }
+    if (is_atomic)
+    {
+        if (needs_comma)
+        {
+            expect_token(pc, TOKEN_ID_COMMA);
+        }
+        node->intrinsic_expr.ordering = parse_atomic_ordering(pc, dir_token);
+        if (id == INTRINSIC_CMPXCHG)
+        {
+            expect_token(pc, TOKEN_ID_COMMA);
+            node->intrinsic_expr.failure_ordering = parse_atomic_ordering(pc, dir_token);
+        }
+        check_atomic_orderings(pc, dir_token, &node->intrinsic_expr);
+    }
+    expect_token(pc, TOKEN_ID_RIGHT_PARENTHESIS);
+
+    return node;
+}
+
 static inline ASTNode*parse_compiler_directive(ParseContext*pc)
 {
     expect_token(pc, TOKEN_ID_HASH);
 
     Token*dir_token = expect_token(pc, TOKEN_ID_SYMBOL);
 
-    if (strcmp(sb_ptr(token_buffer(dir_token)), "size") == 0)
+    const char*name = sb_ptr(token_buffer(dir_token));
+    if (strcmp(name, "size") == 0)
     {
         return parse_size_directive(pc, dir_token);
     }
+    if (strequal(name, "unroll") || strequal(name, "no_unroll") || strequal(name, "vectorize") || strequal(name, "interleave"))
+    {
+        return parse_loop_directive(pc, dir_token);
+    }
+    for (IntrinsicID id = 0; id < INTRINSIC_COUNT; id++)
+    {
+        if (strequal(name, intrinsic_name(id)))
+        {
+            return parse_intrinsic_directive(pc, dir_token, id);
+        }
+    }
 
     RED_NOT_IMPLEMENTED;
     return null;
 }
 
+static inline ASTNode*parse_comptime_expr(ParseContext*pc)
+{
+    Token*comptime_token = expect_token(pc, TOKEN_ID_KEYWORD_COMPTIME);
+
+    ASTNode*expression = parse_primary_expr(pc);
+    if (!expression)
+    {
+        return null;
+    }
+    if (expression->node_id != AST_TYPE_COMPOUND_STATEMENT && expression->node_id != AST_TYPE_FN_CALL)
+    {
+        error(pc, comptime_token, "comptime must be followed by a block or a function call");
+    }
+
+    ASTNode*node = NEW(ASTNode, 1);
+    fill_base_node(node, comptime_token, AST_TYPE_COMPTIME_EXPR);
+    node->comptime_expr.expr = expression;
+    return node;
+}
+
 static inline ASTNode*parse_primary_expr(ParseContext*pc)
 {
     Token*t = get_token(pc);
@@ -753,6 +1247,8 @@ static inline ASTNode*parse_primary_expr(ParseContext*pc)
             return parse_for_expr(pc);
         case TOKEN_ID_KEYWORD_RETURN:
             return parse_return_statement(pc);
+        case TOKEN_ID_KEYWORD_AWAIT:
+            return parse_await_expr(pc);
         case TOKEN_ID_INT_LIT:
             return parse_int_literal(pc);
         case TOKEN_ID_STRING_LIT:
@@ -775,6 +1271,8 @@ static inline ASTNode*parse_primary_expr(ParseContext*pc)
             return null;
         case TOKEN_ID_HASH:
             return parse_compiler_directive(pc);
+        case TOKEN_ID_KEYWORD_COMPTIME:
+            return parse_comptime_expr(pc);
         default:
         RED_NOT_IMPLEMENTED;
             return null;
@@ -852,6 +1350,18 @@ static inline ASTNode*parse_statement(ParseContext*pc)
         return node;
     }
 
+    node = parse_suspend_statement(pc);
+    if (node)
+    {
+        return node;
+    }
+
+    node = parse_resume_statement(pc);
+    if (node)
+    {
+        return node;
+    }
+
     node = parse_expression(pc);
     if (node)
     {
@@ -1052,12 +1562,31 @@ static inline ASTNode*parse_fn_decl(ParseContext*pc)
 
 static inline ASTNode*parse_fn_definition(ParseContext*pc)
 {
+    Token*async_token = consume_token_if(pc, TOKEN_ID_KEYWORD_ASYNC);
+    InlineKind inline_kind = INLINE_KIND_DEFAULT;
+    Token*inline_token = consume_token_if(pc, TOKEN_ID_KEYWORD_INLINE);
+    if (inline_token)
+    {
+        // The ramp function returns before the body finishes, there is nothing to inline into the caller
+        if (async_token)
+        {
+            error(pc, inline_token, "async functions can't be inline");
+        }
+        inline_kind = INLINE_KIND_ALWAYS;
+    }
+    else if (consume_token_if(pc, TOKEN_ID_KEYWORD_NO_INLINE))
+    {
+        inline_kind = INLINE_KIND_NEVER;
+    }
+
     ASTNode*proto = parse_fn_proto(pc);
     if (!proto)
     {
         print("Error parsing function prototype for function (token %zu)\n", pc->current_token);
         return null;
     }
+    proto->fn_proto.attributes.inline_kind = inline_kind;
+    proto->fn_proto.attributes.is_async = async_token != null;
 
     ASTNode*body = parse_compound_st(pc);
     if (!body)
@@ -1088,6 +1617,10 @@ static inline bool is_complex_type_start(ParseContext*pc, TokenID container_type
     }
 
     Token*struct_tok = get_token_i(pc, 2);
+    if (struct_tok->id == TOKEN_ID_KEYWORD_PACKED && container_type == TOKEN_ID_KEYWORD_STRUCT)
+    {
+        struct_tok = get_token_i(pc, 3);
+    }
     if (struct_tok->id != container_type)
     {
         return false;
@@ -1108,6 +1641,7 @@ static inline ASTNode*parse_container_field(ParseContext*pc)
     fill_base_node(node, name, AST_TYPE_FIELD_DECL);
     node->field_decl.sym = create_symbol_node(name);
     node->field_decl.type = create_type_node(pc);
+    node->field_decl.alignment = parse_align_attribute(pc);
 
     return node;
 }
@@ -1216,10 +1750,13 @@ static inline ASTNode*parse_struct_decl(ParseContext*pc)
 
     Token*first = consume_token(pc);
     consume_token(pc);
+    bool is_packed = consume_token_if(pc, TOKEN_ID_KEYWORD_PACKED) != null;
     consume_token(pc);
 
     ASTNode*node = NEW(ASTNode, 1);
     fill_base_node(node, first, AST_TYPE_STRUCT_DECL);
+    node->struct_decl.is_packed = is_packed;
+    node->struct_decl.alignment = parse_align_attribute(pc);
     node->struct_decl.fields = parse_container_fields(pc);
     node->struct_decl.name = first->str_lit.str;
 
@@ -1247,11 +1784,33 @@ static inline ASTNode*parse_enum_decl(ParseContext*pc)
     return node;
 }
 
+// #reorder_fields Name = struct { ... }
+static inline ASTNode*parse_struct_decl_with_directives(ParseContext*pc)
+{
+    Token*hash_token = get_token(pc);
+    Token*dir_token = get_token_i(pc, 1);
+    if (hash_token->id != TOKEN_ID_HASH || !dir_token || dir_token->id != TOKEN_ID_SYMBOL || strcmp(sb_ptr(token_buffer(dir_token)), "reorder_fields") != 0)
+    {
+        return parse_struct_decl(pc);
+    }
+
+    consume_token(pc);
+    consume_token(pc);
+    ASTNode*node = parse_struct_decl(pc);
+    if (!node)
+    {
+        error(pc, dir_token, "reorder_fields must be followed by a struct declaration");
+    }
+    node->struct_decl.reorder_fields = true;
+
+    return node;
+}
+
 bool parse_top_level_declaration(ParseContext*pc, ASTModule*module_ast)
 {
     ASTNode*node;
 
-    if ((node = parse_struct_decl(pc)))
+    if ((node = parse_struct_decl_with_directives(pc)))
     {
         node_append(&module_ast->struct_decls, node);
         return true;
@@ -1263,22 +1822,67 @@ bool parse_top_level_declaration(ParseContext*pc, ASTModule*module_ast)
         return true;
     }
 
+    Token*visibility_token = consume_token_if(pc, TOKEN_ID_KEYWORD_PUB);
+    if (!visibility_token)
+    {
+        visibility_token = consume_token_if(pc, TOKEN_ID_KEYWORD_EXPORT);
+    }
+    Visibility visibility = VISIBILITY_PRIVATE;
+    if (visibility_token)
+    {
+        visibility = visibility_token->id == TOKEN_ID_KEYWORD_PUB ? VISIBILITY_PUB : VISIBILITY_EXPORT;
+    }
+
+    Token*thread_local_token = consume_token_if(pc, TOKEN_ID_KEYWORD_THREAD_LOCAL);
     if ((node = parse_sym_decl(pc)))
     {
+        node->sym_decl.is_thread_local = thread_local_token != null;
+        node->sym_decl.visibility = visibility;
         node_append(&module_ast->global_sym_decls, node);
         return true;
     }
+    if (thread_local_token)
+    {
+        error(pc, thread_local_token, "thread_local must be followed by a global variable declaration");
+    }
+
+    Token*directive_token = get_token(pc);
+    ASTFnAttributes attributes = ZERO_INIT;
+    bool has_directives = parse_fn_directives(pc, &attributes);
 
-    if ((node = parse_fn_decl(pc)))
+    if ((node = parse_fn_decl(pc)) || (node = parse_fn_definition(pc)))
     {
+        if (attributes.target_clones.len && !node->fn_def.body)
+        {
+            error(pc, directive_token, "target_clones needs a function definition, the clones are compiled from its body");
+        }
+        if (visibility_token && !node->fn_def.body)
+        {
+            error(pc, visibility_token, "%s can't be used on extern functions", token_name(visibility_token->id));
+        }
+        if (attributes.frame_alloc_fn && !node->fn_def.proto->fn_proto.attributes.is_async)
+        {
+            error(pc, directive_token, "frame_allocator can only be used on async functions");
+        }
+        if (attributes.target_clones.len && node->fn_def.proto->fn_proto.attributes.is_async)
+        {
+            error(pc, directive_token, "target_clones can't be used on async functions");
+        }
+        node->fn_def.proto->fn_proto.attributes.target_clones = attributes.target_clones;
+        node->fn_def.proto->fn_proto.attributes.frame_alloc_fn = attributes.frame_alloc_fn;
+        node->fn_def.proto->fn_proto.attributes.frame_free_fn = attributes.frame_free_fn;
+        node->fn_def.proto->fn_proto.attributes.visibility = visibility;
         node_append(&module_ast->fn_definitions, node);
         return true;
     }
 
-    if ((node = parse_fn_definition(pc)))
+    if (has_directives)
     {
-        node_append(&module_ast->fn_definitions, node);
-        return true;
+        error(pc, directive_token, "function directives must be followed by a function");
+    }
+    if (visibility_token)
+    {
+        error(pc, visibility_token, "%s must be followed by a function or a global variable declaration", token_name(visibility_token->id));
     }
 
     return false;
@@ -1314,7 +1918,11 @@ ASTModule parse_module(TokenBuffer*tb, SB*module_name)
 ASTModule load_lex_and_parse_user_module(SB* module_filename)
 {
     // TODO: Here we should handle include folders indicated by the build module
-    return load_lex_and_parse_included_module(sb_ptr(module_filename), module_filename);
+    // Like system modules, the name is used as the module namespace (name.fn()) and the extension is implied
+    char file_path[1024] = "";
+    strcat(file_path, sb_ptr(module_filename));
+    strcat(file_path, ".red");
+    return load_lex_and_parse_included_module(file_path, module_filename);
 }
 
 ASTModule load_lex_and_parse_system_module(SB* module_name)
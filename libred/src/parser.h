@@ -33,6 +33,11 @@ typedef enum AST_ID
     AST_TYPE_STRUCT_DECL,
     AST_TYPE_UNION_DECL,
     AST_TYPE_ENUM_DECL,
+    AST_TYPE_COMPTIME_EXPR,
+    AST_TYPE_INTRINSIC_EXPR,
+    AST_TYPE_SUSPEND_STATEMENT,
+    AST_TYPE_RESUME_STATEMENT,
+    AST_TYPE_AWAIT_EXPR,
 } AST_ID;
 
 
@@ -51,6 +56,8 @@ typedef struct ASTSymbol
         ASTNode* subscript;
         ASTSymbolSubscriptType subscript_type;
     };
+    /* Field selected on the indexed element: a[i].f */
+    SB* element_field;
 } ASTSymbol;
 
 typedef struct ASTStringLit
@@ -62,6 +69,8 @@ typedef struct ASTArrayType
 {
     ASTNode* type;
     ASTNode* element_count_expr;
+    /* #soa: the struct elements are stored as one array per field */
+    bool is_soa;
 } ASTArrayType;
 
 typedef struct ASTStructType
@@ -73,6 +82,11 @@ typedef struct ASTStructDecl
 {
     SB name;
     ASTNodeBuffer fields;
+    /* Name = packed struct align(N) { ... }. Alignment is 0 when not given */
+    u32 alignment;
+    bool is_packed;
+    /* #reorder_fields before the declaration */
+    bool reorder_fields;
 } ASTStructDecl, ASTUnionDecl;
 
 typedef struct ASTEnumField
@@ -100,11 +114,24 @@ typedef struct ASTEnumDecl
     ASTEnumType type;
 } ASTEnumDecl;
 
+/* v4f32, v16u8, v8bool... Vectors of bool are the masks comparisons produce */
+typedef struct ASTVectorType
+{
+    SB* element_type;
+    u32 element_count;
+} ASTVectorType;
+
 typedef struct ASTPointerType
 {
     ASTNode* type;
 } ASTPointerType;
 
+/* anyframe->T is the handle an async call returns. A plain anyframe can only be resumed: the result type is null */
+typedef struct ASTFrameType
+{
+    ASTNode* result_type;
+} ASTFrameType;
+
 typedef struct ASTType
 {
     TypeKind kind;
@@ -117,6 +144,8 @@ typedef struct ASTType
         // probably buggy enum decl: subst for enum type
         ASTEnumDecl enum_;
         ASTPointerType pointer_;
+        ASTVectorType vector_;
+        ASTFrameType frame_;
     };
 } ASTType;
 
@@ -129,6 +158,10 @@ typedef struct ASTParamDecl
 {
     ASTNode* sym;
     ASTNode* type;
+    /* noalias, only for pointer parameters */
+    bool is_noalias;
+    /* align(N) after the type, only for fields */
+    u32 alignment;
 } ASTParamDecl, ASTFieldDecl;
 
 typedef struct ASTSymDecl
@@ -137,6 +170,14 @@ typedef struct ASTSymDecl
     ASTNode* type;
     ASTNode* value;
     bool is_const;
+    /* = undefined: left uninitialized */
+    bool is_undefined;
+    /* thread_local, only for globals */
+    bool is_thread_local;
+    /* pub or export, only for globals */
+    Visibility visibility;
+    /* align(N) after the type */
+    u32 alignment;
 } ASTSymDecl;
 
 typedef struct ASTIntLit
@@ -161,6 +202,12 @@ typedef struct ASTRetExpr
     ASTNode* expr;
 } ASTRetExpr;
 
+/* resume h; and await h, where h is a frame handle */
+typedef struct ASTFrameExpr
+{
+    ASTNode* frame;
+} ASTFrameExpr;
+
 typedef struct ASTCompoundStatement
 {
     ASTNodeBuffer statements;
@@ -190,6 +237,7 @@ typedef struct ASTLoopExpr
 {
     ASTNode* condition;
     ASTNode* body;
+    LoopHints hints;
 } ASTLoopExpr;
 
 typedef struct ASTFnCallExpr
@@ -199,11 +247,227 @@ typedef struct ASTFnCallExpr
     u8 arg_count;
 } ASTFnCallExpr;
 
+/* comptime { ... } or comptime fn_call(...) */
+typedef struct ASTComptimeExpr
+{
+    ASTNode* expr;
+} ASTComptimeExpr;
+
+/* Builtin directives that map to a machine intrinsic: #popcount(x), #prefetch(p, 0, 3), #unreachable...
+ * The vector ones: #shuffle(a, b, [0, 4, 1, 5]), #select(mask, a, b), #reduce_add(v), #vload(a[i]) and #vstore(a[i], v)
+ * The atomic ones end with their memory ordering: #atomic_load(p, acquire), #atomic_store(p, v, release),
+ * #atomic_rmw(add, p, v, seq_cst), #cmpxchg(p, expected, desired, acq_rel, acquire) and #fence(seq_cst) */
+typedef enum IntrinsicID
+{
+    INTRINSIC_EXPECT,
+    INTRINSIC_ASSUME,
+    INTRINSIC_PREFETCH,
+    INTRINSIC_POPCOUNT,
+    INTRINSIC_CLZ,
+    INTRINSIC_CTZ,
+    INTRINSIC_BSWAP,
+    INTRINSIC_ROTL,
+    INTRINSIC_ROTR,
+    INTRINSIC_SHUFFLE,
+    INTRINSIC_SELECT,
+    INTRINSIC_REDUCE_ADD,
+    INTRINSIC_REDUCE_MUL,
+    INTRINSIC_REDUCE_MIN,
+    INTRINSIC_REDUCE_MAX,
+    INTRINSIC_REDUCE_AND,
+    INTRINSIC_REDUCE_OR,
+    INTRINSIC_REDUCE_XOR,
+    INTRINSIC_VLOAD,
+    INTRINSIC_VLOAD_ALIGNED,
+    INTRINSIC_VSTORE,
+    INTRINSIC_VSTORE_ALIGNED,
+    INTRINSIC_ATOMIC_LOAD,
+    INTRINSIC_ATOMIC_STORE,
+    INTRINSIC_ATOMIC_RMW,
+    INTRINSIC_CMPXCHG,
+    INTRINSIC_FENCE,
+    INTRINSIC_UNREACHABLE,
+    INTRINSIC_COUNT,
+} IntrinsicID;
+
+/* C11 memory orderings, from weakest to strongest */
+typedef enum AtomicOrdering
+{
+    ATOMIC_ORDERING_RELAXED,
+    ATOMIC_ORDERING_ACQUIRE,
+    ATOMIC_ORDERING_RELEASE,
+    ATOMIC_ORDERING_ACQ_REL,
+    ATOMIC_ORDERING_SEQ_CST,
+    ATOMIC_ORDERING_COUNT,
+} AtomicOrdering;
+
+typedef enum AtomicRMWOp
+{
+    ATOMIC_RMW_OP_ADD,
+    ATOMIC_RMW_OP_SUB,
+    ATOMIC_RMW_OP_XCHG,
+    ATOMIC_RMW_OP_AND,
+    ATOMIC_RMW_OP_OR,
+    ATOMIC_RMW_OP_COUNT,
+} AtomicRMWOp;
+
+#define MAX_INTRINSIC_ARG_COUNT 3
+
+static inline const char* intrinsic_name(IntrinsicID id)
+{
+    switch (id)
+    {
+        case INTRINSIC_EXPECT: return "expect";
+        case INTRINSIC_ASSUME: return "assume";
+        case INTRINSIC_PREFETCH: return "prefetch";
+        case INTRINSIC_POPCOUNT: return "popcount";
+        case INTRINSIC_CLZ: return "clz";
+        case INTRINSIC_CTZ: return "ctz";
+        case INTRINSIC_BSWAP: return "bswap";
+        case INTRINSIC_ROTL: return "rotl";
+        case INTRINSIC_ROTR: return "rotr";
+        case INTRINSIC_SHUFFLE: return "shuffle";
+        case INTRINSIC_SELECT: return "select";
+        case INTRINSIC_REDUCE_ADD: return "reduce_add";
+        case INTRINSIC_REDUCE_MUL: return "reduce_mul";
+        case INTRINSIC_REDUCE_MIN: return "reduce_min";
+        case INTRINSIC_REDUCE_MAX: return "reduce_max";
+        case INTRINSIC_REDUCE_AND: return "reduce_and";
+        case INTRINSIC_REDUCE_OR: return "reduce_or";
+        case INTRINSIC_REDUCE_XOR: return "reduce_xor";
+        case INTRINSIC_VLOAD: return "vload";
+        case INTRINSIC_VLOAD_ALIGNED: return "vload_aligned";
+        case INTRINSIC_VSTORE: return "vstore";
+        case INTRINSIC_VSTORE_ALIGNED: return "vstore_aligned";
+        case INTRINSIC_ATOMIC_LOAD: return "atomic_load";
+        case INTRINSIC_ATOMIC_STORE: return "atomic_store";
+        case INTRINSIC_ATOMIC_RMW: return "atomic_rmw";
+        case INTRINSIC_CMPXCHG: return "cmpxchg";
+        case INTRINSIC_FENCE: return "fence";
+        case INTRINSIC_UNREACHABLE: return "unreachable";
+        default:
+            RED_UNREACHABLE;
+            return null;
+    }
+}
+
+/* Expression arguments only: the operation and orderings of the atomics are parsed apart */
+static inline u8 intrinsic_arg_count(IntrinsicID id)
+{
+    switch (id)
+    {
+        case INTRINSIC_UNREACHABLE:
+        case INTRINSIC_FENCE:
+            return 0;
+        case INTRINSIC_ASSUME:
+        case INTRINSIC_POPCOUNT:
+        case INTRINSIC_CLZ:
+        case INTRINSIC_CTZ:
+        case INTRINSIC_BSWAP:
+        case INTRINSIC_REDUCE_ADD:
+        case INTRINSIC_REDUCE_MUL:
+        case INTRINSIC_REDUCE_MIN:
+        case INTRINSIC_REDUCE_MAX:
+        case INTRINSIC_REDUCE_AND:
+        case INTRINSIC_REDUCE_OR:
+        case INTRINSIC_REDUCE_XOR:
+        case INTRINSIC_VLOAD:
+        case INTRINSIC_VLOAD_ALIGNED:
+        case INTRINSIC_ATOMIC_LOAD:
+            return 1;
+        case INTRINSIC_EXPECT:
+        case INTRINSIC_ROTL:
+        case INTRINSIC_ROTR:
+        case INTRINSIC_VSTORE:
+        case INTRINSIC_VSTORE_ALIGNED:
+        case INTRINSIC_ATOMIC_STORE:
+        case INTRINSIC_ATOMIC_RMW:
+            return 2;
+        case INTRINSIC_PREFETCH:
+        case INTRINSIC_SHUFFLE:
+        case INTRINSIC_SELECT:
+        case INTRINSIC_CMPXCHG:
+            return 3;
+        default:
+            RED_UNREACHABLE;
+            return 0;
+    }
+}
+
+/* From #shuffle to #vstore_aligned */
+static inline bool intrinsic_is_vector_op(IntrinsicID id)
+{
+    return id >= INTRINSIC_SHUFFLE && id <= INTRINSIC_VSTORE_ALIGNED;
+}
+
+/* From #atomic_load to #fence */
+static inline bool intrinsic_is_atomic_op(IntrinsicID id)
+{
+    return id >= INTRINSIC_ATOMIC_LOAD && id <= INTRINSIC_FENCE;
+}
+
+static inline const char* atomic_ordering_name(AtomicOrdering ordering)
+{
+    switch (ordering)
+    {
+        case ATOMIC_ORDERING_RELAXED: return "relaxed";
+        case ATOMIC_ORDERING_ACQUIRE: return "acquire";
+        case ATOMIC_ORDERING_RELEASE: return "release";
+        case ATOMIC_ORDERING_ACQ_REL: return "acq_rel";
+        case ATOMIC_ORDERING_SEQ_CST: return "seq_cst";
+        default:
+            RED_UNREACHABLE;
+            return null;
+    }
+}
+
+static inline const char* atomic_rmw_op_name(AtomicRMWOp op)
+{
+    switch (op)
+    {
+        case ATOMIC_RMW_OP_ADD: return "add";
+        case ATOMIC_RMW_OP_SUB: return "sub";
+        case ATOMIC_RMW_OP_XCHG: return "xchg";
+        case ATOMIC_RMW_OP_AND: return "and";
+        case ATOMIC_RMW_OP_OR: return "or";
+        default:
+            RED_UNREACHABLE;
+            return null;
+    }
+}
+
+typedef struct ASTIntrinsicExpr
+{
+    ASTNode* args[MAX_INTRINSIC_ARG_COUNT];
+    IntrinsicID id;
+    /* Atomics only. The failure ordering is only used by #cmpxchg */
+    AtomicRMWOp rmw_op;
+    AtomicOrdering ordering;
+    AtomicOrdering failure_ordering;
+} ASTIntrinsicExpr;
+
+/* Directives written before a function */
+typedef struct ASTFnAttributes
+{
+    /* #target_clones("avx2", "sse4.2", "default") */
+    SBBuffer target_clones;
+    /* inline or noinline before the name */
+    InlineKind inline_kind;
+    /* pub or export before the function */
+    Visibility visibility;
+    /* async before the name */
+    bool is_async;
+    /* #frame_allocator(alloc_fn, free_fn). Null names mean malloc and free */
+    SB* frame_alloc_fn;
+    SB* frame_free_fn;
+} ASTFnAttributes;
+
 typedef struct ASTFnProto
 {
     ASTNodeBuffer params;
     ASTNode* sym;
     ASTNode* ret_type;
+    ASTFnAttributes attributes;
 } ASTFnProto;
 
 typedef struct ASTFnDef
@@ -236,12 +500,15 @@ typedef struct ASTNode
         ASTArrayLit array_lit;
         ASTBinExpr bin_expr;
         ASTRetExpr return_expr;
+        ASTFrameExpr frame_expr;
         ASTCompoundStatement compound_statement;
         ASTBranchExpr branch_expr;
         ASTSwitchCase switch_case;
         ASTSwitchExpr switch_expr;
         ASTLoopExpr loop_expr;
         ASTFnCallExpr fn_call;
+        ASTComptimeExpr comptime_expr;
+        ASTIntrinsicExpr intrinsic_expr;
         ASTFnProto fn_proto;
         ASTFnDef fn_def;
     };
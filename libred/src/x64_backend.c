@@ -1,10 +1,12 @@
 #include "types.h"
 #include "compiler_types.h"
-#include <Windows.h>
 #include <assert.h>
 #include <stdio.h>
 #include "x64_backend.h"
 
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+
 
 typedef enum Mod
 {
@@ -23,67 +25,353 @@ typedef enum Rex
     REX_B = 0b01000001,
 } Rex;
 
-typedef enum OperandType
-{
-    OPERAND_TYPE_REGISTER = 1,
-    OPERAND_TYPE_REGISTER_MEMORY,
-} OperandType;
-
-typedef struct Register
-{
-    u8 index;
-} Register;
-
-typedef struct Operand
-{
-    OperandType type;
-    union
-    {
-        Register reg;
-    };
-} Operand;
-
-const Operand rax =
+const char* gp_register_names[4][16] =
 {
-    .type = OPERAND_TYPE_REGISTER,
-    .reg.index = (u8)0xb0000,
+    { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b", },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w", },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d", },
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", },
 };
 
-const Operand rcx =
+const char* xmm_register_names[16] =
 {
-    .type = OPERAND_TYPE_REGISTER,
-    .reg.index = (u8)0xb0001,
+    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
 };
 
-typedef enum x64_Mnemonic
+const char* mnemonic_names[] =
 {
-    MOV,
-} x64_Mnemonic;
+    [MNEMONIC_ADD] = "add",
+    [MNEMONIC_OR] = "or",
+    [MNEMONIC_ADC] = "adc",
+    [MNEMONIC_SBB] = "sbb",
+    [MNEMONIC_AND] = "and",
+    [MNEMONIC_SUB] = "sub",
+    [MNEMONIC_XOR] = "xor",
+    [MNEMONIC_CMP] = "cmp",
+    [MNEMONIC_TEST] = "test",
+    [MNEMONIC_MOV] = "mov",
+    [MNEMONIC_LEA] = "lea",
+    [MNEMONIC_MOVZX] = "movzx",
+    [MNEMONIC_MOVSX] = "movsx",
+    [MNEMONIC_MOVSXD] = "movsxd",
+    [MNEMONIC_IMUL] = "imul",
+    [MNEMONIC_NOT] = "not",
+    [MNEMONIC_NEG] = "neg",
+    [MNEMONIC_MUL] = "mul",
+    [MNEMONIC_DIV] = "div",
+    [MNEMONIC_IDIV] = "idiv",
+    [MNEMONIC_INC] = "inc",
+    [MNEMONIC_DEC] = "dec",
+    [MNEMONIC_SHL] = "shl",
+    [MNEMONIC_SHR] = "shr",
+    [MNEMONIC_SAR] = "sar",
+    [MNEMONIC_PUSH] = "push",
+    [MNEMONIC_POP] = "pop",
+    [MNEMONIC_CALL] = "call",
+    [MNEMONIC_JMP] = "jmp",
+    [MNEMONIC_RET] = "ret",
+    [MNEMONIC_CDQ] = "cdq",
+    [MNEMONIC_CQO] = "cqo",
+    [MNEMONIC_NOP] = "nop",
+    [MNEMONIC_JCC] = "j",
+    [MNEMONIC_SETCC] = "set",
+    [MNEMONIC_CMOVCC] = "cmov",
+    [MNEMONIC_MOVSS] = "movss",
+    [MNEMONIC_MOVSD] = "movsd",
+    [MNEMONIC_MOVAPS] = "movaps",
+    [MNEMONIC_MOVUPS] = "movups",
+    [MNEMONIC_MOVAPD] = "movapd",
+    [MNEMONIC_MOVUPD] = "movupd",
+    [MNEMONIC_MOVDQA] = "movdqa",
+    [MNEMONIC_MOVDQU] = "movdqu",
+    [MNEMONIC_MOVD] = "movd",
+    [MNEMONIC_MOVQ] = "movq",
+    [MNEMONIC_ADDSS] = "addss",
+    [MNEMONIC_ADDSD] = "addsd",
+    [MNEMONIC_ADDPS] = "addps",
+    [MNEMONIC_ADDPD] = "addpd",
+    [MNEMONIC_SUBSS] = "subss",
+    [MNEMONIC_SUBSD] = "subsd",
+    [MNEMONIC_SUBPS] = "subps",
+    [MNEMONIC_SUBPD] = "subpd",
+    [MNEMONIC_MULSS] = "mulss",
+    [MNEMONIC_MULSD] = "mulsd",
+    [MNEMONIC_MULPS] = "mulps",
+    [MNEMONIC_MULPD] = "mulpd",
+    [MNEMONIC_DIVSS] = "divss",
+    [MNEMONIC_DIVSD] = "divsd",
+    [MNEMONIC_DIVPS] = "divps",
+    [MNEMONIC_DIVPD] = "divpd",
+    [MNEMONIC_MINSS] = "minss",
+    [MNEMONIC_MINSD] = "minsd",
+    [MNEMONIC_MAXSS] = "maxss",
+    [MNEMONIC_MAXSD] = "maxsd",
+    [MNEMONIC_SQRTSS] = "sqrtss",
+    [MNEMONIC_SQRTSD] = "sqrtsd",
+    [MNEMONIC_UCOMISS] = "ucomiss",
+    [MNEMONIC_UCOMISD] = "ucomisd",
+    [MNEMONIC_CVTSI2SS] = "cvtsi2ss",
+    [MNEMONIC_CVTSI2SD] = "cvtsi2sd",
+    [MNEMONIC_CVTTSS2SI] = "cvttss2si",
+    [MNEMONIC_CVTTSD2SI] = "cvttsd2si",
+    [MNEMONIC_CVTSS2SD] = "cvtss2sd",
+    [MNEMONIC_CVTSD2SS] = "cvtsd2ss",
+    [MNEMONIC_XORPS] = "xorps",
+    [MNEMONIC_XORPD] = "xorpd",
+    [MNEMONIC_ANDPS] = "andps",
+    [MNEMONIC_ANDPD] = "andpd",
+    [MNEMONIC_PXOR] = "pxor",
+    [MNEMONIC_PADDD] = "paddd",
+    [MNEMONIC_PADDQ] = "paddq",
+    [MNEMONIC_PSUBD] = "psubd",
+    [MNEMONIC_PSUBQ] = "psubq",
+    [MNEMONIC_XCHG] = "xchg",
+    [MNEMONIC_XADD] = "xadd",
+    [MNEMONIC_CMPXCHG] = "cmpxchg",
+    [MNEMONIC_MFENCE] = "mfence",
+    [MNEMONIC_LABEL] = "label",
+};
+static_assert(array_length(mnemonic_names) == MNEMONIC_COUNT, "Every mnemonic must have a name");
 
-typedef struct Instruction
+const char* condition_code_names[CONDITION_CODE_COUNT] =
 {
-    x64_Mnemonic mnemonic;
-    Operand operands[2];
-} Instruction;
+    "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
 
 typedef enum InstructionExtensionType
 {
+    INSTRUCTION_EXTENSION_TYPE_NONE,
     INSTRUCTION_EXTENSION_TYPE_REGISTER = 1,
     INSTRUCTION_EXTENSION_TYPE_OP_CODE,
     INSTRUCTION_EXTENSION_TYPE_OP_CODE_PLUS_REGISTER,
 } InstructionExtensionType;
 
+typedef enum OperandEncodingKind
+{
+    OPERAND_ENCODING_NONE,
+    /* General purpose register in ModRM.reg */
+    OPERAND_ENCODING_REGISTER,
+    /* General purpose register or memory in ModRM.rm */
+    OPERAND_ENCODING_REGISTER_MEMORY,
+    /* Memory in ModRM.rm, the size is not checked (lea) */
+    OPERAND_ENCODING_MEMORY,
+    /* General purpose register in the low 3 bits of the op code */
+    OPERAND_ENCODING_OP_CODE_REGISTER,
+    OPERAND_ENCODING_IMMEDIATE,
+    OPERAND_ENCODING_RELATIVE,
+    /* Implicit CL register (shifts) */
+    OPERAND_ENCODING_CL,
+    /* XMM register in ModRM.reg */
+    OPERAND_ENCODING_XMM,
+    /* XMM register or memory in ModRM.rm */
+    OPERAND_ENCODING_XMM_MEMORY,
+} OperandEncodingKind;
+
+typedef struct OperandEncoding
+{
+    u8 kind;
+    u8 size;
+} OperandEncoding;
+
+typedef enum EncodingFlags
+{
+    ENCODING_FLAG_REX_W = 1 << 0,
+    /* 0x66 operand size override for 16-bit operations */
+    ENCODING_FLAG_OPERAND_SIZE = 1 << 1,
+    /* The condition code is added to the last op code byte */
+    ENCODING_FLAG_CONDITION_CODE = 1 << 2,
+} EncodingFlags;
+
 typedef struct InstructionEncoding
 {
-    u16 op_code;
+    x64_Mnemonic mnemonic;
+    /* Mandatory prefix (0x66, 0xf2, 0xf3) or 0 */
+    u8 prefix;
+    u8 op_code[3];
+    u8 op_code_size;
+    u8 op_code_extension;
+    u8 flags;
     InstructionExtensionType ext_type;
-    OperandType operand_types[2];
+    OperandEncoding operands[2];
 } InstructionEncoding;
 
+#define SIZE_FLAGS_1 0
+#define SIZE_FLAGS_2 ENCODING_FLAG_OPERAND_SIZE
+#define SIZE_FLAGS_4 0
+#define SIZE_FLAGS_8 ENCODING_FLAG_REX_W
+
+#define ENCODING(_mnemonic, _prefix, _flags, _op_code_size, _op0, _op1, _op2, _ext_type, _ext, _kind0, _size0, _kind1, _size1) \
+    {\
+        .mnemonic = MNEMONIC_##_mnemonic,\
+        .prefix = _prefix,\
+        .op_code = { _op0, _op1, _op2 },\
+        .op_code_size = _op_code_size,\
+        .op_code_extension = _ext,\
+        .flags = _flags,\
+        .ext_type = INSTRUCTION_EXTENSION_TYPE_##_ext_type,\
+        .operands = { { OPERAND_ENCODING_##_kind0, _size0 }, { OPERAND_ENCODING_##_kind1, _size1 } },\
+    }
+
+/* One-byte op code */
+#define OP1(_mnemonic, _flags, _op, _ext_type, _ext, _kind0, _size0, _kind1, _size1) \
+    ENCODING(_mnemonic, 0, _flags, 1, _op, 0, 0, _ext_type, _ext, _kind0, _size0, _kind1, _size1)
+/* Two-byte op code (0x0f escape) */
+#define OP2(_mnemonic, _prefix, _flags, _op, _ext_type, _ext, _kind0, _size0, _kind1, _size1) \
+    ENCODING(_mnemonic, _prefix, _flags, 2, 0x0f, _op, 0, _ext_type, _ext, _kind0, _size0, _kind1, _size1)
+
+/* rm, r and r, rm forms with the size chosen by the operand size prefixes */
+#define RM_R(_mnemonic, _op, _size) OP1(_mnemonic, SIZE_FLAGS_##_size, _op, REGISTER, 0, REGISTER_MEMORY, _size, REGISTER, _size)
+#define R_RM(_mnemonic, _op, _size) OP1(_mnemonic, SIZE_FLAGS_##_size, _op, REGISTER, 0, REGISTER, _size, REGISTER_MEMORY, _size)
+#define RM_IMM(_mnemonic, _op, _ext, _size, _imm_size) OP1(_mnemonic, SIZE_FLAGS_##_size, _op, OP_CODE, _ext, REGISTER_MEMORY, _size, IMMEDIATE, _imm_size)
+#define RM_ONLY(_mnemonic, _op, _ext, _size) OP1(_mnemonic, SIZE_FLAGS_##_size, _op, OP_CODE, _ext, REGISTER_MEMORY, _size, NONE, 0)
+
+#define ALU_ENCODINGS(_mnemonic, _base, _ext) \
+    RM_R(_mnemonic, _base + 0, 1), RM_R(_mnemonic, _base + 1, 2), RM_R(_mnemonic, _base + 1, 4), RM_R(_mnemonic, _base + 1, 8),\
+    R_RM(_mnemonic, _base + 2, 1), R_RM(_mnemonic, _base + 3, 2), R_RM(_mnemonic, _base + 3, 4), R_RM(_mnemonic, _base + 3, 8),\
+    RM_IMM(_mnemonic, 0x80, _ext, 1, 1),\
+    RM_IMM(_mnemonic, 0x83, _ext, 2, 1), RM_IMM(_mnemonic, 0x83, _ext, 4, 1), RM_IMM(_mnemonic, 0x83, _ext, 8, 1),\
+    RM_IMM(_mnemonic, 0x81, _ext, 2, 2), RM_IMM(_mnemonic, 0x81, _ext, 4, 4), RM_IMM(_mnemonic, 0x81, _ext, 8, 4)
+
+#define UNARY_ENCODINGS(_mnemonic, _op8, _op, _ext) \
+    RM_ONLY(_mnemonic, _op8, _ext, 1), RM_ONLY(_mnemonic, _op, _ext, 2), RM_ONLY(_mnemonic, _op, _ext, 4), RM_ONLY(_mnemonic, _op, _ext, 8)
+
+#define SHIFT_ENCODINGS(_mnemonic, _ext) \
+    RM_IMM(_mnemonic, 0xc0, _ext, 1, 1), RM_IMM(_mnemonic, 0xc1, _ext, 2, 1), RM_IMM(_mnemonic, 0xc1, _ext, 4, 1), RM_IMM(_mnemonic, 0xc1, _ext, 8, 1),\
+    OP1(_mnemonic, SIZE_FLAGS_1, 0xd2, OP_CODE, _ext, REGISTER_MEMORY, 1, CL, 1),\
+    OP1(_mnemonic, SIZE_FLAGS_2, 0xd3, OP_CODE, _ext, REGISTER_MEMORY, 2, CL, 1),\
+    OP1(_mnemonic, SIZE_FLAGS_4, 0xd3, OP_CODE, _ext, REGISTER_MEMORY, 4, CL, 1),\
+    OP1(_mnemonic, SIZE_FLAGS_8, 0xd3, OP_CODE, _ext, REGISTER_MEMORY, 8, CL, 1)
+
+/* Two-byte op code, r, rm form for 16, 32 and 64 bit destinations */
+#define R_RM_0F(_mnemonic, _op, _size, _rm_size) OP2(_mnemonic, 0, SIZE_FLAGS_##_size, _op, REGISTER, 0, REGISTER, _size, REGISTER_MEMORY, _rm_size)
+
+/* Two-byte op code, rm, r form, with the byte variant at _op8 */
+#define RM_R_0F_ENCODINGS(_mnemonic, _op8, _op) \
+    OP2(_mnemonic, 0, SIZE_FLAGS_1, _op8, REGISTER, 0, REGISTER_MEMORY, 1, REGISTER, 1),\
+    OP2(_mnemonic, 0, SIZE_FLAGS_2, _op, REGISTER, 0, REGISTER_MEMORY, 2, REGISTER, 2),\
+    OP2(_mnemonic, 0, SIZE_FLAGS_4, _op, REGISTER, 0, REGISTER_MEMORY, 4, REGISTER, 4),\
+    OP2(_mnemonic, 0, SIZE_FLAGS_8, _op, REGISTER, 0, REGISTER_MEMORY, 8, REGISTER, 8)
+
+/* SSE xmm, xmm/m and xmm/m, xmm forms */
+#define SSE_RM(_mnemonic, _prefix, _op, _mem_size) OP2(_mnemonic, _prefix, 0, _op, REGISTER, 0, XMM, 16, XMM_MEMORY, _mem_size)
+#define SSE_MR(_mnemonic, _prefix, _op, _mem_size) OP2(_mnemonic, _prefix, 0, _op, REGISTER, 0, XMM_MEMORY, _mem_size, XMM, 16)
+
+#define SSE_ARITHMETIC_ENCODINGS(_name, _op) \
+    SSE_RM(_name##SS, 0xf3, _op, 4), SSE_RM(_name##SD, 0xf2, _op, 8), SSE_RM(_name##PS, 0, _op, 16), SSE_RM(_name##PD, 0x66, _op, 16)
+
+/* Order matters: the first encoding that matches the operands is used, so shorter forms go first */
+const InstructionEncoding encodings[] =
+{
+    ALU_ENCODINGS(ADD, 0x00, 0),
+    ALU_ENCODINGS(OR, 0x08, 1),
+    ALU_ENCODINGS(ADC, 0x10, 2),
+    ALU_ENCODINGS(SBB, 0x18, 3),
+    ALU_ENCODINGS(AND, 0x20, 4),
+    ALU_ENCODINGS(SUB, 0x28, 5),
+    ALU_ENCODINGS(XOR, 0x30, 6),
+    ALU_ENCODINGS(CMP, 0x38, 7),
+
+    RM_R(TEST, 0x84, 1), RM_R(TEST, 0x85, 2), RM_R(TEST, 0x85, 4), RM_R(TEST, 0x85, 8),
+    RM_IMM(TEST, 0xf6, 0, 1, 1), RM_IMM(TEST, 0xf7, 0, 2, 2), RM_IMM(TEST, 0xf7, 0, 4, 4), RM_IMM(TEST, 0xf7, 0, 8, 4),
+
+    RM_R(MOV, 0x88, 1), RM_R(MOV, 0x89, 2), RM_R(MOV, 0x89, 4), RM_R(MOV, 0x89, 8),
+    R_RM(MOV, 0x8a, 1), R_RM(MOV, 0x8b, 2), R_RM(MOV, 0x8b, 4), R_RM(MOV, 0x8b, 8),
+    OP1(MOV, SIZE_FLAGS_1, 0xb0, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 1, IMMEDIATE, 1),
+    OP1(MOV, SIZE_FLAGS_2, 0xb8, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 2, IMMEDIATE, 2),
+    OP1(MOV, SIZE_FLAGS_4, 0xb8, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 4, IMMEDIATE, 4),
+    RM_IMM(MOV, 0xc6, 0, 1, 1), RM_IMM(MOV, 0xc7, 0, 2, 2), RM_IMM(MOV, 0xc7, 0, 4, 4), RM_IMM(MOV, 0xc7, 0, 8, 4),
+    OP1(MOV, SIZE_FLAGS_8, 0xb8, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 8, IMMEDIATE, 8),
+
+    OP1(LEA, SIZE_FLAGS_2, 0x8d, REGISTER, 0, REGISTER, 2, MEMORY, 0),
+    OP1(LEA, SIZE_FLAGS_4, 0x8d, REGISTER, 0, REGISTER, 4, MEMORY, 0),
+    OP1(LEA, SIZE_FLAGS_8, 0x8d, REGISTER, 0, REGISTER, 8, MEMORY, 0),
+
+    R_RM_0F(MOVZX, 0xb6, 2, 1), R_RM_0F(MOVZX, 0xb6, 4, 1), R_RM_0F(MOVZX, 0xb6, 8, 1),
+    R_RM_0F(MOVZX, 0xb7, 4, 2), R_RM_0F(MOVZX, 0xb7, 8, 2),
+    R_RM_0F(MOVSX, 0xbe, 2, 1), R_RM_0F(MOVSX, 0xbe, 4, 1), R_RM_0F(MOVSX, 0xbe, 8, 1),
+    R_RM_0F(MOVSX, 0xbf, 4, 2), R_RM_0F(MOVSX, 0xbf, 8, 2),
+    OP1(MOVSXD, SIZE_FLAGS_8, 0x63, REGISTER, 0, REGISTER, 8, REGISTER_MEMORY, 4),
+
+    R_RM_0F(IMUL, 0xaf, 2, 2), R_RM_0F(IMUL, 0xaf, 4, 4), R_RM_0F(IMUL, 0xaf, 8, 8),
+    UNARY_ENCODINGS(NOT, 0xf6, 0xf7, 2),
+    UNARY_ENCODINGS(NEG, 0xf6, 0xf7, 3),
+    UNARY_ENCODINGS(MUL, 0xf6, 0xf7, 4),
+    UNARY_ENCODINGS(DIV, 0xf6, 0xf7, 6),
+    UNARY_ENCODINGS(IDIV, 0xf6, 0xf7, 7),
+    UNARY_ENCODINGS(INC, 0xfe, 0xff, 0),
+    UNARY_ENCODINGS(DEC, 0xfe, 0xff, 1),
+    SHIFT_ENCODINGS(SHL, 4),
+    SHIFT_ENCODINGS(SHR, 5),
+    SHIFT_ENCODINGS(SAR, 7),
+
+    /* push, pop, call and jmp default to 64-bit operands, so they never need REX.W */
+    OP1(PUSH, 0, 0x50, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 8, NONE, 0),
+    OP1(POP, 0, 0x58, OP_CODE_PLUS_REGISTER, 0, OP_CODE_REGISTER, 8, NONE, 0),
+    OP1(CALL, 0, 0xe8, NONE, 0, RELATIVE, 4, NONE, 0),
+    OP1(CALL, 0, 0xff, OP_CODE, 2, REGISTER_MEMORY, 8, NONE, 0),
+    OP1(JMP, 0, 0xeb, NONE, 0, RELATIVE, 1, NONE, 0),
+    OP1(JMP, 0, 0xe9, NONE, 0, RELATIVE, 4, NONE, 0),
+    OP1(JMP, 0, 0xff, OP_CODE, 4, REGISTER_MEMORY, 8, NONE, 0),
+    OP1(RET, 0, 0xc3, NONE, 0, NONE, 0, NONE, 0),
+    OP1(CDQ, 0, 0x99, NONE, 0, NONE, 0, NONE, 0),
+    OP1(CQO, SIZE_FLAGS_8, 0x99, NONE, 0, NONE, 0, NONE, 0),
+    OP1(NOP, 0, 0x90, NONE, 0, NONE, 0, NONE, 0),
+
+    OP1(JCC, ENCODING_FLAG_CONDITION_CODE, 0x70, NONE, 0, RELATIVE, 1, NONE, 0),
+    OP2(JCC, 0, ENCODING_FLAG_CONDITION_CODE, 0x80, NONE, 0, RELATIVE, 4, NONE, 0),
+    OP2(SETCC, 0, ENCODING_FLAG_CONDITION_CODE, 0x90, OP_CODE, 0, REGISTER_MEMORY, 1, NONE, 0),
+    OP2(CMOVCC, 0, ENCODING_FLAG_CONDITION_CODE | SIZE_FLAGS_2, 0x40, REGISTER, 0, REGISTER, 2, REGISTER_MEMORY, 2),
+    OP2(CMOVCC, 0, ENCODING_FLAG_CONDITION_CODE | SIZE_FLAGS_4, 0x40, REGISTER, 0, REGISTER, 4, REGISTER_MEMORY, 4),
+    OP2(CMOVCC, 0, ENCODING_FLAG_CONDITION_CODE | SIZE_FLAGS_8, 0x40, REGISTER, 0, REGISTER, 8, REGISTER_MEMORY, 8),
+
+    SSE_RM(MOVSS, 0xf3, 0x10, 4), SSE_MR(MOVSS, 0xf3, 0x11, 4),
+    SSE_RM(MOVSD, 0xf2, 0x10, 8), SSE_MR(MOVSD, 0xf2, 0x11, 8),
+    SSE_RM(MOVAPS, 0, 0x28, 16), SSE_MR(MOVAPS, 0, 0x29, 16),
+    SSE_RM(MOVUPS, 0, 0x10, 16), SSE_MR(MOVUPS, 0, 0x11, 16),
+    SSE_RM(MOVAPD, 0x66, 0x28, 16), SSE_MR(MOVAPD, 0x66, 0x29, 16),
+    SSE_RM(MOVUPD, 0x66, 0x10, 16), SSE_MR(MOVUPD, 0x66, 0x11, 16),
+    SSE_RM(MOVDQA, 0x66, 0x6f, 16), SSE_MR(MOVDQA, 0x66, 0x7f, 16),
+    SSE_RM(MOVDQU, 0xf3, 0x6f, 16), SSE_MR(MOVDQU, 0xf3, 0x7f, 16),
+    OP2(MOVD, 0x66, 0, 0x6e, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 4),
+    OP2(MOVD, 0x66, 0, 0x7e, REGISTER, 0, REGISTER_MEMORY, 4, XMM, 16),
+    SSE_RM(MOVQ, 0xf3, 0x7e, 8), SSE_MR(MOVQ, 0x66, 0xd6, 8),
+    OP2(MOVQ, 0x66, ENCODING_FLAG_REX_W, 0x6e, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 8),
+    OP2(MOVQ, 0x66, ENCODING_FLAG_REX_W, 0x7e, REGISTER, 0, REGISTER_MEMORY, 8, XMM, 16),
+
+    SSE_ARITHMETIC_ENCODINGS(ADD, 0x58),
+    SSE_ARITHMETIC_ENCODINGS(SUB, 0x5c),
+    SSE_ARITHMETIC_ENCODINGS(MUL, 0x59),
+    SSE_ARITHMETIC_ENCODINGS(DIV, 0x5e),
+    SSE_RM(MINSS, 0xf3, 0x5d, 4), SSE_RM(MINSD, 0xf2, 0x5d, 8),
+    SSE_RM(MAXSS, 0xf3, 0x5f, 4), SSE_RM(MAXSD, 0xf2, 0x5f, 8),
+    SSE_RM(SQRTSS, 0xf3, 0x51, 4), SSE_RM(SQRTSD, 0xf2, 0x51, 8),
+    SSE_RM(UCOMISS, 0, 0x2e, 4), SSE_RM(UCOMISD, 0x66, 0x2e, 8),
+    OP2(CVTSI2SS, 0xf3, 0, 0x2a, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 4),
+    OP2(CVTSI2SS, 0xf3, ENCODING_FLAG_REX_W, 0x2a, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 8),
+    OP2(CVTSI2SD, 0xf2, 0, 0x2a, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 4),
+    OP2(CVTSI2SD, 0xf2, ENCODING_FLAG_REX_W, 0x2a, REGISTER, 0, XMM, 16, REGISTER_MEMORY, 8),
+    OP2(CVTTSS2SI, 0xf3, 0, 0x2c, REGISTER, 0, REGISTER, 4, XMM_MEMORY, 4),
+    OP2(CVTTSS2SI, 0xf3, ENCODING_FLAG_REX_W, 0x2c, REGISTER, 0, REGISTER, 8, XMM_MEMORY, 4),
+    OP2(CVTTSD2SI, 0xf2, 0, 0x2c, REGISTER, 0, REGISTER, 4, XMM_MEMORY, 8),
+    OP2(CVTTSD2SI, 0xf2, ENCODING_FLAG_REX_W, 0x2c, REGISTER, 0, REGISTER, 8, XMM_MEMORY, 8),
+    SSE_RM(CVTSS2SD, 0xf3, 0x5a, 4), SSE_RM(CVTSD2SS, 0xf2, 0x5a, 8),
+    SSE_RM(XORPS, 0, 0x57, 16), SSE_RM(XORPD, 0x66, 0x57, 16),
+    SSE_RM(ANDPS, 0, 0x54, 16), SSE_RM(ANDPD, 0x66, 0x54, 16),
+    SSE_RM(PXOR, 0x66, 0xef, 16),
+    SSE_RM(PADDD, 0x66, 0xfe, 16), SSE_RM(PADDQ, 0x66, 0xd4, 16),
+    SSE_RM(PSUBD, 0x66, 0xfa, 16), SSE_RM(PSUBQ, 0x66, 0xfb, 16),
+
+    /* Atomics: xchg with memory is implicitly locked, xadd and cmpxchg need the LOCK prefix (Instruction.lock) */
+    RM_R(XCHG, 0x86, 1), RM_R(XCHG, 0x87, 2), RM_R(XCHG, 0x87, 4), RM_R(XCHG, 0x87, 8),
+    RM_R_0F_ENCODINGS(XADD, 0xc0, 0xc1),
+    RM_R_0F_ENCODINGS(CMPXCHG, 0xb0, 0xb1),
+    ENCODING(MFENCE, 0, 0, 3, 0x0f, 0xae, 0xf0, NONE, 0, NONE, 0, NONE, 0),
+};
+
 typedef U8Buffer U8B;
-U8B make_buffer(s64 capacity, s32 mem_flags)
+U8B make_buffer(s64 capacity)
 {
-    void* memory = VirtualAlloc(nullptr, capacity, MEM_COMMIT | MEM_RESERVE, mem_flags);
+    void* memory = os_ask_executable_memory_block(capacity);
     assert(memory);
     U8B u8b;
     u8b.ptr = memory;
@@ -110,65 +398,1724 @@ void u8_append_s32(U8B* b, s32 c)
     u8_append_mem(b, &c, sizeof(s32));
 }
 
-void u8_append_sub_rsp_imm_8(U8B* b, s8 fn_handle)
+Operand x64_reg(x64_Register reg, u8 size)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_REGISTER,
+        .reg = { .index = reg, .size = reg >= REGISTER_XMM0 ? 16 : size },
+    };
+    return operand;
+}
+
+Operand x64_mem(u8 size, x64_Register base, x64_Register index, u8 scale, s32 displacement)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_MEMORY,
+        .mem = { .base = base, .index = index, .scale = scale, .size = size, .displacement = displacement },
+    };
+    return operand;
+}
+
+Operand x64_mem_rip(u8 size, s32 displacement)
+{
+    Operand operand = x64_mem(size, REGISTER_NONE, REGISTER_NONE, 1, displacement);
+    operand.mem.rip_relative = true;
+    return operand;
+}
+
+Operand x64_imm(s64 value)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_IMMEDIATE,
+        .imm = value,
+    };
+    return operand;
+}
+
+Operand x64_rel(u8 size, s32 displacement)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_RELATIVE,
+        .rel = { .displacement = displacement, .size = size },
+    };
+    return operand;
+}
+
+Instruction x64_inst0(x64_Mnemonic mnemonic)
+{
+    Instruction instruction = ZERO_INIT;
+    instruction.mnemonic = mnemonic;
+    return instruction;
+}
+
+Instruction x64_inst1(x64_Mnemonic mnemonic, Operand operand)
 {
-    u8_append_u8(b, 0x48);
-    u8_append_u8(b, 0x83);
-    u8_append_u8(b, 0xec);
-    u8_append_u8(b, fn_handle);
+    Instruction instruction = x64_inst0(mnemonic);
+    instruction.operands[0] = operand;
+    return instruction;
 }
 
-void u8_append_add_rsp_imm_8(U8B* b, s8 fn_handle)
+Instruction x64_inst2(x64_Mnemonic mnemonic, Operand destination, Operand source)
 {
-    u8_append_u8(b, 0x48);
-    u8_append_u8(b, 0x83);
-    u8_append_u8(b, 0xc4);
-    u8_append_u8(b, fn_handle);
+    Instruction instruction = x64_inst1(mnemonic, destination);
+    instruction.operands[1] = source;
+    return instruction;
 }
 
-void u8_append_mov_to_stack_offset_imm_32(U8B* b, s8 offset, s32 fn_handle)
+Instruction x64_inst_cc(x64_Mnemonic mnemonic, ConditionCode condition_code, Operand operand)
 {
-    u8_append_u8(b, 0xc7);
-    u8_append_u8(b, 0x44);
-    u8_append_u8(b, 0x24);
-    u8_append_u8(b, offset);
-    u8_append_s32(b, fn_handle);
+    Instruction instruction = x64_inst1(mnemonic, operand);
+    instruction.condition_code = condition_code;
+    return instruction;
 }
 
-void u8_append_add_to_ecx_value_at_stack_offset(U8B* b, s8 fn_handle)
+static inline bool is_xmm(u8 reg)
 {
-    u8_append_u8(b, 0x03);
-    u8_append_u8(b, 0x4c);
-    u8_append_u8(b, 0x24);
-    u8_append_u8(b, fn_handle);
+    return reg >= REGISTER_XMM0 && reg <= REGISTER_XMM15;
+}
+
+static inline bool is_gp(u8 reg)
+{
+    return reg <= REGISTER_R15;
+}
+
+/* An immediate fits if it can be sign extended from the encoded size, or, when the immediate is as wide as the operation, if it fits unsigned */
+static inline bool immediate_fits(s64 value, u8 imm_size, u8 operation_size)
+{
+    if (imm_size == 8)
+    {
+        return true;
+    }
+
+    s64 bits = imm_size * 8;
+    s64 min = -(1LL << (bits - 1));
+    s64 max = (1LL << (bits - 1)) - 1;
+    if (value >= min && value <= max)
+    {
+        return true;
+    }
+    if (imm_size == operation_size)
+    {
+        return value >= 0 && value <= (s64)((1ULL << bits) - 1);
+    }
+    return false;
+}
+
+static inline bool operand_matches(const InstructionEncoding* encoding, u8 operand_index, const Operand* operand)
+{
+    OperandEncoding operand_encoding = encoding->operands[operand_index];
+    switch (operand_encoding.kind)
+    {
+        case OPERAND_ENCODING_NONE:
+            return operand->type == OPERAND_TYPE_NONE;
+        case OPERAND_ENCODING_REGISTER:
+        case OPERAND_ENCODING_OP_CODE_REGISTER:
+            return operand->type == OPERAND_TYPE_REGISTER && is_gp(operand->reg.index) && operand->reg.size == operand_encoding.size;
+        case OPERAND_ENCODING_REGISTER_MEMORY:
+            return (operand->type == OPERAND_TYPE_REGISTER && is_gp(operand->reg.index) && operand->reg.size == operand_encoding.size) ||
+                (operand->type == OPERAND_TYPE_MEMORY && operand->mem.size == operand_encoding.size);
+        case OPERAND_ENCODING_MEMORY:
+            return operand->type == OPERAND_TYPE_MEMORY;
+        case OPERAND_ENCODING_IMMEDIATE:
+            return operand->type == OPERAND_TYPE_IMMEDIATE && immediate_fits(operand->imm, operand_encoding.size, encoding->operands[0].size);
+        case OPERAND_ENCODING_RELATIVE:
+            return operand->type == OPERAND_TYPE_RELATIVE && operand->rel.size == operand_encoding.size;
+        case OPERAND_ENCODING_CL:
+            return operand->type == OPERAND_TYPE_REGISTER && operand->reg.index == REGISTER_C && operand->reg.size == 1;
+        case OPERAND_ENCODING_XMM:
+            return operand->type == OPERAND_TYPE_REGISTER && is_xmm(operand->reg.index);
+        case OPERAND_ENCODING_XMM_MEMORY:
+            return (operand->type == OPERAND_TYPE_REGISTER && is_xmm(operand->reg.index)) ||
+                (operand->type == OPERAND_TYPE_MEMORY && operand->mem.size == operand_encoding.size);
+        default:
+            RED_UNREACHABLE;
+            return false;
+    }
+}
+
+static const InstructionEncoding* find_encoding(const Instruction* instruction)
+{
+    for (usize i = 0; i < array_length(encodings); i++)
+    {
+        const InstructionEncoding* encoding = &encodings[i];
+        if (encoding->mnemonic == instruction->mnemonic &&
+            operand_matches(encoding, 0, &instruction->operands[0]) &&
+            operand_matches(encoding, 1, &instruction->operands[1]))
+        {
+            return encoding;
+        }
+    }
+
+    return nullptr;
+}
+
+static inline void encode_mod_r_m(U8B* b, u8 reg_field, const Operand* rm)
+{
+    if (rm->type == OPERAND_TYPE_REGISTER)
+    {
+        u8_append_u8(b, (MOD_REGISTER << 6) | ((reg_field & 7) << 3) | (rm->reg.index & 7));
+        return;
+    }
+
+    redassert(rm->type == OPERAND_TYPE_MEMORY);
+    const MemoryOperand* mem = &rm->mem;
+    const u8 scale_bits[9] = { [1] = 0, [2] = 1, [4] = 2, [8] = 3 };
+    const u8 sib_rm = 0b100;
+    const u8 no_index = 0b100;
+    const u8 no_base = 0b101;
+
+    if (mem->rip_relative)
+    {
+        u8_append_u8(b, (MOD_DISPLACEMENT_0 << 6) | ((reg_field & 7) << 3) | 0b101);
+        u8_append_s32(b, mem->displacement);
+        return;
+    }
+
+    bool has_index = mem->index != REGISTER_NONE;
+    /* rsp can't be an index: its encoding means "no index" */
+    redassert(!has_index || mem->index != REGISTER_SP);
+    u8 index_bits = has_index ? (mem->index & 7) : no_index;
+    u8 scale = has_index ? scale_bits[mem->scale] : 0;
+
+    if (mem->base == REGISTER_NONE)
+    {
+        /* Absolute disp32 needs a SIB byte in 64-bit mode, since the plain encoding means rip-relative */
+        u8_append_u8(b, (MOD_DISPLACEMENT_0 << 6) | ((reg_field & 7) << 3) | sib_rm);
+        u8_append_u8(b, (scale << 6) | (index_bits << 3) | no_base);
+        u8_append_s32(b, mem->displacement);
+        return;
+    }
+
+    u8 base_bits = mem->base & 7;
+    Mod mod;
+    /* rbp and r13 as base can't use mod 00, since that means disp32 with no base */
+    if (mem->displacement == 0 && base_bits != no_base)
+    {
+        mod = MOD_DISPLACEMENT_0;
+    }
+    else if (mem->displacement >= INT8_MIN && mem->displacement <= INT8_MAX)
+    {
+        mod = MOD_DISPLACEMENT_s8;
+    }
+    else
+    {
+        mod = MOD_DISPLACEMENT_s32;
+    }
+
+    /* rsp and r12 as base need a SIB byte, since their rm encoding is the SIB escape */
+    if (has_index || base_bits == sib_rm)
+    {
+        u8_append_u8(b, (mod << 6) | ((reg_field & 7) << 3) | sib_rm);
+        u8_append_u8(b, (scale << 6) | (index_bits << 3) | base_bits);
+    }
+    else
+    {
+        u8_append_u8(b, (mod << 6) | ((reg_field & 7) << 3) | base_bits);
+    }
+
+    if (mod == MOD_DISPLACEMENT_s8)
+    {
+        u8_append_u8(b, (u8)(s8)mem->displacement);
+    }
+    else if (mod == MOD_DISPLACEMENT_s32)
+    {
+        u8_append_s32(b, mem->displacement);
+    }
+}
+
+/* LOCK only applies to read-modify-write instructions on memory, anything else is #UD */
+static inline bool is_lockable(const Instruction* instruction)
+{
+    if (instruction->operands[0].type != OPERAND_TYPE_MEMORY)
+    {
+        return false;
+    }
+
+    switch (instruction->mnemonic)
+    {
+        case MNEMONIC_ADD:
+        case MNEMONIC_OR:
+        case MNEMONIC_ADC:
+        case MNEMONIC_SBB:
+        case MNEMONIC_AND:
+        case MNEMONIC_SUB:
+        case MNEMONIC_XOR:
+        case MNEMONIC_NOT:
+        case MNEMONIC_NEG:
+        case MNEMONIC_INC:
+        case MNEMONIC_DEC:
+        case MNEMONIC_XCHG:
+        case MNEMONIC_XADD:
+        case MNEMONIC_CMPXCHG:
+            return true;
+        default:
+            return false;
+    }
 }
 
 void encode(U8Buffer* b, Instruction instruction)
 {
-    // TODO: this should be a lookup table
-    InstructionEncoding encoding =
+    const InstructionEncoding* encoding = find_encoding(&instruction);
+    if (!encoding)
+    {
+        RED_PANIC("No x64 encoding for mnemonic %s\n", mnemonic_names[instruction.mnemonic]);
+    }
+    if (instruction.lock && !is_lockable(&instruction))
+    {
+        RED_PANIC("LOCK prefix is not valid for %s\n", mnemonic_names[instruction.mnemonic]);
+    }
+
+    u8 reg_field = encoding->op_code_extension;
+    u8 op_code_register = 0;
+    const Operand* rm = nullptr;
+    const Operand* imm = nullptr;
+    const Operand* rel = nullptr;
+    u8 imm_size = 0;
+    u8 rex = 0;
+
+    for (u8 i = 0; i < array_length(instruction.operands); i++)
     {
-        .op_code = 0x89,
-        .ext_type = INSTRUCTION_EXTENSION_TYPE_REGISTER,
-        .operand_types =
+        const Operand* operand = &instruction.operands[i];
+        switch (encoding->operands[i].kind)
+        {
+            case OPERAND_ENCODING_REGISTER:
+            case OPERAND_ENCODING_XMM:
+                reg_field = operand->reg.index & 0xf;
+                if (reg_field & 8)
+                {
+                    rex |= REX_R;
+                }
+                break;
+            case OPERAND_ENCODING_REGISTER_MEMORY:
+            case OPERAND_ENCODING_XMM_MEMORY:
+            case OPERAND_ENCODING_MEMORY:
+                rm = operand;
+                if (operand->type == OPERAND_TYPE_REGISTER)
+                {
+                    if (operand->reg.index & 8)
+                    {
+                        rex |= REX_B;
+                    }
+                }
+                else
+                {
+                    if (operand->mem.base != REGISTER_NONE && (operand->mem.base & 8))
+                    {
+                        rex |= REX_B;
+                    }
+                    if (operand->mem.index != REGISTER_NONE && (operand->mem.index & 8))
+                    {
+                        rex |= REX_X;
+                    }
+                }
+                break;
+            case OPERAND_ENCODING_OP_CODE_REGISTER:
+                op_code_register = operand->reg.index & 0xf;
+                if (op_code_register & 8)
+                {
+                    rex |= REX_B;
+                }
+                break;
+            case OPERAND_ENCODING_IMMEDIATE:
+                imm = operand;
+                imm_size = encoding->operands[i].size;
+                break;
+            case OPERAND_ENCODING_RELATIVE:
+                rel = operand;
+                break;
+            case OPERAND_ENCODING_NONE:
+            case OPERAND_ENCODING_CL:
+                break;
+            default:
+                RED_UNREACHABLE;
+        }
+
+        /* spl, bpl, sil and dil are only reachable with a REX prefix; without it they encode ah, ch, dh and bh */
+        if (operand->type == OPERAND_TYPE_REGISTER && operand->reg.size == 1 && operand->reg.index >= REGISTER_SP && operand->reg.index <= REGISTER_DI)
         {
-            [0] = OPERAND_TYPE_REGISTER_MEMORY,
-            [1] = OPERAND_TYPE_REGISTER,
-        },
+            rex |= REX;
+        }
+    }
+
+    if (encoding->flags & ENCODING_FLAG_REX_W)
+    {
+        rex |= REX_W;
+    }
+
+    if (instruction.lock)
+    {
+        u8_append_u8(b, 0xf0);
+    }
+    if (encoding->flags & ENCODING_FLAG_OPERAND_SIZE)
+    {
+        u8_append_u8(b, 0x66);
+    }
+    if (encoding->prefix)
+    {
+        u8_append_u8(b, encoding->prefix);
+    }
+    if (rex)
+    {
+        u8_append_u8(b, rex);
+    }
+
+    for (u8 i = 0; i < encoding->op_code_size - 1; i++)
+    {
+        u8_append_u8(b, encoding->op_code[i]);
+    }
+    u8 last_op_code = encoding->op_code[encoding->op_code_size - 1];
+    if (encoding->flags & ENCODING_FLAG_CONDITION_CODE)
+    {
+        last_op_code += instruction.condition_code;
+    }
+    if (encoding->ext_type == INSTRUCTION_EXTENSION_TYPE_OP_CODE_PLUS_REGISTER)
+    {
+        last_op_code += op_code_register & 7;
+    }
+    u8_append_u8(b, last_op_code);
+
+    if (rm)
+    {
+        encode_mod_r_m(b, reg_field, rm);
+    }
+
+    if (imm)
+    {
+        u8_append_mem(b, (void*)&imm->imm, imm_size);
+    }
+    if (rel)
+    {
+        u8_append_mem(b, (void*)&rel->rel.displacement, rel->rel.size);
+    }
+}
+
+static inline const char* register_name(Register reg)
+{
+    if (is_xmm(reg.index))
+    {
+        return xmm_register_names[reg.index - REGISTER_XMM0];
+    }
+
+    switch (reg.size)
+    {
+        case 1: return gp_register_names[0][reg.index];
+        case 2: return gp_register_names[1][reg.index];
+        case 4: return gp_register_names[2][reg.index];
+        case 8: return gp_register_names[3][reg.index];
+        default:
+            RED_UNREACHABLE;
+            return nullptr;
+    }
+}
+
+static inline const char* memory_size_name(u8 size)
+{
+    switch (size)
+    {
+        case 1: return "byte ptr ";
+        case 2: return "word ptr ";
+        case 4: return "dword ptr ";
+        case 8: return "qword ptr ";
+        case 16: return "xmmword ptr ";
+        default:
+            RED_UNREACHABLE;
+            return nullptr;
+    }
+}
+
+/* Formats in the same Intel syntax the LLVM disassembler prints, so the encoder can be checked against it */
+usize x64_format_instruction(char* buffer, usize size, Instruction instruction)
+{
+    const InstructionEncoding* encoding = find_encoding(&instruction);
+    usize len = 0;
+#define x64_print(...) len += snprintf(buffer + len, len < size ? size - len : 0, __VA_ARGS__)
+
+    if (encoding && encoding->mnemonic == MNEMONIC_MOV && encoding->operands[1].kind == OPERAND_ENCODING_IMMEDIATE && encoding->operands[1].size == 8)
+    {
+        x64_print("movabs");
+    }
+    else
+    {
+        x64_print("%s%s", instruction.lock ? "lock " : "", mnemonic_names[instruction.mnemonic]);
+    }
+    if (instruction.mnemonic == MNEMONIC_JCC || instruction.mnemonic == MNEMONIC_SETCC || instruction.mnemonic == MNEMONIC_CMOVCC)
+    {
+        x64_print("%s", condition_code_names[instruction.condition_code]);
+    }
+
+    /* xchg is symmetric, and LLVM prints the register to register form with the reg field first */
+    bool swap_operands = instruction.mnemonic == MNEMONIC_XCHG &&
+        instruction.operands[0].type == OPERAND_TYPE_REGISTER && instruction.operands[1].type == OPERAND_TYPE_REGISTER;
+
+    for (u8 i = 0; i < array_length(instruction.operands); i++)
+    {
+        const Operand* operand = &instruction.operands[swap_operands ? 1 - i : i];
+        if (operand->type == OPERAND_TYPE_NONE)
+        {
+            break;
+        }
+
+        x64_print(i == 0 ? "\t" : ", ");
+        switch (operand->type)
+        {
+            case OPERAND_TYPE_REGISTER:
+                x64_print("%s", register_name(operand->reg));
+                break;
+            case OPERAND_TYPE_MEMORY:
+            {
+                const MemoryOperand* mem = &operand->mem;
+                bool first = true;
+                if (instruction.mnemonic != MNEMONIC_LEA)
+                {
+                    x64_print("%s", memory_size_name(mem->size));
+                }
+                x64_print("[");
+                if (mem->rip_relative)
+                {
+                    x64_print("rip");
+                    first = false;
+                }
+                if (mem->base != REGISTER_NONE)
+                {
+                    x64_print("%s", gp_register_names[3][mem->base]);
+                    first = false;
+                }
+                else if (mem->virtual_base)
+                {
+                    x64_print("v%u", mem->virtual_base);
+                    first = false;
+                }
+                if (mem->index != REGISTER_NONE)
+                {
+                    x64_print("%s", first ? "" : " + ");
+                    if (mem->scale != 1)
+                    {
+                        x64_print("%d*", mem->scale);
+                    }
+                    x64_print("%s", gp_register_names[3][mem->index]);
+                    first = false;
+                }
+                if (first)
+                {
+                    x64_print("%d", mem->displacement);
+                }
+                else if (mem->displacement)
+                {
+                    x64_print(" %c %" RED_PRI_s64, mem->displacement < 0 ? '-' : '+', mem->displacement < 0 ? -(s64)mem->displacement : (s64)mem->displacement);
+                }
+                x64_print("]");
+            } break;
+            case OPERAND_TYPE_IMMEDIATE:
+            {
+                /* Sign-extended immediates and byte immediates are printed signed, full width 16 and 32-bit ones and shift counts unsigned */
+                s64 value = operand->imm;
+                u8 imm_size = encoding ? encoding->operands[i].size : 8;
+                u8 operation_size = encoding ? encoding->operands[0].size : 8;
+                bool is_unsigned = (imm_size == operation_size && imm_size != 1) ||
+                    instruction.mnemonic == MNEMONIC_SHL || instruction.mnemonic == MNEMONIC_SHR || instruction.mnemonic == MNEMONIC_SAR;
+                switch (imm_size)
+                {
+                    case 1: value = is_unsigned ? (s64)(u8)value : (s64)(s8)value; break;
+                    case 2: value = is_unsigned ? (s64)(u16)value : (s64)(s16)value; break;
+                    case 4: value = is_unsigned ? (s64)(u32)value : (s64)(s32)value; break;
+                    default: break;
+                }
+                x64_print("%" RED_PRI_s64, value);
+            } break;
+            case OPERAND_TYPE_RELATIVE:
+                x64_print("%d", operand->rel.displacement);
+                break;
+            case OPERAND_TYPE_VIRTUAL_REGISTER:
+                x64_print("v%u", operand->vreg.index);
+                break;
+            case OPERAND_TYPE_LABEL:
+                x64_print(".L%u", operand->label);
+                break;
+            default:
+                RED_UNREACHABLE;
+        }
+    }
+
+#undef x64_print
+    return len;
+}
+
+Operand x64_mem_vreg(u8 size, Operand base, s32 displacement)
+{
+    redassert(base.type == OPERAND_TYPE_VIRTUAL_REGISTER && base.vreg.size == 8);
+    Operand operand = x64_mem(size, REGISTER_NONE, REGISTER_NONE, 1, displacement);
+    operand.mem.virtual_base = base.vreg.index;
+    return operand;
+}
+
+Operand x64_new_vreg(MachineFunction* fn, u8 size)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_VIRTUAL_REGISTER,
+        .vreg = { .index = ++fn->virtual_register_count, .size = size },
+    };
+    return operand;
+}
+
+Operand x64_new_label(MachineFunction* fn)
+{
+    Operand operand =
+    {
+        .type = OPERAND_TYPE_LABEL,
+        .label = fn->label_count++,
     };
+    return operand;
+}
+
+GEN_BUFFER_FUNCTIONS(instruction, ib, InstructionBuffer, Instruction)
+
+void x64_append(MachineFunction* fn, Instruction instruction)
+{
+    instruction_append(&fn->instructions, instruction);
+}
+
+const x64_Register x64_win64_argument_registers[4] = { REGISTER_C, REGISTER_D, REGISTER_R8, REGISTER_R9 };
+
+#define REGISTER_MASK(_reg) (1u << (_reg))
+#define WIN64_VOLATILE_REGISTERS (REGISTER_MASK(REGISTER_A) | REGISTER_MASK(REGISTER_C) | REGISTER_MASK(REGISTER_D) | REGISTER_MASK(REGISTER_R8) | REGISTER_MASK(REGISTER_R9) | REGISTER_MASK(REGISTER_R10) | REGISTER_MASK(REGISTER_R11))
+#define WIN64_ARGUMENT_REGISTERS (REGISTER_MASK(REGISTER_C) | REGISTER_MASK(REGISTER_D) | REGISTER_MASK(REGISTER_R8) | REGISTER_MASK(REGISTER_R9))
+/* r10 and r11 are never allocated. r10 holds the spilled base of a memory operand and r11 a spilled operand that can't be replaced by a memory operand, so one instruction can need both */
+#define SPILL_BASE_SCRATCH_REGISTER REGISTER_R10
+#define SPILL_SCRATCH_REGISTER REGISTER_R11
+
+/* Volatile registers first, so callee-saved ones are only used (and saved) when needed */
+const x64_Register allocatable_registers[] =
+{
+    REGISTER_A, REGISTER_C, REGISTER_D, REGISTER_R8, REGISTER_R9,
+    REGISTER_B, REGISTER_SI, REGISTER_DI, REGISTER_R12, REGISTER_R13, REGISTER_R14, REGISTER_R15,
+};
+
+typedef enum OperandAccess
+{
+    OPERAND_ACCESS_NONE = 0,
+    OPERAND_ACCESS_USE = 1 << 0,
+    OPERAND_ACCESS_DEF = 1 << 1,
+    OPERAND_ACCESS_USE_DEF = OPERAND_ACCESS_USE | OPERAND_ACCESS_DEF,
+} OperandAccess;
+
+static inline OperandAccess operand_access(x64_Mnemonic mnemonic, u8 operand_index)
+{
+    if (operand_index == 1)
+    {
+        /* xchg and xadd hand the old destination value back in the source register */
+        return (mnemonic == MNEMONIC_XCHG || mnemonic == MNEMONIC_XADD) ? OPERAND_ACCESS_USE_DEF : OPERAND_ACCESS_USE;
+    }
+
+    switch (mnemonic)
+    {
+        case MNEMONIC_MOV:
+        case MNEMONIC_LEA:
+        case MNEMONIC_MOVZX:
+        case MNEMONIC_MOVSX:
+        case MNEMONIC_MOVSXD:
+        case MNEMONIC_SETCC:
+        case MNEMONIC_POP:
+        case MNEMONIC_MOVD:
+        case MNEMONIC_MOVQ:
+        case MNEMONIC_CVTTSS2SI:
+        case MNEMONIC_CVTTSD2SI:
+            return OPERAND_ACCESS_DEF;
+        case MNEMONIC_CMP:
+        case MNEMONIC_TEST:
+        case MNEMONIC_PUSH:
+        case MNEMONIC_CALL:
+        case MNEMONIC_JMP:
+        case MNEMONIC_JCC:
+        case MNEMONIC_UCOMISS:
+        case MNEMONIC_UCOMISD:
+        case MNEMONIC_LABEL:
+            return OPERAND_ACCESS_USE;
+        default:
+            return OPERAND_ACCESS_USE_DEF;
+    }
+}
+
+/* Registers read and written by the instruction that don't appear as operands */
+static inline void implicit_registers(x64_Mnemonic mnemonic, u32* uses, u32* defs)
+{
+    *uses = 0;
+    *defs = 0;
+    switch (mnemonic)
+    {
+        case MNEMONIC_MUL:
+        case MNEMONIC_DIV:
+        case MNEMONIC_IDIV:
+            *uses = REGISTER_MASK(REGISTER_A) | REGISTER_MASK(REGISTER_D);
+            *defs = REGISTER_MASK(REGISTER_A) | REGISTER_MASK(REGISTER_D);
+            break;
+        case MNEMONIC_CDQ:
+        case MNEMONIC_CQO:
+            *uses = REGISTER_MASK(REGISTER_A);
+            *defs = REGISTER_MASK(REGISTER_D);
+            break;
+        case MNEMONIC_CALL:
+            *uses = WIN64_ARGUMENT_REGISTERS;
+            *defs = WIN64_VOLATILE_REGISTERS;
+            break;
+        case MNEMONIC_RET:
+            *uses = REGISTER_MASK(REGISTER_A);
+            break;
+        case MNEMONIC_CMPXCHG:
+            /* rax holds the expected value and receives the old one */
+            *uses = REGISTER_MASK(REGISTER_A);
+            *defs = REGISTER_MASK(REGISTER_A);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Positions: the uses of instruction i happen at 2i and its definitions at 2i + 1, so a value last read by an instruction can share a register with the value it defines */
+typedef struct LiveRange
+{
+    u32 start;
+    u32 end;
+} LiveRange;
+
+GEN_BUFFER_STRUCT(LiveRange)
+GEN_BUFFER_FUNCTIONS(live_range, lrb, LiveRangeBuffer, LiveRange)
+
+#define POSITION_NONE UINT32_MAX
+
+typedef struct RegisterAllocator
+{
+    MachineFunction* fn;
+    /* Indexed by virtual register */
+    LiveRange* intervals;
+    u8* sizes;
+    u8* locations;
+    s32* spill_slots;
+    u8* hint_registers;
+    u32* hint_vregs;
+    /* Ranges where physical registers are used directly (arguments, return value, implicit operands, call clobbers) */
+    LiveRangeBuffer fixed[16];
+    bool fixed_open[16];
+} RegisterAllocator;
+
+static inline void ra_vreg_access(RegisterAllocator* ra, u32 vreg, u8 size, u32 position)
+{
+    LiveRange* interval = &ra->intervals[vreg];
+    if (interval->start == POSITION_NONE || position < interval->start)
+    {
+        interval->start = position;
+    }
+    if (interval->end == POSITION_NONE || position > interval->end)
+    {
+        interval->end = position;
+    }
+    ra->sizes[vreg] = size;
+}
+
+static inline void ra_fixed_def(RegisterAllocator* ra, u8 reg, u32 position)
+{
+    live_range_append(&ra->fixed[reg], (LiveRange) { position, position });
+    ra->fixed_open[reg] = true;
+}
+
+/* Explicit uses of a register that was never written are live-in (incoming arguments), implicit ones are ignored */
+static inline void ra_fixed_use(RegisterAllocator* ra, u8 reg, u32 position, bool explicit_use)
+{
+    if (!ra->fixed_open[reg])
+    {
+        if (!explicit_use)
+        {
+            return;
+        }
+        live_range_append(&ra->fixed[reg], (LiveRange) { 0, position });
+        ra->fixed_open[reg] = true;
+    }
+    live_range_last(&ra->fixed[reg])->end = position;
+}
+
+static inline void ra_operand_access(RegisterAllocator* ra, const Operand* operand, OperandAccess access, u32 index)
+{
+    switch (operand->type)
+    {
+        case OPERAND_TYPE_VIRTUAL_REGISTER:
+            if (access & OPERAND_ACCESS_USE)
+            {
+                ra_vreg_access(ra, operand->vreg.index, operand->vreg.size, 2 * index);
+            }
+            if (access & OPERAND_ACCESS_DEF)
+            {
+                ra_vreg_access(ra, operand->vreg.index, operand->vreg.size, 2 * index + 1);
+            }
+            break;
+        case OPERAND_TYPE_REGISTER:
+            if (is_gp(operand->reg.index))
+            {
+                if (access & OPERAND_ACCESS_USE)
+                {
+                    ra_fixed_use(ra, operand->reg.index, 2 * index, true);
+                }
+                if (access & OPERAND_ACCESS_DEF)
+                {
+                    ra_fixed_def(ra, operand->reg.index, 2 * index + 1);
+                }
+            }
+            break;
+        case OPERAND_TYPE_MEMORY:
+            if (operand->mem.virtual_base)
+            {
+                ra_vreg_access(ra, operand->mem.virtual_base, 8, 2 * index);
+            }
+            if (operand->mem.base != REGISTER_NONE)
+            {
+                ra_fixed_use(ra, operand->mem.base, 2 * index, true);
+            }
+            if (operand->mem.index != REGISTER_NONE)
+            {
+                ra_fixed_use(ra, operand->mem.index, 2 * index, true);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void ra_compute_live_ranges(RegisterAllocator* ra)
+{
+    MachineFunction* fn = ra->fn;
+    u32 instruction_count = fn->instructions.len;
+    u32* label_positions = NEW(u32, (fn->label_count + 1));
+
+    for (u32 i = 0; i < instruction_count; i++)
+    {
+        Instruction* instruction = &fn->instructions.ptr[i];
+        if (instruction->mnemonic == MNEMONIC_LABEL)
+        {
+            label_positions[instruction->operands[0].label] = i;
+            continue;
+        }
+        if (instruction->mnemonic == MNEMONIC_CALL)
+        {
+            fn->has_calls = true;
+        }
+
+        u32 implicit_uses, implicit_defs;
+        implicit_registers(instruction->mnemonic, &implicit_uses, &implicit_defs);
+        for (u8 reg = 0; reg < 16; reg++)
+        {
+            if (implicit_uses & REGISTER_MASK(reg))
+            {
+                ra_fixed_use(ra, reg, 2 * i, false);
+            }
+        }
+
+        /* Uses before definitions, so read-modify-write operands get both positions */
+        for (u8 o = 0; o < array_length(instruction->operands); o++)
+        {
+            OperandAccess access = operand_access(instruction->mnemonic, o);
+            ra_operand_access(ra, &instruction->operands[o], access & OPERAND_ACCESS_USE, i);
+        }
+        for (u8 o = 0; o < array_length(instruction->operands); o++)
+        {
+            OperandAccess access = operand_access(instruction->mnemonic, o);
+            if (instruction->operands[o].type != OPERAND_TYPE_MEMORY)
+            {
+                ra_operand_access(ra, &instruction->operands[o], access & OPERAND_ACCESS_DEF, i);
+            }
+        }
+
+        for (u8 reg = 0; reg < 16; reg++)
+        {
+            if (implicit_defs & REGISTER_MASK(reg))
+            {
+                ra_fixed_def(ra, reg, 2 * i + 1);
+            }
+        }
+
+        /* Coalescing hints: a move between two values prefers giving them the same register */
+        if (instruction->mnemonic == MNEMONIC_MOV)
+        {
+            Operand* dst = &instruction->operands[0];
+            Operand* src = &instruction->operands[1];
+            if (dst->type == OPERAND_TYPE_VIRTUAL_REGISTER && src->type == OPERAND_TYPE_VIRTUAL_REGISTER)
+            {
+                ra->hint_vregs[dst->vreg.index] = src->vreg.index;
+            }
+            else if (dst->type == OPERAND_TYPE_VIRTUAL_REGISTER && src->type == OPERAND_TYPE_REGISTER && ra->hint_registers[dst->vreg.index] == REGISTER_NONE)
+            {
+                ra->hint_registers[dst->vreg.index] = src->reg.index;
+            }
+            else if (dst->type == OPERAND_TYPE_REGISTER && src->type == OPERAND_TYPE_VIRTUAL_REGISTER && ra->hint_registers[src->vreg.index] == REGISTER_NONE)
+            {
+                ra->hint_registers[src->vreg.index] = dst->reg.index;
+            }
+        }
+    }
+
+    /* The linear order doesn't see loop back edges: anything live at a loop header must stay live until the backward branch. Nested loops need more than one pass */
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (u32 i = 0; i < instruction_count; i++)
+        {
+            Instruction* instruction = &fn->instructions.ptr[i];
+            if ((instruction->mnemonic != MNEMONIC_JMP && instruction->mnemonic != MNEMONIC_JCC) || instruction->operands[0].type != OPERAND_TYPE_LABEL)
+            {
+                continue;
+            }
+            u32 header = 2 * label_positions[instruction->operands[0].label];
+            u32 branch = 2 * i;
+            if (header >= branch)
+            {
+                continue;
+            }
+
+            for (u32 v = 1; v <= fn->virtual_register_count; v++)
+            {
+                LiveRange* interval = &ra->intervals[v];
+                if (interval->start != POSITION_NONE && interval->start < header && interval->end >= header && interval->end < branch)
+                {
+                    interval->end = branch;
+                    changed = true;
+                }
+            }
+            for (u8 reg = 0; reg < 16; reg++)
+            {
+                for (u32 r = 0; r < ra->fixed[reg].len; r++)
+                {
+                    LiveRange* range = &ra->fixed[reg].ptr[r];
+                    if (range->start < header && range->end >= header && range->end < branch)
+                    {
+                        range->end = branch;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static inline bool ra_fixed_conflict(RegisterAllocator* ra, u8 reg, LiveRange interval)
+{
+    for (u32 r = 0; r < ra->fixed[reg].len; r++)
+    {
+        LiveRange range = ra->fixed[reg].ptr[r];
+        if (interval.start <= range.end && range.start <= interval.end)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool ra_register_available(RegisterAllocator* ra, u32* owners, u8 reg, u32 vreg)
+{
+    return reg != REGISTER_NONE && is_gp(reg) && reg != SPILL_BASE_SCRATCH_REGISTER && reg != SPILL_SCRATCH_REGISTER && reg != REGISTER_SP && reg != REGISTER_BP &&
+        owners[reg] == 0 && !ra_fixed_conflict(ra, reg, ra->intervals[vreg]);
+}
+
+static void ra_linear_scan(RegisterAllocator* ra)
+{
+    MachineFunction* fn = ra->fn;
+    u32 vreg_count = fn->virtual_register_count;
+
+    /* Intervals sorted by start point */
+    u32* order = NEW(u32, (vreg_count + 1));
+    u32 order_count = 0;
+    for (u32 v = 1; v <= vreg_count; v++)
+    {
+        if (ra->intervals[v].start == POSITION_NONE)
+        {
+            continue;
+        }
+        u32 j = order_count++;
+        while (j > 0 && ra->intervals[order[j - 1]].start > ra->intervals[v].start)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = v;
+    }
+
+    /* Active intervals sorted by end point */
+    u32* active = NEW(u32, (vreg_count + 1));
+    u32 active_count = 0;
+    u32 owners[16] = { 0 };
+
+    for (u32 o = 0; o < order_count; o++)
+    {
+        u32 v = order[o];
+        LiveRange interval = ra->intervals[v];
+
+        u32 expired = 0;
+        while (expired < active_count && ra->intervals[active[expired]].end < interval.start)
+        {
+            owners[ra->locations[active[expired]]] = 0;
+            expired++;
+        }
+        memmove(active, active + expired, (active_count - expired) * sizeof(u32));
+        active_count -= expired;
+
+        u8 reg = REGISTER_NONE;
+        u32 hint_vreg = ra->hint_vregs[v];
+        if (hint_vreg && ra_register_available(ra, owners, ra->locations[hint_vreg], v))
+        {
+            reg = ra->locations[hint_vreg];
+        }
+        else if (ra_register_available(ra, owners, ra->hint_registers[v], v))
+        {
+            reg = ra->hint_registers[v];
+        }
+        else
+        {
+            for (u32 r = 0; r < array_length(allocatable_registers); r++)
+            {
+                if (ra_register_available(ra, owners, allocatable_registers[r], v))
+                {
+                    reg = allocatable_registers[r];
+                    break;
+                }
+            }
+        }
+
+        if (reg == REGISTER_NONE)
+        {
+            /* Spill whatever ends last: either this interval or an active one whose register this interval can take */
+            s32 victim = -1;
+            for (s32 a = active_count - 1; a >= 0; a--)
+            {
+                u32 candidate = active[a];
+                if (ra->intervals[candidate].end <= interval.end)
+                {
+                    break;
+                }
+                u8 candidate_reg = ra->locations[candidate];
+                if (!ra_fixed_conflict(ra, candidate_reg, interval))
+                {
+                    victim = a;
+                    break;
+                }
+            }
+
+            if (victim == -1)
+            {
+                ra->spill_slots[v] = fn->spill_slot_count++;
+                continue;
+            }
+
+            u32 victim_vreg = active[victim];
+            reg = ra->locations[victim_vreg];
+            ra->locations[victim_vreg] = REGISTER_NONE;
+            ra->spill_slots[victim_vreg] = fn->spill_slot_count++;
+            memmove(active + victim, active + victim + 1, (active_count - victim - 1) * sizeof(u32));
+            active_count--;
+        }
+
+        ra->locations[v] = reg;
+        owners[reg] = v;
+        if (!(WIN64_VOLATILE_REGISTERS & REGISTER_MASK(reg)))
+        {
+            fn->used_callee_saved |= REGISTER_MASK(reg);
+        }
+
+        u32 j = active_count++;
+        while (j > 0 && ra->intervals[active[j - 1]].end > interval.end)
+        {
+            active[j] = active[j - 1];
+            j--;
+        }
+        active[j] = v;
+    }
+}
+
+static inline s32 ra_spill_offset(RegisterAllocator* ra, u32 vreg)
+{
+    /* Spill slots sit above the 32-byte shadow space that calls need */
+    return (ra->fn->has_calls ? 32 : 0) + ra->spill_slots[vreg] * 8;
+}
+
+static inline Operand ra_spill_slot(RegisterAllocator* ra, u32 vreg, u8 size)
+{
+    return x64_mem(size, REGISTER_SP, REGISTER_NONE, 1, ra_spill_offset(ra, vreg));
+}
+
+static void ra_rewrite(RegisterAllocator* ra)
+{
+    MachineFunction* fn = ra->fn;
+    InstructionBuffer rewritten = ZERO_INIT;
+    Operand scratch_base = x64_reg(SPILL_BASE_SCRATCH_REGISTER, 8);
+
+    for (u32 i = 0; i < fn->instructions.len; i++)
+    {
+        Instruction instruction = fn->instructions.ptr[i];
+        s32 spilled[2] = { -1, -1 };
+        u32 spilled_count = 0;
+
+        for (u8 o = 0; o < array_length(instruction.operands); o++)
+        {
+            Operand* operand = &instruction.operands[o];
+            if (operand->type == OPERAND_TYPE_MEMORY && operand->mem.virtual_base)
+            {
+                u32 base = operand->mem.virtual_base;
+                operand->mem.virtual_base = 0;
+                if (ra->locations[base] != REGISTER_NONE)
+                {
+                    operand->mem.base = ra->locations[base];
+                }
+                else
+                {
+                    instruction_append(&rewritten, x64_inst2(MNEMONIC_MOV, scratch_base, ra_spill_slot(ra, base, 8)));
+                    operand->mem.base = SPILL_BASE_SCRATCH_REGISTER;
+                }
+            }
+            else if (operand->type == OPERAND_TYPE_VIRTUAL_REGISTER)
+            {
+                u32 vreg = operand->vreg.index;
+                if (ra->locations[vreg] != REGISTER_NONE)
+                {
+                    *operand = x64_reg(ra->locations[vreg], operand->vreg.size);
+                }
+                else
+                {
+                    *operand = ra_spill_slot(ra, vreg, operand->vreg.size);
+                    spilled[spilled_count++] = o;
+                }
+            }
+        }
+
+        /* Spilled values are used straight from their stack slot when the instruction has a memory form, otherwise one of them goes through the scratch register */
+        Instruction after = { 0 };
+        bool has_after = false;
+        if (spilled_count && !find_encoding(&instruction))
+        {
+            bool done = false;
+            for (u32 s = 0; s < spilled_count && !done; s++)
+            {
+                u8 o = spilled[s];
+                OperandAccess access = operand_access(instruction.mnemonic, o);
+                Instruction candidate = instruction;
+                Operand slot = candidate.operands[o];
+                Operand scratch = x64_reg(SPILL_SCRATCH_REGISTER, slot.mem.size);
+                candidate.operands[o] = scratch;
+                if (!find_encoding(&candidate))
+                {
+                    continue;
+                }
+
+                if (access & OPERAND_ACCESS_USE)
+                {
+                    instruction_append(&rewritten, x64_inst2(MNEMONIC_MOV, scratch, slot));
+                }
+                if (access & OPERAND_ACCESS_DEF)
+                {
+                    after = x64_inst2(MNEMONIC_MOV, slot, scratch);
+                    has_after = true;
+                }
+                instruction = candidate;
+                done = true;
+            }
+
+            /* Every general purpose form has a register, register/memory variant */
+            if (!done)
+            {
+                RED_UNREACHABLE;
+            }
+        }
+
+        /* Coalesced moves end up as mov r, r */
+        bool is_self_move = instruction.mnemonic == MNEMONIC_MOV &&
+            instruction.operands[0].type == OPERAND_TYPE_REGISTER && instruction.operands[1].type == OPERAND_TYPE_REGISTER &&
+            instruction.operands[0].reg.index == instruction.operands[1].reg.index && instruction.operands[0].reg.size == instruction.operands[1].reg.size;
+        if (!is_self_move)
+        {
+            instruction_append(&rewritten, instruction);
+        }
+        if (has_after)
+        {
+            instruction_append(&rewritten, after);
+        }
+    }
+
+    fn->instructions = rewritten;
+}
+
+/* Linear scan (Poletto & Sarkar) over the instruction order. Values that don't fit in registers are spilled for their whole lifetime */
+void x64_allocate_registers(MachineFunction* fn)
+{
+    RegisterAllocator ra = { .fn = fn };
+    u32 vreg_count = fn->virtual_register_count + 1;
+    ra.intervals = NEW(LiveRange, vreg_count);
+    ra.sizes = NEW(u8, vreg_count);
+    ra.locations = NEW(u8, vreg_count);
+    ra.spill_slots = NEW(s32, vreg_count);
+    ra.hint_registers = NEW(u8, vreg_count);
+    ra.hint_vregs = NEW(u32, vreg_count);
+    for (u32 v = 0; v < vreg_count; v++)
+    {
+        ra.intervals[v] = (LiveRange) { POSITION_NONE, POSITION_NONE };
+        ra.locations[v] = REGISTER_NONE;
+        ra.spill_slots[v] = -1;
+        ra.hint_registers[v] = REGISTER_NONE;
+    }
+
+    ra_compute_live_ranges(&ra);
+    ra_linear_scan(&ra);
+    ra_rewrite(&ra);
+}
 
-    // TODO: check that encoding matches the instruction
-    // TODO: add REX.W prefix only if necessary
-    u8_append_u8(b, REX_W);
-    // TODO: if opcode is 2 byte need different append
-    u8_append_u8(b, encoding.op_code);
-    u8 mod_r_m = (
-        (MOD_REGISTER << 6) |
-        (instruction.operands[0].reg.index << 3) |
-        (instruction.operands[1].reg.index)
-    );
+/* Liveness masks: one bit per general purpose register plus one for the flags */
+#define FLAGS_MASK (1u << 16)
 
-    u8_append_u8(b, mod_r_m);
+static inline bool reads_flags(x64_Mnemonic mnemonic)
+{
+    switch (mnemonic)
+    {
+        case MNEMONIC_JCC:
+        case MNEMONIC_SETCC:
+        case MNEMONIC_CMOVCC:
+        case MNEMONIC_ADC:
+        case MNEMONIC_SBB:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Shifts are left out: a zero count leaves the flags untouched */
+static inline bool writes_flags(x64_Mnemonic mnemonic)
+{
+    switch (mnemonic)
+    {
+        case MNEMONIC_ADD:
+        case MNEMONIC_OR:
+        case MNEMONIC_ADC:
+        case MNEMONIC_SBB:
+        case MNEMONIC_AND:
+        case MNEMONIC_SUB:
+        case MNEMONIC_XOR:
+        case MNEMONIC_CMP:
+        case MNEMONIC_TEST:
+        case MNEMONIC_IMUL:
+        case MNEMONIC_NEG:
+        case MNEMONIC_MUL:
+        case MNEMONIC_DIV:
+        case MNEMONIC_IDIV:
+        case MNEMONIC_INC:
+        case MNEMONIC_DEC:
+        case MNEMONIC_UCOMISS:
+        case MNEMONIC_UCOMISD:
+        case MNEMONIC_CALL:
+        case MNEMONIC_XADD:
+        case MNEMONIC_CMPXCHG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool is_branch(const Instruction* instruction)
+{
+    return (instruction->mnemonic == MNEMONIC_JMP || instruction->mnemonic == MNEMONIC_JCC) && instruction->operands[0].type == OPERAND_TYPE_LABEL;
+}
+
+static inline bool ends_block(const Instruction* instruction)
+{
+    return instruction->mnemonic == MNEMONIC_JMP || instruction->mnemonic == MNEMONIC_JCC || instruction->mnemonic == MNEMONIC_RET;
+}
+
+/* Registers read and killed by an allocated instruction. Byte and word writes merge into the old value, so they don't kill it */
+static inline void instruction_uses_defs(const Instruction* instruction, u32* uses, u32* defs)
+{
+    implicit_registers(instruction->mnemonic, uses, defs);
+    if (reads_flags(instruction->mnemonic))
+    {
+        *uses |= FLAGS_MASK;
+    }
+    if (writes_flags(instruction->mnemonic))
+    {
+        *defs |= FLAGS_MASK;
+    }
+
+    for (u8 o = 0; o < array_length(instruction->operands); o++)
+    {
+        const Operand* operand = &instruction->operands[o];
+        OperandAccess access = operand_access(instruction->mnemonic, o);
+        if (operand->type == OPERAND_TYPE_REGISTER && is_gp(operand->reg.index))
+        {
+            u32 mask = REGISTER_MASK(operand->reg.index);
+            if ((access & OPERAND_ACCESS_USE) || operand->reg.size < 4)
+            {
+                *uses |= mask;
+            }
+            if (access & OPERAND_ACCESS_DEF)
+            {
+                *defs |= mask;
+            }
+        }
+        else if (operand->type == OPERAND_TYPE_MEMORY)
+        {
+            if (operand->mem.base != REGISTER_NONE)
+            {
+                *uses |= REGISTER_MASK(operand->mem.base);
+            }
+            if (operand->mem.index != REGISTER_NONE)
+            {
+                *uses |= REGISTER_MASK(operand->mem.index);
+            }
+        }
+    }
+
+    /* A zeroing xor doesn't read its operand */
+    if (instruction->mnemonic == MNEMONIC_XOR && instruction->operands[0].type == OPERAND_TYPE_REGISTER && instruction->operands[1].type == OPERAND_TYPE_REGISTER &&
+        instruction->operands[0].reg.index == instruction->operands[1].reg.index && instruction->operands[0].reg.size >= 4)
+    {
+        *uses &= ~REGISTER_MASK(instruction->operands[0].reg.index);
+    }
+}
+
+/* Backward dataflow over the basic blocks, giving the registers live after each instruction */
+static u32* compute_live_after(MachineFunction* fn)
+{
+    u32 count = fn->instructions.len;
+    Instruction* instructions = fn->instructions.ptr;
+    u32* live_after = NEW(u32, (count + 1));
+    u32* block_of = NEW(u32, (count + 1));
+    u32* block_starts = NEW(u32, (count + 1));
+    u32* label_blocks = NEW(u32, (fn->label_count + 1));
+    u32 block_count = 0;
+
+    for (u32 i = 0; i < count; i++)
+    {
+        if (i == 0 || instructions[i].mnemonic == MNEMONIC_LABEL || ends_block(&instructions[i - 1]))
+        {
+            block_starts[block_count++] = i;
+        }
+        block_of[i] = block_count - 1;
+        if (instructions[i].mnemonic == MNEMONIC_LABEL)
+        {
+            label_blocks[instructions[i].operands[0].label] = block_count - 1;
+        }
+    }
+    block_starts[block_count] = count;
+
+    u32* live_in = NEW(u32, (block_count + 1));
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (s32 b = block_count - 1; b >= 0; b--)
+        {
+            u32 last = block_starts[b + 1] - 1;
+            const Instruction* terminator = &instructions[last];
+            u32 live = 0;
+            if (terminator->mnemonic != MNEMONIC_RET && terminator->mnemonic != MNEMONIC_JMP && (u32)b + 1 < block_count)
+            {
+                live |= live_in[b + 1];
+            }
+            if (is_branch(terminator))
+            {
+                live |= live_in[label_blocks[terminator->operands[0].label]];
+            }
+            else if (terminator->mnemonic == MNEMONIC_JMP)
+            {
+                /* Indirect jump: assume everything is live */
+                live = UINT32_MAX;
+            }
+
+            for (s32 i = last; i >= (s32)block_starts[b]; i--)
+            {
+                live_after[i] = live;
+                u32 uses, defs;
+                instruction_uses_defs(&instructions[i], &uses, &defs);
+                live = (live & ~defs) | uses;
+            }
+
+            if (live != live_in[b])
+            {
+                live_in[b] = live;
+                changed = true;
+            }
+        }
+    }
+
+    return live_after;
+}
+
+static inline bool operands_equal(const Operand* a, const Operand* b)
+{
+    if (a->type != b->type)
+    {
+        return false;
+    }
+    switch (a->type)
+    {
+        case OPERAND_TYPE_REGISTER:
+            return a->reg.index == b->reg.index && a->reg.size == b->reg.size;
+        case OPERAND_TYPE_MEMORY:
+            return a->mem.base == b->mem.base && a->mem.index == b->mem.index && a->mem.scale == b->mem.scale &&
+                a->mem.size == b->mem.size && a->mem.displacement == b->mem.displacement && a->mem.rip_relative == b->mem.rip_relative;
+        case OPERAND_TYPE_IMMEDIATE:
+            return a->imm == b->imm;
+        default:
+            return false;
+    }
+}
+
+static inline bool writes_memory(const Instruction* instruction)
+{
+    return (instruction->operands[0].type == OPERAND_TYPE_MEMORY && (operand_access(instruction->mnemonic, 0) & OPERAND_ACCESS_DEF)) ||
+        instruction->mnemonic == MNEMONIC_PUSH || instruction->mnemonic == MNEMONIC_CALL || instruction->mnemonic == MNEMONIC_MFENCE;
+}
+
+typedef struct PeepholeStats
+{
+    u32 forwarded_loads;
+    u32 dead_moves;
+    u32 useless_arithmetic;
+    u32 jumps_to_next;
+    u32 fused_branches;
+    u32 zero_idioms;
+} PeepholeStats;
+
+/* mov [m], r ... mov r2, [m] -> mov r2, r, as long as nothing in between can change r or [m] */
+static inline bool peephole_forward_store(Instruction* instructions, u32 load_index, PeepholeStats* stats)
+{
+    Instruction* load = &instructions[load_index];
+    const u32 window = 16;
+    for (u32 back = 1; back <= window && back <= load_index; back++)
+    {
+        Instruction* candidate = &instructions[load_index - back];
+        if (candidate->mnemonic == MNEMONIC_LABEL || ends_block(candidate))
+        {
+            return false;
+        }
+        if (candidate->mnemonic == MNEMONIC_MOV && candidate->operands[1].type == OPERAND_TYPE_REGISTER && operands_equal(&candidate->operands[0], &load->operands[1]))
+        {
+            Operand stored = candidate->operands[1];
+            /* Nothing in between may redefine the stored register or the address registers */
+            u32 address_mask = 0;
+            if (load->operands[1].mem.base != REGISTER_NONE)
+            {
+                address_mask |= REGISTER_MASK(load->operands[1].mem.base);
+            }
+            if (load->operands[1].mem.index != REGISTER_NONE)
+            {
+                address_mask |= REGISTER_MASK(load->operands[1].mem.index);
+            }
+            for (u32 i = load_index - back + 1; i < load_index; i++)
+            {
+                u32 uses, defs;
+                instruction_uses_defs(&instructions[i], &uses, &defs);
+                bool partial_write = instructions[i].operands[0].type == OPERAND_TYPE_REGISTER && (operand_access(instructions[i].mnemonic, 0) & OPERAND_ACCESS_DEF);
+                u32 written = defs | (partial_write ? REGISTER_MASK(instructions[i].operands[0].reg.index) : 0);
+                if (written & (REGISTER_MASK(stored.reg.index) | address_mask))
+                {
+                    return false;
+                }
+            }
+            load->operands[1] = stored;
+            stats->forwarded_loads++;
+            return true;
+        }
+        if (writes_memory(candidate))
+        {
+            return false;
+        }
+    }
+    return false;
+}
+
+static inline bool is_dead_move_candidate(const Instruction* instruction)
+{
+    switch (instruction->mnemonic)
+    {
+        case MNEMONIC_MOV:
+        case MNEMONIC_LEA:
+        case MNEMONIC_MOVZX:
+        case MNEMONIC_MOVSX:
+        case MNEMONIC_MOVSXD:
+            return instruction->operands[0].type == OPERAND_TYPE_REGISTER && instruction->operands[0].reg.index != REGISTER_SP && is_gp(instruction->operands[0].reg.index);
+        default:
+            return false;
+    }
+}
+
+static inline bool is_register_immediate(const Instruction* instruction, x64_Mnemonic mnemonic, s64 value)
+{
+    return instruction->mnemonic == mnemonic && instruction->operands[0].type == OPERAND_TYPE_REGISTER &&
+        instruction->operands[1].type == OPERAND_TYPE_IMMEDIATE && instruction->operands[1].imm == value;
+}
+
+static bool peephole_pass(MachineFunction* fn, PeepholeStats* stats)
+{
+    Instruction* instructions = fn->instructions.ptr;
+    u32 count = fn->instructions.len;
+    u32* live_after = compute_live_after(fn);
+    bool* removed = NEW(bool, (count + 1));
+    bool changed = false;
+
+    for (u32 i = 0; i < count; i++)
+    {
+        Instruction* instruction = &instructions[i];
+
+        if (instruction->mnemonic == MNEMONIC_MOV && instruction->operands[0].type == OPERAND_TYPE_REGISTER && instruction->operands[1].type == OPERAND_TYPE_MEMORY &&
+            peephole_forward_store(instructions, i, stats))
+        {
+            changed = true;
+        }
+
+        /* mov r, r and moves into registers nobody reads */
+        if (is_dead_move_candidate(instruction))
+        {
+            bool self_move = instruction->mnemonic == MNEMONIC_MOV && operands_equal(&instruction->operands[0], &instruction->operands[1]);
+            bool dead = !(live_after[i] & REGISTER_MASK(instruction->operands[0].reg.index));
+            if (self_move || dead)
+            {
+                removed[i] = true;
+                stats->dead_moves++;
+                changed = true;
+                continue;
+            }
+        }
+
+        /* add/sub r64, 0 (add rsp, 0 included) only change the flags */
+        if ((is_register_immediate(instruction, MNEMONIC_ADD, 0) || is_register_immediate(instruction, MNEMONIC_SUB, 0)) &&
+            instruction->operands[0].reg.size == 8 && !(live_after[i] & FLAGS_MASK))
+        {
+            removed[i] = true;
+            stats->useless_arithmetic++;
+            changed = true;
+            continue;
+        }
+
+        /* Branch to the instruction right after it */
+        if (is_branch(instruction))
+        {
+            bool to_next = false;
+            for (u32 next = i + 1; next < count && instructions[next].mnemonic == MNEMONIC_LABEL; next++)
+            {
+                if (instructions[next].operands[0].label == instruction->operands[0].label)
+                {
+                    to_next = true;
+                    break;
+                }
+            }
+            if (to_next)
+            {
+                removed[i] = true;
+                stats->jumps_to_next++;
+                changed = true;
+                continue;
+            }
+        }
+
+        /* setcc r8; [movzx r, r8;] test r, r / cmp r, 0; jne/je L -> jcc L. The test has to read exactly the setcc result, and neither
+         * the register nor the flags the test produced can be read after the branch: the fused jcc leaves the flags of the original compare */
+        if (instruction->mnemonic == MNEMONIC_SETCC && instruction->operands[0].type == OPERAND_TYPE_REGISTER)
+        {
+            u8 reg = instruction->operands[0].reg.index;
+            const Operand* value = &instruction->operands[0];
+            u32 next = i + 1;
+            if (next < count && instructions[next].mnemonic == MNEMONIC_MOVZX && instructions[next].operands[0].type == OPERAND_TYPE_REGISTER &&
+                instructions[next].operands[0].reg.index == reg && operands_equal(&instructions[next].operands[1], &instruction->operands[0]))
+            {
+                value = &instructions[next].operands[0];
+                next++;
+            }
+            if (next + 1 < count)
+            {
+                Instruction* test = &instructions[next];
+                Instruction* branch = &instructions[next + 1];
+                bool is_test = (test->mnemonic == MNEMONIC_TEST && test->operands[0].type == OPERAND_TYPE_REGISTER && operands_equal(&test->operands[0], &test->operands[1])) ||
+                    is_register_immediate(test, MNEMONIC_CMP, 0);
+                if (is_test && operands_equal(&test->operands[0], value) && is_branch(branch) && branch->mnemonic == MNEMONIC_JCC &&
+                    (branch->condition_code == CONDITION_CODE_NE || branch->condition_code == CONDITION_CODE_E) &&
+                    !(live_after[next + 1] & (REGISTER_MASK(reg) | FLAGS_MASK)))
+                {
+                    /* Condition codes come in pairs that differ in the lowest bit */
+                    ConditionCode condition_code = branch->condition_code == CONDITION_CODE_NE ? instruction->condition_code : instruction->condition_code ^ 1;
+                    Operand target = branch->operands[0];
+                    for (u32 r = i; r < next + 1; r++)
+                    {
+                        removed[r] = true;
+                    }
+                    branch->condition_code = condition_code;
+                    branch->operands[0] = target;
+                    stats->fused_branches++;
+                    changed = true;
+                    i = next + 1;
+                    continue;
+                }
+            }
+        }
+
+        /* mov r, 0 -> xor r32, r32 (shorter, and a dependency-breaking idiom) when the flags are dead */
+        if (is_register_immediate(instruction, MNEMONIC_MOV, 0) && instruction->operands[0].reg.size >= 4 && !(live_after[i] & FLAGS_MASK))
+        {
+            Operand reg = x64_reg(instruction->operands[0].reg.index, 4);
+            *instruction = x64_inst2(MNEMONIC_XOR, reg, reg);
+            stats->zero_idioms++;
+            changed = true;
+        }
+    }
+
+    if (changed)
+    {
+        u32 kept = 0;
+        for (u32 i = 0; i < count; i++)
+        {
+            if (!removed[i])
+            {
+                instructions[kept++] = instructions[i];
+            }
+        }
+        fn->instructions.len = kept;
+    }
+
+    return changed;
+}
+
+/* Runs after register allocation, on the instruction list, until nothing changes. Branch shortening happens in x64_emit_function */
+void x64_peephole(MachineFunction* fn)
+{
+    PeepholeStats stats = ZERO_INIT;
+#if RED_X64_VERBOSE
+    u32 instruction_count = fn->instructions.len;
+#endif
+    while (peephole_pass(fn, &stats));
+
+#if RED_X64_VERBOSE
+    print("x64 peephole: %u -> %u instructions (%u loads forwarded, %u dead moves, %u useless add/sub, %u jumps to next, %u branches fused, %u zero idioms)\n",
+        instruction_count, fn->instructions.len, stats.forwarded_loads, stats.dead_moves, stats.useless_arithmetic, stats.jumps_to_next, stats.fused_branches, stats.zero_idioms);
+#endif
+}
+
+typedef struct LabelFixup
+{
+    u32 offset;
+    u32 label;
+    u32 instruction;
+    u8 size;
+} LabelFixup;
+
+GEN_BUFFER_STRUCT(LabelFixup)
+GEN_BUFFER_FUNCTIONS(label_fixup, lfb, LabelFixupBuffer, LabelFixup)
+
+/* Win64 frame: callee-saved pushes, then spill slots and shadow space, keeping rsp 16-byte aligned at calls */
+void x64_emit_function(U8B* b, MachineFunction* fn)
+{
+    u32 push_count = 0;
+    for (u8 reg = 0; reg < 16; reg++)
+    {
+        if (fn->used_callee_saved & REGISTER_MASK(reg))
+        {
+            encode(b, x64_inst1(MNEMONIC_PUSH, x64_reg(reg, 8)));
+            push_count++;
+        }
+    }
+
+    s32 frame_size = fn->spill_slot_count * 8 + (fn->has_calls ? 32 : 0);
+    if (frame_size || fn->has_calls)
+    {
+        /* The return address is already on the stack */
+        if ((8 + push_count * 8 + frame_size) % 16)
+        {
+            frame_size += 8;
+        }
+    }
+    Operand rsp = x64_reg(REGISTER_SP, 8);
+    if (frame_size)
+    {
+        encode(b, x64_inst2(MNEMONIC_SUB, rsp, x64_imm(frame_size)));
+    }
+
+    u32* label_offsets = NEW(u32, (fn->label_count + 1));
+    bool* long_branches = NEW(bool, (fn->instructions.len + 1));
+    LabelFixupBuffer fixups = ZERO_INIT;
+    u32 body_start = b->len;
+
+    /* Branch relaxation: every jmp/jcc starts as rel8 and the ones whose target is out of range are grown to rel32 until nothing changes. Branches only grow, so this terminates */
+    bool relaxed = false;
+    while (!relaxed)
+    {
+        b->len = body_start;
+        label_fixup_clear(&fixups);
+
+        for (u32 i = 0; i < fn->instructions.len; i++)
+        {
+            Instruction instruction = fn->instructions.ptr[i];
+            switch (instruction.mnemonic)
+            {
+                case MNEMONIC_LABEL:
+                    label_offsets[instruction.operands[0].label] = b->len;
+                    break;
+                case MNEMONIC_RET:
+                    if (frame_size)
+                    {
+                        encode(b, x64_inst2(MNEMONIC_ADD, rsp, x64_imm(frame_size)));
+                    }
+                    for (s32 reg = 15; reg >= 0; reg--)
+                    {
+                        if (fn->used_callee_saved & REGISTER_MASK(reg))
+                        {
+                            encode(b, x64_inst1(MNEMONIC_POP, x64_reg(reg, 8)));
+                        }
+                    }
+                    encode(b, instruction);
+                    break;
+                default:
+                    if (instruction.operands[0].type == OPERAND_TYPE_LABEL)
+                    {
+                        u32 label = instruction.operands[0].label;
+                        u8 size = (long_branches[i] || !is_branch(&instruction)) ? 4 : 1;
+                        instruction.operands[0] = x64_rel(size, 0);
+                        encode(b, instruction);
+                        label_fixup_append(&fixups, (LabelFixup) { b->len - size, label, i, size });
+                    }
+                    else
+                    {
+                        encode(b, instruction);
+                    }
+                    break;
+            }
+        }
+
+        relaxed = true;
+        for (u32 i = 0; i < fixups.len; i++)
+        {
+            LabelFixup fixup = fixups.ptr[i];
+            s32 displacement = (s32)label_offsets[fixup.label] - (s32)(fixup.offset + fixup.size);
+            if (fixup.size == 1 && (displacement < INT8_MIN || displacement > INT8_MAX))
+            {
+                long_branches[fixup.instruction] = true;
+                relaxed = false;
+            }
+        }
+    }
+
+    u32 short_branches = 0;
+    for (u32 i = 0; i < fixups.len; i++)
+    {
+        LabelFixup fixup = fixups.ptr[i];
+        s32 displacement = (s32)label_offsets[fixup.label] - (s32)(fixup.offset + fixup.size);
+        if (fixup.size == 1)
+        {
+            b->ptr[fixup.offset] = (u8)(s8)displacement;
+            short_branches++;
+        }
+        else
+        {
+            memcpy(&b->ptr[fixup.offset], &displacement, sizeof(s32));
+        }
+    }
+
+#if RED_X64_VERBOSE
+    print("x64 emit: %u bytes, %u of %u branches short\n", b->len, short_branches, fixups.len);
+#endif
 }
 
 void ptest(const char* text, bool expr)
@@ -176,36 +2123,212 @@ void ptest(const char* text, bool expr)
     printf("%s %s\n", text, expr ? "OK" : "FAIL");
 }
 
-static const u8 x64_ret = 0xc3;
+typedef struct EncoderTest
+{
+    LLVMDisasmContextRef disassembler;
+    u32 instruction_count;
+    u32 failure_count;
+    /* Only the first failure of each encoding is printed */
+    bool encoding_reported;
+} EncoderTest;
+
+static void encoder_test_check(EncoderTest* test, Instruction instruction)
+{
+    u8 bytes[32];
+    U8B b = { .ptr = bytes, .len = 0, .cap = sizeof(bytes) };
+    encode(&b, instruction);
+
+    char expected[128];
+    x64_format_instruction(expected, sizeof(expected), instruction);
+    char disassembly[128];
+    usize decoded = LLVMDisasmInstruction(test->disassembler, bytes, b.len, 0, disassembly, sizeof(disassembly));
+    /* LLVM prefixes the text with a tab */
+    const char* text = disassembly[0] == '\t' ? disassembly + 1 : disassembly;
+
+    test->instruction_count++;
+    if (decoded != b.len || strcmp(expected, text) != 0)
+    {
+        test->failure_count++;
+        if (!test->encoding_reported)
+        {
+            test->encoding_reported = true;
+            printf("Expected \"%s\", LLVM decoded %zu of %u bytes as \"%s\":", expected, decoded, b.len, text);
+            for (u32 i = 0; i < b.len; i++)
+            {
+                printf(" %02x", bytes[i]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+static u32 encoder_test_candidates(Operand* candidates, OperandEncoding operand_encoding, u8 operation_size)
+{
+    const s32 displacements[] = { 0, 1, -1, INT8_MAX, INT8_MIN, INT8_MAX + 1, INT8_MIN - 1, 0x12345678, INT32_MIN };
+    u32 count = 0;
+
+    switch (operand_encoding.kind)
+    {
+        case OPERAND_ENCODING_NONE:
+            candidates[count++] = (Operand) { 0 };
+            return count;
+        case OPERAND_ENCODING_CL:
+            candidates[count++] = x64_reg(REGISTER_C, 1);
+            return count;
+        case OPERAND_ENCODING_IMMEDIATE:
+        {
+            s64 bits = operand_encoding.size * 8;
+            s64 max = bits == 64 ? INT64_MAX : (1LL << (bits - 1)) - 1;
+            s64 min = bits == 64 ? INT64_MIN : -(1LL << (bits - 1));
+            candidates[count++] = x64_imm(0);
+            candidates[count++] = x64_imm(1);
+            candidates[count++] = x64_imm(-1);
+            candidates[count++] = x64_imm(max);
+            candidates[count++] = x64_imm(min);
+            return count;
+        }
+        case OPERAND_ENCODING_RELATIVE:
+            for (u32 i = 0; i < array_length(displacements); i++)
+            {
+                if (operand_encoding.size == 4 || (displacements[i] >= INT8_MIN && displacements[i] <= INT8_MAX))
+                {
+                    candidates[count++] = x64_rel(operand_encoding.size, displacements[i]);
+                }
+            }
+            return count;
+        default:
+            break;
+    }
+
+    bool registers = operand_encoding.kind != OPERAND_ENCODING_MEMORY;
+    bool memory = operand_encoding.kind == OPERAND_ENCODING_REGISTER_MEMORY || operand_encoding.kind == OPERAND_ENCODING_XMM_MEMORY || operand_encoding.kind == OPERAND_ENCODING_MEMORY;
+    bool xmm = operand_encoding.kind == OPERAND_ENCODING_XMM || operand_encoding.kind == OPERAND_ENCODING_XMM_MEMORY;
+
+    if (registers)
+    {
+        for (u8 reg = 0; reg < 16; reg++)
+        {
+            candidates[count++] = x64_reg(xmm ? REGISTER_XMM0 + reg : reg, operand_encoding.size);
+        }
+    }
+
+    if (memory)
+    {
+        u8 size = operand_encoding.kind == OPERAND_ENCODING_MEMORY ? operation_size : operand_encoding.size;
+        const u8 scales[] = { 1, 2, 4, 8 };
+        for (u32 d = 0; d < array_length(displacements); d++)
+        {
+            candidates[count++] = x64_mem_rip(size, displacements[d]);
+            for (s32 base = -1; base < 16; base++)
+            {
+                for (s32 index = -1; index < 16; index++)
+                {
+                    if (index == REGISTER_SP)
+                    {
+                        continue;
+                    }
+                    for (u32 s = 0; s < array_length(scales); s++)
+                    {
+                        if (index == -1 && s != 0)
+                        {
+                            break;
+                        }
+                        candidates[count++] = x64_mem(size, base == -1 ? REGISTER_NONE : base, index == -1 ? REGISTER_NONE : index, scales[s], displacements[d]);
+                    }
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/* Exhaustive round trip: every encoding in the table is tried with every register and addressing mode, and the bytes are decoded back with the LLVM disassembler */
+bool x64_test_encoder(void)
+{
+    LLVMInitializeX86TargetInfo();
+    LLVMInitializeX86TargetMC();
+    LLVMInitializeX86Disassembler();
+
+    EncoderTest test = { 0 };
+    test.disassembler = LLVMCreateDisasm("x86_64-pc-windows-msvc", nullptr, 0, nullptr, nullptr);
+    redassert(test.disassembler);
+    LLVMSetDisasmOptions(test.disassembler, LLVMDisassembler_Option_AsmPrinterVariant);
+
+    const u32 max_candidates = 16 + 9 * (1 + 17 * 61);
+    Operand* first = NEW(Operand, max_candidates);
+    Operand* second = NEW(Operand, max_candidates);
+
+    for (usize e = 0; e < array_length(encodings); e++)
+    {
+        const InstructionEncoding* encoding = &encodings[e];
+        u8 operation_size = encoding->operands[0].size ? encoding->operands[0].size : 8;
+        u32 first_count = encoder_test_candidates(first, encoding->operands[0], operation_size);
+        u32 second_count = encoder_test_candidates(second, encoding->operands[1], operation_size);
+        u8 condition_code_count = (encoding->flags & ENCODING_FLAG_CONDITION_CODE) ? CONDITION_CODE_COUNT : 1;
+        test.encoding_reported = false;
+
+        for (u8 cc = 0; cc < condition_code_count; cc++)
+        {
+            /* Full cross product when it is small, otherwise every candidate of the longer list paired with a rotating one of the shorter */
+            if (first_count * second_count <= 4096)
+            {
+                for (u32 i = 0; i < first_count; i++)
+                {
+                    for (u32 j = 0; j < second_count; j++)
+                    {
+                        Instruction instruction = x64_inst2(encoding->mnemonic, first[i], second[j]);
+                        instruction.condition_code = cc;
+                        encoder_test_check(&test, instruction);
+                    }
+                }
+            }
+            else
+            {
+                u32 count = first_count > second_count ? first_count : second_count;
+                for (u32 i = 0; i < count; i++)
+                {
+                    Instruction instruction = x64_inst2(encoding->mnemonic, first[i % first_count], second[(i * 7) % second_count]);
+                    instruction.condition_code = cc;
+                    encoder_test_check(&test, instruction);
+                }
+            }
+        }
+    }
+
+    LLVMDisasmDispose(test.disassembler);
+    printf("x64 encoder: %u instructions, %u failures\n", test.instruction_count, test.failure_count);
+    ptest("x64 encoder round trip", test.failure_count == 0);
+    return test.failure_count == 0;
+}
 
 get_constant_s32* make_constant_s32(s32 fn_handle)
 {
-    U8B buffer = make_buffer(1024, PAGE_EXECUTE_READWRITE);
-    u8_append_u8(&buffer, 0x48);
-    u8_append_u8(&buffer, 0xc7);
-    u8_append_u8(&buffer, 0xc0);
-    u8_append_s32(&buffer, fn_handle);
-    u8_append_u8(&buffer, x64_ret);
-    return (get_constant_s32*)buffer.ptr;
+    U8B b = make_buffer(1024);
+    encode(&b, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 4), x64_imm(fn_handle)));
+    encode(&b, x64_inst0(MNEMONIC_RET));
+    return (get_constant_s32*)b.ptr;
 }
 
 identity_s64* make_identity_s64(void)
 {
-    U8B b = make_buffer(1024, PAGE_EXECUTE_READWRITE);
-    encode(&b, (Instruction) { MOV, { rcx, rax } });
-    u8_append_u8(&b, x64_ret);
+    U8B b = make_buffer(1024);
+    encode(&b, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 8), x64_reg(REGISTER_C, 8)));
+    encode(&b, x64_inst0(MNEMONIC_RET));
     return (identity_s64*)b.ptr;
 }
 
 increment_s64* make_increment_s64(void)
 {
-    U8B b = make_buffer(1024, PAGE_EXECUTE_READWRITE);
-    u8_append_sub_rsp_imm_8(&b, 24);
-    u8_append_mov_to_stack_offset_imm_32(&b, 0, 1);
-    u8_append_add_to_ecx_value_at_stack_offset(&b, 0);
-    encode(&b, (Instruction) { MOV, { rcx, rax } });
-    u8_append_add_rsp_imm_8(&b, 24);
-    u8_append_u8(&b, x64_ret);
+    U8B b = make_buffer(1024);
+    MachineFunction fn = ZERO_INIT;
+    Operand n = x64_new_vreg(&fn, 8);
+    x64_append(&fn, x64_inst2(MNEMONIC_MOV, n, x64_reg(REGISTER_C, 8)));
+    x64_append(&fn, x64_inst2(MNEMONIC_ADD, n, x64_imm(1)));
+    x64_append(&fn, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 8), n));
+    x64_append(&fn, x64_inst0(MNEMONIC_RET));
+    x64_allocate_registers(&fn);
+    x64_peephole(&fn);
+    x64_emit_function(&b, &fn);
     return (increment_s64*)b.ptr;
 }
-
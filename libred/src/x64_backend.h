@@ -1,5 +1,271 @@
 #pragma once
 
+typedef enum x64_Register
+{
+    REGISTER_A,
+    REGISTER_C,
+    REGISTER_D,
+    REGISTER_B,
+    REGISTER_SP,
+    REGISTER_BP,
+    REGISTER_SI,
+    REGISTER_DI,
+    REGISTER_R8,
+    REGISTER_R9,
+    REGISTER_R10,
+    REGISTER_R11,
+    REGISTER_R12,
+    REGISTER_R13,
+    REGISTER_R14,
+    REGISTER_R15,
+    REGISTER_XMM0,
+    REGISTER_XMM1,
+    REGISTER_XMM2,
+    REGISTER_XMM3,
+    REGISTER_XMM4,
+    REGISTER_XMM5,
+    REGISTER_XMM6,
+    REGISTER_XMM7,
+    REGISTER_XMM8,
+    REGISTER_XMM9,
+    REGISTER_XMM10,
+    REGISTER_XMM11,
+    REGISTER_XMM12,
+    REGISTER_XMM13,
+    REGISTER_XMM14,
+    REGISTER_XMM15,
+    REGISTER_COUNT,
+    REGISTER_NONE = 0xff,
+} x64_Register;
+
+typedef enum OperandType
+{
+    OPERAND_TYPE_NONE,
+    OPERAND_TYPE_REGISTER = 1,
+    OPERAND_TYPE_MEMORY,
+    OPERAND_TYPE_IMMEDIATE,
+    OPERAND_TYPE_RELATIVE,
+    /* Before register allocation */
+    OPERAND_TYPE_VIRTUAL_REGISTER,
+    /* Branch target, resolved to a relative displacement when the function is emitted */
+    OPERAND_TYPE_LABEL,
+} OperandType;
+
+typedef struct Register
+{
+    u8 index;
+    /* In bytes: 1, 2, 4, 8 for general purpose registers, 16 for xmm */
+    u8 size;
+} Register;
+
+typedef struct VirtualRegister
+{
+    /* Starts at 1 */
+    u32 index;
+    u8 size;
+} VirtualRegister;
+
+/* [base + scale * index + displacement] or [rip + displacement]. Before register allocation the base can be a virtual register */
+typedef struct MemoryOperand
+{
+    u8 base;
+    u8 index;
+    u8 scale;
+    u8 size;
+    s32 displacement;
+    u32 virtual_base;
+    bool rip_relative;
+} MemoryOperand;
+
+/* Displacement from the end of the instruction */
+typedef struct Relative
+{
+    s32 displacement;
+    u8 size;
+} Relative;
+
+typedef struct Operand
+{
+    OperandType type;
+    union
+    {
+        Register reg;
+        MemoryOperand mem;
+        s64 imm;
+        Relative rel;
+        VirtualRegister vreg;
+        u32 label;
+    };
+} Operand;
+
+typedef enum x64_Mnemonic
+{
+    MNEMONIC_ADD,
+    MNEMONIC_OR,
+    MNEMONIC_ADC,
+    MNEMONIC_SBB,
+    MNEMONIC_AND,
+    MNEMONIC_SUB,
+    MNEMONIC_XOR,
+    MNEMONIC_CMP,
+    MNEMONIC_TEST,
+    MNEMONIC_MOV,
+    MNEMONIC_LEA,
+    MNEMONIC_MOVZX,
+    MNEMONIC_MOVSX,
+    MNEMONIC_MOVSXD,
+    MNEMONIC_IMUL,
+    MNEMONIC_NOT,
+    MNEMONIC_NEG,
+    MNEMONIC_MUL,
+    MNEMONIC_DIV,
+    MNEMONIC_IDIV,
+    MNEMONIC_INC,
+    MNEMONIC_DEC,
+    MNEMONIC_SHL,
+    MNEMONIC_SHR,
+    MNEMONIC_SAR,
+    MNEMONIC_PUSH,
+    MNEMONIC_POP,
+    MNEMONIC_CALL,
+    MNEMONIC_JMP,
+    MNEMONIC_RET,
+    MNEMONIC_CDQ,
+    MNEMONIC_CQO,
+    MNEMONIC_NOP,
+    MNEMONIC_JCC,
+    MNEMONIC_SETCC,
+    MNEMONIC_CMOVCC,
+    MNEMONIC_MOVSS,
+    MNEMONIC_MOVSD,
+    MNEMONIC_MOVAPS,
+    MNEMONIC_MOVUPS,
+    MNEMONIC_MOVAPD,
+    MNEMONIC_MOVUPD,
+    MNEMONIC_MOVDQA,
+    MNEMONIC_MOVDQU,
+    MNEMONIC_MOVD,
+    MNEMONIC_MOVQ,
+    MNEMONIC_ADDSS,
+    MNEMONIC_ADDSD,
+    MNEMONIC_ADDPS,
+    MNEMONIC_ADDPD,
+    MNEMONIC_SUBSS,
+    MNEMONIC_SUBSD,
+    MNEMONIC_SUBPS,
+    MNEMONIC_SUBPD,
+    MNEMONIC_MULSS,
+    MNEMONIC_MULSD,
+    MNEMONIC_MULPS,
+    MNEMONIC_MULPD,
+    MNEMONIC_DIVSS,
+    MNEMONIC_DIVSD,
+    MNEMONIC_DIVPS,
+    MNEMONIC_DIVPD,
+    MNEMONIC_MINSS,
+    MNEMONIC_MINSD,
+    MNEMONIC_MAXSS,
+    MNEMONIC_MAXSD,
+    MNEMONIC_SQRTSS,
+    MNEMONIC_SQRTSD,
+    MNEMONIC_UCOMISS,
+    MNEMONIC_UCOMISD,
+    MNEMONIC_CVTSI2SS,
+    MNEMONIC_CVTSI2SD,
+    MNEMONIC_CVTTSS2SI,
+    MNEMONIC_CVTTSD2SI,
+    MNEMONIC_CVTSS2SD,
+    MNEMONIC_CVTSD2SS,
+    MNEMONIC_XORPS,
+    MNEMONIC_XORPD,
+    MNEMONIC_ANDPS,
+    MNEMONIC_ANDPD,
+    MNEMONIC_PXOR,
+    MNEMONIC_PADDD,
+    MNEMONIC_PADDQ,
+    MNEMONIC_PSUBD,
+    MNEMONIC_PSUBQ,
+    MNEMONIC_XCHG,
+    MNEMONIC_XADD,
+    MNEMONIC_CMPXCHG,
+    MNEMONIC_MFENCE,
+    /* Pseudo instruction: binds its label operand to the current position */
+    MNEMONIC_LABEL,
+    MNEMONIC_COUNT,
+} x64_Mnemonic;
+
+/* Condition codes in encoding order, for jcc, setcc and cmovcc */
+typedef enum ConditionCode
+{
+    CONDITION_CODE_O,
+    CONDITION_CODE_NO,
+    CONDITION_CODE_B,
+    CONDITION_CODE_AE,
+    CONDITION_CODE_E,
+    CONDITION_CODE_NE,
+    CONDITION_CODE_BE,
+    CONDITION_CODE_A,
+    CONDITION_CODE_S,
+    CONDITION_CODE_NS,
+    CONDITION_CODE_P,
+    CONDITION_CODE_NP,
+    CONDITION_CODE_L,
+    CONDITION_CODE_GE,
+    CONDITION_CODE_LE,
+    CONDITION_CODE_G,
+    CONDITION_CODE_COUNT,
+} ConditionCode;
+
+/* Operands are in Intel order: destination first */
+typedef struct Instruction
+{
+    x64_Mnemonic mnemonic;
+    ConditionCode condition_code;
+    Operand operands[2];
+    /* Emits the LOCK prefix: only valid for read-modify-write instructions with a memory destination */
+    bool lock;
+} Instruction;
+
+GEN_BUFFER_STRUCT(Instruction)
+
+/* Instructions of a single function. General purpose values live in virtual registers until x64_allocate_registers() runs */
+typedef struct MachineFunction
+{
+    InstructionBuffer instructions;
+    u32 virtual_register_count;
+    u32 label_count;
+    u32 spill_slot_count;
+    /* Bit mask of the callee-saved registers the allocator used, saved in the prologue */
+    u32 used_callee_saved;
+    bool has_calls;
+} MachineFunction;
+
+/* Readable, writable and executable, so the encoded code can be called in place */
+U8Buffer make_buffer(s64 capacity);
+Operand x64_reg(x64_Register reg, u8 size);
+Operand x64_mem(u8 size, x64_Register base, x64_Register index, u8 scale, s32 displacement);
+Operand x64_mem_rip(u8 size, s32 displacement);
+Operand x64_imm(s64 value);
+Operand x64_rel(u8 size, s32 displacement);
+/* Instructions without a LOCK prefix. Operands they don't use are OPERAND_TYPE_NONE */
+Instruction x64_inst0(x64_Mnemonic mnemonic);
+Instruction x64_inst1(x64_Mnemonic mnemonic, Operand operand);
+Instruction x64_inst2(x64_Mnemonic mnemonic, Operand destination, Operand source);
+/* jcc and setcc */
+Instruction x64_inst_cc(x64_Mnemonic mnemonic, ConditionCode condition_code, Operand operand);
+void encode(U8Buffer* b, Instruction instruction);
+usize x64_format_instruction(char* buffer, usize size, Instruction instruction);
+
+extern const x64_Register x64_win64_argument_registers[4];
+Operand x64_mem_vreg(u8 size, Operand base, s32 displacement);
+Operand x64_new_vreg(MachineFunction* fn, u8 size);
+Operand x64_new_label(MachineFunction* fn);
+void x64_append(MachineFunction* fn, Instruction instruction);
+void x64_allocate_registers(MachineFunction* fn);
+void x64_peephole(MachineFunction* fn);
+void x64_emit_function(U8Buffer* b, MachineFunction* fn);
+bool x64_test_encoder(void);
+
 typedef s32 get_constant_s32(s32);
 typedef s64 identity_s64(s64);
 typedef s64 increment_s64(s64);
@@ -0,0 +1,787 @@
+#include "types.h"
+#include "compiler_types.h"
+#include "ir.h"
+#include "bigint.h"
+#include "lexer.h"
+#include "x64_backend.h"
+#include "x64_lowering.h"
+#include <assert.h>
+
+/* Lowers the scalar subset of the IR to machine functions. Every value lives in a 64-bit virtual register: narrower integers are kept
+ * sign or zero-extended to 64 bits, like in the bytecode VM, so comparisons and calls never have to look at the type again.
+ * Calls load the callee address from a table that is filled once every function is emitted, so they can be lowered before their callee */
+typedef struct x64_ExternFunction
+{
+    const char* name;
+    void** address;
+} x64_ExternFunction;
+
+GEN_BUFFER_STRUCT(x64_ExternFunction)
+GEN_BUFFER_FUNCTIONS(x64_extern, eb, x64_ExternFunctionBuffer, x64_ExternFunction)
+
+typedef struct x64_Module
+{
+    IRModule* ir_module;
+    /* Indexed like ir_module->fn_definitions */
+    void** function_addresses;
+    x64_ExternFunctionBuffer extern_functions;
+    /* One slot per global, initialized when the module is lowered: there is no code that runs before main */
+    s64* globals;
+} x64_Module;
+
+typedef struct x64_Builder
+{
+    x64_Module* module;
+    IRFunctionDefinition* ir_fn;
+    MachineFunction* fn;
+    Operand* params;
+    /* Indexed like ir_fn->sym_declarations */
+    Operand* locals;
+    u32 local_count;
+} x64_Builder;
+
+#define X64_MAX_PARAM_COUNT array_length(x64_win64_argument_registers)
+
+static inline bool x64_primitive_is_signed(IRTypePrimitive type)
+{
+    return type >= IR_TYPE_PRIMITIVE_S8 && type <= IR_TYPE_PRIMITIVE_S64;
+}
+
+static inline bool x64_type_is_unsigned(IRType* type)
+{
+    return (type->kind == TYPE_KIND_PRIMITIVE && type->primitive_type <= IR_TYPE_PRIMITIVE_U64) || type->kind == TYPE_KIND_POINTER || type->kind == TYPE_KIND_RAW_STRING;
+}
+
+/* Bit count of the integers that need extending after arithmetic, 0 for the ones that fill a register */
+static inline u8 x64_narrow_bit_count(IRType* type)
+{
+    if (type->kind != TYPE_KIND_PRIMITIVE || type->primitive_type > IR_TYPE_PRIMITIVE_S64)
+    {
+        return 0;
+    }
+    u8 bit_count = (u8)(8 << (type->primitive_type & 3));
+    return bit_count < 64 ? bit_count : 0;
+}
+
+static inline s64 x64_int_literal_value(IRIntLiteral* int_lit)
+{
+    BigInt* bigint = &int_lit->bigint;
+    if (bigint->digit_count > 1 || (bigint->is_negative && bigint->digit > (u64)INT64_MAX + 1))
+    {
+        os_exit_with_message("Integer literal doesn't fit in 64 bits, the x64 backend can't represent it\n");
+    }
+
+    /* -1 as a u8 is 255 */
+    IRType type = { .kind = TYPE_KIND_PRIMITIVE, .primitive_type = int_lit->type, };
+    u8 bit_count = x64_narrow_bit_count(&type);
+    bool is_signed = x64_primitive_is_signed(int_lit->type);
+    BigInt value;
+    BigInt_truncate(&value, bigint, bit_count ? bit_count : 64, is_signed);
+    return is_signed ? BigInt_as_signed(&value) : (s64)BigInt_as_u64(&value);
+}
+
+static const char* x64_type_kind_names[] =
+{
+    [TYPE_KIND_INVALID] = "invalid",
+    [TYPE_KIND_VOID] = "void",
+    [TYPE_KIND_PRIMITIVE] = "primitive",
+    [TYPE_KIND_COMPLEX_TO_BE_DETERMINED] = "unresolved",
+    [TYPE_KIND_STRUCT] = "struct",
+    [TYPE_KIND_UNION] = "union",
+    [TYPE_KIND_ENUM] = "enum",
+    [TYPE_KIND_ARRAY] = "array",
+    [TYPE_KIND_VECTOR] = "vector",
+    [TYPE_KIND_POINTER] = "pointer",
+    [TYPE_KIND_RAW_STRING] = "string",
+    [TYPE_KIND_FRAME] = "frame",
+    [TYPE_KIND_FUNCTION] = "function",
+    [TYPE_KIND_MODULE_NAMESPACE] = "module",
+};
+static_assert(array_length(x64_type_kind_names) == TYPE_KIND_MODULE_NAMESPACE + 1, "Every type kind must have a name");
+
+/* Only scalars that fit in a general purpose register. Aggregates would need stack slots the machine functions don't have yet */
+static inline void x64_check_type(IRType* type, const char* what, SB* name)
+{
+    switch (type->kind)
+    {
+        case TYPE_KIND_PRIMITIVE:
+            if (type->primitive_type >= IR_TYPE_PRIMITIVE_F32 && type->primitive_type <= IR_TYPE_PRIMITIVE_F128)
+            {
+                os_exit_with_message("%s %s: floating point values are not supported in the x64 backend\n", what, sb_ptr(name));
+            }
+            break;
+        case TYPE_KIND_ENUM:
+        case TYPE_KIND_POINTER:
+        case TYPE_KIND_RAW_STRING:
+            break;
+        default:
+            os_exit_with_message("%s %s: %s values are not supported in the x64 backend\n", what, sb_ptr(name), x64_type_kind_names[type->kind]);
+            break;
+    }
+}
+
+/* Arguments only go in registers, the Win64 convention puts the fifth and later ones on the stack */
+static inline void x64_check_signature(IRFunctionPrototype* proto)
+{
+    if (proto->attributes.is_async)
+    {
+        os_exit_with_message("Async function %s is not supported in the x64 backend\n", sb_ptr(proto->name));
+    }
+    if (proto->param_count > X64_MAX_PARAM_COUNT)
+    {
+        os_exit_with_message("Function %s: more than %u parameters are not supported in the x64 backend\n", sb_ptr(proto->name), (u32)X64_MAX_PARAM_COUNT);
+    }
+    for (u8 i = 0; i < proto->param_count; i++)
+    {
+        x64_check_type(&proto->params[i].type, "Parameter", proto->params[i].name);
+    }
+    if (proto->ret_type.kind != TYPE_KIND_VOID)
+    {
+        x64_check_type(&proto->ret_type, "Return value of", proto->name);
+    }
+}
+
+static inline void x64_emit(x64_Builder* builder, Instruction instruction)
+{
+    x64_append(builder->fn, instruction);
+}
+
+static inline Operand x64_new_value(x64_Builder* builder)
+{
+    return x64_new_vreg(builder->fn, 8);
+}
+
+/* The low bytes of a virtual register */
+static inline Operand x64_narrow(Operand value, u8 size)
+{
+    value.vreg.size = size;
+    return value;
+}
+
+static inline void x64_emit_label(x64_Builder* builder, Operand label)
+{
+    x64_emit(builder, x64_inst1(MNEMONIC_LABEL, label));
+}
+
+static inline void x64_emit_normalize(x64_Builder* builder, Operand value, IRType* type)
+{
+    u8 bit_count = x64_narrow_bit_count(type);
+    if (!bit_count)
+    {
+        return;
+    }
+
+    if (x64_primitive_is_signed(type->primitive_type))
+    {
+        x64_emit(builder, x64_inst2(bit_count == 32 ? MNEMONIC_MOVSXD : MNEMONIC_MOVSX, value, x64_narrow(value, bit_count / 8)));
+    }
+    else if (bit_count == 32)
+    {
+        /* movzx has no 32-bit form, and mov r32, r32 would leave the upper half of a spilled value in its stack slot */
+        x64_emit(builder, x64_inst2(MNEMONIC_SHL, value, x64_imm(32)));
+        x64_emit(builder, x64_inst2(MNEMONIC_SHR, value, x64_imm(32)));
+    }
+    else
+    {
+        x64_emit(builder, x64_inst2(MNEMONIC_MOVZX, value, x64_narrow(value, bit_count / 8)));
+    }
+}
+
+static inline Operand x64_gen_constant(x64_Builder* builder, s64 value)
+{
+    Operand result = x64_new_value(builder);
+    x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, x64_imm(value)));
+    return result;
+}
+
+static inline Operand x64_gen_global(x64_Builder* builder, IRSymDeclStatement* global_sym)
+{
+    u32 global_index = (u32)(global_sym - builder->module->ir_module->global_sym_decls.ptr);
+    Operand address = x64_gen_constant(builder, (s64)(uptr)&builder->module->globals[global_index]);
+    return x64_mem_vreg(8, address, 0);
+}
+
+static Operand x64_gen_expression(x64_Builder* builder, IRExpression* expression);
+static void x64_gen_statement(x64_Builder* builder, IRStatement* st);
+
+/* add, sub and cmp take a sign-extended 32-bit immediate as their source */
+static inline Operand x64_gen_source(x64_Builder* builder, IRExpression* expression)
+{
+    if (expression->type == IR_EXPRESSION_TYPE_INT_LIT)
+    {
+        s64 value = x64_int_literal_value(&expression->int_literal);
+        if (value >= INT32_MIN && value <= INT32_MAX)
+        {
+            return x64_imm(value);
+        }
+    }
+
+    return x64_gen_expression(builder, expression);
+}
+
+static inline void** x64_callee_address(x64_Builder* builder, IRFunctionPrototype* proto)
+{
+    x64_Module* module = builder->module;
+    IRFunctionDefinitionBuffer* fn_definitions = &module->ir_module->fn_definitions;
+    for (u32 i = 0; i < fn_definitions->len; i++)
+    {
+        if (fn_definitions->ptr[i].proto == proto)
+        {
+            return &module->function_addresses[i];
+        }
+    }
+
+    /* Only the main module is lowered, so functions defined in the others are unknown to the backend */
+    if (proto->has_body)
+    {
+        os_exit_with_message("Calling %s from another module is not supported in the x64 backend\n", sb_ptr(proto->name));
+    }
+    x64_check_signature(proto);
+
+    const char* name = sb_ptr(proto->name);
+    for (u32 i = 0; i < module->extern_functions.len; i++)
+    {
+        if (strequal(module->extern_functions.ptr[i].name, name))
+        {
+            return module->extern_functions.ptr[i].address;
+        }
+    }
+    void** address = NEW(void*, 1);
+    x64_extern_append(&module->extern_functions, (const x64_ExternFunction) { .name = name, .address = address, });
+    return address;
+}
+
+static inline Operand x64_gen_fn_call(x64_Builder* builder, IRFunctionCallExpr* fn_call)
+{
+    IRFunctionPrototype* proto = fn_call->fn;
+    redassert(fn_call->arg_count == proto->param_count);
+    void** callee_address = x64_callee_address(builder, proto);
+
+    /* Every argument is computed before the first one is moved in place, so nested calls can't clobber the argument registers */
+    Operand args[X64_MAX_PARAM_COUNT];
+    for (u8 i = 0; i < fn_call->arg_count; i++)
+    {
+        args[i] = x64_gen_expression(builder, &fn_call->args[i]);
+    }
+    for (u8 i = 0; i < fn_call->arg_count; i++)
+    {
+        x64_emit(builder, x64_inst2(MNEMONIC_MOV, x64_reg(x64_win64_argument_registers[i], 8), args[i]));
+    }
+    Operand address = x64_gen_constant(builder, (s64)(uptr)callee_address);
+    x64_emit(builder, x64_inst1(MNEMONIC_CALL, x64_mem_vreg(8, address, 0)));
+
+    if (proto->ret_type.kind == TYPE_KIND_VOID)
+    {
+        Operand none = ZERO_INIT;
+        return none;
+    }
+
+    Operand result = x64_new_value(builder);
+    x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, x64_reg(REGISTER_A, 8)));
+    /* The C ABI leaves the upper bits of narrow results undefined */
+    if (!proto->has_body)
+    {
+        x64_emit_normalize(builder, result, &proto->ret_type);
+    }
+    return result;
+}
+
+static inline s64 x64_enum_field_value(IREnumDecl* enum_decl, SB* field_name)
+{
+    u32 field_count = enum_decl->fields.len;
+    IREnumField* field_ptr = enum_decl->fields.ptr;
+    for (u32 i = 0; i < field_count; i++)
+    {
+        IREnumField* field = &field_ptr[i];
+        if (sb_cmp(field->name, field_name))
+        {
+            return field->value.signed64;
+        }
+    }
+
+    RED_UNREACHABLE;
+    return 0;
+}
+
+static inline Operand x64_local(x64_Builder* builder, IRSymDeclStatement* sym)
+{
+    u32 index = (u32)(sym - builder->ir_fn->sym_declarations.ptr);
+    redassert(index < builder->ir_fn->sym_declarations.len);
+    return builder->locals[index];
+}
+
+/* Parameters and locals are handed out as they are: every user only reads them */
+static inline Operand x64_gen_sym_load(x64_Builder* builder, IRSymExpr* sym_expr)
+{
+    IRExpression* subscript = sym_expr->subscript;
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_PARAM:
+            redassert(!subscript);
+            return builder->params[sym_expr->param_decl - builder->ir_fn->proto->params];
+        case IR_SYM_EXPR_TYPE_SYM:
+            /* Locals are scalars, see x64_check_type() */
+            redassert(!subscript);
+            return x64_local(builder, sym_expr->sym_decl);
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+        {
+            redassert(!subscript);
+            Operand global = x64_gen_global(builder, sym_expr->global_sym_decl);
+            Operand result = x64_new_value(builder);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, global));
+            return result;
+        }
+        case IR_SYM_EXPR_TYPE_ENUM:
+            redassert(subscript && subscript->type == IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS);
+            return x64_gen_constant(builder, x64_enum_field_value(sym_expr->enum_decl, subscript->subscript_access.name));
+        default:
+            os_exit_with_message("Struct and module member accesses are not supported in the x64 backend\n");
+            return x64_imm(0);
+    }
+}
+
+static inline ConditionCode x64_comparison_condition_code(TokenID op, bool is_unsigned)
+{
+    switch (op)
+    {
+        case TOKEN_ID_CMP_EQ:
+            return CONDITION_CODE_E;
+        case TOKEN_ID_CMP_NOT_EQ:
+            return CONDITION_CODE_NE;
+        case TOKEN_ID_CMP_LESS:
+            return is_unsigned ? CONDITION_CODE_B : CONDITION_CODE_L;
+        case TOKEN_ID_CMP_LESS_OR_EQ:
+            return is_unsigned ? CONDITION_CODE_BE : CONDITION_CODE_LE;
+        case TOKEN_ID_CMP_GREATER:
+            return is_unsigned ? CONDITION_CODE_A : CONDITION_CODE_G;
+        case TOKEN_ID_CMP_GREATER_OR_EQ:
+            return is_unsigned ? CONDITION_CODE_AE : CONDITION_CODE_GE;
+        default:
+            RED_UNREACHABLE;
+            return CONDITION_CODE_COUNT;
+    }
+}
+
+static inline Operand x64_gen_bin_expr(x64_Builder* builder, IRBinaryExpr* bin_expr)
+{
+    TokenID op = bin_expr->op;
+    /* Both operands have the type of the left one, and so does the result of the arithmetic */
+    IRType type = ast_to_ir_find_expression_type(bin_expr->left);
+    if (type.kind == TYPE_KIND_VECTOR)
+    {
+        os_exit_with_message("Vector operations are not supported in the x64 backend\n");
+    }
+    bool is_unsigned = x64_type_is_unsigned(&type);
+    Operand left = x64_gen_expression(builder, bin_expr->left);
+
+    /* Comparisons give 0 or 1. Branches test that value, and the peephole pass fuses the setcc, test and jcc back into one jcc */
+    if (token_is_comparison(op))
+    {
+        Operand right = x64_gen_source(builder, bin_expr->right);
+        Operand result = x64_new_value(builder);
+        x64_emit(builder, x64_inst2(MNEMONIC_CMP, left, right));
+        x64_emit(builder, x64_inst_cc(MNEMONIC_SETCC, x64_comparison_condition_code(op, is_unsigned), x64_narrow(result, 1)));
+        x64_emit(builder, x64_inst2(MNEMONIC_MOVZX, result, x64_narrow(result, 1)));
+        return result;
+    }
+
+    Operand result = x64_new_value(builder);
+    switch (op)
+    {
+        case TOKEN_ID_PLUS:
+        case TOKEN_ID_DASH:
+        {
+            Operand right = x64_gen_source(builder, bin_expr->right);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, left));
+            x64_emit(builder, x64_inst2(op == TOKEN_ID_PLUS ? MNEMONIC_ADD : MNEMONIC_SUB, result, right));
+            break;
+        }
+        case TOKEN_ID_STAR:
+        {
+            Operand right = x64_gen_expression(builder, bin_expr->right);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, left));
+            x64_emit(builder, x64_inst2(MNEMONIC_IMUL, result, right));
+            break;
+        }
+        case TOKEN_ID_SLASH:
+        {
+            /* The dividend goes in rdx:rax, the allocator keeps the divisor out of both */
+            Operand right = x64_gen_expression(builder, bin_expr->right);
+            Operand rax = x64_reg(REGISTER_A, 8);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, rax, left));
+            if (is_unsigned)
+            {
+                x64_emit(builder, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_D, 8), x64_imm(0)));
+                x64_emit(builder, x64_inst1(MNEMONIC_DIV, right));
+            }
+            else
+            {
+                x64_emit(builder, x64_inst0(MNEMONIC_CQO));
+                x64_emit(builder, x64_inst1(MNEMONIC_IDIV, right));
+            }
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, result, rax));
+            break;
+        }
+        default:
+            os_exit_with_message("Operator %s is not supported in the x64 backend\n", token_name(op));
+            break;
+    }
+
+    x64_emit_normalize(builder, result, &type);
+    return result;
+}
+
+/* Only #expect computes a value here, it is just a hint */
+static inline Operand x64_gen_intrinsic(x64_Builder* builder, IRIntrinsicExpr* intrinsic)
+{
+    if (intrinsic->id != INTRINSIC_EXPECT)
+    {
+        os_exit_with_message("#%s is not supported in the x64 backend\n", intrinsic_name(intrinsic->id));
+    }
+
+    return x64_gen_expression(builder, &intrinsic->args[0]);
+}
+
+static Operand x64_gen_expression(x64_Builder* builder, IRExpression* expression)
+{
+    switch (expression->type)
+    {
+        case IR_EXPRESSION_TYPE_INT_LIT:
+            return x64_gen_constant(builder, x64_int_literal_value(&expression->int_literal));
+        case IR_EXPRESSION_TYPE_STRING_LIT:
+            return x64_gen_constant(builder, (s64)(uptr)sb_ptr(expression->string_literal.str_lit));
+        case IR_EXPRESSION_TYPE_SYM_EXPR:
+            redassert(expression->sym_expr.use_type == LOAD);
+            return x64_gen_sym_load(builder, &expression->sym_expr);
+        case IR_EXPRESSION_TYPE_BIN_EXPR:
+            return x64_gen_bin_expr(builder, &expression->bin_expr);
+        case IR_EXPRESSION_TYPE_FN_CALL_EXPR:
+            return x64_gen_fn_call(builder, &expression->fn_call_expr);
+        case IR_EXPRESSION_TYPE_INTRINSIC_EXPR:
+            return x64_gen_intrinsic(builder, &expression->intrinsic_expr);
+        case IR_EXPRESSION_TYPE_ARRAY_LIT:
+            os_exit_with_message("Array literals are not supported in the x64 backend\n");
+            break;
+        case IR_EXPRESSION_TYPE_SUBSCRIPT_ACCESS:
+            os_exit_with_message("Struct and module member accesses are not supported in the x64 backend\n");
+            break;
+        case IR_EXPRESSION_TYPE_AWAIT_EXPR:
+            os_exit_with_message("await is not supported in the x64 backend\n");
+            break;
+        default:
+            /* Comptime expressions are replaced by literals before the backends run */
+            RED_UNREACHABLE;
+            break;
+    }
+
+    return x64_imm(0);
+}
+
+static inline void x64_gen_compound_statement(x64_Builder* builder, IRCompoundStatement* compound_st)
+{
+    u32 st_count = compound_st->stmts.len;
+    for (u32 i = 0; i < st_count; i++)
+    {
+        x64_gen_statement(builder, &compound_st->stmts.ptr[i]);
+    }
+}
+
+static inline void x64_gen_sym_decl(x64_Builder* builder, IRSymDeclStatement* decl_st)
+{
+    /* Same order as fn_definition->sym_declarations, the way the LLVM backend fills its alloca buffer */
+    redassert(builder->local_count < builder->ir_fn->sym_declarations.len);
+    x64_check_type(&decl_st->type, "Variable", decl_st->name);
+    Operand local = x64_new_value(builder);
+    builder->locals[builder->local_count++] = local;
+
+    /* Without a value, symbols are zero-initialized */
+    if (decl_st->value.type != IR_EXPRESSION_TYPE_VOID)
+    {
+        x64_emit(builder, x64_inst2(MNEMONIC_MOV, local, x64_gen_expression(builder, &decl_st->value)));
+    }
+    else if (!decl_st->is_undefined)
+    {
+        x64_emit(builder, x64_inst2(MNEMONIC_MOV, local, x64_imm(0)));
+    }
+}
+
+static inline void x64_gen_assign(x64_Builder* builder, IRSymAssignStatement* assign_st)
+{
+    IRExpression* left = assign_st->left;
+    redassert(left->type == IR_EXPRESSION_TYPE_SYM_EXPR);
+    IRSymExpr* sym_expr = &left->sym_expr;
+    redassert(!sym_expr->subscript);
+
+    switch (sym_expr->type)
+    {
+        case IR_SYM_EXPR_TYPE_PARAM:
+        {
+            Operand value = x64_gen_expression(builder, assign_st->right);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, builder->params[sym_expr->param_decl - builder->ir_fn->proto->params], value));
+            break;
+        }
+        case IR_SYM_EXPR_TYPE_SYM:
+        {
+            Operand value = x64_gen_expression(builder, assign_st->right);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, x64_local(builder, sym_expr->sym_decl), value));
+            break;
+        }
+        case IR_SYM_EXPR_TYPE_GLOBAL_SYM:
+        {
+            Operand value = x64_gen_expression(builder, assign_st->right);
+            x64_emit(builder, x64_inst2(MNEMONIC_MOV, x64_gen_global(builder, sym_expr->global_sym_decl), value));
+            break;
+        }
+        default:
+            os_exit_with_message("Struct and module member accesses are not supported in the x64 backend\n");
+            break;
+    }
+}
+
+/* A compare and branch per case value. Jump tables and bit tests are left to the LLVM backend */
+static inline void x64_gen_switch(x64_Builder* builder, IRSwitchStatement* switch_st)
+{
+    IRSwitchLowering* lowering = ir_switch_lowering(switch_st);
+    Operand value = x64_gen_expression(builder, &switch_st->switch_expr);
+
+    u32 case_count = switch_st->cases.len;
+    Operand* case_labels = NEW(Operand, (case_count + 1));
+    for (u32 i = 0; i < case_count; i++)
+    {
+        case_labels[i] = x64_new_label(builder->fn);
+    }
+    Operand end = x64_new_label(builder->fn);
+
+    for (u32 i = 0; i < lowering->value_count; i++)
+    {
+        /* Case values have the bits of the switch type extended to 64, the same as the switch value */
+        s64 case_value = (s64)lowering->values[i].value;
+        Operand right = case_value >= INT32_MIN && case_value <= INT32_MAX ? x64_imm(case_value) : x64_gen_constant(builder, case_value);
+        x64_emit(builder, x64_inst2(MNEMONIC_CMP, value, right));
+        x64_emit(builder, x64_inst_cc(MNEMONIC_JCC, CONDITION_CODE_E, case_labels[lowering->values[i].case_index]));
+    }
+    x64_emit(builder, x64_inst1(MNEMONIC_JMP, lowering->default_case >= 0 ? case_labels[lowering->default_case] : end));
+
+    for (u32 i = 0; i < case_count; i++)
+    {
+        x64_emit_label(builder, case_labels[i]);
+        x64_gen_compound_statement(builder, &switch_st->cases.ptr[i].case_body);
+        if (i + 1 < case_count)
+        {
+            x64_emit(builder, x64_inst1(MNEMONIC_JMP, end));
+        }
+    }
+    x64_emit_label(builder, end);
+}
+
+/* Branches on a 0 or 1 value */
+static inline void x64_gen_jump_if_false(x64_Builder* builder, IRExpression* condition, Operand target)
+{
+    Operand value = x64_gen_expression(builder, condition);
+    x64_emit(builder, x64_inst2(MNEMONIC_TEST, value, value));
+    x64_emit(builder, x64_inst_cc(MNEMONIC_JCC, CONDITION_CODE_E, target));
+}
+
+static void x64_gen_statement(x64_Builder* builder, IRStatement* st)
+{
+    switch (st->type)
+    {
+        case IR_ST_TYPE_COMPOUND_ST:
+            x64_gen_compound_statement(builder, &st->compound_st);
+            break;
+        case IR_ST_TYPE_RETURN_ST:
+        {
+            IRExpression* expression = &st->return_st.expression;
+            if (expression->type != IR_EXPRESSION_TYPE_VOID)
+            {
+                Operand value = x64_gen_expression(builder, expression);
+                x64_emit(builder, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 8), value));
+            }
+            x64_emit(builder, x64_inst0(MNEMONIC_RET));
+            break;
+        }
+        case IR_ST_TYPE_BRANCH_ST:
+        {
+            IRBranchStatement* branch_st = &st->branch_st;
+            Operand else_label = x64_new_label(builder->fn);
+            x64_gen_jump_if_false(builder, &branch_st->condition, else_label);
+            x64_gen_compound_statement(builder, &branch_st->if_block);
+            if (branch_st->else_block)
+            {
+                Operand end = x64_new_label(builder->fn);
+                x64_emit(builder, x64_inst1(MNEMONIC_JMP, end));
+                x64_emit_label(builder, else_label);
+                x64_gen_statement(builder, branch_st->else_block);
+                x64_emit_label(builder, end);
+            }
+            else
+            {
+                x64_emit_label(builder, else_label);
+            }
+            break;
+        }
+        case IR_ST_TYPE_SWITCH_ST:
+            x64_gen_switch(builder, &st->switch_st);
+            break;
+        case IR_ST_TYPE_SYM_DECL_ST:
+            x64_gen_sym_decl(builder, &st->sym_decl_st);
+            break;
+        case IR_ST_TYPE_ASSIGN_ST:
+            x64_gen_assign(builder, &st->sym_assign_st);
+            break;
+        case IR_ST_TYPE_FN_CALL_ST:
+            x64_gen_fn_call(builder, &st->fn_call_st);
+            break;
+        case IR_ST_TYPE_LOOP_ST:
+        {
+            IRLoopStatement* loop_st = &st->loop_st;
+            Operand start = x64_new_label(builder->fn);
+            Operand end = x64_new_label(builder->fn);
+            x64_emit_label(builder, start);
+            x64_gen_jump_if_false(builder, &loop_st->condition, end);
+            x64_gen_compound_statement(builder, &loop_st->body);
+            x64_emit(builder, x64_inst1(MNEMONIC_JMP, start));
+            x64_emit_label(builder, end);
+            break;
+        }
+        case IR_ST_TYPE_SUSPEND_ST:
+        case IR_ST_TYPE_RESUME_ST:
+        case IR_ST_TYPE_AWAIT_ST:
+            os_exit_with_message("suspend, resume and await are not supported in the x64 backend\n");
+            break;
+        case IR_ST_TYPE_INTRINSIC_ST:
+            /* #assume, #prefetch, #unreachable and #fence are hints single threaded code without loads and stores through pointers can ignore */
+            if (intrinsic_is_vector_op(st->intrinsic_st.id) || (intrinsic_is_atomic_op(st->intrinsic_st.id) && st->intrinsic_st.id != INTRINSIC_FENCE))
+            {
+                os_exit_with_message("#%s is not supported in the x64 backend\n", intrinsic_name(st->intrinsic_st.id));
+            }
+            break;
+        default:
+            RED_UNREACHABLE;
+            break;
+    }
+}
+
+static inline void x64_gen_fn_definition(x64_Module* module, IRFunctionDefinition* ir_fn, MachineFunction* fn)
+{
+    IRFunctionPrototype* proto = ir_fn->proto;
+    u32 sym_decl_count = ir_fn->sym_declarations.len;
+    x64_Builder builder =
+    {
+        .module = module,
+        .ir_fn = ir_fn,
+        .fn = fn,
+        .params = NEW(Operand, (proto->param_count + 1)),
+        .locals = NEW(Operand, (sym_decl_count + 1)),
+    };
+
+    for (u8 i = 0; i < proto->param_count; i++)
+    {
+        builder.params[i] = x64_new_value(&builder);
+        x64_emit(&builder, x64_inst2(MNEMONIC_MOV, builder.params[i], x64_reg(x64_win64_argument_registers[i], 8)));
+    }
+
+    x64_gen_compound_statement(&builder, &ir_fn->body);
+    if (!fn->instructions.len || fn->instructions.ptr[fn->instructions.len - 1].mnemonic != MNEMONIC_RET)
+    {
+        x64_emit(&builder, x64_inst0(MNEMONIC_RET));
+    }
+}
+
+typedef s64 x64_main_fn(void);
+
+s64 x64_run_main(IRModule* ir_module, u8 opt_level)
+{
+    u32 fn_count = ir_module->fn_definitions.len;
+    x64_Module module =
+    {
+        .ir_module = ir_module,
+        .function_addresses = NEW(void*, (fn_count + 1)),
+        .globals = NEW(s64, (ir_module->global_sym_decls.len + 1)),
+    };
+
+    for (u32 i = 0; i < ir_module->global_sym_decls.len; i++)
+    {
+        IRSymDeclStatement* global_sym = &ir_module->global_sym_decls.ptr[i];
+        x64_check_type(&global_sym->type, "Global", global_sym->name);
+        IRExpression* value = &global_sym->value;
+        switch (value->type)
+        {
+            case IR_EXPRESSION_TYPE_VOID:
+                break;
+            case IR_EXPRESSION_TYPE_INT_LIT:
+                module.globals[i] = x64_int_literal_value(&value->int_literal);
+                break;
+            case IR_EXPRESSION_TYPE_STRING_LIT:
+                module.globals[i] = (s64)(uptr)sb_ptr(value->string_literal.str_lit);
+                break;
+            default:
+                os_exit_with_message("Global %s: initializers other than literals are not supported in the x64 backend\n", sb_ptr(global_sym->name));
+                break;
+        }
+    }
+
+    s32 main_index = -1;
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        IRFunctionPrototype* proto = ir_module->fn_definitions.ptr[i].proto;
+        x64_check_signature(proto);
+        if (strequal(sb_ptr(proto->name), "main"))
+        {
+            main_index = (s32)i;
+        }
+    }
+    if (main_index < 0 || ir_module->fn_definitions.ptr[main_index].proto->param_count != 0)
+    {
+        os_exit_with_message("The x64 backend needs a main function without parameters\n");
+    }
+
+    MachineFunction* fns = NEW(MachineFunction, (fn_count + 1));
+    u32 instruction_count = 0;
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        x64_gen_fn_definition(&module, &ir_module->fn_definitions.ptr[i], &fns[i]);
+        x64_allocate_registers(&fns[i]);
+        if (opt_level > 0)
+        {
+            x64_peephole(&fns[i]);
+        }
+        instruction_count += fns[i].instructions.len;
+    }
+
+    u32 extern_count = module.extern_functions.len;
+    if (extern_count > 0)
+    {
+        s32 crt = os_load_dynamic_library("msvcrt.dll");
+        for (u32 e = 0; e < extern_count; e++)
+        {
+            x64_ExternFunction* extern_fn = &module.extern_functions.ptr[e];
+            *extern_fn->address = os_load_procedure_from_dynamic_library(crt, extern_fn->name);
+            if (!*extern_fn->address)
+            {
+                os_exit_with_message("Extern function %s was not found in the C runtime\n", extern_fn->name);
+            }
+        }
+    }
+
+    /* An instruction encodes in at most 15 bytes, and the prologue and the epilogue every ret grows into take less than 32 */
+    U8Buffer code = make_buffer((s64)(instruction_count + fn_count) * 48 + 16);
+    for (u32 i = 0; i < fn_count; i++)
+    {
+        /* Functions start 16-byte aligned */
+        while (code.len % 16)
+        {
+            encode(&code, x64_inst0(MNEMONIC_NOP));
+        }
+        module.function_addresses[i] = code.ptr + code.len;
+        x64_emit_function(&code, &fns[i]);
+    }
+
+#if RED_X64_VERBOSE
+    print("x64: %u functions, %u instructions, %u bytes\n", fn_count, instruction_count, code.len);
+#endif
+
+    x64_main_fn* main_fn = (x64_main_fn*)module.function_addresses[main_index];
+    s64 result = main_fn();
+    return ir_module->fn_definitions.ptr[main_index].proto->ret_type.kind == TYPE_KIND_VOID ? 0 : result;
+}
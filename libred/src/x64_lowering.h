@@ -0,0 +1,6 @@
+#pragma once
+
+#include "ir.h"
+
+/* Compiles the module with the native x64 backend and runs main in process. The peephole pass runs from -O1 */
+s64 x64_run_main(IRModule* ir_module, u8 opt_level);
@@ -0,0 +1,147 @@
+//
+// x64 backend tests, run by ctest
+//
+
+#include "compiler_types.h"
+#include "os.h"
+#include "x64_backend.h"
+
+/* The backend emits code for the Windows x64 calling convention, so these are only built on Windows */
+typedef void store_values_fn(s64* values, s64 base);
+typedef s64 compare_fn(s64 a, s64 b);
+
+#define SPILL_TEST_VALUE_COUNT 24
+
+static inline bool uses_base(Instruction* instruction, x64_Register base)
+{
+    for (u32 o = 0; o < array_length(instruction->operands); o++)
+    {
+        Operand* operand = &instruction->operands[o];
+        if (operand->type == OPERAND_TYPE_MEMORY && operand->mem.base == base)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* More values are live than there are registers and the pointer they are stored through lives across all of them,
+ * so both the pointer and the stored values get spilled: the store needs a scratch register for each */
+static bool test_register_allocator_spilled_base(void)
+{
+    MachineFunction fn = ZERO_INIT;
+    Operand pointer = x64_new_vreg(&fn, 8);
+    Operand base = x64_new_vreg(&fn, 8);
+    x64_append(&fn, x64_inst2(MNEMONIC_MOV, pointer, x64_reg(REGISTER_C, 8)));
+    x64_append(&fn, x64_inst2(MNEMONIC_MOV, base, x64_reg(REGISTER_D, 8)));
+
+    Operand values[SPILL_TEST_VALUE_COUNT];
+    for (s32 i = 0; i < SPILL_TEST_VALUE_COUNT; i++)
+    {
+        values[i] = x64_new_vreg(&fn, 8);
+        x64_append(&fn, x64_inst2(MNEMONIC_LEA, values[i], x64_mem_vreg(8, base, i)));
+    }
+    for (s32 i = 0; i < SPILL_TEST_VALUE_COUNT; i++)
+    {
+        x64_append(&fn, x64_inst2(MNEMONIC_MOV, x64_mem_vreg(8, pointer, i * 8), values[i]));
+    }
+    x64_append(&fn, x64_inst0(MNEMONIC_RET));
+
+    x64_allocate_registers(&fn);
+    x64_peephole(&fn);
+
+    bool spilled_base_and_value = false;
+    for (u32 i = 0; i < fn.instructions.len; i++)
+    {
+        Instruction* instruction = &fn.instructions.ptr[i];
+        Operand* source = &instruction->operands[1];
+        if (instruction->mnemonic == MNEMONIC_MOV && uses_base(instruction, REGISTER_R10) && source->type == OPERAND_TYPE_REGISTER && source->reg.index == REGISTER_R11)
+        {
+            spilled_base_and_value = true;
+        }
+    }
+
+    U8Buffer b = make_buffer(4096);
+    x64_emit_function(&b, &fn);
+    store_values_fn* store_values = (store_values_fn*)b.ptr;
+    s64 stored[SPILL_TEST_VALUE_COUNT] = ZERO_INIT;
+    store_values(stored, 1000);
+
+    bool result = spilled_base_and_value;
+    for (s32 i = 0; i < SPILL_TEST_VALUE_COUNT; i++)
+    {
+        result = result && stored[i] == 1000 + i;
+    }
+
+    ptest("x64 register allocator: spilled base and spilled value", result);
+    return result;
+}
+
+static inline bool has_mnemonic(MachineFunction* fn, x64_Mnemonic mnemonic)
+{
+    for (u32 i = 0; i < fn->instructions.len; i++)
+    {
+        if (fn->instructions.ptr[i].mnemonic == mnemonic)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* a < b ? 2 : fallthrough, where the fallthrough block either reads the flags of the test (sete dl) or not */
+static compare_fn* make_setcc_branch(MachineFunction* fn, bool flags_read_after_branch)
+{
+    Operand al = x64_reg(REGISTER_A, 1);
+    Operand less = x64_new_label(fn);
+    x64_append(fn, x64_inst2(MNEMONIC_CMP, x64_reg(REGISTER_C, 8), x64_reg(REGISTER_D, 8)));
+    x64_append(fn, x64_inst_cc(MNEMONIC_SETCC, CONDITION_CODE_L, al));
+    x64_append(fn, x64_inst2(MNEMONIC_TEST, al, al));
+    x64_append(fn, x64_inst_cc(MNEMONIC_JCC, CONDITION_CODE_NE, less));
+    if (flags_read_after_branch)
+    {
+        x64_append(fn, x64_inst_cc(MNEMONIC_SETCC, CONDITION_CODE_E, x64_reg(REGISTER_D, 1)));
+        x64_append(fn, x64_inst2(MNEMONIC_MOVZX, x64_reg(REGISTER_A, 4), x64_reg(REGISTER_D, 1)));
+    }
+    else
+    {
+        x64_append(fn, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 4), x64_imm(1)));
+    }
+    x64_append(fn, x64_inst0(MNEMONIC_RET));
+    x64_append(fn, x64_inst1(MNEMONIC_LABEL, less));
+    x64_append(fn, x64_inst2(MNEMONIC_MOV, x64_reg(REGISTER_A, 4), x64_imm(2)));
+    x64_append(fn, x64_inst0(MNEMONIC_RET));
+
+    x64_peephole(fn);
+
+    U8Buffer b = make_buffer(4096);
+    x64_emit_function(&b, fn);
+    return (compare_fn*)b.ptr;
+}
+
+/* setcc + test + jcc is fused into a jcc only when the test flags are dead after the branch */
+static bool test_peephole_branch_fusion(void)
+{
+    MachineFunction fused_fn = ZERO_INIT;
+    compare_fn* fused = make_setcc_branch(&fused_fn, false);
+    bool fused_result = !has_mnemonic(&fused_fn, MNEMONIC_SETCC) && fused(3, 5) == 2 && fused(5, 3) == 1;
+    ptest("x64 peephole: setcc branch fusion", fused_result);
+
+    MachineFunction kept_fn = ZERO_INIT;
+    compare_fn* kept = make_setcc_branch(&kept_fn, true);
+    bool kept_result = has_mnemonic(&kept_fn, MNEMONIC_TEST) && kept(3, 5) == 2 && kept(5, 3) == 1;
+    ptest("x64 peephole: no fusion when the flags are read after the branch", kept_result);
+
+    return fused_result && kept_result;
+}
+
+s32 main(s32 argc, char* argv[])
+{
+    os_init();
+
+    bool passed = x64_test_encoder();
+    passed = test_register_allocator_spilled_base() && passed;
+    passed = test_peephole_branch_fusion() && passed;
+
+    return passed ? 0 : 1;
+}
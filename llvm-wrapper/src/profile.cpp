@@ -0,0 +1,30 @@
+#include "profile.h"
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/ProfileData/InstrProfReader.h>
+#include <stdio.h>
+
+void llvm_pass_manager_builder_set_pgo(LLVMPassManagerBuilderRef builder, const char* generate_path, const char* use_path)
+{
+    llvm::PassManagerBuilder* pmb = reinterpret_cast<llvm::PassManagerBuilder*>(builder);
+    if (generate_path)
+    {
+        pmb->EnablePGOInstrGen = true;
+        pmb->PGOInstrGen = generate_path;
+    }
+    if (use_path)
+    {
+        pmb->PGOInstrUse = use_path;
+    }
+}
+
+bool llvm_profile_is_valid(const char* path, char* error, size_t error_size)
+{
+    auto reader = llvm::IndexedInstrProfReader::create(path);
+    if (!reader)
+    {
+        snprintf(error, error_size, "%s", llvm::toString(reader.takeError()).c_str());
+        return false;
+    }
+
+    return true;
+}
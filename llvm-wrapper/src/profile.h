@@ -0,0 +1,16 @@
+#pragma once
+
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // Either path can be null. With generate_path, the IR is instrumented and the counters are lowered to the __llvm_prf_* sections, written at exit by the runtime in llvm.c.
+    // With use_path, branch weights and function entry counts are attached from the indexed profile before the rest of the pipeline runs
+    void llvm_pass_manager_builder_set_pgo(LLVMPassManagerBuilderRef builder, const char* generate_path, const char* use_path);
+    // Checks that the file is an indexed profile (llvm-profdata merge output). On failure, error is filled with the reason
+    bool llvm_profile_is_valid(const char* path, char* error, size_t error_size);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,37 @@
+#include "target.h"
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <memory>
+#include <string>
+
+static std::unique_ptr<llvm::MCSubtargetInfo> create_subtarget_info(const char* triple, const std::string& features)
+{
+    std::string error;
+    const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+    {
+        return nullptr;
+    }
+
+    return std::unique_ptr<llvm::MCSubtargetInfo>(target->createMCSubtargetInfo(triple, "", features));
+}
+
+bool llvm_target_has_cpu(const char* triple, const char* cpu)
+{
+    auto subtarget_info = create_subtarget_info(triple, "");
+    return subtarget_info && subtarget_info->isCPUStringValid(cpu);
+}
+
+bool llvm_target_has_feature(const char* triple, const char* feature)
+{
+    // Enabling a known feature on a subtarget where it's disabled always sets its bit; an unknown one is ignored
+    std::string name = feature;
+    auto subtarget_info = create_subtarget_info(triple, "-" + name);
+    if (!subtarget_info)
+    {
+        return false;
+    }
+    llvm::FeatureBitset disabled = subtarget_info->getFeatureBits();
+    llvm::FeatureBitset enabled = subtarget_info->ApplyFeatureFlag("+" + name);
+    return enabled != disabled;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // The C API takes any CPU name or feature and only warns about the unknown ones when the target machine is created, so these check them against the subtarget tables of the triple
+    bool llvm_target_has_cpu(const char* triple, const char* cpu);
+    // Feature name without the +/- prefix
+    bool llvm_target_has_feature(const char* triple, const char* feature);
+#ifdef __cplusplus
+}
+#endif